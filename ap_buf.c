@@ -0,0 +1,431 @@
+/** \file ap_buf.c
+ * \brief Part of AP's Toolkit. Growable byte buffers and arena allocator module
+ */
+#define AP_BUF_C
+#include "ap_buf.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* arena allocations alignment. enough for any basic type and SSE */
+#define ARENA_ALIGN 16
+#define arena_align(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* ********************************************************************** */
+/** \brief Sets up the arena. Memory is taken on the first allocation
+ *
+ * \param arena ap_arena_t* - arena to set up
+ * \param chunk_size int - bytes to get from heap at once. 0 - AP_ARENA_DEFAULT_CHUNK
+ * \return void
+ */
+void ap_arena_init(ap_arena_t *arena, int chunk_size)
+{
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size > 0 ? arena_align(chunk_size) : AP_ARENA_DEFAULT_CHUNK;
+    arena->last = NULL;
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Allocates memory from arena
+ *
+ * \param arena ap_arena_t* - arena set up by ap_arena_init()
+ * \param size int - bytes needed
+ * \return void* - memory aligned to 16 bytes, NULL if out of memory. Valid until ap_arena_reset() or ap_arena_destroy()
+ *
+ * Allocations larger than chunk size get a chunk of their own
+ */
+void *ap_arena_alloc(ap_arena_t *arena, int size)
+{
+    ap_arena_chunk_t *c;
+    void *p;
+    int n;
+
+
+    if ( size < 0 || size > INT_MAX - ARENA_ALIGN )
+        return NULL;
+
+    n = arena_align(size);
+    c = arena->chunks;
+
+    if ( c == NULL || c->size - c->used < n )
+    {
+        c = malloc(sizeof(ap_arena_chunk_t) + (n > arena->chunk_size ? n : arena->chunk_size));
+
+        if ( c == NULL )
+            return NULL;
+
+        c->size = n > arena->chunk_size ? n : arena->chunk_size;
+        c->used = 0;
+        c->next = arena->chunks;
+        arena->chunks = c;
+    }
+
+    p = c->data + c->used;
+    c->used += n;
+
+    arena->last = p;
+    arena->used += n;
+
+    if ( arena->peak < arena->used )
+        arena->peak = arena->used;
+
+    return p;
+}
+
+/* ********************************************************************** */
+/** \brief Resizes arena allocation
+ *
+ * \param arena ap_arena_t* - arena set up by ap_arena_init()
+ * \param ptr void* - memory allocated from this arena or NULL
+ * \param old_size int - size it was allocated with
+ * \param new_size int - size needed
+ * \return void* - memory, NULL if out of memory. ptr stays valid then
+ *
+ * The latest allocation is extended in place while there is room in its chunk. Otherwise new memory is allocated
+ * and the contents copied. The old block is not reused until reset.
+ */
+void *ap_arena_realloc(ap_arena_t *arena, void *ptr, int old_size, int new_size)
+{
+    ap_arena_chunk_t *c;
+    void *p;
+    int off;
+
+
+    if ( ptr == NULL )
+        return ap_arena_alloc(arena, new_size);
+
+    if ( new_size < 0 || new_size > INT_MAX - ARENA_ALIGN )
+        return NULL;
+
+    c = arena->chunks;
+
+    if ( ptr == arena->last && c != NULL )
+    {
+        off = (char *)ptr - c->data;
+
+        if ( off + arena_align(new_size) <= c->size )
+        {
+            arena->used += off + arena_align(new_size) - c->used;
+            c->used = off + arena_align(new_size);
+
+            if ( arena->peak < arena->used )
+                arena->peak = arena->used;
+
+            return ptr;
+        }
+    }
+
+    p = ap_arena_alloc(arena, new_size);
+
+    if ( p == NULL )
+        return NULL;
+
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+
+    return p;
+}
+
+/* ********************************************************************** */
+/** \brief Frees all allocations at once
+ *
+ * \param arena ap_arena_t* - arena set up by ap_arena_init()
+ * \return void
+ *
+ * The memory is kept for reuse. If more than one chunk was used, they are replaced by one chunk of the total size
+ * on the next allocation, so the same load fits in one chunk next time.
+ */
+void ap_arena_reset(ap_arena_t *arena)
+{
+    if ( arena->chunks != NULL && arena->chunks->next != NULL )
+    {
+        if ( arena->chunk_size < arena->used && arena->used <= INT_MAX - ARENA_ALIGN )
+            arena->chunk_size = arena_align(arena->used);
+
+        ap_arena_destroy(arena);
+    }
+    else if ( arena->chunks != NULL )
+        arena->chunks->used = 0;
+
+    arena->last = NULL;
+    arena->used = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Frees arena's memory. Arena stays usable, as after ap_arena_init()
+ *
+ * \param arena ap_arena_t* - arena set up by ap_arena_init()
+ * \return void
+ */
+void ap_arena_destroy(ap_arena_t *arena)
+{
+    ap_arena_chunk_t *c;
+
+
+    while ( arena->chunks != NULL )
+    {
+        c = arena->chunks;
+        arena->chunks = c->next;
+        free(c);
+    }
+
+    arena->last = NULL;
+    arena->used = 0;
+}
+
+/* ********************************************************************** */
+/* sets the allocated size to exactly new_size >= len */
+static int buf_resize(ap_buf_t *buf, int new_size)
+{
+    char *p;
+
+
+    if ( buf->data == buf->inline_data )
+    {
+        p = ( buf->arena != NULL ) ? ap_arena_alloc(buf->arena, new_size) : malloc(new_size);
+
+        if ( p != NULL )
+            memcpy(p, buf->inline_data, buf->len);
+    }
+    else if ( buf->arena != NULL )
+        p = ap_arena_realloc(buf->arena, buf->data, buf->size, new_size);
+    else
+        p = realloc(buf->data, new_size);
+
+    if ( p == NULL )
+        return 0;
+
+    buf->data = p;
+    buf->size = new_size;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* makes room for n more bytes. the size is at least doubled, so appends cost O(1) amortized */
+static int buf_make_room(ap_buf_t *buf, int n)
+{
+    int new_size;
+
+
+    if ( n < 0 || n > INT_MAX - buf->len )
+        return 0;
+
+    if ( buf->size - buf->len >= n )
+        return 1;
+
+    new_size = ( buf->size > INT_MAX / 2 ) ? INT_MAX : buf->size * 2;
+
+    if ( new_size < buf->len + n )
+        new_size = buf->len + n;
+
+    return buf_resize(buf, new_size);
+}
+
+/* ********************************************************************** */
+/** \brief Sets up empty buffer
+ *
+ * \param buf ap_buf_t* - buffer to set up
+ * \param arena ap_arena_t* - where to get memory from when the data outgrows inline storage. NULL - heap
+ * \return void
+ *
+ * Example of message assembly without reallocs in the steady state:
+ * ap_buf_t msg;
+ *
+ * ap_buf_init(&msg, NULL);
+ * ap_buf_append(&msg, &header, sizeof(header));
+ * ap_buf_printf(&msg, "%d items", count);
+ * ap_net_conn_pool_send(pool, conn->idx, msg.data, msg.len);
+ * ap_buf_clear(&msg); // for the next one, the memory is kept
+ */
+void ap_buf_init(ap_buf_t *buf, ap_arena_t *arena)
+{
+    buf->data = buf->inline_data;
+    buf->len = 0;
+    buf->size = AP_BUF_INLINE_SIZE;
+    buf->arena = arena;
+}
+
+/* ********************************************************************** */
+/** \brief Releases buffer's memory. Buffer is empty and ready for use with the same arena
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \return void
+ */
+void ap_buf_free(ap_buf_t *buf)
+{
+    if ( buf->data != buf->inline_data && buf->arena == NULL )
+        free(buf->data);
+
+    ap_buf_init(buf, buf->arena);
+}
+
+/* ********************************************************************** */
+/** \brief Makes sure the buffer can hold size bytes without reallocations
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param size int - total bytes
+ * \return int - true/false. False if out of memory
+ */
+int ap_buf_reserve(ap_buf_t *buf, int size)
+{
+    if ( size <= buf->size )
+        return 1;
+
+    return buf_resize(buf, size);
+}
+
+/* ********************************************************************** */
+/** \brief Gives unused memory back to heap
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \return int - true/false
+ *
+ * Does nothing for arena buffers: the arena frees everything at once
+ */
+int ap_buf_shrink(ap_buf_t *buf)
+{
+    if ( buf->data == buf->inline_data || buf->arena != NULL || buf->size == buf->len )
+        return 1;
+
+    if ( buf->len <= AP_BUF_INLINE_SIZE )
+    {
+        memcpy(buf->inline_data, buf->data, buf->len);
+        free(buf->data);
+        buf->data = buf->inline_data;
+        buf->size = AP_BUF_INLINE_SIZE;
+
+        return 1;
+    }
+
+    return buf_resize(buf, buf->len);
+}
+
+/* ********************************************************************** */
+/** \brief Appends data to buffer
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param src const void* - data
+ * \param src_len int - length of data
+ * \return int - true/false. False if out of memory, the buffer is not changed then
+ */
+int ap_buf_append(ap_buf_t *buf, const void *src, int src_len)
+{
+    if ( ! buf_make_room(buf, src_len) )
+        return 0;
+
+    memcpy(buf->data + buf->len, src, src_len);
+    buf->len += src_len;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Appends n bytes to fill in by caller, to avoid copying through a temporary
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param n int - bytes to add
+ * \return char* - where to put them. NULL if out of memory. Valid until the next change of buffer
+ */
+char *ap_buf_append_space(ap_buf_t *buf, int n)
+{
+    if ( ! buf_make_room(buf, n) )
+        return NULL;
+
+    buf->len += n;
+
+    return buf->data + buf->len - n;
+}
+
+/* ********************************************************************** */
+/** \brief Appends formatted text. vprintf() variant
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param format const char* - printf() format
+ * \param ap va_list - arguments
+ * \return int - true/false
+ *
+ * Zero byte is kept after the text, but is not counted in len
+ */
+int ap_buf_vprintf(ap_buf_t *buf, const char *format, va_list ap)
+{
+    va_list ap2;
+    int n;
+
+
+    va_copy(ap2, ap);
+    n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap2);
+    va_end(ap2);
+
+    if ( n < 0 )
+        return 0;
+
+    if ( n >= buf->size - buf->len ) /* did not fit */
+    {
+        if ( n == INT_MAX || ! buf_make_room(buf, n + 1) )
+            return 0;
+
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+    }
+
+    buf->len += n;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Appends formatted text
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param format const char* - printf() format
+ * \return int - true/false
+ *
+ * Zero byte is kept after the text, but is not counted in len
+ */
+int ap_buf_printf(ap_buf_t *buf, const char *format, ...)
+{
+    va_list ap;
+    int retval;
+
+
+    va_start(ap, format);
+    retval = ap_buf_vprintf(buf, format, ap);
+    va_end(ap);
+
+    return retval;
+}
+
+/* ********************************************************************** */
+/** \brief Removes n bytes from the beginning. For example the part that was sent
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \param n int - bytes to remove
+ * \return void
+ */
+void ap_buf_consume(ap_buf_t *buf, int n)
+{
+    if ( n <= 0 )
+        return;
+
+    if ( n >= buf->len )
+    {
+        buf->len = 0;
+        return;
+    }
+
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+}
+
+/* ********************************************************************** */
+/** \brief Empties buffer keeping the memory
+ *
+ * \param buf ap_buf_t* - buffer set up by ap_buf_init()
+ * \return void
+ */
+void ap_buf_clear(ap_buf_t *buf)
+{
+    buf->len = 0;
+}
@@ -0,0 +1,65 @@
+/** \file ap_buf.h
+ * \brief Part of AP's Toolkit. Growable byte buffers and arena allocator module. Main header
+ */
+#ifndef AP_BUF_H
+#define AP_BUF_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/* bytes stored inside ap_buf_t itself before going to heap or arena */
+#define AP_BUF_INLINE_SIZE 64
+/* ap_arena_init() default */
+#define AP_ARENA_DEFAULT_CHUNK 65536
+
+/** \brief Arena's memory block
+*/
+typedef struct ap_arena_chunk_t
+{
+    struct ap_arena_chunk_t *next;
+    int size; /**< usable bytes in data */
+    int used;
+    char data[];
+} ap_arena_chunk_t;
+
+/** \brief Bump-pointer allocator: allocations are not freed one by one, but all at once by ap_arena_reset()
+*/
+typedef struct ap_arena_t
+{
+    struct ap_arena_chunk_t *chunks; /**< the current one is the first. NULL until the first allocation */
+    int chunk_size; /**< size of new chunks. grows to the peak usage on reset, so a steady load fits in one chunk */
+    void *last; /**< the latest allocation. ap_arena_realloc() extends it in place */
+    long used; /**< bytes allocated since the last reset */
+    long peak; /**< maximum of used */
+} ap_arena_t;
+
+/** \brief Growable byte buffer. Small data is kept inline, larger goes to heap or arena with geometric growth.
+ * Do not copy the struct: data may point inside it
+*/
+typedef struct ap_buf_t
+{
+    char *data; /**< contents. not zero-terminated, except after ap_buf_printf() */
+    int len; /**< bytes of data */
+    int size; /**< allocated bytes */
+    struct ap_arena_t *arena; /**< memory source. NULL - heap */
+    char inline_data[AP_BUF_INLINE_SIZE];
+} ap_buf_t;
+
+extern void ap_arena_init(ap_arena_t *arena, int chunk_size); /**< 0 - AP_ARENA_DEFAULT_CHUNK. allocates nothing yet */
+extern void *ap_arena_alloc(ap_arena_t *arena, int size); /**< 16 bytes aligned. NULL if out of memory */
+extern void *ap_arena_realloc(ap_arena_t *arena, void *ptr, int old_size, int new_size); /**< in place if ptr is the latest */
+extern void ap_arena_reset(ap_arena_t *arena); /**< forgets all allocations, keeping the memory */
+extern void ap_arena_destroy(ap_arena_t *arena); /**< frees the memory */
+
+extern void ap_buf_init(ap_buf_t *buf, ap_arena_t *arena); /**< arena - NULL for heap */
+extern void ap_buf_free(ap_buf_t *buf); /**< releases the memory. buf is empty and ready to be used again */
+extern int ap_buf_reserve(ap_buf_t *buf, int size); /**< makes size to be at least this */
+extern int ap_buf_shrink(ap_buf_t *buf); /**< makes size to fit len. heap only */
+extern int ap_buf_append(ap_buf_t *buf, const void *src, int src_len);
+extern char *ap_buf_append_space(ap_buf_t *buf, int n); /**< adds n bytes to fill in. NULL if out of memory */
+extern int ap_buf_printf(ap_buf_t *buf, const char *format, ...); /**< appends formatted text, keeping zero byte after it */
+extern int ap_buf_vprintf(ap_buf_t *buf, const char *format, va_list ap);
+extern void ap_buf_consume(ap_buf_t *buf, int n); /**< removes n bytes from the beginning */
+extern void ap_buf_clear(ap_buf_t *buf); /**< len = 0, memory is kept */
+
+#endif
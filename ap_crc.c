@@ -0,0 +1,434 @@
+/** \file ap_crc.c
+ * \brief Part of AP's Toolkit. Checksums module
+ *
+ * Three implementations of each checksum, selected at the first call by CPU features, or by ap_crc_set_impl():
+ * bitwise reference, slicing-by-8 tables (8 bytes per step, no CPU requirements) and SIMD.
+ * SIMD CRC16 folds the data 64 bytes per step with PCLMULQDQ, keeping the remainder modulo CRC polynomial,
+ * and then runs the tables over the last 16 bytes of folded value. CRC32C uses SSE 4.2 crc32 instruction.
+ * All of them give the same results for any length and alignment.
+ */
+#define AP_CRC_C
+#include "ap_crc.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define AP_CRC_HAVE_SIMD
+#endif
+
+/* reflected polynomials */
+#define CRC16_POLY 0x8408
+#define CRC32C_POLY 0x82F63B78
+/* CRC16 polynomial in the normal bit order: x^16 + x^12 + x^5 + 1 without x^16. for folding constants */
+#define CRC16_POLY_NORMAL 0x1021
+
+/* shortest data to bother with folding */
+#define FOLD_MIN_LEN 64
+
+static uint16_t crc16_table[8][256];
+static uint32_t crc32c_table[8][256];
+static int tables_ready;
+static int impl_in_use = AP_CRC_IMPL_AUTO;
+
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *p, size_t len);
+static uint32_t crc32c_bitwise(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint16_t (*crc16_func)(uint16_t crc, const uint8_t *p, size_t len) = crc16_bitwise;
+static uint32_t (*crc32c_func)(uint32_t crc, const uint8_t *p, size_t len) = crc32c_bitwise;
+
+#ifdef AP_CRC_HAVE_SIMD
+/* folding constants: low qword multiplies the first 8 bytes of block, high qword the second 8 */
+static uint64_t fold_512[2]; /* to the block 64 bytes ahead */
+static uint64_t fold_128[2]; /* to the next block */
+#endif
+
+/* ********************************************************************** */
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *p, size_t len)
+{
+    int i;
+
+
+    while ( len-- )
+    {
+        crc ^= *p++;
+
+        for ( i = 0; i < 8; ++i )
+            crc = (crc & 1) ? (crc >> 1) ^ CRC16_POLY : crc >> 1;
+    }
+
+    return crc;
+}
+
+/* ********************************************************************** */
+static uint32_t crc32c_bitwise(uint32_t crc, const uint8_t *p, size_t len)
+{
+    int i;
+
+
+    while ( len-- )
+    {
+        crc ^= *p++;
+
+        for ( i = 0; i < 8; ++i )
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+
+    return crc;
+}
+
+/* ********************************************************************** */
+/* slicing-by-8: table k gives the effect of a byte followed by k more bytes */
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *p, size_t len)
+{
+    for ( ; len >= 8; len -= 8, p += 8 )
+    {
+        crc ^= p[0] | (p[1] << 8);
+        crc = crc16_table[7][crc & 0xff] ^ crc16_table[6][crc >> 8]
+            ^ crc16_table[5][p[2]] ^ crc16_table[4][p[3]] ^ crc16_table[3][p[4]]
+            ^ crc16_table[2][p[5]] ^ crc16_table[1][p[6]] ^ crc16_table[0][p[7]];
+    }
+
+    while ( len-- )
+        crc = crc16_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+/* ********************************************************************** */
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for ( ; len >= 8; len -= 8, p += 8 )
+    {
+        crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff]
+            ^ crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24]
+            ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+
+    while ( len-- )
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef AP_CRC_HAVE_SIMD
+/* ********************************************************************** */
+/* x^n mod P, bit i is the coefficient of x^i */
+static uint32_t xpow_mod(unsigned n, uint32_t poly, int width)
+{
+    uint32_t r;
+    uint32_t top;
+
+
+    top = 1u << (width - 1);
+
+    for ( r = 1; n > 0; --n )
+        r = (r & top) ? ((r << 1) ^ poly) & (top | (top - 1)) : r << 1;
+
+    return r;
+}
+
+/* ********************************************************************** */
+/* constant in the reflected order of 64-bit lane: x^i goes to bit 63 - i */
+static uint64_t reflect64(uint32_t v, int width)
+{
+    uint64_t r;
+    int i;
+
+
+    for ( r = 0, i = 0; i < width; ++i )
+        if ( v & (1u << i) )
+            r |= 1ull << (63 - i);
+
+    return r;
+}
+
+/* ********************************************************************** */
+/* block A at distance D bits before B adds A * x^D to it. A = Lo * x^64 + Hi in the reflected lanes.
+ * carry-less product of reflected values comes out one bit short, so the constants are multiplied by x^-1:
+ * x^(D + 63) for Lo and x^(D - 1) for Hi. */
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i x, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/* ********************************************************************** */
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *p, size_t len)
+{
+    __m128i x0, x1, x2, x3, k;
+    uint8_t folded[16];
+
+
+    if ( len < FOLD_MIN_LEN )
+        return crc16_slice8(crc, p, len);
+
+    /* running CRC is the same as xor-ing it into the first bytes and starting from zero */
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi32_si128(crc));
+    x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+    p += 64;
+    len -= 64;
+
+    k = _mm_loadu_si128((const __m128i *)fold_512);
+
+    for ( ; len >= 64; len -= 64, p += 64 )
+    {
+        x0 = _mm_xor_si128(fold(x0, k), _mm_loadu_si128((const __m128i *)p));
+        x1 = _mm_xor_si128(fold(x1, k), _mm_loadu_si128((const __m128i *)(p + 16)));
+        x2 = _mm_xor_si128(fold(x2, k), _mm_loadu_si128((const __m128i *)(p + 32)));
+        x3 = _mm_xor_si128(fold(x3, k), _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+
+    k = _mm_loadu_si128((const __m128i *)fold_128);
+
+    x1 = _mm_xor_si128(fold(x0, k), x1);
+    x2 = _mm_xor_si128(fold(x1, k), x2);
+    x0 = _mm_xor_si128(fold(x2, k), x3);
+
+    for ( ; len >= 16; len -= 16, p += 16 )
+        x0 = _mm_xor_si128(fold(x0, k), _mm_loadu_si128((const __m128i *)p));
+
+    /* 16 bytes with the same remainder as all data before the tail */
+    _mm_storeu_si128((__m128i *)folded, x0);
+
+    return crc16_slice8(crc16_slice8(0, folded, 16), p, len);
+}
+
+/* ********************************************************************** */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64;
+    uint64_t v;
+
+
+    crc64 = crc;
+
+    for ( ; len >= 8; len -= 8, p += 8 )
+    {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+
+    crc = crc64;
+
+    while ( len-- )
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+/* ********************************************************************** */
+static void setup_tables(void)
+{
+    int i, k;
+    uint16_t c16;
+    uint32_t c32;
+
+
+    for ( i = 0; i < 256; ++i )
+    {
+        c16 = i;
+        c32 = i;
+
+        for ( k = 0; k < 8; ++k )
+        {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : c32 >> 1;
+        }
+
+        crc16_table[0][i] = c16;
+        crc32c_table[0][i] = c32;
+    }
+
+    for ( k = 1; k < 8; ++k )
+        for ( i = 0; i < 256; ++i )
+        {
+            crc16_table[k][i] = (crc16_table[k - 1][i] >> 8) ^ crc16_table[0][crc16_table[k - 1][i] & 0xff];
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+        }
+
+#ifdef AP_CRC_HAVE_SIMD
+    fold_512[0] = reflect64(xpow_mod(512 + 63, CRC16_POLY_NORMAL, 16), 16);
+    fold_512[1] = reflect64(xpow_mod(512 - 1, CRC16_POLY_NORMAL, 16), 16);
+    fold_128[0] = reflect64(xpow_mod(128 + 63, CRC16_POLY_NORMAL, 16), 16);
+    fold_128[1] = reflect64(xpow_mod(128 - 1, CRC16_POLY_NORMAL, 16), 16);
+#endif
+
+    tables_ready = 1;
+}
+
+/* ********************************************************************** */
+/** \brief Selects checksums implementation
+ *
+ * \param impl int - AP_CRC_IMPL_*
+ * \return int - true/false. False if the CPU does not support it, the current one is kept
+ *
+ * AP_CRC_IMPL_AUTO is used by default and there is no need to call this, except for testing and benchmarks.
+ * Set it before starting threads: the first call of any ap_crc* function does the setup when nothing was set.
+ */
+int ap_crc_set_impl(int impl)
+{
+    if ( ! tables_ready )
+        setup_tables();
+
+    if ( impl == AP_CRC_IMPL_AUTO )
+    {
+#ifdef AP_CRC_HAVE_SIMD
+        __builtin_cpu_init();
+        impl = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.2") ? AP_CRC_IMPL_SIMD : AP_CRC_IMPL_TABLE;
+#else
+        impl = AP_CRC_IMPL_TABLE;
+#endif
+    }
+
+    switch ( impl )
+    {
+        case AP_CRC_IMPL_BITWISE:
+            crc16_func = crc16_bitwise;
+            crc32c_func = crc32c_bitwise;
+            break;
+
+        case AP_CRC_IMPL_TABLE:
+            crc16_func = crc16_slice8;
+            crc32c_func = crc32c_slice8;
+            break;
+
+#ifdef AP_CRC_HAVE_SIMD
+        case AP_CRC_IMPL_SIMD:
+            __builtin_cpu_init();
+
+            if ( ! __builtin_cpu_supports("pclmul") || ! __builtin_cpu_supports("sse4.2") )
+                return 0;
+
+            crc16_func = crc16_clmul;
+            crc32c_func = crc32c_hw;
+            break;
+#endif
+
+        default:
+            return 0;
+    }
+
+    impl_in_use = impl;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Returns the checksums implementation in use
+ *
+ * \return int - AP_CRC_IMPL_*, never AP_CRC_IMPL_AUTO
+ */
+int ap_crc_get_impl(void)
+{
+    if ( impl_in_use == AP_CRC_IMPL_AUTO )
+        ap_crc_set_impl(AP_CRC_IMPL_AUTO);
+
+    return impl_in_use;
+}
+
+/* ********************************************************************** */
+/** \brief CRC-16/KERMIT of memory block. The same as count_crc16()
+ *
+ * \param mem const void* - data
+ * \param len size_t - length of data
+ * \return uint16_t - CRC
+ */
+uint16_t ap_crc16(const void *mem, size_t len)
+{
+    return ap_crc16_final(ap_crc16_update(ap_crc16_init(), mem, len));
+}
+
+/* ********************************************************************** */
+/** \brief Starts CRC16 of data coming in parts
+ *
+ * \return uint16_t - initial CRC value to pass to ap_crc16_update()
+ */
+uint16_t ap_crc16_init(void)
+{
+    return 0;
+}
+
+/* ********************************************************************** */
+/** \brief Adds the next part of data to CRC16
+ *
+ * \param crc uint16_t - value returned by ap_crc16_init() or the previous ap_crc16_update()
+ * \param mem const void* - data
+ * \param len size_t - length of data
+ * \return uint16_t - updated CRC
+ *
+ * The parts may be of any length, the result is the same as of the whole data at once.
+ * For example, call it on the new bytes of conn->buf in AP_NET_SIGNAL_CONN_DATA_IN handler.
+ */
+uint16_t ap_crc16_update(uint16_t crc, const void *mem, size_t len)
+{
+    if ( impl_in_use == AP_CRC_IMPL_AUTO )
+        ap_crc_set_impl(AP_CRC_IMPL_AUTO);
+
+    return crc16_func(crc, mem, len);
+}
+
+/* ********************************************************************** */
+/** \brief Finishes CRC16 of data coming in parts
+ *
+ * \param crc uint16_t - value returned by the last ap_crc16_update()
+ * \return uint16_t - CRC
+ */
+uint16_t ap_crc16_final(uint16_t crc)
+{
+    return crc;
+}
+
+/* ********************************************************************** */
+/** \brief CRC-32C of memory block
+ *
+ * \param mem const void* - data
+ * \param len size_t - length of data
+ * \return uint32_t - CRC
+ */
+uint32_t ap_crc32c(const void *mem, size_t len)
+{
+    return ap_crc32c_final(ap_crc32c_update(ap_crc32c_init(), mem, len));
+}
+
+/* ********************************************************************** */
+/** \brief Starts CRC32C of data coming in parts
+ *
+ * \return uint32_t - initial CRC value to pass to ap_crc32c_update()
+ */
+uint32_t ap_crc32c_init(void)
+{
+    return 0xffffffff;
+}
+
+/* ********************************************************************** */
+/** \brief Adds the next part of data to CRC32C
+ *
+ * \param crc uint32_t - value returned by ap_crc32c_init() or the previous ap_crc32c_update()
+ * \param mem const void* - data
+ * \param len size_t - length of data
+ * \return uint32_t - updated CRC. Not the final value, pass it to ap_crc32c_final()
+ */
+uint32_t ap_crc32c_update(uint32_t crc, const void *mem, size_t len)
+{
+    if ( impl_in_use == AP_CRC_IMPL_AUTO )
+        ap_crc_set_impl(AP_CRC_IMPL_AUTO);
+
+    return crc32c_func(crc, mem, len);
+}
+
+/* ********************************************************************** */
+/** \brief Finishes CRC32C of data coming in parts
+ *
+ * \param crc uint32_t - value returned by the last ap_crc32c_update()
+ * \return uint32_t - CRC
+ */
+uint32_t ap_crc32c_final(uint32_t crc)
+{
+    return ~crc;
+}
@@ -0,0 +1,37 @@
+/** \file ap_crc.h
+ * \brief Part of AP's Toolkit. Checksums module. Main header
+ */
+#ifndef AP_CRC_H
+#define AP_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+    /* for ap_crc_set_impl():
+     fastest of supported by CPU. default */
+#define AP_CRC_IMPL_AUTO 0
+    /* one bit at a time. reference implementation */
+#define AP_CRC_IMPL_BITWISE 1
+    /* slicing-by-8 tables */
+#define AP_CRC_IMPL_TABLE 2
+    /* carry-less multiplication folding for CRC16, crc32 instruction for CRC32C. x86-64 with PCLMULQDQ and SSE4.2 */
+#define AP_CRC_IMPL_SIMD 3
+
+/* implementation used by all of the functions below. returns false if not supported on this CPU */
+extern int ap_crc_set_impl(int impl);
+extern int ap_crc_get_impl(void); /**< AP_CRC_IMPL_* in use. AUTO is resolved to the actual one */
+
+/* CRC-16/KERMIT (reflected 0x1021, zero init), the same as count_crc16().
+ * streaming: crc = ap_crc16_init(); crc = ap_crc16_update(crc, part, len); ...; result = ap_crc16_final(crc); */
+extern uint16_t ap_crc16(const void *mem, size_t len);
+extern uint16_t ap_crc16_init(void);
+extern uint16_t ap_crc16_update(uint16_t crc, const void *mem, size_t len);
+extern uint16_t ap_crc16_final(uint16_t crc);
+
+/* CRC-32C (Castagnoli), as in iSCSI, SCTP and ext4. streaming the same way as above */
+extern uint32_t ap_crc32c(const void *mem, size_t len);
+extern uint32_t ap_crc32c_init(void);
+extern uint32_t ap_crc32c_update(uint32_t crc, const void *mem, size_t len);
+extern uint32_t ap_crc32c_final(uint32_t crc);
+
+#endif
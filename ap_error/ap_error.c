@@ -68,7 +68,7 @@ void ap_error_set_detailed(const char *in_function_name, int in_errno, char *fmt
     vsnprintf(ap_log_err_details, ap_error_str_maxlen, fmt, vl);
     va_end(vl);
 
-    if (ap_log_debug_level)
+    if ( ap_log_debug_on(1) )
     {
         debug_msg = (char *)ap_error_get_string();
         ap_log_debug_log_raw(debug_msg, strlen(debug_msg));
@@ -9,11 +9,13 @@
 #define AP_LOG_C
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -21,6 +23,11 @@
 #include "ap_log.h"
 #include "ap_net/ap_net.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define AP_LOG_HAVE_SIMD
+#endif
+
 int ap_log_debug_to_tty = 0; /**< If set to true will output ap_log_debug_log() messages also to stderr */
 int ap_log_debug_level = 0;  /**< Global debugging messages verbosity level */
 
@@ -318,6 +325,7 @@ void ap_log_debug_log(char *fmt, ...)
  *
  * Use it in place of plain syslog() call to get the debugging and/or logging information on the debug channels too
  * Output to the debug channel(s) is triggered when global variable ap_log_debug_level > 0
+ * and the toolkit is not compiled with AP_LOG_NO_DEBUG
  */
 void ap_log_do_syslog(int priority, char *fmt, ...)
 {
@@ -331,7 +339,7 @@ void ap_log_do_syslog(int priority, char *fmt, ...)
 
     syslog(priority, buf);
 
-    if ( ap_log_debug_level )
+    if ( ap_log_debug_on(1) )
         ap_log_debug_log(buf);
 }
 
@@ -399,6 +407,564 @@ int ap_log_hputc(char c, int file_handle)
     return write(file_handle, &c, 1);
 }
 
+/* ********************************************************************** */
+/** \brief Sets up buffered writer for file or socket handle
+ *
+ * \param w ap_log_writer_t* - writer to set up
+ * \param file_handle int - file or socket handle. blocking or not
+ * \param flush_size int - pending bytes count that triggers flush. 0 - AP_LOG_WRITER_DEFAULT_FLUSH
+ * \return int - true/false. False if handle is invalid
+ *
+ * Example of report to telnet session with a few syscalls instead of one per line:
+ * ap_log_writer_t w;
+ *
+ * ap_log_writer_init(&w, conn->fd, 0);
+ * for ( i = 0; i < count; ++i )
+ *     ap_log_writer_printf(&w, "%d: %s\n", i, names[i]);
+ * ap_log_writer_destroy(&w);
+ */
+int ap_log_writer_init(ap_log_writer_t *w, int file_handle, int flush_size)
+{
+    struct stat statbuf;
+
+
+    w->fd = file_handle;
+    w->flush_size = flush_size > 0 ? flush_size : AP_LOG_WRITER_DEFAULT_FLUSH;
+    w->error = 0;
+    w->written = 0;
+    ap_buf_init(&w->buf, NULL);
+
+    if ( 0 != fstat(file_handle, &statbuf) )
+    {
+        w->error = errno;
+        w->is_socket = 0;
+        ap_error_set("ap_log_writer_init()", AP_ERRNO_SYSTEM);
+        return 0;
+    }
+
+    w->is_socket = S_ISSOCK(statbuf.st_mode);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Writes pending output followed by data with one writev()/sendmsg() call
+ * \internal
+ *
+ * Whatever the handle did not take is kept pending, including the tail of data.
+ * On error the pending output is discarded and w->error is set.
+ */
+static int writer_out(ap_log_writer_t *w, const void *data, int len)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    int cnt;
+    long total; /* bytes of pending output and data written */
+    ssize_t n;
+
+
+    cnt = 0;
+
+    if ( w->buf.len > 0 )
+    {
+        iov[cnt].iov_base = w->buf.data;
+        iov[cnt++].iov_len = w->buf.len;
+    }
+
+    if ( len > 0 )
+    {
+        iov[cnt].iov_base = (void *)data;
+        iov[cnt++].iov_len = len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    total = 0;
+
+    while ( msg.msg_iovlen > 0 )
+    {
+        if ( w->is_socket )
+            n = sendmsg(w->fd, &msg, MSG_NOSIGNAL);
+        else
+            n = writev(w->fd, msg.msg_iov, msg.msg_iovlen);
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+
+            w->error = errno;
+            ap_buf_clear(&w->buf);
+            ap_error_set("ap_log_writer_flush()", AP_ERRNO_SYSTEM);
+
+            return 0;
+        }
+
+        total += n;
+
+        /* skip what was written. partial writes are usual for sockets and pipes */
+        while ( msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len )
+        {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+
+        if ( msg.msg_iovlen > 0 )
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    w->written += total;
+
+    if ( total < w->buf.len )
+    {
+        ap_buf_consume(&w->buf, total);
+        total = 0;
+    }
+    else
+    {
+        total -= w->buf.len;
+        ap_buf_clear(&w->buf);
+    }
+
+    /* the handle did not take all of data. keep the rest for the next flush */
+    if ( total < len && ! ap_buf_append(&w->buf, (const char *)data + total, len - total) )
+    {
+        ap_error_set("ap_log_writer_write()", AP_ERRNO_OOM);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Buffered write()
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \param data const void* - what to write
+ * \param len int - length of data
+ * \return int - true/false. False on output error or out of memory
+ *
+ * Data that does not fit into flush_size goes to the handle together with the pending output without copying
+ */
+int ap_log_writer_write(ap_log_writer_t *w, const void *data, int len)
+{
+    if ( w->error != 0 || len < 0 )
+        return 0;
+
+    if ( len < w->flush_size - w->buf.len )
+    {
+        if ( ! ap_buf_append(&w->buf, data, len) )
+        {
+            ap_error_set("ap_log_writer_write()", AP_ERRNO_OOM);
+            return 0;
+        }
+
+        return 1;
+    }
+
+    return writer_out(w, data, len);
+}
+
+/* ********************************************************************** */
+/** \brief Buffered vfprintf()
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \param fmt const char* - printf() alike
+ * \param ap va_list - arguments
+ * \return int - true/false. False on output error or out of memory
+ *
+ */
+int ap_log_writer_vprintf(ap_log_writer_t *w, const char *fmt, va_list ap)
+{
+    if ( w->error != 0 )
+        return 0;
+
+    if ( ! ap_buf_vprintf(&w->buf, fmt, ap) )
+    {
+        ap_error_set("ap_log_writer_printf()", AP_ERRNO_OOM);
+        return 0;
+    }
+
+    if ( w->buf.len >= w->flush_size )
+        return writer_out(w, NULL, 0);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Buffered fprintf()
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \param fmt const char* - printf() alike
+ * \param ... Optional parameters
+ * \return int - true/false. False on output error or out of memory
+ *
+ */
+int ap_log_writer_printf(ap_log_writer_t *w, const char *fmt, ...)
+{
+    va_list vl;
+    int retcode;
+
+
+    va_start(vl, fmt);
+    retcode = ap_log_writer_vprintf(w, fmt, vl);
+    va_end(vl);
+
+    return retcode;
+}
+
+/* ********************************************************************** */
+/** \brief Buffered fputs()
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \param str const char* - output string
+ * \return int - true/false
+ *
+ */
+int ap_log_writer_puts(ap_log_writer_t *w, const char *str)
+{
+    return ap_log_writer_write(w, str, strlen(str));
+}
+
+/* ********************************************************************** */
+/** \brief Buffered fputc()
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \param c char - output char
+ * \return int - true/false
+ *
+ */
+int ap_log_writer_putc(ap_log_writer_t *w, char c)
+{
+    return ap_log_writer_write(w, &c, 1);
+}
+
+/* ********************************************************************** */
+/** \brief Writes out pending output
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \return int - true if nothing is pending now. False if non-blocking handle is full (call again later) or on error
+ *
+ * Use w->error to tell one from another. The handle's EPOLLOUT is a good time to call it again.
+ */
+int ap_log_writer_flush(ap_log_writer_t *w)
+{
+    if ( w->error != 0 )
+        return 0;
+
+    if ( w->buf.len == 0 )
+        return 1;
+
+    if ( ! writer_out(w, NULL, 0) )
+        return 0;
+
+    return w->buf.len == 0;
+}
+
+/* ********************************************************************** */
+/** \brief Returns count of bytes not written yet
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \return int - pending bytes
+ */
+int ap_log_writer_pending(ap_log_writer_t *w)
+{
+    return w->buf.len;
+}
+
+/* ********************************************************************** */
+/** \brief Flushes the writer and frees its memory
+ *
+ * \param w ap_log_writer_t* - writer set up by ap_log_writer_init()
+ * \return int - true/false. False if some output was lost
+ *
+ * The handle is not closed. Output that non-blocking handle could not take at once is discarded.
+ */
+int ap_log_writer_destroy(ap_log_writer_t *w)
+{
+    int retcode;
+
+
+    retcode = ap_log_writer_flush(w);
+    ap_buf_free(&w->buf);
+
+    return retcode;
+}
+
+/* ********************************************************************** */
+/* Memory dumps.
+ * Hex dump lines are formatted straight into the output buffer: the bytes go through lookup tables,
+ * or through SSSE3 nibble-to-hex shuffles 16 bytes (one full line) at once.
+ * Then the whole buffer is written out with a single call.
+ */
+
+/* dump input bytes formatted at once by ap_log_mem_dump_to_fd() and friends. ~26KB of output */
+#define DUMP_CHUNK 4096
+
+static const char hex_digits[] = "0123456789abcdef";
+static char dump_chars[256]; /* byte as printable char or '.' */
+static char dump_bits[256][8]; /* byte as '0'/'1' string */
+static int dump_tables_ready;
+static int dump_simd = -1; /* -1 - not decided yet */
+
+#ifdef AP_LOG_HAVE_SIMD
+/* shuffle masks for each of 5 output vectors of 16 byte line: "xx c " per byte */
+static unsigned char dump_mask_lo[5][16]; /* hex of line bytes 0-7 */
+static unsigned char dump_mask_hi[5][16]; /* hex of line bytes 8-15 */
+static unsigned char dump_mask_char[5][16]; /* printable chars */
+static unsigned char dump_spaces[5][16];
+#endif
+
+/* ********************************************************************** */
+static void setup_dump_tables(void)
+{
+    int i, bit;
+
+
+    for ( i = 0; i < 256; ++i )
+    {
+        dump_chars[i] = isprint(i) ? i : '.';
+
+        for ( bit = 0; bit < 8; ++bit )
+            dump_bits[i][bit] = (i & (128 >> bit)) ? '1' : '0';
+    }
+
+#ifdef AP_LOG_HAVE_SIMD
+    {
+        int pos, byte, field;
+
+
+        for ( pos = 0; pos < 80; ++pos )
+        {
+            byte = pos / 5;
+            field = pos % 5; /* 0, 1 - hex digits, 3 - char, 2, 4 - spaces */
+
+            dump_mask_lo[pos / 16][pos % 16] = ( field < 2 && byte < 8 ) ? byte * 2 + field : 0x80;
+            dump_mask_hi[pos / 16][pos % 16] = ( field < 2 && byte >= 8 ) ? (byte - 8) * 2 + field : 0x80;
+            dump_mask_char[pos / 16][pos % 16] = ( field == 3 ) ? byte : 0x80;
+            dump_spaces[pos / 16][pos % 16] = ( field == 2 || field == 4 ) ? ' ' : 0;
+        }
+    }
+#endif
+
+    dump_tables_ready = 1;
+}
+
+/* ********************************************************************** */
+/** \brief Selects hexdump implementation. For testing and benchmarks
+ *
+ * \param enable int - true to use SIMD, false - lookup tables only
+ * \return int - true/false. False if SIMD is not supported by this CPU
+ *
+ * By default SIMD is used when CPU supports it
+ */
+int ap_log_hexdump_set_simd(int enable)
+{
+    if ( ! dump_tables_ready )
+        setup_dump_tables();
+
+    dump_simd = 0;
+
+    if ( ! enable )
+        return 1;
+
+#ifdef AP_LOG_HAVE_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports("ssse3") )
+    {
+        dump_simd = 1;
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/* "%04x(%4d):  " */
+static char *put_dump_addr(char *out, unsigned int addr)
+{
+    char tmp[12];
+    unsigned int a;
+    int n;
+
+
+    n = 0;
+    for ( a = addr; a != 0 || n < 4; a >>= 4 )
+        tmp[n++] = hex_digits[a & 15];
+
+    while ( n > 0 )
+        *out++ = tmp[--n];
+
+    *out++ = '(';
+
+    a = addr;
+    do
+    {
+        tmp[n++] = '0' + a % 10;
+        a /= 10;
+    } while ( a != 0 );
+
+    while ( n < 4 )
+        tmp[n++] = ' ';
+
+    while ( n > 0 )
+        *out++ = tmp[--n];
+
+    memcpy(out, "):  ", 4);
+
+    return out + 4;
+}
+
+/* ********************************************************************** */
+/* "xx c " for each byte */
+static char *put_dump_bytes(char *out, const unsigned char *s, int len)
+{
+    int i;
+
+
+    for ( i = 0; i < len; ++i, out += 5 )
+    {
+        out[0] = hex_digits[s[i] >> 4];
+        out[1] = hex_digits[s[i] & 15];
+        out[2] = ' ';
+        out[3] = dump_chars[s[i]];
+        out[4] = ' ';
+    }
+
+    return out;
+}
+
+#ifdef AP_LOG_HAVE_SIMD
+/* ********************************************************************** */
+/* the same for exactly 16 bytes */
+__attribute__((target("ssse3")))
+static char *put_dump_line_ssse3(char *out, const unsigned char *s)
+{
+    __m128i v, nib_lo, nib_hi, hex_lo, hex_hi, chars, printable;
+    const __m128i digits = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i low4 = _mm_set1_epi8(0x0f);
+    int i;
+
+
+    v = _mm_loadu_si128((const __m128i *)s);
+
+    nib_lo = _mm_and_si128(v, low4);
+    nib_hi = _mm_and_si128(_mm_srli_epi16(v, 4), low4);
+    nib_lo = _mm_shuffle_epi8(digits, nib_lo);
+    nib_hi = _mm_shuffle_epi8(digits, nib_hi);
+    hex_lo = _mm_unpacklo_epi8(nib_hi, nib_lo); /* digit pairs of bytes 0-7 */
+    hex_hi = _mm_unpackhi_epi8(nib_hi, nib_lo); /* of bytes 8-15 */
+
+    /* isprint() of "C" locale: 0x20 - 0x7e. signed compare makes bytes >= 0x80 negative */
+    printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+    chars = _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+
+    for ( i = 0; i < 5; ++i )
+    {
+        v = _mm_or_si128(_mm_shuffle_epi8(hex_lo, _mm_loadu_si128((const __m128i *)dump_mask_lo[i])),
+                         _mm_shuffle_epi8(hex_hi, _mm_loadu_si128((const __m128i *)dump_mask_hi[i])));
+        v = _mm_or_si128(v, _mm_shuffle_epi8(chars, _mm_loadu_si128((const __m128i *)dump_mask_char[i])));
+        v = _mm_or_si128(v, _mm_loadu_si128((const __m128i *)dump_spaces[i]));
+        _mm_storeu_si128((__m128i *)(out + i * 16), v);
+    }
+
+    return out + 80;
+}
+#endif
+
+/* ********************************************************************** */
+/** \brief Formats memory hex dump into buffer
+ *
+ * \param out char* - output buffer of at least ap_log_hexdump_size(len) bytes
+ * \param memory_area const void* - origin of data
+ * \param len int - length of data
+ * \param addr int - address shown for the first byte
+ * \param show_addr int - true to start lines with address
+ * \return int - bytes put into out. no '\0' is added
+ *
+ * Makes the same lines as ap_log_mem_dump_to_fd(): 16 bytes per line of "xx c " each
+ */
+int ap_log_hexdump(char *out, const void *memory_area, int len, int addr, int show_addr)
+{
+    const unsigned char *s;
+    char *o;
+    int linelen;
+
+
+    if ( dump_simd == -1 )
+        ap_log_hexdump_set_simd(1);
+
+    s = memory_area;
+    o = out;
+
+    for ( ; len > 0; len -= linelen, addr += linelen, s += linelen )
+    {
+        if ( show_addr )
+            o = put_dump_addr(o, addr);
+
+        linelen = len > 16 ? 16 : len;
+
+#ifdef AP_LOG_HAVE_SIMD
+        if ( dump_simd && linelen == 16 )
+            o = put_dump_line_ssse3(o, s);
+        else
+#endif
+            o = put_dump_bytes(o, s, linelen);
+
+        *o++ = '\n';
+    }
+
+    return o - out;
+}
+
+/* ********************************************************************** */
+/** \brief Returns the buffer size ap_log_hexdump() needs
+ *
+ * \param len int - length of data
+ * \return int - bytes
+ */
+int ap_log_hexdump_size(int len)
+{
+    return (len + 15) / 16 * AP_LOG_HEXDUMP_LINE;
+}
+
+/* ********************************************************************** */
+/* formats dump chunk by chunk into the writer's buffer */
+static void writer_hexdump(ap_log_writer_t *w, const unsigned char *s, int len, int show_addr)
+{
+    char *out;
+    int addr;
+    int n, size;
+
+
+    for ( addr = 0; len > 0 && w->error == 0; len -= n, addr += n, s += n )
+    {
+        n = len > DUMP_CHUNK ? DUMP_CHUNK : len;
+        size = ap_log_hexdump_size(n);
+
+        if ( NULL == (out = ap_buf_append_space(&w->buf, size)) )
+        {
+            ap_error_set("ap_log_mem_dump_to_fd()", AP_ERRNO_OOM);
+            return;
+        }
+
+        w->buf.len -= size - ap_log_hexdump(out, s, n, addr, show_addr);
+
+        if ( w->buf.len >= w->flush_size )
+            writer_out(w, NULL, 0);
+    }
+}
+
 /* ********************************************************************** */
 /** \brief Memory hex dump with printable characters shown
  *
@@ -414,41 +980,98 @@ int ap_log_hputc(char c, int file_handle)
  */
 void ap_log_mem_dump_to_fd(int file_handle, void *memory_area, int len)
 {
-    int i;
-    int addr;
-    int showaddr;
-    int linelen;
-    unsigned char *s;
+    ap_log_writer_t w;
 
 
-    if (len == 0)
+    if (len <= 0)
         return;
 
-    showaddr = (len > 48);/*  > 3 lines of data */
-    addr = 0;
+    if ( ! ap_log_writer_init(&w, file_handle, DUMP_CHUNK * 16) )
+        return;
 
-    s = (unsigned char*)memory_area;
+    writer_hexdump(&w, memory_area, len, len > 48); /* address for > 3 lines of data */
 
-    for (; len > 0; len -= 16, addr += 16)
-    {
-        if (showaddr)
-            ap_log_hprintf(file_handle, "%04x(%4d):  ", addr, addr);
+    ap_log_writer_destroy(&w);
+}
 
-        linelen = len > 16 ? 16 : len;
+/* ********************************************************************** */
+/** \brief Sets up truncation and sampling for ap_log_mem_dump_limited()
+ *
+ * \param limit ap_log_dump_limit_t* - limits to set up
+ * \param max_bytes int - dump only this many first bytes of each area. 0 - no limit
+ * \param sample_every int - dump only one of each sample_every areas. 0 or 1 - each
+ * \return void
+ */
+void ap_log_dump_limit_init(ap_log_dump_limit_t *limit, int max_bytes, int sample_every)
+{
+    limit->max_bytes = max_bytes;
+    limit->sample_every = sample_every;
+    limit->seen = 0;
+    limit->dumped = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Memory hex dump with truncation and sampling. For payload tracing on live traffic
+ *
+ * \param file_handle int - output file or socket handle
+ * \param limit ap_log_dump_limit_t* - limits set up by ap_log_dump_limit_init(). Keep one per connection
+ * \param memory_area void* - origin of data
+ * \param len int - length of data
+ * \return int - true if dumped, false if skipped by sampling
+ *
+ * Truncated dump ends with "... N more bytes" line. Example for DATA_IN signal handler:
+ * ap_log_mem_dump_limited(trace_fd, &trace_limits[conn->idx], conn->buf + conn->bufpos, conn->buffill - conn->bufpos);
+ */
+int ap_log_mem_dump_limited(int file_handle, ap_log_dump_limit_t *limit, void *memory_area, int len)
+{
+    ap_log_writer_t w;
+    int n;
 
-        for (i = 0; i < linelen; ++i)
-            ap_log_hprintf(file_handle, "%02x %c ", s[i], isprint(s[i]) ? s[i] : '.');
 
-        /*
-        for(i = 0; i < linelen; ++i) hprintf(file_handle, "%02x ", s[i]);
-        for(i = 16 - linelen; i > 0; --i) hputs("   ", file_handle);
+    if ( limit->sample_every > 1 && limit->seen++ % limit->sample_every != 0 )
+        return 0;
 
-        hprintf(file_handle, "\n\t");
-        for(i = 0; i < linelen; ++i) hprintf(file_handle, " %c ", isprint(s[i]) ? s[i] : '.');
-        */
-        ap_log_hputc('\n', file_handle);
+    if ( limit->sample_every <= 1 )
+        ++limit->seen;
+
+    ++limit->dumped;
+
+    if ( len <= 0 || ! ap_log_writer_init(&w, file_handle, DUMP_CHUNK * 16) )
+        return 1;
+
+    n = ( limit->max_bytes > 0 && len > limit->max_bytes ) ? limit->max_bytes : len;
+
+    writer_hexdump(&w, memory_area, n, n > 48);
+
+    if ( n < len )
+        ap_log_writer_printf(&w, "... %d more bytes\n", len - n);
+
+    ap_log_writer_destroy(&w);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* writes complete dump to stderr if set so and to all of debug handles */
+static void dump_to_debug_channels(ap_buf_t *dump)
+{
+    ap_log_writer_t w;
+    int i;
+
+
+    if (ap_log_debug_to_tty && ap_log_writer_init(&w, fileno(stderr), dump->len + 1))
+    {
+        ap_log_writer_write(&w, dump->data, dump->len);
+        ap_log_writer_destroy(&w);
+    }
 
-        s += linelen;
+    for ( i = 0; i < debug_handles_count; ++i )
+    {
+        if ( ap_log_writer_init(&w, debug_handles[i].fd, dump->len + 1) )
+        {
+            ap_log_writer_write(&w, dump->data, dump->len);
+            ap_log_writer_destroy(&w);
+        }
     }
 }
 
@@ -466,16 +1089,65 @@ void ap_log_mem_dump_to_fd(int file_handle, void *memory_area, int len)
  */
 void ap_log_mem_dump(void *memory_area, int len)
 {
+    ap_buf_t dump;
+    char *out;
+
+
+    if ( len <= 0 || (! ap_log_debug_to_tty && debug_handles_count == 0) )
+        return;
+
+    /* formatted once for all of the channels */
+    ap_buf_init(&dump, NULL);
+
+    if ( NULL != (out = ap_buf_append_space(&dump, ap_log_hexdump_size(len))) )
+    {
+        dump.len = ap_log_hexdump(out, memory_area, len, 0, len > 48);
+        dump_to_debug_channels(&dump);
+    }
+
+    ap_buf_free(&dump);
+}
+
+/* ********************************************************************** */
+/* "\t" + "0x%02x: bbbbbbbb   " for each of up to 4 bytes + "\n" */
+static int put_dump_bits(char *out, const unsigned char *s, int len)
+{
+    char *o;
+    int linelen;
     int i;
 
 
-    if (ap_log_debug_to_tty)
-        ap_log_mem_dump_to_fd(fileno(stderr), memory_area, len);
+    if ( ! dump_tables_ready )
+        setup_dump_tables();
 
-    for ( i = 0; i < debug_handles_count; ++i )
-        ap_log_mem_dump_to_fd(debug_handles[i].fd, memory_area, len);
+    o = out;
+
+    for ( ; len > 0; len -= linelen, s += linelen )
+    {
+        *o++ = '\t';
+
+        linelen = len > 4 ? 4 : len;
+
+        for ( i = 0; i < linelen; ++i )
+        {
+            memcpy(o, "0x", 2);
+            o[2] = hex_digits[s[i] >> 4];
+            o[3] = hex_digits[s[i] & 15];
+            memcpy(o + 4, ": ", 2);
+            memcpy(o + 6, dump_bits[s[i]], 8);
+            memcpy(o + 14, "   ", 3);
+            o += 17;
+        }
+
+        *o++ = '\n';
+    }
+
+    return o - out;
 }
 
+/* bytes of output of put_dump_bits() for len */
+#define dump_bits_size(len) (((len) + 3) / 4 * (4 * 17 + 2))
+
 /* ********************************************************************** */
 /** \brief Memory area bits dump direct to file or socket descriptor
  *
@@ -491,35 +1163,34 @@ void ap_log_mem_dump(void *memory_area, int len)
  */
 void ap_log_mem_dump_bits_to_fd(int file_handle, void *memory_area, int len)
 {
-    int i;
-    int mask;
-    int size;
+    ap_log_writer_t w;
     unsigned char *s;
+    char *out;
+    int n;
+
 
+    if (len <= 0)
+        return;
 
-    if (len == 0)
+    if ( ! ap_log_writer_init(&w, file_handle, DUMP_CHUNK * 16) )
         return;
 
     s = (unsigned char*)memory_area;
 
-    for (; len > 0; len -= 4)
+    for (; len > 0 && w.error == 0; len -= n, s += n)
     {
-        ap_log_hputs("\t", file_handle);
-
-        size = len > 4 ? 4 : len;
+        n = len > DUMP_CHUNK ? DUMP_CHUNK : len;
 
-        for(i = 0; i < size; ++i)
-        {
-            ap_log_hprintf(file_handle, "0x%02x: ", s[i]);
+        if ( NULL == (out = ap_buf_append_space(&w.buf, dump_bits_size(n))) )
+            break;
 
-            for (mask = 128; mask != 0; mask >>= 1)
-                ap_log_hputc( s[i] & mask ? '1' : '0', file_handle );
+        w.buf.len -= dump_bits_size(n) - put_dump_bits(out, s, n);
 
-            ap_log_hputs("   ", file_handle);
-        }
-
-        ap_log_hputs("\n", file_handle);
+        if ( w.buf.len >= w.flush_size )
+            writer_out(&w, NULL, 0);
     }
+
+    ap_log_writer_destroy(&w);
 }
 
 /* ********************************************************************** */
@@ -536,13 +1207,20 @@ void ap_log_mem_dump_bits_to_fd(int file_handle, void *memory_area, int len)
  */
 void ap_log_mem_dump_bits(void *memory_area, int len)
 {
-    int i;
+    ap_buf_t dump;
+    char *out;
 
 
-    if (ap_log_debug_to_tty)
-        ap_log_mem_dump_bits_to_fd(fileno(stderr), memory_area, len);
+    if ( len <= 0 || (! ap_log_debug_to_tty && debug_handles_count == 0) )
+        return;
 
-    for ( i = 0; i < debug_handles_count; ++i )
-        ap_log_mem_dump_bits_to_fd(debug_handles[i].fd, memory_area, len);
-}
+    ap_buf_init(&dump, NULL);
 
+    if ( NULL != (out = ap_buf_append_space(&dump, dump_bits_size(len))) )
+    {
+        dump.len = put_dump_bits(out, memory_area, len);
+        dump_to_debug_channels(&dump);
+    }
+
+    ap_buf_free(&dump);
+}
@@ -9,8 +9,11 @@
 #ifndef AP_LOG_H
 #define AP_LOG_H
 
+#include <stdarg.h>
 #include <syslog.h>
 
+#include "ap_buf.h"
+
 #define AP_ERRNO_NOERROR              0
 #define AP_ERRNO_SYSTEM               1
 #define AP_ERRNO_CUSTOM_MESSAGE       2
@@ -22,6 +25,16 @@
 #define AP_ERRNO_ACCEPT_DENIED        8
 /* !!! don't forget to update internal_strings.h with error description !!! */
 
+/* Toolkit's internal diagnostics are guarded by ap_log_debug_on() and ap_net_poller_debug_on() checks.
+ * Compile with -DAP_LOG_NO_DEBUG (see 'make nodebug') to throw them out of the code completely.
+ * ap_log_debug_log() and friends are still available for the application itself.
+ */
+#ifdef AP_LOG_NO_DEBUG
+#define ap_log_debug_on(min_level) 0
+#else
+#define ap_log_debug_on(min_level) (ap_log_debug_level >= (min_level))
+#endif
+
 #ifndef AP_LOG_C
 extern int ap_log_debug_to_tty; /* boolean flag telling whether to output debug messages to stderr also */
 extern int ap_log_debug_level; /* verboseness of debug messages. use  if ( debug_level >= MINLEVEL ) say_something; */
@@ -47,10 +60,56 @@ extern int ap_log_hputs(char *str, int fh); /* like fputs for int handles */
 extern int ap_log_hputc(char c, int fh); /* like fputc for int handles */
 
 /* ************************************* */
+/* ap_log_writer_init() default of flush_size */
+#define AP_LOG_WRITER_DEFAULT_FLUSH 4096
+
+/** \brief Buffered output to file or socket handle. Like stdio FILE for int handles, but socket-aware.
+ * Output is collected in memory and goes to the handle when flush_size is reached or ap_log_writer_flush() is called.
+ * Non-blocking handles are not waited for: whatever is not taken by the kernel stays pending for the next flush.
+*/
+typedef struct ap_log_writer_t
+{
+    int fd; /**< output file or socket handle */
+    int is_socket; /**< socket: send with MSG_NOSIGNAL instead of plain writev() */
+    int flush_size; /**< pending bytes count that triggers flush */
+    int error; /**< errno of the failed write. 0 - none. output is discarded after an error */
+    long written; /**< bytes taken by the handle so far */
+    ap_buf_t buf; /**< pending output */
+} ap_log_writer_t;
+
+extern int ap_log_writer_init(ap_log_writer_t *w, int fh, int flush_size); /* flush_size 0 - default */
+extern int ap_log_writer_write(ap_log_writer_t *w, const void *data, int len);
+extern int ap_log_writer_printf(ap_log_writer_t *w, const char *fmt, ...); /* like fprintf */
+extern int ap_log_writer_vprintf(ap_log_writer_t *w, const char *fmt, va_list ap);
+extern int ap_log_writer_puts(ap_log_writer_t *w, const char *str); /* like fputs */
+extern int ap_log_writer_putc(ap_log_writer_t *w, char c); /* like fputc */
+extern int ap_log_writer_flush(ap_log_writer_t *w); /* true if nothing is pending after it */
+extern int ap_log_writer_pending(ap_log_writer_t *w); /* bytes not written yet */
+extern int ap_log_writer_destroy(ap_log_writer_t *w); /* flushes and frees the memory. true if all was written */
+
+/* ************************************* */
+/* ap_log_hexdump() output size limit per line of 16 bytes */
+#define AP_LOG_HEXDUMP_LINE 104
+
+/** \brief Truncation and sampling of dumps by ap_log_mem_dump_limited(). Keep one per connection for payload tracing
+*/
+typedef struct ap_log_dump_limit_t
+{
+    int max_bytes; /**< dump only this many first bytes of each area. 0 - no limit */
+    int sample_every; /**< dump only one of each sample_every areas. 0 or 1 - each */
+    long seen; /**< areas offered */
+    long dumped; /**< areas actually dumped */
+} ap_log_dump_limit_t;
+
 extern void ap_log_mem_dump_to_fd(int fh, void *p, int len); /* hexdump/printable chars into specified file handle */
 extern void ap_log_mem_dump(void *p, int len); /* hexdump/printable chars to debug channel(s) */
 extern void ap_log_mem_dump_bits_to_fd(int fh, void *p, int len); /* bitdump into specified file handle */
 extern void ap_log_mem_dump_bits(void *p, int len); /* bitdump into debug channel(s) */
+extern void ap_log_dump_limit_init(ap_log_dump_limit_t *limit, int max_bytes, int sample_every); /* 0 - no limit */
+extern int ap_log_mem_dump_limited(int fh, ap_log_dump_limit_t *limit, void *p, int len); /* true if not skipped by sampling */
+extern int ap_log_hexdump(char *out, const void *p, int len, int addr, int show_addr); /* formats hexdump. returns its length */
+extern int ap_log_hexdump_size(int len); /* out size for ap_log_hexdump() */
+extern int ap_log_hexdump_set_simd(int enable); /* false if SIMD is not supported. default is to use it if possible */
 
 
 #endif
@@ -6,8 +6,10 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +18,10 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../ap_buf.h"
+#include "../ap_utils.h"
 
 /* connection statuses bits */
         /* ERROR state. Without doubt you should not perform i/o operations on this connection anymore */
@@ -33,6 +39,13 @@
         /* Closing. Set in poller when data input attempt returns that peer disconnected gracefully. ap_net_conn_pool_poll() closes those on start, so do your best */
 #define AP_NET_ST_DISCONNECTION 64
 
+/* true if poller should report events to debug channel(s). Always false if compiled with AP_LOG_NO_DEBUG */
+#ifdef AP_LOG_NO_DEBUG
+#define ap_net_poller_debug_on(poller) 0
+#else
+#define ap_net_poller_debug_on(poller) ((poller)->debug)
+#endif
+
 /* Flags for pools */
         /* Pool is of TCP type. Absence of this flag means UDP pool */
 #define AP_NET_POOL_FLAGS_TCP    1
@@ -67,6 +80,64 @@
 #define AP_NET_SIGNAL_CONN_CAN_SEND    8
 #define AP_NET_SIGNAL_CONN_TIMED_OUT   9
 #define AP_NET_SIGNAL_CONN_DATA_LEFT  10
+#define AP_NET_SIGNAL_CONN_SEND_DONE  11
+#define AP_NET_SIGNAL_CONN_RECV_DONE  12
+#define AP_NET_SIGNAL_CONN_MESSAGE    13
+    /* count of signals above. keep it in sync */
+#define AP_NET_SIGNALS_COUNT          14
+
+/* flight recorder event types. see ap_net_conn_pool_recorder_enable() for detailed description */
+#define AP_NET_REC_ACCEPT   1
+#define AP_NET_REC_CONNECT  2
+#define AP_NET_REC_RECV     3
+#define AP_NET_REC_SEND     4
+#define AP_NET_REC_CLOSE    5
+#define AP_NET_REC_EXPIRE   6
+#define AP_NET_REC_ERROR    7
+
+/* ring size of the flight recorder every pool gets on creation */
+#define AP_NET_RECORDER_DEFAULT_EVENTS 256
+
+/* poll cycle phases measured by profiler. see ap_net_conn_pool_profiler_enable() for detailed description */
+#define AP_NET_PHASE_ZOMBIES   0
+#define AP_NET_PHASE_EPOLL     1
+#define AP_NET_PHASE_ACCEPT    2
+#define AP_NET_PHASE_RECV      3
+#define AP_NET_PHASE_CALLBACK  4
+#define AP_NET_PHASE_EXPIRY    5
+#define AP_NET_PHASE_CYCLE     6
+    /* count of phases above. keep it in sync */
+#define AP_NET_PHASES_COUNT    7
+
+/* flags for ap_net_conn_pool_shm_export() */
+        /* publish per-connection summaries too */
+#define AP_NET_SHM_CONNS 1
+/* ap_net_shm_t.magic value: "APNS" */
+#define AP_NET_SHM_MAGIC 0x534e5041
+/* ap_net_shm_t layout version. bump on any change to ap_net_shm_t, ap_net_shm_conn_t or ap_net_stat_t */
+#define AP_NET_SHM_VERSION 6
+
+/* flags for ap_net_conn_pool_sendfile() */
+        /* close the source descriptor when the transfer is done or dropped */
+#define AP_NET_SENDFILE_CLOSE 1
+
+/* framer types for ap_net_conn_pool_framer_set() */
+        /* no framing. AP_NET_SIGNAL_CONN_DATA_IN as usual */
+#define AP_NET_FRAMER_NONE      0
+        /* each message is preceded by its length of 1, 2 or 4 bytes */
+#define AP_NET_FRAMER_LENGTH    1
+        /* each message ends with the delimiter byte */
+#define AP_NET_FRAMER_DELIMITER 2
+        /* all messages are of the same size */
+#define AP_NET_FRAMER_FIXED     3
+
+/* flags for ap_net_conn_pool_framer_set() */
+        /* length prefix is in network byte order. little endian otherwise */
+#define AP_NET_FRAMER_BIG_ENDIAN 1
+
+/* flags for ap_net_conn_pool_profiler_enable() */
+        /* sample CPU cycles and cache misses counters via perf_event_open() */
+#define AP_NET_PROFILE_HW_COUNTERS 1
 
 typedef struct ap_net_conn_pool_t ap_net_conn_pool_t;
 
@@ -124,6 +195,8 @@ typedef struct ap_net_poll_t
 
 /* ********************************************************************** */
 /** \brief Statistics for pool
+ *
+ * Counters are updated with relaxed atomic operations. Use ap_net_conn_pool_get_stat() to read them from other thread
 */
 typedef struct ap_net_stat_t
 {
@@ -131,11 +204,348 @@ typedef struct ap_net_stat_t
     unsigned timedout;   /**< How many times connections was expired */
     unsigned queue_full_count;  /**< Count of dropped connections because of queue full */
     unsigned active_conn_count; /**< A sum of active pool's connections at the time of newly created. use for average_conn_count = active_conn_count / conn_count */
-    struct timespec total_time;  /**< Total connected time for all past connections */
+    struct timespec total_time; /**< Total connected time for all past connections. Same as total_time_ns, kept for compatibility */
+    uint64_t total_time_ns; /**< Total connected time for all past connections, in nanoseconds */
+    uint64_t bytes_in;      /**< Bytes received */
+    uint64_t bytes_out;     /**< Bytes sent */
+    uint64_t msgs_in;       /**< Successful recv() calls. For UDP it is datagrams count */
+    uint64_t msgs_out;      /**< Successful send() calls. For UDP it is datagrams count */
+    uint64_t recv_calls;    /**< recv() and recvfrom() system calls made */
+    uint64_t send_calls;    /**< send() and sendto() system calls made */
+    uint64_t epoll_calls;   /**< epoll_wait() system calls made */
+    uint64_t accept_calls;  /**< accept() system calls made */
+    uint64_t eagain_in;     /**< recv() returned EAGAIN */
+    uint64_t eagain_out;    /**< send() returned EAGAIN */
+    uint64_t partial_sends; /**< send() has sent less than requested */
+    uint64_t buf_full;      /**< Receive skipped because connection's buffer is full */
+    uint64_t errors;        /**< Socket errors: failed system calls, except EAGAIN, and EPOLLERR/EPOLLHUP events */
+    uint64_t signals[AP_NET_SIGNALS_COUNT]; /**< Callback calls per AP_NET_SIGNAL_* */
 } ap_net_stat_t;
 
+/* ********************************************************************** */
+/** \brief Single flight recorder event
+*/
+typedef struct ap_net_recorder_event_t
+{
+    unsigned long seq; /**< event number + 1. Written last, so partially written slot is detectable. 0 if slot is unused */
+    uint64_t time_ns; /**< CLOCK_MONOTONIC timestamp in nanoseconds */
+    int type; /**< AP_NET_REC_* */
+    int conn_idx; /**< connection index in pool. -1 if not applicable */
+    int fd; /**< connection's socket descriptor at the time of event */
+    int value; /**< bytes count for AP_NET_REC_RECV/SEND, state bits for AP_NET_REC_CLOSE, errno for AP_NET_REC_ERROR */
+} ap_net_recorder_event_t;
+
+/* ********************************************************************** */
+/** \brief Flight recorder: fixed-size ring of the latest connection lifecycle events
+*/
+typedef struct ap_net_recorder_t
+{
+    struct ap_net_recorder_event_t *events; /**< Ring storage */
+    unsigned long size_mask; /**< Ring size - 1. Size is always power of two */
+    unsigned long head; /**< Count of events recorded so far. Next slot is head & size_mask */
+    int id; /**< Recorder's number in global list. Used to distinguish pools in dumps */
+} ap_net_recorder_t;
+
+/* ********************************************************************** */
+/** \brief Poll cycle profiler data. All times are in nanoseconds
+*/
+typedef struct ap_net_profile_t
+{
+    struct ap_utils_hist_t phase[AP_NET_PHASES_COUNT]; /**< Per-cycle time spent in each of AP_NET_PHASE_* */
+    struct ap_utils_hist_t signal[AP_NET_SIGNALS_COUNT]; /**< Callback function execution time per AP_NET_SIGNAL_* */
+    uint64_t slow_callback_ns; /**< Callbacks that run longer than this are counted as slow. 0 to disable */
+    uint64_t slow_callbacks; /**< Count of slow callbacks */
+    uint64_t slowest_callback_ns; /**< Slowest callback time seen */
+    int slowest_signal; /**< AP_NET_SIGNAL_* of the slowest callback seen */
+    int flags; /**< AP_NET_PROFILE_* */
+    int hw_fd; /**< perf_event group leader descriptor. -1 if hardware counters are not used or not available */
+    int hw_fd_misses; /**< perf_event cache misses counter descriptor */
+    uint64_t hw_cycles; /**< CPU cycles spent inside ap_net_conn_pool_poll() */
+    uint64_t hw_cache_misses; /**< Cache misses inside ap_net_conn_pool_poll() */
+    uint64_t hw_start[2]; /**< Internal. Counters at the start of current cycle */
+    uint64_t cycle_start; /**< Internal. Current cycle start time */
+    uint64_t mark; /**< Internal. Time of the last phase end */
+    uint64_t callback_ns; /**< Internal. Time spent in callbacks during current cycle */
+    uint64_t mark_callback_ns; /**< Internal. callback_ns at the time of the last phase end */
+    int in_cycle; /**< Internal. True while inside ap_net_conn_pool_poll() */
+    int callback_depth; /**< Internal. Nesting level of callbacks, e.g. CLOSING fired from inside of DATA_IN */
+} ap_net_profile_t;
+
+/* ********************************************************************** */
+/** \brief Per-connection summary in the shared memory statistics segment
+*/
+typedef struct ap_net_shm_conn_t
+{
+    int idx; /**< Index in pool's connections array */
+    int fd; /**< Socket descriptor */
+    unsigned state; /**< AP_NET_ST_* */
+    unsigned flags; /**< AP_NET_CONN_FLAGS_* */
+    int af; /**< Remote address family: AF_INET or AF_INET6 */
+    unsigned short remote_port; /**< Remote port in host byte order */
+    unsigned char remote_addr[16]; /**< Remote address in network byte order. First 4 bytes are used for AF_INET */
+    int buffered; /**< Unprocessed bytes in receive buffer: buffill - bufpos */
+    int bufsize; /**< Receive buffer size */
+    uint64_t age_ms; /**< Time since connection was created */
+} ap_net_shm_conn_t;
+
+/* ********************************************************************** */
+/** \brief Shared memory statistics segment layout. See ap_net_conn_pool_shm_export()
+*/
+typedef struct ap_net_shm_t
+{
+    uint32_t magic; /**< AP_NET_SHM_MAGIC */
+    uint32_t version; /**< AP_NET_SHM_VERSION */
+    uint64_t seq; /**< Seqlock sequence. Odd while the writer is updating the data */
+    int pid; /**< Exporting process ID */
+    int flags; /**< AP_NET_SHM_* */
+    uint64_t publish_ns; /**< CLOCK_MONOTONIC time of the last update */
+    uint64_t publish_count; /**< Count of updates */
+    int max_connections; /**< Pool's connections array size */
+    int used_slots; /**< Pool's connections in use */
+    int conns_capacity; /**< Size of conns[] array. 0 without AP_NET_SHM_CONNS flag */
+    int conns_count; /**< Valid entries in conns[] */
+    struct ap_net_stat_t stat; /**< Pool's statistics */
+    struct ap_net_shm_conn_t conns[]; /**< Connected connections summaries */
+} ap_net_shm_t;
+
+/* ********************************************************************** */
+/** \brief Exporting side state of the shared memory statistics segment
+*/
+typedef struct ap_net_shm_export_t
+{
+    char name[NAME_MAX]; /**< Segment name as given to shm_open() */
+    struct ap_net_shm_t *shm; /**< Mapped segment */
+    size_t size; /**< Mapped size */
+    uint64_t interval_ns; /**< Minimal time between updates */
+    uint64_t last_ns; /**< Last update time */
+} ap_net_shm_export_t;
+
+/* ********************************************************************** */
+/** \brief Traffic capture state. See ap_net_conn_pool_capture_start()
+*/
+typedef struct ap_net_capture_t
+{
+    int fd; /**< Output pcapng file */
+    char *buf; /**< Blocks not written to file yet */
+    int buf_size; /**< buf capacity */
+    int buf_fill; /**< Bytes in buf */
+    int snaplen; /**< Payload bytes saved per packet. 0 - all */
+    struct ap_net_capture_flow_t *flows; /**< Per-connection synthetic TCP state, indexed by connection slot */
+    int flows_size; /**< flows array size */
+    unsigned ip_id; /**< Synthetic IPv4 identification counter */
+    uint64_t packets; /**< Packets captured */
+    uint64_t dropped; /**< Packets lost on write errors */
+} ap_net_capture_t;
+
+/* ********************************************************************** */
+/** \brief Output corking state. See ap_net_conn_pool_cork_enable()
+*/
+typedef struct ap_net_cork_t
+{
+    struct ap_net_cork_conn_t *conns; /**< Held output per connection slot */
+    int conns_size; /**< conns and pending arrays size */
+    int *pending; /**< Slots with held output */
+    int pending_count; /**< Count of slots in pending */
+    int max_held; /**< Held bytes per connection that are sent right away with MSG_MORE */
+    int in_cycle; /**< True inside ap_net_conn_pool_poll(). Sends are held only then */
+    uint64_t held; /**< Sends held */
+    uint64_t flushes; /**< System calls made to send held output */
+} ap_net_cork_t;
+
+/* ********************************************************************** */
+/** \brief File transfers state. See ap_net_conn_pool_sendfile()
+*/
+typedef struct ap_net_sendfile_t
+{
+    struct ap_net_sendfile_conn_t *conns; /**< Transfer per connection slot */
+    int conns_size; /**< conns array size */
+    int active; /**< Transfers in progress */
+    char *capture_buf; /**< File data is read here for traffic capture. NULL until needed */
+    uint64_t completed; /**< Transfers done */
+    uint64_t bytes; /**< Bytes sent by all transfers */
+} ap_net_sendfile_t;
+
+/* ********************************************************************** */
+/** \brief Scratch memory of pool. See ap_net_conn_pool_scratch() and ap_net_connection_arena()
+*/
+typedef struct ap_net_arenas_t
+{
+    ap_arena_t cycle; /**< Reset at the end of each ap_net_conn_pool_poll() */
+    ap_arena_t *conns; /**< Per connection slot. Reset on connection close */
+    int conns_size; /**< conns array size */
+} ap_net_arenas_t;
+
+/* ********************************************************************** */
+/** \brief Message framing state. See ap_net_conn_pool_framer_set()
+*/
+typedef struct ap_net_framer_t
+{
+    int type; /**< AP_NET_FRAMER_* */
+    int param; /**< Length prefix size, delimiter or message size */
+    int flags; /**< AP_NET_FRAMER_BIG_ENDIAN */
+    int *scanned; /**< Per connection slot: bytes from bufpos on searched for delimiter already */
+    int conns_size; /**< scanned array size */
+    char *msg; /**< The message being signaled. See ap_net_conn_pool_message() */
+    int msg_len; /**< Its length */
+    uint64_t messages; /**< Messages signaled */
+    uint64_t scanned_bytes; /**< Bytes searched for delimiter */
+    uint64_t oversized; /**< Connections closed on message larger than buffer */
+} ap_net_framer_t;
+
+/* ********************************************************************** */
+/** \brief Receiving buffer given to application. See ap_net_conn_pool_buf_detach()
+*/
+typedef struct ap_net_rbuf_t
+{
+    char *data; /**< Detached data */
+    int len; /**< Its length */
+    char *mem; /**< The whole buffer */
+    int size; /**< Its size */
+    int refs; /**< References. Use ap_net_rbuf_ref() and ap_net_rbuf_release() */
+    struct ap_net_rbuf_t *next; /**< Free list link */
+    struct ap_net_rbufs_t *owner; /**< Pool's buffers state */
+} ap_net_rbuf_t;
+
+/** \brief Receiving buffers handoff state. See ap_net_conn_pool_buf_detach()
+*/
+typedef struct ap_net_rbufs_t
+{
+    struct ap_net_rbuf_t *free_list; /**< Buffers to give to connections. Used by pool's thread only */
+    struct ap_net_rbuf_t *returned; /**< Released buffers not on free list yet. Any thread adds here */
+    int refs; /**< One of pool plus one per detached buffer */
+    int allocated; /**< Buffers allocated */
+    uint64_t detached; /**< Buffers given to application */
+    uint64_t tail_bytes; /**< Bytes after detached part copied to fresh buffers */
+} ap_net_rbufs_t;
+
+/* ********************************************************************** */
+/** \brief Direct reads state. See ap_net_conn_pool_recv_into()
+*/
+typedef struct ap_net_recv_into_t
+{
+    struct ap_net_recv_into_conn_t *conns; /**< Read per connection slot */
+    int conns_size; /**< conns array size */
+    int active; /**< Reads in progress */
+    uint64_t completed; /**< Reads done */
+    uint64_t bytes; /**< Bytes received directly into application's memory */
+} ap_net_recv_into_t;
+
+/* ********************************************************************** */
+/** \brief Bridged connections of pool. See ap_net_conn_pool_bridge()
+*/
+typedef struct ap_net_bridges_t
+{
+    struct ap_net_bridge_t **conns; /**< Bridge per connection slot. NULL if not bridged */
+    int conns_size; /**< conns array size */
+    int active; /**< Bridged connections */
+} ap_net_bridges_t;
+
+/** \brief Bridge counters of connection. See ap_net_conn_pool_bridge_get_stat()
+*/
+typedef struct ap_net_bridge_stat_t
+{
+    uint64_t bytes_in; /**< Received from this connection */
+    uint64_t bytes_out; /**< Sent to this connection */
+    int piped_in; /**< Received from this connection, not sent to the other one yet */
+    int piped_out; /**< Received from the other connection, not sent to this one yet */
+    int eof_in; /**< This connection's peer has shut down its output */
+    int eof_out; /**< Output of this connection is shut down, passing on the other's end */
+} ap_net_bridge_stat_t;
+
+/* ********************************************************************** */
+/** \brief System calls used by the networking module. The current table is pointed by ap_net_io
+ *
+ * ap_net_io_system is the default one. Network simulator installs its own, see ap_net_sim_create()
+*/
+typedef struct ap_net_io_ops_t
+{
+    int (*socket)(int domain, int type, int protocol);
+    int (*bind)(int fd, const struct sockaddr *addr, socklen_t addr_len);
+    int (*listen)(int fd, int backlog);
+    int (*accept)(int fd, struct sockaddr *addr, socklen_t *addr_len);
+    int (*connect)(int fd, const struct sockaddr *addr, socklen_t addr_len);
+    int (*getsockname)(int fd, struct sockaddr *addr, socklen_t *addr_len);
+    int (*getsockopt)(int fd, int level, int name, void *value, socklen_t *value_len);
+    int (*setsockopt)(int fd, int level, int name, const void *value, socklen_t value_len);
+    int (*fcntl)(int fd, int cmd, int arg);
+    ssize_t (*recv)(int fd, void *buf, size_t len, int flags);
+    ssize_t (*recvfrom)(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len);
+    ssize_t (*recvmsg)(int fd, struct msghdr *msg, int flags);
+    ssize_t (*send)(int fd, const void *buf, size_t len, int flags);
+    ssize_t (*sendto)(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len);
+    ssize_t (*sendmsg)(int fd, const struct msghdr *msg, int flags);
+    ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
+    ssize_t (*splice)(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+    int (*shutdown)(int fd, int how);
+    int (*close)(int fd);
+    int (*epoll_create)(int size);
+    int (*epoll_ctl)(int epoll_fd, int op, int fd, struct epoll_event *event);
+    int (*epoll_wait)(int epoll_fd, struct epoll_event *events, int max_events, int timeout);
+} ap_net_io_ops_t;
+
+/* ********************************************************************** */
+/** \brief Simulated link properties. See ap_net_sim_set_link()
+*/
+typedef struct ap_net_sim_link_t
+{
+    uint64_t delay_ns; /**< One way propagation delay */
+    uint64_t jitter_ns; /**< Random extra delay: 0 to jitter_ns. TCP segments are still delivered in order */
+    double loss; /**< Packet loss probability: 0.0 - 1.0. Lost TCP segments are retransmitted after RTO, UDP datagrams are gone */
+    uint64_t bandwidth; /**< Bytes per second for each flow. 0 - unlimited */
+} ap_net_sim_link_t;
+
+typedef struct ap_net_sim_t ap_net_sim_t;
+
+/* ********************************************************************** */
+/** \brief Impairment shim settings. See ap_net_shim_enable()
+*/
+typedef struct ap_net_shim_params_t
+{
+    uint64_t delay_ns; /**< Added to each send */
+    uint64_t jitter_ns; /**< Random extra delay: 0 to jitter_ns. TCP data still goes in order */
+    double loss; /**< Packet loss probability: 0.0 - 1.0. Lost TCP data is delayed by RTO instead, UDP datagrams are dropped */
+    double reorder; /**< UDP: probability of datagram being held for one more delay, so the next ones overtake it */
+    uint64_t bandwidth; /**< Bytes per second for each socket. 0 - unlimited */
+    int max_queue; /**< Bytes held per socket before send() returns EAGAIN. 0 - default of 1 MB */
+} ap_net_shim_params_t;
+
+/** \brief Impairment shim counters. See ap_net_shim_get_stat()
+*/
+typedef struct ap_net_shim_stat_t
+{
+    uint64_t packets; /**< Sends handed to kernel */
+    uint64_t bytes; /**< Bytes handed to kernel */
+    uint64_t lost; /**< UDP datagrams dropped */
+    uint64_t retransmits; /**< TCP sends delayed by simulated retransmission */
+    uint64_t reordered; /**< UDP datagrams held back */
+    uint64_t queue_full; /**< Sends refused with EAGAIN */
+    int queued_bytes; /**< Held by shim right now */
+} ap_net_shim_stat_t;
+
 typedef int (*ap_net_conn_pool_callback_func)(struct ap_net_connection_t *conn, int signal_type); /* signal_type is of AP_NET_SIGNAL_* */
 
+/* the memory given to ap_net_conn_pool_send() may be reused. see ap_net_conn_pool_zerocopy_enable() */
+typedef void (*ap_net_zerocopy_release_func)(struct ap_net_connection_t *conn, void *data, int len);
+
+/* ********************************************************************** */
+/** \brief Zero-copy sends state. See ap_net_conn_pool_zerocopy_enable()
+*/
+typedef struct ap_net_zerocopy_t
+{
+    struct ap_net_zerocopy_conn_t *conns; /**< Per connection slot */
+    int conns_size; /**< conns array size */
+    int min_size; /**< Smaller sends are copied */
+    int all_conns; /**< True if connections use zero-copy unless switched off by ap_net_conn_pool_zerocopy_conn() */
+    ap_net_zerocopy_release_func release_func;
+    int in_flight; /**< Sends not released yet */
+    struct ap_net_zerocopy_orphan_t *orphans; /**< Closed connections with sends not reported yet. Their sockets are kept open until then */
+    int orphans_count;
+    uint64_t sends; /**< Sends made with MSG_ZEROCOPY */
+    uint64_t copied; /**< Of them copied by the kernel anyway, e.g. on loopback */
+    uint64_t fallbacks; /**< Sends of min_size or more that were copied: no support by socket or the kernel copies anyway */
+    uint64_t lost; /**< Sends never released: not reported by pool destroy, or no memory to wait for the report */
+} ap_net_zerocopy_t;
+
 /* ********************************************************************** */
 /** \brief Connections pool data structure
 */
@@ -164,6 +574,19 @@ typedef struct ap_net_conn_pool_t
     ap_net_conn_pool_callback_func callback_func; /**< Callback function pointer for ap_net_conn_pool_poll() */
 
     struct ap_net_stat_t stat; /**< Statistics */
+
+    struct ap_net_recorder_t *recorder; /**< Flight recorder. NULL if disabled */
+    struct ap_net_profile_t *profile; /**< Poll cycle profiler. NULL if disabled */
+    struct ap_net_shm_export_t *shm; /**< Shared memory statistics exporter. NULL if disabled */
+    struct ap_net_capture_t *capture; /**< Traffic capture. NULL if disabled */
+    struct ap_net_cork_t *cork; /**< Output corking. NULL if disabled */
+    struct ap_net_sendfile_t *sendfile; /**< File transfers. NULL until the first ap_net_conn_pool_sendfile() */
+    struct ap_net_bridges_t *bridges; /**< Bridged connections. NULL until the first ap_net_conn_pool_bridge() */
+    struct ap_net_zerocopy_t *zerocopy; /**< Zero-copy sends. NULL if disabled */
+    struct ap_net_recv_into_t *recv_into; /**< Direct reads. NULL until the first ap_net_conn_pool_recv_into() */
+    struct ap_net_rbufs_t *rbufs; /**< Receiving buffers handoff. NULL until the first ap_net_conn_pool_buf_detach() */
+    struct ap_net_framer_t *framer; /**< Message framing. NULL if disabled */
+    struct ap_net_arenas_t *arenas; /**< Scratch memory. NULL until the first ap_net_conn_pool_scratch() or ap_net_connection_arena() */
 } ap_net_conn_pool_t;
 
 /* ********************************************************************** */
@@ -203,8 +626,102 @@ extern int  ap_net_conn_pool_connection_is_alive(struct ap_net_conn_pool_t *pool
 extern int  ap_net_conn_pool_recv(struct ap_net_conn_pool_t *pool, int conn_idx);
 extern int  ap_net_conn_pool_send(struct ap_net_conn_pool_t *pool, int conn_idx, void *src_buf, int size);
 extern int  ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, void *src_buf, int size);
+extern int  ap_net_conn_pool_sendv(struct ap_net_conn_pool_t *pool, int conn_idx, const struct iovec *iov, int iovcnt); /* one sendmsg() */
+
+    /* the next len bytes are received straight into dst. AP_NET_SIGNAL_CONN_RECV_DONE at the end */
+extern int  ap_net_conn_pool_recv_into(struct ap_net_conn_pool_t *pool, int conn_idx, void *dst, int len);
+extern int  ap_net_conn_pool_recv_into_left(struct ap_net_conn_pool_t *pool, int conn_idx); /* bytes still to come */
+extern int  ap_net_conn_pool_recv_into_cancel(struct ap_net_conn_pool_t *pool, int conn_idx);
+
+    /* bump-pointer memory for callbacks' temporary objects. see ap_buf.h for ap_arena_* functions */
+extern ap_arena_t *ap_net_conn_pool_scratch(struct ap_net_conn_pool_t *pool); /* reset at the end of each poll cycle */
+extern ap_arena_t *ap_net_connection_arena(struct ap_net_connection_t *conn); /* reset on connection close */
+
+    /* input is cut into messages given by AP_NET_SIGNAL_CONN_MESSAGE */
+extern int  ap_net_conn_pool_framer_set(struct ap_net_conn_pool_t *pool, int type, int param, int flags);
+extern char *ap_net_conn_pool_message(struct ap_net_connection_t *conn, int *len); /* for AP_NET_SIGNAL_CONN_MESSAGE handler */
+
+    /* unprocessed data is given away with the buffer holding it, the connection gets a fresh one */
+extern struct ap_net_rbuf_t *ap_net_conn_pool_buf_detach(struct ap_net_conn_pool_t *pool, int conn_idx, int len);
+extern void ap_net_rbuf_ref(struct ap_net_rbuf_t *rb); /* thread safe */
+extern void ap_net_rbuf_release(struct ap_net_rbuf_t *rb); /* thread safe. the last one gives it back to the pool */
+
+    /* sends made in callbacks are held and sent once per connection at the end of poll cycle */
+extern int  ap_net_conn_pool_cork_enable(struct ap_net_conn_pool_t *pool, int max_held);
+extern void ap_net_conn_pool_cork_disable(struct ap_net_conn_pool_t *pool); /* sends out what is held */
+extern int  ap_net_conn_pool_cork_flush(struct ap_net_conn_pool_t *pool); /* returns count of connections with output left held */
+extern int  ap_net_conn_pool_cork_pending(struct ap_net_conn_pool_t *pool, int conn_idx); /* held bytes */
+
+    /* file or pipe contents sent by the kernel, resumed by poller. AP_NET_SIGNAL_CONN_SEND_DONE at the end */
+extern int  ap_net_conn_pool_sendfile(struct ap_net_conn_pool_t *pool, int conn_idx, int fd, off_t offset, off_t count, int flags);
+extern int  ap_net_conn_pool_sendfile_active(struct ap_net_conn_pool_t *pool, int conn_idx); /* true if transfer is in progress */
+extern void ap_net_conn_pool_sendfile_cancel(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern void ap_net_conn_pool_sendfile_free(struct ap_net_conn_pool_t *pool); /* drops all transfers */
+
+    /* data of two connections goes from one to the other through kernel pipes. closed together */
+extern int  ap_net_conn_pool_bridge(struct ap_net_conn_pool_t *pool_a, int conn_idx_a, struct ap_net_conn_pool_t *pool_b, int conn_idx_b);
+extern int  ap_net_conn_pool_bridge_get_stat(struct ap_net_conn_pool_t *pool, int conn_idx, struct ap_net_bridge_stat_t *dst); /* false if not bridged */
+
+    /* large sends go by MSG_ZEROCOPY. the memory is given back by release function called from poller */
+extern int  ap_net_conn_pool_zerocopy_enable(struct ap_net_conn_pool_t *pool, int min_size, int all_conns, ap_net_zerocopy_release_func release_func);
+extern int  ap_net_conn_pool_zerocopy_conn(struct ap_net_conn_pool_t *pool, int conn_idx, int on); /* per connection switch */
+extern int  ap_net_conn_pool_zerocopy_pending(struct ap_net_conn_pool_t *pool, int conn_idx); /* sends not released yet */
 
 extern void ap_net_conn_pool_print_stat(struct ap_net_conn_pool_t *pool, char *intro_message); /*  print stats to debug channel(s) */
+extern int  ap_net_conn_pool_get_stat(struct ap_net_conn_pool_t *pool, struct ap_net_stat_t *dst); /* copy statistics */
+
+    /* flight recorder of connections events */
+extern int  ap_net_conn_pool_recorder_enable(struct ap_net_conn_pool_t *pool, int max_events);
+extern void ap_net_conn_pool_recorder_disable(struct ap_net_conn_pool_t *pool);
+extern int  ap_net_conn_pool_recorder_dump(struct ap_net_conn_pool_t *pool, int fd); /* async-signal safe */
+extern int  ap_net_recorder_dump_all(int fd); /* dumps recorders of all pools. async-signal safe */
+extern int  ap_net_recorder_dump_on_signal(int signal_number, const char *file_name);
+
+    /* shared memory statistics exporter */
+extern int  ap_net_conn_pool_shm_export(struct ap_net_conn_pool_t *pool, const char *name, int flags, int interval_ms);
+extern void ap_net_conn_pool_shm_close(struct ap_net_conn_pool_t *pool);
+extern void ap_net_conn_pool_shm_publish(struct ap_net_conn_pool_t *pool, int force);
+    /* and the reading side of it */
+extern struct ap_net_shm_t *ap_net_shm_attach(const char *name, size_t *size);
+extern int  ap_net_shm_snapshot(struct ap_net_shm_t *shm, size_t size, struct ap_net_shm_t *dst);
+extern void ap_net_shm_detach(struct ap_net_shm_t *shm, size_t size);
+
+    /* poll cycle phases profiler */
+extern int  ap_net_conn_pool_profiler_enable(struct ap_net_conn_pool_t *pool, int flags, int slow_callback_us);
+extern void ap_net_conn_pool_profiler_disable(struct ap_net_conn_pool_t *pool);
+extern void ap_net_conn_pool_profiler_reset(struct ap_net_conn_pool_t *pool);
+extern void ap_net_conn_pool_print_profile(struct ap_net_conn_pool_t *pool, char *intro_message); /* print profiler data to debug channel(s) */
+extern int  ap_net_profile_callback(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int signal_type);
+extern void ap_net_profile_cycle_begin(struct ap_net_profile_t *profile);
+extern void ap_net_profile_phase_end(struct ap_net_profile_t *profile, int phase);
+extern void ap_net_profile_cycle_end(struct ap_net_profile_t *profile);
+
+    /* traffic capture into pcapng file */
+extern int  ap_net_conn_pool_capture_start(struct ap_net_conn_pool_t *pool, const char *file_name, int snaplen, int buf_size);
+extern void ap_net_conn_pool_capture_stop(struct ap_net_conn_pool_t *pool);
+extern int  ap_net_conn_pool_capture_flush(struct ap_net_conn_pool_t *pool);
+extern void ap_net_capture_add(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int is_out, const void *data, int len);
+
+    /* system calls table used by networking functions */
+extern struct ap_net_io_ops_t ap_net_io_system;
+extern struct ap_net_io_ops_t *ap_net_io;
+
+    /* deterministic in-memory network with virtual clock */
+extern struct ap_net_sim_t *ap_net_sim_create(uint64_t seed);
+extern void ap_net_sim_destroy(struct ap_net_sim_t *sim);
+extern int  ap_net_sim_set_link(struct ap_net_sim_t *sim, const char *address1, const char *address2, struct ap_net_sim_link_t *link);
+extern int  ap_net_sim_set_source_addr(struct ap_net_sim_t *sim, const char *address);
+extern uint64_t ap_net_sim_now(struct ap_net_sim_t *sim); /* virtual clock in nanoseconds */
+extern uint64_t ap_net_sim_next_event(struct ap_net_sim_t *sim); /* time of the next packet delivery. 0 if nothing is in flight */
+extern int  ap_net_sim_advance(struct ap_net_sim_t *sim, uint64_t ns); /* moves the clock, delivering packets. returns deliveries count */
+extern int  ap_net_sim_run(struct ap_net_sim_t *sim, struct ap_net_conn_pool_t **pools, int pools_count, uint64_t duration_ns, uint64_t tick_ns);
+
+    /* delay, jitter, reordering, loss and bandwidth cap on real sockets */
+extern int  ap_net_shim_enable(struct ap_net_shim_params_t *params, uint64_t seed);
+extern void ap_net_shim_disable(void); /* sends out everything held and restores previous ap_net_io */
+extern int  ap_net_shim_flush(void); /* hands due data to kernel. returns count of sends held yet */
+extern void ap_net_shim_get_stat(struct ap_net_shim_stat_t *dst);
+extern int  ap_net_shim_params_parse(struct ap_net_shim_params_t *dst, const char *spec); /* "delay=20ms,jitter=5ms,loss=0.01,..." */
 
     /* Set initial or change max allowed connections for pool */
 extern int  ap_net_conn_pool_set_max_connections(struct ap_net_conn_pool_t *pool, int new_max, int new_bufsize);
@@ -3,9 +3,13 @@
  */
 #include "ap_net.h"
 #include "../ap_utils.h"
+#include "../ap_crc.h"
 #include "../ap_log.h"
+#include "../ap_str.h"
 #include <assert.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -29,9 +33,14 @@
 #define CLIENT_DEBUG_LEVEL 0
 
 const char *log_file_name = "ap_net.tests.log";
+const char *recorder_file_name = "ap_net.tests.recorder.log";
+#define RECORDER_EVENTS 4096
+#define SLOW_CALLBACK_US 10000
+const char *shm_name = "/ap_net.tests"; /* statistics export. use tools/ap_netstat -c /ap_net.tests while running */
 
 const char *localhost_str = "127.0.0.1";
 const int tcp_port = 22222, udp_port = 22223; /* server listener */
+const int shutdown_port = 22224; /* orderly shutdown test */
 
 /* prototypes of client-server main functions */
 void go_client(void);
@@ -40,6 +49,123 @@ void go_client(void);
 int server_callback(struct ap_net_connection_t *conn, int signal_type);
 void generate_sequences(void);
 
+/* orderly shutdown test: counts the connections closed after the peer's close() */
+int shutdown_closed;
+int shutdown_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* tokenizer test: the tokens found by plain scan of every byte */
+int tok_reference(const char *buf, int len, const char *separators, int *starts, int *lens, int max_tokens);
+
+/* simulated network test */
+#define sim_clients 200
+#define sim_port 30000
+#define sim_expire_ms 5000
+
+struct sim_result_t
+{
+    unsigned echoes;
+    unsigned timedout;
+    int server_used;
+    uint64_t bytes_in;
+    uint64_t captured; /* packets written by the server's capture */
+    uint64_t cork_held, cork_flushes; /* server's corking counters */
+};
+
+unsigned sim_echoes;
+int sim_cork; /* server corks its output and both sides use ap_net_conn_pool_sendv() */
+void sim_test(uint64_t seed, int clients, uint64_t duration_ns, const char *capture_file, struct sim_result_t *result);
+
+/* the tests of single features: server pool listening on sim_port and client pool connected to it */
+#define sim_pool_slots 8
+struct ap_net_connection_t *sim_setup(struct ap_net_sim_t **sim, struct ap_net_conn_pool_t **pools, uint64_t seed, struct ap_net_sim_link_t *link,
+                                      int buf_size, ap_net_conn_pool_callback_func server_callback, ap_net_conn_pool_callback_func client_callback);
+void sim_teardown(struct ap_net_sim_t *sim, struct ap_net_conn_pool_t **pools, int pools_count);
+
+/* file transfer test: header, file and pipe contents make one stream of sim_stream_byte() */
+#define sim_xfer_header 16
+#define sim_xfer_file_size 600000
+#define sim_xfer_pipe_size 20000
+#define sim_stream_byte(pos) ((char)((pos) * 31 + ((pos) >> 9)))
+const char *sim_xfer_file_name = "ap_net.tests.sendfile";
+int sim_xfer_file_fd, sim_xfer_pipe_fd;
+int sim_xfer_done; /* AP_NET_SIGNAL_CONN_SEND_DONE count */
+long sim_xfer_received; /* by client, checked against sim_stream_byte() */
+int sim_xfer_server_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_xfer_client_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* bridge test: client -> proxy -> echo backend. the backend greets first, so the client sends after the bridge is made */
+#define sim_bridge_size 200000
+const char *sim_bridge_greeting = "HELLO";
+struct ap_net_conn_pool_t *sim_bridge_back_pool; /* proxy's outbound connections */
+long sim_bridge_echoed, sim_bridge_received;
+int sim_bridge_closed; /* proxy's client side connections closed */
+struct ap_net_bridge_stat_t sim_bridge_stat; /* of proxy's client side, taken on close */
+int sim_bridge_backend_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_bridge_proxy_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_bridge_client_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* zero-copy test: the server sends slices of one buffer, the next one when a previous is released. the small one is copied */
+#define sim_zc_slices 7
+const int sim_zc_slice_size[sim_zc_slices] = { 16384, 16384, 16384, 100, 16384, 16384, 16384 };
+char sim_zc_data[6 * 16384 + 100];
+int sim_zc_sent, sim_zc_released;
+long sim_zc_received;
+int sim_zc_server_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_zc_client_callback(struct ap_net_connection_t *conn, int signal_type);
+void sim_zc_release(struct ap_net_connection_t *conn, void *data, int len);
+/* the server closes the connection right after two sends. they are released when reported, not on close */
+int sim_zc_close_callback(struct ap_net_connection_t *conn, int signal_type);
+void sim_zc_orphan_release(struct ap_net_connection_t *conn, void *data, int len);
+
+/* direct read test: the client sends messages of int length and body. the server reads bodies straight into sim_ri_data */
+#define sim_ri_msgs 3
+const int sim_ri_msg_size[sim_ri_msgs] = { 150000, 10, 70000 };
+char sim_ri_data[150000 + 10 + 70000];
+int sim_ri_started, sim_ri_done, sim_ri_at_once; /* reads started, ended by AP_NET_SIGNAL_CONN_RECV_DONE, done from buffer */
+int sim_ri_pos; /* where the next body goes */
+int sim_ri_server_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* buffer handoff test: the server detaches each message of int length and body. every second one is released at once */
+#define sim_rb_msgs 6
+#define sim_rb_msg_size 300
+struct ap_net_rbuf_t *sim_rb[sim_rb_msgs];
+int sim_rb_count;
+int sim_rb_server_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* framing test: the same messages are sent framed in each way in turn */
+#define sim_fr_msgs 40
+#define sim_fr_msg_len(k) (sim_fr_type == AP_NET_FRAMER_FIXED ? sim_fr_param : (k) * 37 % 200)
+#define sim_fr_byte(k, i) ((char)('a' + ((k) + (i)) % 26))
+int sim_fr_type, sim_fr_param;
+int sim_fr_count; /* messages got */
+int sim_fr_server_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* framing with direct reads test: each framed header tells the size of raw body that follows it. "END" message ends it all */
+#define sim_fri_items 4
+const int sim_fri_size[sim_fri_items] = { 3000, 20, 100000, 7 };
+char sim_fri_data[3000 + 20 + 100000 + 7];
+int sim_fri_started, sim_fri_done, sim_fri_offset;
+int sim_fri_server_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* scratch arenas test: the server answers each request with a reply built in pool's arena */
+#define sim_ar_requests 5
+int sim_ar_replies, sim_ar_closed;
+int sim_ar_server_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_ar_client_callback(struct ap_net_connection_t *conn, int signal_type);
+
+/* moving test: server's connections hold corked output, send a file and read directly while moved to other pool or slot */
+#define sim_mv_size 600000
+char sim_mv_data[sim_mv_size]; /* what is sent: sim_stream_byte() */
+char sim_mv_in[sim_mv_size]; /* the server's direct read goes here */
+int sim_mv_file_fd; /* file with sim_mv_data */
+char sim_mv_kind[sim_pool_slots]; /* client connection's request: 'X' - closed at once, 'C' - corked reply, 'F' - file reply, 'R' - body for direct read */
+long sim_mv_received[sim_pool_slots]; /* by client connection */
+int sim_mv_read_done;
+int sim_mv_fd[3]; /* server's connections busy with 'C', 'F' and 'R' */
+int sim_mv_server_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_mv_client_callback(struct ap_net_connection_t *conn, int signal_type);
+int sim_mv_failing_epoll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout);
+
 /* the test sequences are generated by randomly picking the elements of this string
  * so you can place more symbols of one type here to make this kind of test to be more frequent
  * For explanation of the meaning of each symbol see below.
@@ -151,7 +277,15 @@ int main(void)
     time_t start_time, last_event_time;
     ap_net_connection_t *conn;
     server_userdata *ud;
+    struct ap_net_shm_t *shm;
+    struct ap_net_shm_t *shm_copy;
+    size_t shm_size;
+
 
+#ifdef AP_NET_NO_SIM
+    printf("* the tests need ap_net_io table, which is compiled out by AP_NET_NO_SIM. use 'make' or 'make release'\n");
+    return 1;
+#endif
 
     ap_log_debug_to_tty = 1; /* we like to see immediately if some trouble happens */
 
@@ -197,243 +331,2061 @@ int main(void)
     /* *********************************************************** */
     /* *********************************************************** */
     /* *********************************************************** */
-    printf("test: Server + %d tcp/udp clients, up to %d tests\n", max_clients, max_clients * max_tests_per_client);
+    printf("test: checksum implementations against the bitwise reference\n");
     fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        static unsigned char data[20000];
+        int impl, off, len, cut;
+        uint16_t ref16, crc16;
+        uint32_t ref32, crc32;
 
-    generate_sequences(); /* this is where the sequentce of tests is generated for each client */
+        assert(0x2189 == ap_crc16("123456789", 9)); /* CRC-16/KERMIT check value */
+        assert(0xe3069283 == ap_crc32c("123456789", 9));
 
-    for ( i = 0; i < max_clients; ++i )
-        control_conns[i] = NULL;
+        for ( i = 0; i < (int)sizeof(data); ++i )
+            data[i] = rand();
 
-    /* tcp pool create and init */
-    tcp_pool = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, max_clients * max_tests_per_client,
-                                       CONNECTION_TIMEOUT, strlen(test_message) * 2, server_callback);
+        for ( impl = AP_CRC_IMPL_TABLE; impl <= AP_CRC_IMPL_SIMD; ++impl )
+        {
+            for ( i = 0; i < 2000; ++i )
+            {
+                off = rand() % 16; /* misaligned too */
+                len = rand() % (i < 1000 ? 200 : (int)sizeof(data) - off);
+                cut = len > 0 ? rand() % len : 0;
 
-    if ( tcp_pool == NULL
-        || ! ap_net_conn_pool_set_str_addr(tcp_pool, (char *)localhost_str, tcp_port)
-        || -1 == ap_net_conn_pool_listener_create(tcp_pool, 1, 1) )
+                assert(ap_crc_set_impl(AP_CRC_IMPL_BITWISE));
+                ref16 = ap_crc16(data + off, len);
+                ref32 = ap_crc32c(data + off, len);
+                assert(ref16 == count_crc16(data + off, len));
+
+                if ( ! ap_crc_set_impl(impl) ) /* no SIMD on this CPU */
+                    break;
+
+                assert(ref16 == ap_crc16(data + off, len));
+                assert(ref32 == ap_crc32c(data + off, len));
+
+                /* in two parts */
+                crc16 = ap_crc16_update(ap_crc16_init(), data + off, cut);
+                assert(ref16 == ap_crc16_final(ap_crc16_update(crc16, data + off + cut, len - cut)));
+                crc32 = ap_crc32c_update(ap_crc32c_init(), data + off, cut);
+                assert(ref32 == ap_crc32c_final(ap_crc32c_update(crc32, data + off + cut, len - cut)));
+            }
+        }
+
+        assert(ap_crc_set_impl(AP_CRC_IMPL_AUTO));
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: buffered writer on a full non-blocking socket\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
     {
-        printf("* !ERROR: tcp_pool: %s\n", ap_error_get_string());
-        exit(1);
+        static char big[100000], got[200000];
+        int sp[2], n, fill, total;
+        ap_log_writer_t w;
+
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sp));
+        assert(0 == fcntl(sp[0], F_SETFL, O_NONBLOCK));
+        n = 4096;
+        assert(0 == setsockopt(sp[0], SOL_SOCKET, SO_SNDBUF, &n, sizeof(n)));
+        assert(ap_log_writer_init(&w, sp[0], 100));
+        assert(w.is_socket);
+
+        for ( i = 0; i < (int)sizeof(big); ++i )
+            big[i] = 'a' + i % 26;
+
+        total = 0;
+        for ( i = 0; i < 1000; ++i, total += 6 )
+            assert(ap_log_writer_printf(&w, "%05d\n", i));
+
+        assert(ap_log_writer_write(&w, big, sizeof(big))); /* more than socket takes at once */
+        total += sizeof(big);
+        assert(ap_log_writer_pending(&w) > 0);
+
+        for ( fill = 0; fill < total; fill += n )
+        {
+            n = read(sp[1], got + fill, total - fill);
+            assert(n > 0);
+            ap_log_writer_flush(&w);
+        }
+
+        assert(ap_log_writer_pending(&w) == 0 && w.written == total && w.error == 0);
+        assert(0 == memcmp(got, "00000\n00001\n", 12) && 0 == memcmp(got + 6000, big, sizeof(big)));
+
+        close(sp[1]);
+        assert(ap_log_writer_puts(&w, "lost"));
+        assert( ! ap_log_writer_destroy(&w));
+        assert(w.error == EPIPE);
+        close(sp[0]);
     }
 
-    tcp_pool->poller->debug = TCP_POLLER_DEBUG;
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: hexdump formatter against printf()\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        static unsigned char data[1000];
+        static char ref[1000 / 16 * AP_LOG_HEXDUMP_LINE + AP_LOG_HEXDUMP_LINE], out[sizeof(ref)];
+        int simd, len, addr, n, pos, line;
 
-    /* udp pool create and init */
-    udp_pool = ap_net_conn_pool_create(0, max_clients * max_tests_per_client, CONNECTION_TIMEOUT, strlen(test_message) * 2, server_callback);
+        for ( i = 0; i < (int)sizeof(data); ++i )
+            data[i] = rand();
 
-    if ( udp_pool == NULL
-        || ! ap_net_conn_pool_set_ip4_addr(udp_pool, INADDR_LOOPBACK, udp_port)
-        || -1 == ap_net_conn_pool_listener_create(udp_pool, 1, 1) )
+        for ( simd = 0; simd < 2; ++simd )
+        {
+            if ( ! ap_log_hexdump_set_simd(simd) ) /* no SSSE3 */
+                continue;
+
+            for ( len = 0; len < (int)sizeof(data); len += 1 + rand() % 50 )
+            {
+                addr = ( len & 1 ) ? rand() : len;
+                n = 0;
+
+                for ( pos = 0; pos < len; pos += 16 )
+                {
+                    if ( len & 2 )
+                        n += sprintf(ref + n, "%04x(%4d):  ", addr + pos, addr + pos);
+
+                    for ( line = pos; line < pos + 16 && line < len; ++line )
+                        n += sprintf(ref + n, "%02x %c ", data[line], isprint(data[line]) ? data[line] : '.');
+
+                    ref[n++] = '\n';
+                }
+
+                assert(n <= ap_log_hexdump_size(len));
+                assert(n == ap_log_hexdump(out, data, len, addr, len & 2));
+                assert(0 == memcmp(ref, out, n));
+            }
+        }
+
+        ap_log_hexdump_set_simd(1);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: zero-copy tokenizer against the plain scan, save/restore and rollback\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        /* up to 4 separators are searched with SIMD, the longer sets via map */
+        static const char *sep_sets[] = { " ", " \t", ",;:", "\t\r\n ", " ,;:=", "abcdefgh\x80\xff" };
+        static char data[300];
+        static int starts[300], lens[300];
+        const char *line;
+        char *s;
+        ap_str_tok_sep_t sep;
+        ap_str_tok_t t;
+        ap_str_slice_t token;
+        ap_str_parse_rec_t *r;
+        int set, off, len, count, k, saved;
+
+        for ( set = 0; set < (int)(sizeof(sep_sets) / sizeof(sep_sets[0])); ++set )
+        {
+            ap_str_tok_sep_init(&sep, sep_sets[set]);
+
+            for ( i = 0; i < 2000; ++i )
+            {
+                for ( k = 0; k < (int)sizeof(data); ++k ) /* runs of separators, zeros and high bytes too */
+                    data[k] = ( rand() % 3 == 0 ) ? sep_sets[set][rand() % strlen(sep_sets[set])] : rand();
+
+                off = rand() % 16; /* misaligned too */
+                len = rand() % ((int)sizeof(data) - off);
+                count = tok_reference(data + off, len, sep_sets[set], starts, lens, sizeof(data));
+
+                ap_str_tok_init(&t, data + off, len, &sep);
+
+                for ( k = 0; ap_str_tok_next(&t, &token); ++k )
+                    assert(k < count && token.s == data + off + starts[k] && token.len == lens[k]);
+
+                assert(k == count);
+            }
+        }
+
+        /* quotes and backslashes are ordinary chars, as they are for ap_str_parse_*() */
+        line = "say \"hello world\" a\\ b 'c'";
+        r = ap_str_parse_init((char *)line, NULL);
+        assert(r != NULL);
+        ap_str_tok_init(&t, line, strlen(line), NULL);
+
+        for ( k = 0, s = r->curr; s != NULL; ++k, s = ap_str_parse_next_arg(r) ) /* init takes the 1st token already */
+            assert(ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, s));
+
+        assert(k == 6 && ! ap_str_tok_next(&t, &token));
+        ap_str_parse_end(r);
+
+        /* save/restore. the rollback can't go past the restored position */
+        ap_str_tok_init(&t, line, strlen(line), NULL);
+        assert(ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "say"));
+        saved = ap_str_tok_save(&t);
+        assert(ap_str_tok_next(&t, &token) && ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "world\""));
+        ap_str_tok_restore(&t, saved);
+        assert(ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "\"hello"));
+        assert( ! ap_str_tok_rollback(&t, 2));
+        assert(ap_str_tok_rollback(&t, 1) && ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "\"hello"));
+        ap_str_tok_remaining(&t, &token);
+        assert(ap_str_slice_eq(&token, "world\" a\\ b 'c'"));
+
+        /* rollback inside and past the window of AP_STR_TOK_HISTORY tokens */
+        line = "t0 t1 t2 t3 t4 t5 t6 t7 t8 t9";
+        ap_str_tok_init(&t, line, strlen(line), NULL);
+
+        for ( k = 0; k < 10; ++k )
+            assert(ap_str_tok_next(&t, &token));
+
+        assert( ! ap_str_tok_rollback(&t, 9) && ! ap_str_tok_rollback(&t, 11));
+        assert(ap_str_tok_rollback(&t, 5) && ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "t5"));
+        assert(ap_str_tok_rollback(&t, 1));
+        assert( ! ap_str_tok_rollback(&t, 4)); /* t1 is overwritten by t9, though the history is shorter now */
+        assert(ap_str_tok_rollback(&t, 3) && ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "t2"));
+
+        while ( ap_str_tok_next(&t, &token) )
+            ;
+
+        assert(ap_str_slice_eq(&token, "t9") && ! ap_str_tok_rollback(&t, 9));
+        assert(ap_str_tok_rollback(&t, 8) && ap_str_tok_next(&t, &token) && ap_str_slice_eq(&token, "t2"));
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: growable buffers and arena\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        static char pattern[1000];
+        ap_buf_t b;
+        ap_arena_t arena;
+        char *p, *q, *s;
+        long used;
+        int k, size, doublings, s_size, s_fill, reallocs;
+
+        for ( k = 0; k < (int)sizeof(pattern); ++k )
+            pattern[k] = 'a' + k % 26;
+
+        /* inline storage first, then heap, doubling the size */
+        ap_buf_init(&b, NULL);
+        assert(ap_buf_append(&b, pattern, AP_BUF_INLINE_SIZE) && b.data == b.inline_data && b.size == AP_BUF_INLINE_SIZE);
+
+        for ( doublings = 0, size = b.size, k = AP_BUF_INLINE_SIZE; k < (int)sizeof(pattern); ++k )
+        {
+            assert(ap_buf_append(&b, pattern + k, 1) && b.data != b.inline_data);
+
+            if ( b.size != size )
+            {
+                assert(b.size == size * 2);
+                size = b.size;
+                ++doublings;
+            }
+        }
+
+        assert(doublings == 4 && b.len == sizeof(pattern) && memcmp(b.data, pattern, b.len) == 0);
+
+        /* consume, then shrink to fit and back to inline storage */
+        ap_buf_consume(&b, 10);
+        assert(b.len == sizeof(pattern) - 10 && memcmp(b.data, pattern + 10, b.len) == 0);
+        assert(ap_buf_shrink(&b) && b.data != b.inline_data && b.size == b.len);
+        ap_buf_consume(&b, b.len - 20);
+        assert(ap_buf_shrink(&b) && b.data == b.inline_data && b.size == AP_BUF_INLINE_SIZE);
+        assert(b.len == 20 && memcmp(b.data, pattern + sizeof(pattern) - 20, 20) == 0);
+        ap_buf_consume(&b, 100);
+        assert(b.len == 0);
+
+        /* printf output longer than inline storage */
+        assert(ap_buf_printf(&b, "%c", '>') && b.data == b.inline_data);
+        assert(ap_buf_printf(&b, "%.*s|%d", 200, pattern, 12345) && b.data != b.inline_data);
+        assert(b.len == 207 && b.data[0] == '>' && memcmp(b.data + 1, pattern, 200) == 0 && strcmp(b.data + 201, "|12345") == 0);
+        ap_buf_free(&b);
+        assert(b.data == b.inline_data && b.len == 0);
+
+        /* arena: the latest allocation grows in place, the older one moves */
+        ap_arena_init(&arena, 1024);
+        p = ap_arena_alloc(&arena, 100);
+        assert(p != NULL && ((size_t)p & 15) == 0);
+        memcpy(p, pattern, 100);
+        q = ap_arena_realloc(&arena, p, 100, 500);
+        assert(q == p && memcmp(q, pattern, 100) == 0);
+        assert(ap_arena_alloc(&arena, 16) != NULL);
+        q = ap_arena_realloc(&arena, p, 500, 600);
+        assert(q != NULL && q != p && memcmp(q, pattern, 100) == 0 && arena.chunks->next != NULL);
+        assert(ap_arena_alloc(&arena, 2000) != NULL); /* larger than a chunk */
+
+        /* reset with several chunks frees them, and the next chunk is of the peak size */
+        used = arena.used;
+        ap_arena_reset(&arena);
+        assert(arena.chunks == NULL && arena.used == 0 && arena.chunk_size == used && arena.peak == used);
+        assert(ap_arena_alloc(&arena, 3000) != NULL && ap_arena_alloc(&arena, 100) != NULL && arena.chunks->next == NULL);
+        ap_arena_reset(&arena); /* one chunk is kept */
+        assert(arena.chunks != NULL && arena.chunks->used == 0 && arena.chunk_size == used);
+
+        /* arena-backed buffer */
+        ap_buf_init(&b, &arena);
+        assert(ap_buf_append(&b, pattern, sizeof(pattern)) && b.data != b.inline_data);
+        p = b.data;
+        assert(ap_buf_append(&b, pattern, sizeof(pattern)) && b.data == p); /* the latest allocation */
+        assert(b.len == 2 * sizeof(pattern) && memcmp(b.data + sizeof(pattern), pattern, sizeof(pattern)) == 0);
+        assert(ap_buf_shrink(&b) && b.data == p); /* nothing to give back */
+        ap_buf_free(&b);
+        assert(b.data == b.inline_data && b.arena == &arena);
+        ap_arena_destroy(&arena);
+
+        /* ap_str_fix_buf_size() doubles the buffer, so many small appends cost few reallocs */
+        s = NULL;
+        s_size = s_fill = reallocs = 0;
+
+        for ( k = 0; k < 10000; ++k )
+        {
+            size = s_size;
+            assert(ap_str_fix_buf_size(&s, &s_size, &s_fill, 7));
+            memcpy(s + s_fill, pattern + k % 900, 7);
+            s_fill += 7;
+
+            if ( s_size != size )
+                ++reallocs;
+        }
+
+        assert(reallocs == 15 && s_size >= s_fill && memcmp(s + 7 * 123, pattern + 123, 7) == 0);
+        free(s);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: %d clients on simulated network, 60 s of virtual time, twice with the same seed\n", sim_clients);
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct sim_result_t r1, r2;
+
+        start_time = time(NULL);
+
+        sim_test(12345, sim_clients, 60000000000ull, NULL, &r1);
+        sim_test(12345, sim_clients, 60000000000ull, NULL, &r2);
+
+        printf("\t%u echoes, %u timed out, %d left on server, %d s elapsed\n",
+            r1.echoes, r1.timedout, r1.server_used, (int)(time(NULL) - start_time));
+
+        assert(r1.echoes > 0);
+        assert(r1.timedout == sim_clients / 2); /* every other client expires */
+        assert(r1.server_used == sim_clients / 2); /* and its server's end sees FIN */
+        assert(0 == memcmp(&r1, &r2, sizeof(r1))); /* reproducible */
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: pcapng capture of the simulated server\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct sim_result_t r;
+        FILE *f;
+        uint32_t magic;
+
+        sim_test(1, 10, 1000000000ull, "ap_net.tests.pcapng", &r);
+
+        /* every echo is two data packets, plus handshakes and FINs of the expired */
+        assert(r.echoes > 0 && r.captured >= 2 * r.echoes);
+
+        f = fopen("ap_net.tests.pcapng", "r");
+        assert(f != NULL);
+        assert(1 == fread(&magic, sizeof(magic), 1, f));
+        assert(magic == 0x0A0D0D0A); /* section header block */
+        fclose(f);
+        unlink("ap_net.tests.pcapng");
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: scatter-gather sends and corking on the simulated server\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct sim_result_t r;
+
+        sim_cork = 1;
+        sim_test(1, 10, 1000000000ull, NULL, &r);
+        sim_cork = 0;
+
+        /* echo is sent by two sends, but goes out with one call. clients check the echo contents */
+        assert(r.echoes > 0 && r.cork_held >= r.echoes && r.cork_flushes < r.cork_held);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: file and pipe transfers on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+        char data[4096];
+        int pipe_fds[2];
+        long pos;
+        int n;
+
+
+        sim_xfer_file_fd = open(sim_xfer_file_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        assert(sim_xfer_file_fd != -1);
+
+        for ( pos = 0; pos < sim_xfer_file_size; pos += n )
+        {
+            n = sim_xfer_file_size - pos < (long)sizeof(data) ? sim_xfer_file_size - pos : (long)sizeof(data);
+
+            for ( i = 0; i < n; ++i )
+                data[i] = sim_stream_byte(sim_xfer_header + pos + i);
+
+            assert(n == write(sim_xfer_file_fd, data, n));
+        }
+
+        unlink(sim_xfer_file_name);
+
+        /* pipe is written and closed beforehand, so the transfer ends at EOF */
+        assert(0 == pipe(pipe_fds));
+
+        for ( pos = 0; pos < sim_xfer_pipe_size; pos += n )
+        {
+            n = sim_xfer_pipe_size - pos < (long)sizeof(data) ? sim_xfer_pipe_size - pos : (long)sizeof(data);
+
+            for ( i = 0; i < n; ++i )
+                data[i] = sim_stream_byte(sim_xfer_header + sim_xfer_file_size + pos + i);
+
+            assert(n == write(pipe_fds[1], data, n));
+        }
+
+        close(pipe_fds[1]);
+        sim_xfer_pipe_fd = pipe_fds[0];
+
+        conn = sim_setup(&sim, pools, 7, &link, 1024, sim_xfer_server_callback, sim_xfer_client_callback);
+        assert(ap_net_conn_pool_cork_enable(pools[0], 0)); /* the header is held and must go before the file */
+        assert(3 == ap_net_conn_pool_send(pools[1], conn->idx, "GET", 3));
+
+        assert(ap_net_sim_run(sim, pools, 2, 10000000000ull, 1000000));
+
+        assert(sim_xfer_done == 2);
+        assert(sim_xfer_received == sim_xfer_header + sim_xfer_file_size + sim_xfer_pipe_size);
+        assert(pools[0]->sendfile->completed == 2 && pools[0]->sendfile->active == 0);
+        assert(pools[0]->sendfile->bytes == sim_xfer_file_size + sim_xfer_pipe_size);
+
+        /* the sources were closed by AP_NET_SENDFILE_CLOSE */
+        assert(-1 == fcntl(sim_xfer_file_fd, F_GETFD) && -1 == fcntl(sim_xfer_pipe_fd, F_GETFD));
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: bridged connections on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[4];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+
+
+        /* client connects to proxy, proxy to backend */
+        assert(NULL != sim_setup(&sim, pools, 11, &link, 1024, sim_bridge_proxy_callback, sim_bridge_client_callback));
+
+        pools[2] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, 2, 0, 1024, sim_bridge_backend_callback);
+        pools[3] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, 2, 0, 1024, sim_bridge_proxy_callback);
+        assert(pools[2] != NULL && pools[3] != NULL);
+
+        assert(ap_net_conn_pool_set_ip4_addr(pools[2], INADDR_LOOPBACK, sim_port + 1));
+        assert(-1 != ap_net_conn_pool_listener_create(pools[2], 1, 1));
+        assert(ap_net_conn_pool_poller_create(pools[3]));
+        sim_bridge_back_pool = pools[3];
+
+        assert(ap_net_sim_run(sim, pools, 4, 10000000000ull, 1000000));
+
+        assert(sim_bridge_echoed == sim_bridge_size);
+        assert(sim_bridge_received == sim_bridge_size);
+
+        /* the client's half-close went through to the backend and the backend's close came back */
+        assert(sim_bridge_closed == 1);
+        assert(sim_bridge_stat.bytes_in == sim_bridge_size && sim_bridge_stat.bytes_out == strlen(sim_bridge_greeting) + sim_bridge_size);
+        assert(sim_bridge_stat.piped_in == 0 && sim_bridge_stat.piped_out == 0);
+        assert(sim_bridge_stat.eof_in && sim_bridge_stat.eof_out);
+        assert(pools[0]->used_slots == 0 && pools[1]->used_slots == 0 && pools[3]->used_slots == 0);
+        assert(pools[0]->bridges->active == 0);
+
+        sim_teardown(sim, pools, 4);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: zero-copy sends on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+
+
+        for ( i = 0; i < (int)sizeof(sim_zc_data); ++i )
+            sim_zc_data[i] = sim_stream_byte(i);
+
+        conn = sim_setup(&sim, pools, 13, &link, 4096, sim_zc_server_callback, sim_zc_client_callback);
+        assert(! ap_net_conn_pool_zerocopy_enable(pools[0], 8192, 1, NULL));
+        assert(ap_net_conn_pool_zerocopy_enable(pools[0], 8192, 1, sim_zc_release));
+        assert(3 == ap_net_conn_pool_send(pools[1], conn->idx, "GET", 3));
+
+        assert(ap_net_sim_run(sim, pools, 2, 2000000000ull, 1000000));
+
+        assert(sim_zc_released == sim_zc_slices);
+        assert(sim_zc_received == sizeof(sim_zc_data));
+        assert(pools[0]->zerocopy->sends == sim_zc_slices - 1 && pools[0]->zerocopy->in_flight == 0);
+        assert(pools[0]->zerocopy->copied == 0 && pools[0]->zerocopy->fallbacks == 0);
+        assert(pools[0]->used_slots == 0);
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: zero-copy sends outlive closed connection\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+
+
+        sim_zc_sent = sim_zc_released = 0;
+        sim_zc_received = 0;
+
+        conn = sim_setup(&sim, pools, 17, &link, 4096, sim_zc_close_callback, sim_zc_client_callback);
+        assert(ap_net_conn_pool_zerocopy_enable(pools[0], 8192, 1, sim_zc_orphan_release));
+        assert(3 == ap_net_conn_pool_send(pools[1], conn->idx, "GET", 3));
+
+        assert(ap_net_sim_run(sim, pools, 2, 1000000000ull, 1000000));
+
+        /* the data has arrived in full and only then the memory is given back */
+        assert(sim_zc_released == 2 && sim_zc_received == 2 * 16384);
+        assert(pools[0]->zerocopy->orphans_count == 0 && pools[0]->zerocopy->in_flight == 0 && pools[0]->zerocopy->lost == 0);
+        assert(pools[0]->used_slots == 0 && pools[1]->used_slots == 0);
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: direct reads on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        static char stream[sizeof(sim_ri_data) + sim_ri_msgs * sizeof(int)];
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+        int k, pos;
+
+
+        for ( k = pos = 0; k < sim_ri_msgs; ++k )
+        {
+            memcpy(stream + pos, &sim_ri_msg_size[k], sizeof(int));
+            pos += sizeof(int);
+
+            for ( i = 0; i < sim_ri_msg_size[k]; ++i )
+                stream[pos++] = sim_stream_byte(i);
+        }
+
+        conn = sim_setup(&sim, pools, 17, &link, 1024, sim_ri_server_callback, NULL);
+        assert(-1 == ap_net_conn_pool_recv_into(pools[1], conn->idx, sim_ri_data, 0));
+        assert(-1 == ap_net_conn_pool_recv_into_cancel(pools[1], conn->idx));
+        assert(pos == ap_net_conn_pool_send(pools[1], conn->idx, stream, pos));
+
+        assert(ap_net_sim_run(sim, pools, 2, 2000000000ull, 1000000));
+
+        assert(sim_ri_started == sim_ri_msgs && sim_ri_done + sim_ri_at_once == sim_ri_msgs);
+        assert(sim_ri_done == 2 && sim_ri_at_once == 1); /* the short one is all in the buffer with the next header */
+
+        for ( k = pos = 0; k < sim_ri_msgs; pos += sim_ri_msg_size[k++] )
+            for ( i = 0; i < sim_ri_msg_size[k]; ++i )
+                assert(sim_ri_data[pos + i] == sim_stream_byte(i));
+
+        /* most of the bodies bypass the connection's buffer */
+        assert(pools[0]->recv_into->completed == 2 && pools[0]->recv_into->active == 0);
+        assert(pools[0]->recv_into->bytes > sizeof(sim_ri_data) - 4096 && pools[0]->recv_into->bytes < sizeof(sim_ri_data));
+        assert(pools[0]->stat.bytes_in == sizeof(stream));
+        assert(pools[0]->stat.signals[AP_NET_SIGNAL_CONN_RECV_DONE] == 2);
+        assert(pools[0]->used_slots == 0);
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: receiving buffers handoff on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        char stream[sim_rb_msgs * (sizeof(int) + sim_rb_msg_size)];
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+        int k, pos;
+
+
+        for ( k = pos = 0; k < sim_rb_msgs; ++k )
+        {
+            i = sim_rb_msg_size;
+            memcpy(stream + pos, &i, sizeof(int));
+            pos += sizeof(int);
+
+            for ( i = 0; i < sim_rb_msg_size; ++i )
+                stream[pos++] = sim_stream_byte(k * sim_rb_msg_size + i);
+        }
+
+        conn = sim_setup(&sim, pools, 19, &link, 1024, sim_rb_server_callback, NULL);
+        assert(NULL == ap_net_conn_pool_buf_detach(pools[1], conn->idx, 0)); /* nothing there */
+        assert(pos == ap_net_conn_pool_send(pools[1], conn->idx, stream, pos));
+
+        assert(ap_net_sim_run(sim, pools, 2, 2000000000ull, 1000000));
+
+        assert(sim_rb_count == sim_rb_msgs);
+        assert(pools[0]->rbufs->detached == sim_rb_msgs);
+        assert(pools[0]->rbufs->allocated == sim_rb_msgs / 2 + 1); /* the released ones are reused */
+        assert(pools[0]->rbufs->refs == 1 + sim_rb_msgs / 2);
+
+        sim_teardown(sim, pools, 2);
+
+        /* the kept ones are intact and outlive the pool */
+        for ( k = 0; k < sim_rb_msgs; k += 2 )
+        {
+            assert(sim_rb[k]->len == sizeof(int) + sim_rb_msg_size);
+
+            for ( i = 0; i < sim_rb_msg_size; ++i )
+                assert(sim_rb[k]->data[sizeof(int) + i] == sim_stream_byte(k * sim_rb_msg_size + i));
+
+            ap_net_rbuf_ref(sim_rb[k]);
+            ap_net_rbuf_release(sim_rb[k]);
+            ap_net_rbuf_release(sim_rb[k]);
+        }
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: message framers on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        const int framers[5][3] = { { AP_NET_FRAMER_LENGTH, 1, 0 }, { AP_NET_FRAMER_LENGTH, 2, AP_NET_FRAMER_BIG_ENDIAN },
+            { AP_NET_FRAMER_LENGTH, 4, 0 }, { AP_NET_FRAMER_DELIMITER, '\n', 0 }, { AP_NET_FRAMER_FIXED, 50, 0 } };
+        char stream[sim_fr_msgs * 204 + 4];
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+        int f, k, len, pos, oversize;
+
+
+        for ( f = 0; f < 5; ++f )
+        {
+            sim_fr_type = framers[f][0];
+            sim_fr_param = framers[f][1];
+            sim_fr_count = 0;
+
+            /* the 2 and 4 bytes prefixed streams end with a message too large for the buffer */
+            oversize = sim_fr_type == AP_NET_FRAMER_LENGTH && sim_fr_param > 1;
+
+            for ( k = pos = 0; k < sim_fr_msgs + oversize; ++k )
+            {
+                len = k < sim_fr_msgs ? sim_fr_msg_len(k) : 1000;
+
+                if ( sim_fr_type == AP_NET_FRAMER_LENGTH )
+                    for ( i = 0; i < sim_fr_param; ++i )
+                        stream[pos++] = len >> (8 * (framers[f][2] == AP_NET_FRAMER_BIG_ENDIAN ? sim_fr_param - 1 - i : i));
+
+                if ( k == sim_fr_msgs ) /* the prefix is enough */
+                    break;
+
+                for ( i = 0; i < len; ++i )
+                    stream[pos++] = sim_fr_byte(k, i);
+
+                if ( sim_fr_type == AP_NET_FRAMER_DELIMITER )
+                    stream[pos++] = '\n';
+            }
+
+            conn = sim_setup(&sim, pools, 23 + f, &link, 256, sim_fr_server_callback, NULL);
+            assert(! ap_net_conn_pool_framer_set(pools[0], AP_NET_FRAMER_LENGTH, 3, 0));
+            assert(ap_net_conn_pool_framer_set(pools[0], sim_fr_type, sim_fr_param, framers[f][2]));
+            assert(pos == ap_net_conn_pool_send(pools[1], conn->idx, stream, pos));
+
+            assert(ap_net_sim_run(sim, pools, 2, 1000000000ull, 1000000));
+
+            assert(sim_fr_count == sim_fr_msgs && pools[0]->framer->messages == sim_fr_msgs);
+            assert(pools[0]->stat.signals[AP_NET_SIGNAL_CONN_MESSAGE] == sim_fr_msgs);
+            assert(pools[0]->framer->oversized == (unsigned)oversize && pools[0]->used_slots == ! oversize);
+
+            if ( sim_fr_type == AP_NET_FRAMER_DELIMITER ) /* each byte is looked at once */
+                assert(pools[0]->framer->scanned_bytes == (unsigned)pos);
+
+            sim_teardown(sim, pools, 2);
+        }
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: direct reads from message handler on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        static char stream[sizeof(sim_fri_data) + sim_fri_items * 5 + 4];
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 10000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+        int k, pos, body;
+
+
+        for ( k = pos = body = 0; k < sim_fri_items; ++k )
+        {
+            stream[pos++] = 4;
+            memcpy(stream + pos, &sim_fri_size[k], 4);
+            pos += 4;
+
+            for ( i = 0; i < sim_fri_size[k]; ++i, ++body )
+                stream[pos++] = sim_stream_byte(body);
+        }
+
+        memcpy(stream + pos, "\003END", 4);
+        pos += 4;
+
+        sim_fri_started = sim_fri_done = sim_fri_offset = 0;
+        memset(sim_fri_data, 0, sizeof(sim_fri_data));
+
+        conn = sim_setup(&sim, pools, 29, &link, 256, sim_fri_server_callback, NULL);
+        assert(ap_net_conn_pool_framer_set(pools[0], AP_NET_FRAMER_LENGTH, 1, 0));
+        assert(pos == ap_net_conn_pool_send(pools[1], conn->idx, stream, pos));
+
+        assert(ap_net_sim_run(sim, pools, 2, 1000000000ull, 1000000));
+
+        /* the bodies are never taken for messages */
+        assert(sim_fri_done == sim_fri_items && pools[0]->framer->messages == sim_fri_items + 1);
+        assert(pools[0]->used_slots == 0);
+
+        for ( i = 0; i < (int)sizeof(sim_fri_data); ++i )
+            assert(sim_fri_data[i] == sim_stream_byte(i));
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: scratch arenas on the simulated network\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[2];
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 0 };
+        struct ap_net_connection_t *conn;
+
+
+        conn = sim_setup(&sim, pools, 29, &link, 256, sim_ar_server_callback, sim_ar_client_callback);
+        assert(4 == ap_net_conn_pool_send(pools[1], conn->idx, "REQ\n", 4));
+
+        assert(ap_net_sim_run(sim, pools, 2, 1000000000ull, 1000000));
+
+        assert(sim_ar_replies == sim_ar_requests && sim_ar_closed == 1);
+        assert(pools[0]->arenas->cycle.used == 0 && pools[0]->arenas->cycle.peak > 0);
+        assert(pools[0]->arenas->conns[0].used == 0 && pools[0]->arenas->conns[0].peak > 0); /* reset on close */
+        assert(pools[0]->arenas->conns[0].chunks != NULL); /* the memory is kept for the next one */
+
+        sim_teardown(sim, pools, 2);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: held output, file transfer and direct read go on after connections are moved\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        const char kinds[] = "XXXCFR";
+        struct ap_net_sim_t *sim;
+        struct ap_net_conn_pool_t *pools[3];
+        struct ap_net_conn_pool_t *dst;
+        struct ap_net_sim_link_t link = { 1000000, 0, 0.0, 10000000 };
+        struct ap_net_connection_t *conn;
+        int idx[3];
+        int client_fd, k, mode;
+
+
+        for ( i = 0; i < sim_mv_size; ++i )
+            sim_mv_data[i] = sim_stream_byte(i);
+
+        sim_mv_file_fd = open(sim_xfer_file_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        assert(sim_mv_file_fd != -1 && sim_mv_size == write(sim_mv_file_fd, sim_mv_data, sim_mv_size));
+        client_fd = open(sim_xfer_file_name, O_RDONLY);
+        assert(client_fd != -1);
+        unlink(sim_xfer_file_name);
+
+        for ( mode = 0; mode < 2; ++mode ) /* to other pool by ap_net_conn_pool_move_conn(), then to lower slots by ap_net_conn_pool_set_max_connections() */
+        {
+            memset(sim_mv_received, 0, sizeof(sim_mv_received));
+            memset(sim_mv_in, 0, sizeof(sim_mv_in));
+            sim_mv_read_done = 0;
+
+            conn = sim_setup(&sim, pools, 31 + mode, &link, 1024, sim_mv_server_callback, sim_mv_client_callback);
+            assert(ap_net_conn_pool_cork_enable(pools[0], 2 * sim_mv_size));
+
+            pools[2] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, sim_pool_slots, 0, 1024, sim_mv_server_callback);
+            assert(pools[2] != NULL && ap_net_conn_pool_poller_create(pools[2]));
+
+            for ( k = 0; kinds[k] != '\0'; ++k )
+            {
+                if ( k > 0 )
+                {
+                    conn = ap_net_conn_pool_connect_straddr(pools[1], 0, localhost_str, AF_INET, sim_port, 0);
+                    assert(conn != NULL);
+                }
+
+                sim_mv_kind[conn->idx] = kinds[k];
+
+                if ( kinds[k] != 'X' )
+                    assert(1 == ap_net_conn_pool_send(pools[1], conn->idx, (void *)&kinds[k], 1));
+            }
+
+            assert(ap_net_conn_pool_sendfile(pools[1], conn->idx, client_fd, 0, sim_mv_size, 0)); /* the body for 'R' */
+
+            assert(ap_net_sim_run(sim, pools, 2, 10000000ull, 1000000));
+
+            /* the fillers are closed after all are accepted, so the busy ones stay in the upper slots */
+            for ( k = 0; k < sim_pool_slots; ++k )
+                if ( sim_mv_kind[k] == 'X' )
+                    assert(1 == ap_net_conn_pool_send(pools[1], k, "X", 1));
+
+            assert(ap_net_sim_run(sim, pools, 2, 10000000ull, 1000000));
+            assert(pools[0]->used_slots == 3);
+
+            for ( k = 0; k < 3; ++k )
+            {
+                for ( idx[k] = 0; idx[k] < pools[0]->max_connections && pools[0]->conns[idx[k]].fd != sim_mv_fd[k]; ++idx[k] )
+                    ;
+
+                assert(idx[k] >= 3 && idx[k] < pools[0]->max_connections);
+            }
+
+            assert(ap_net_conn_pool_cork_pending(pools[0], idx[0]) > 0);
+            assert(ap_net_conn_pool_sendfile_active(pools[0], idx[1]));
+            assert(ap_net_conn_pool_recv_into_left(pools[0], idx[2]) > 0);
+
+            if ( mode == 0 )
+            {
+                for ( k = 0; k < 3; ++k )
+                    assert(ap_net_conn_pool_move_conn(pools[2], pools[0], idx[k]));
+
+                dst = pools[2];
+            }
+            else
+            {
+                assert(ap_net_conn_pool_set_max_connections(pools[0], 3, 1024));
+                dst = pools[0];
+            }
+
+            for ( k = 0; k < 3; ++k )
+            {
+                for ( idx[k] = 0; idx[k] < dst->max_connections && dst->conns[idx[k]].fd != sim_mv_fd[k]; ++idx[k] )
+                    ;
+
+                assert(idx[k] < 3 && bit_is_set(dst->conns[idx[k]].state, AP_NET_ST_CONNECTED));
+            }
+
+            assert(ap_net_conn_pool_cork_pending(dst, idx[0]) > 0);
+            assert(ap_net_conn_pool_sendfile_active(dst, idx[1]));
+            assert(ap_net_conn_pool_recv_into_left(dst, idx[2]) > 0);
+
+            assert(ap_net_sim_run(sim, pools, 3, 5000000000ull, 1000000));
+
+            /* all came in order to the end */
+            assert(sim_mv_read_done == 1 && 0 == memcmp(sim_mv_in, sim_mv_data, sim_mv_size));
+
+            for ( k = 0; k < sim_pool_slots; ++k )
+                if ( sim_mv_kind[k] == 'C' || sim_mv_kind[k] == 'F' )
+                    assert(sim_mv_received[k] == sim_mv_size);
+
+            assert(pools[0]->used_slots == 0 && pools[1]->used_slots == 0 && pools[2]->used_slots == 0);
+
+            sim_teardown(sim, pools, 3);
+        }
+
+        close(client_fd);
+
+        /* *********************************************************** */
+        printf("test: poll error ends the cycle of corked pool\n");
+        fflush(stdout);
+        /* *********************************************************** */
+        {
+            struct ap_net_io_ops_t failing_io;
+            struct ap_net_io_ops_t *saved_io;
+            int held, client_idx;
+
+
+            memset(sim_mv_received, 0, sizeof(sim_mv_received));
+
+            conn = sim_setup(&sim, pools, 37, &link, 1024, sim_mv_server_callback, sim_mv_client_callback);
+            assert(ap_net_conn_pool_cork_enable(pools[0], 2 * sim_mv_size));
+
+            client_idx = conn->idx;
+            sim_mv_kind[client_idx] = 'C';
+            assert(1 == ap_net_conn_pool_send(pools[1], client_idx, "C", 1));
+
+            assert(ap_net_sim_run(sim, pools, 2, 20000000ull, 1000000));
+
+            held = ap_net_conn_pool_cork_pending(pools[0], 0);
+            assert(held > 0);
+
+            assert(ap_net_sim_run(sim, pools + 1, 1, 50000000ull, 1000000)); /* the client takes what is sent, so the socket has room */
+
+            saved_io = ap_net_io;
+            failing_io = *ap_net_io;
+            failing_io.epoll_wait = sim_mv_failing_epoll_wait;
+            ap_net_io = &failing_io;
+
+            assert(! ap_net_conn_pool_poll(pools[0]));
+
+            ap_net_io = saved_io;
+
+            /* the cycle is over and the held output went on anyway */
+            assert(pools[0]->cork->in_cycle == 0);
+            assert(ap_net_conn_pool_cork_pending(pools[0], 0) < held);
+
+            assert(ap_net_sim_run(sim, pools, 2, 2000000000ull, 1000000));
+
+            assert(sim_mv_received[client_idx] == sim_mv_size);
+            assert(pools[0]->used_slots == 0 && pools[1]->used_slots == 0);
+
+            sim_teardown(sim, pools, 2);
+        }
+
+        close(sim_mv_file_fd);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: impairment shim delays and drops\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_shim_params_t params;
+        struct ap_net_shim_stat_t shim_stat;
+        int sv[2];
+        char buf[16];
+
+        assert(ap_net_shim_params_parse(&params, "delay=20ms,jitter=1ms,loss=0"));
+        assert(params.delay_ns == 20000000 && params.jitter_ns == 1000000);
+        assert(! ap_net_shim_params_parse(&params, "delay=20ms,los=1"));
+        assert(ap_net_shim_enable(&params, 1));
+
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+        assert(4 == ap_net_io->send(sv[0], "ping", 4, 0));
+        assert(-1 == ap_net_io->recv(sv[1], buf, sizeof(buf), 0) && errno == EAGAIN); /* still held */
+        usleep(25000);
+        assert(4 == ap_net_io->recv(sv[1], buf, sizeof(buf), 0)); /* due by now */
+        ap_net_io->close(sv[0]);
+        ap_net_io->close(sv[1]);
+
+        params.loss = 1.0; /* datagrams are gone, stream data is retransmitted */
+        assert(ap_net_shim_enable(&params, 1));
+        assert(0 == socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv));
+
+        for ( i = 0; i < 10; ++i )
+            assert(4 == ap_net_io->send(sv[0], "ping", 4, 0));
+
+        usleep(25000);
+        assert(-1 == ap_net_io->recv(sv[1], buf, sizeof(buf), 0) && errno == EAGAIN);
+        ap_net_shim_get_stat(&shim_stat);
+        assert(shim_stat.lost == 10 && shim_stat.packets == 1);
+
+        ap_net_io->close(sv[0]);
+        ap_net_io->close(sv[1]);
+        ap_net_shim_disable();
+        assert(ap_net_io == &ap_net_io_system);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: orderly shutdown of peer is detected with stale errno\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_conn_pool_t *pool;
+        struct sockaddr_in addr;
+        int sock;
+
+
+        pool = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, 2, 0, 256, shutdown_callback);
+        assert(pool != NULL);
+        assert(ap_net_conn_pool_set_ip4_addr(pool, INADDR_LOOPBACK, shutdown_port));
+        assert(-1 != ap_net_conn_pool_listener_create(pool, 1, 1));
+
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        assert(sock != -1);
+        assert(ap_net_set_ip4_addr(&addr, INADDR_LOOPBACK, shutdown_port));
+        assert(0 == connect(sock, (struct sockaddr *)&addr, sizeof(addr)));
+        assert(1 == write(sock, "x", 1));
+        close(sock);
+
+        for ( i = 0; i < 1000 && shutdown_closed == 0; ++i )
+        {
+            errno = EAGAIN; /* recv() returning 0 leaves it as is */
+            assert(ap_net_conn_pool_poll(pool));
+            usleep(1000);
+        }
+
+        assert(shutdown_closed == 1);
+
+        ap_net_conn_pool_destroy(pool, 1);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: empty datagram does not shut UDP connection down\n");
+    fflush(stdout);
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    {
+        struct ap_net_conn_pool_t *pool;
+        struct ap_net_connection_t *conn;
+        struct sockaddr_in addr;
+        int sock;
+
+
+        shutdown_closed = 0;
+
+        pool = ap_net_conn_pool_create(0, 2, 0, 256, shutdown_callback);
+        assert(pool != NULL && ap_net_conn_pool_poller_create(pool));
+
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        assert(sock != -1);
+        assert(ap_net_set_ip4_addr(&addr, INADDR_LOOPBACK, shutdown_port));
+        assert(0 == bind(sock, (struct sockaddr *)&addr, sizeof(addr)));
+
+        conn = ap_net_conn_pool_connect_ip4(pool, 0, INADDR_LOOPBACK, shutdown_port, 0);
+        assert(conn != NULL);
+
+        assert(0 == sendto(sock, "", 0, 0, (struct sockaddr *)&conn->local.addr4, sizeof(conn->local.addr4)));
+        assert(1 == sendto(sock, "x", 1, 0, (struct sockaddr *)&conn->local.addr4, sizeof(conn->local.addr4)));
+
+        for ( i = 0; i < 1000 && conn->buffill == 0 && shutdown_closed == 0; ++i )
+        {
+            assert(ap_net_conn_pool_poll(pool));
+            usleep(1000);
+        }
+
+        assert(shutdown_closed == 0 && conn->buffill == 1 && bit_is_set(conn->state, AP_NET_ST_CONNECTED));
+
+        close(sock);
+        ap_net_conn_pool_destroy(pool, 1);
+    }
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    printf("test: Server + %d tcp/udp clients, up to %d tests\n", max_clients, max_clients * max_tests_per_client);
+    fflush(stdout);
+
+    generate_sequences(); /* this is where the sequentce of tests is generated for each client */
+
+    for ( i = 0; i < max_clients; ++i )
+        control_conns[i] = NULL;
+
+    /* tcp pool create and init */
+    tcp_pool = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, max_clients * max_tests_per_client,
+                                       CONNECTION_TIMEOUT, strlen(test_message) * 2, server_callback);
+
+    if ( tcp_pool == NULL
+        || ! ap_net_conn_pool_set_str_addr(tcp_pool, (char *)localhost_str, tcp_port)
+        || -1 == ap_net_conn_pool_listener_create(tcp_pool, 1, 1) )
+    {
+        printf("* !ERROR: tcp_pool: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    tcp_pool->poller->debug = TCP_POLLER_DEBUG;
+
+    if ( ! ap_net_conn_pool_recorder_enable(tcp_pool, RECORDER_EVENTS)
+         || ! ap_net_conn_pool_profiler_enable(tcp_pool, AP_NET_PROFILE_HW_COUNTERS, SLOW_CALLBACK_US)
+         || ! ap_net_conn_pool_shm_export(tcp_pool, shm_name, AP_NET_SHM_CONNS, 100) )
+    {
+        printf("* !ERROR: tcp_pool recorder/profiler/shm: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    /* udp pool create and init */
+    udp_pool = ap_net_conn_pool_create(0, max_clients * max_tests_per_client, CONNECTION_TIMEOUT, strlen(test_message) * 2, server_callback);
+
+    if ( udp_pool == NULL
+        || ! ap_net_conn_pool_set_ip4_addr(udp_pool, INADDR_LOOPBACK, udp_port)
+        || -1 == ap_net_conn_pool_listener_create(udp_pool, 1, 1) )
+    {
+        printf("* !ERROR: udp_pool: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    udp_pool->poller->debug = UDP_POLLER_DEBUG;
+
+    if ( ! ap_net_conn_pool_recorder_enable(udp_pool, RECORDER_EVENTS)
+         || ! ap_net_recorder_dump_on_signal(SIGSEGV, recorder_file_name) )
+    {
+        printf("* !ERROR: udp_pool recorder: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    log_file_handle = open(log_file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if ( log_file_handle <= 0 )
+    {
+        printf("Failed to open log file: %s %s\n", log_file_name, strerror(errno));
+        exit(1);
+    }
+
+    if ( ! ap_log_add_debug_handle(log_file_handle) )
+    {
+        printf("Failed to register log file handle for debug output: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    /* ------------------------------------------------------------------
+       Spawning clients
+    */
+    for ( client_index = 0; client_index < max_clients; ++client_index )
+    {
+        if ( 0 == fork() )
+        {
+            /* we'll reuse those varables for client's operations. also another test of correct re-use */
+            ap_net_conn_pool_destroy(tcp_pool, 1);
+            ap_net_conn_pool_destroy(udp_pool, 1);
+
+            go_client();
+
+            exit(0);
+        }
+    }
+
+    ap_log_debug_level = SERVER_DEBUG_LEVEL;
+
+/* ###############################################################################################################
+ * Main loop
+ * ###############################################################################################################
+ */
+    start_time = last_event_time = time(NULL);
+
+    while ( (time(NULL) - start_time < 5) || tcp_pool->used_slots > 0 || udp_pool->used_slots > 0 )
+    {
+        if (time(NULL) - last_event_time > 5 )
+        {
+            ap_log_debug_log("! Finishing: last event was long ago. tcp slots used: %d, udp slots: %d\n", tcp_pool->used_slots, udp_pool->used_slots);
+
+            break;
+        }
+
+        usleep(10000);
+
+        if ( ! ap_net_conn_pool_poll(tcp_pool) )
+        {
+            ap_log_debug_log("* !ERROR: tcp_pool: %s\n", ap_error_get_string());
+            exit(1);
+        }
+
+        for (i = 0; i < tcp_pool->max_connections; ++i ) /* checking for unassigned Ids */
+        {
+            conn = &tcp_pool->conns[i];
+            ud = conn->user_data;
+
+            if( ! (bit_is_set(conn->state, AP_NET_ST_CONNECTED)) || ud->client_id != -1 )
+                continue;
+
+            for( n = 0; n < ID_STACK_MAX; ++n )
+            {
+                if( id_stack[n].is_tcp && id_stack[n].port == conn->remote.addr4.sin_port )
+                    break;
+            }
+
+            if ( n == ID_STACK_MAX ) /* not in stack, skipping */
+                continue;
+
+            ud->test_index = id_stack[n].test_index;
+            ud->test_type  = id_stack[n].test_type;
+            ud->client_id  = id_stack[n].client_index;
+            id_stack[n].client_index = -1; /* free the stack slot */
+
+            ap_log_debug_log("%c", ud->test_type);
+        }
+
+        if ( tcp_pool->poller->events_count )
+            last_event_time = time(NULL);
+
+#ifdef TEST_UDP
+        if ( ! ap_net_conn_pool_poll(udp_pool) )
+        {
+            ap_log_debug_log("* !ERROR: udp_pool: %s\n", ap_error_get_string());
+            exit(1);
+        }
+
+        for (i = 0; i < udp_pool->max_connections; ++i ) /* checking for unassigned Ids */
+        {
+            conn = &udp_pool->conns[i];
+            ud = conn->user_data;
+
+            if( ! (bit_is_set(conn->state, AP_NET_ST_CONNECTED)) || ud->client_id != -1 )
+                continue;
+
+            for( n = 0; n < ID_STACK_MAX; ++n )
+            {
+                if ( ! id_stack[n].is_tcp && id_stack[n].port == conn->remote.addr4.sin_port )
+                    break;
+            }
+
+            if ( n == ID_STACK_MAX ) /* not in stack, skipping */
+                continue;
+
+            ud->test_index = id_stack[n].test_index;
+            ud->test_type  = id_stack[n].test_type;
+            ud->client_id  = id_stack[n].client_index;
+            id_stack[n].client_index = -1; /* free the stack slot */
+
+            ap_log_debug_log("%c", ud->test_type);
+        }
+
+        if ( udp_pool->poller->events_count )
+            last_event_time = time(NULL);
+#endif
+    } /* while ( has activity ) */
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* DONE HERE. REPORTING STATS */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+
+    ap_log_debug_log("\n");
+
+    for (i = 0; i < max_clients; ++i)
+    {
+        ap_log_debug_log("Client #%4d: %s\n         TCP: %s\n", i, tests[TEST_IS_TCP][i].plan, tests[TEST_IS_TCP][i].results);
+        ap_log_debug_log("\t\tTotal: %d, Good %d, Bad: %d\n", tests[TEST_IS_TCP][i].count, tests[TEST_IS_TCP][i].good, tests[TEST_IS_TCP][i].bad);
+#ifdef TEST_UDP
+        ap_log_debug_log("         UDP: %s\n", tests[TEST_IS_UDP][i].results);
+#endif
+        ap_log_debug_log("\t\tTotal: %d, Good %d, Bad: %d\n", tests[TEST_IS_UDP][i].count, tests[TEST_IS_UDP][i].good, tests[TEST_IS_UDP][i].bad);
+    }
+
+    for( n = i = 0; i < ID_STACK_MAX; ++i)
+        if ( id_stack[i].client_index != -1 && id_stack[i].test_type != '-' )
+        {
+            ++n;
+            ap_log_debug_log("%02d) Client #%d %s test index: %d, '%c'\n", n, id_stack[i].client_index, id_stack[i].is_tcp ? "TCP" : "UDP", id_stack[i].test_index, id_stack[i].test_type);
+        }
+
+    if(n)
+        ap_log_debug_log("! ERROR: %d id packets still in stack\n", n);
+
+    if ( tcp_pool->used_slots > max_clients )
+    {
+        ap_log_debug_log ("TCP pool stale connections:\n");
+
+        for (i = 0; i < tcp_pool->max_connections; ++i)
+        {
+            if ( ! (tcp_pool->conns[i].state & AP_NET_ST_CONNECTED) )
+                continue;
+
+            conn = &tcp_pool->conns[i];
+            ud = conn->user_data;
+
+            if ( ud->is_control )
+                continue;
+
+            ap_log_debug_log("%d) Client %d, expire in: %ldms, State: ", conn->idx, ud->client_id, ap_utils_timespec_elapsed(NULL, &conn->expire, NULL));
+
+            if ( bit_is_set(conn->state, AP_NET_ST_BUSY) )
+                ap_log_debug_log(" Busy,");
+
+            if ( bit_is_set(conn->state, AP_NET_ST_DISCONNECTION) )
+                ap_log_debug_log(" Disc,");
+
+            if ( bit_is_set(conn->state, AP_NET_ST_ERROR) )
+                ap_log_debug_log(" Error,");
+
+            if ( bit_is_set(conn->state, AP_NET_ST_EXPIRED) )
+                ap_log_debug_log(" Expired,");
+
+            if ( bit_is_set(conn->state, AP_NET_ST_IN) )
+                ap_log_debug_log(" DataIn,");
+
+            if ( bit_is_set(conn->state, AP_NET_ST_OUT) )
+                ap_log_debug_log(" DataOut,");
+
+            ap_log_debug_log(" buf p: %d, f: %d, s: %d, Test #%d '%c'\n", conn->bufpos, conn->buffill, conn->bufsize, ud->test_index, ud->test_type);
+        }
+    }
+
+    n = open(recorder_file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if ( n == -1 || -1 == ap_net_recorder_dump_all(n) )
+        ap_log_debug_log("! ERROR: recorder dump to %s failed: %s\n", recorder_file_name, strerror(errno));
+
+    if ( n != -1 )
+        close(n);
+
+    /* checking the shared memory statistics export against the pool itself */
+    ap_net_conn_pool_shm_publish(tcp_pool, 1);
+
+    shm = ap_net_shm_attach(shm_name, &shm_size);
+    shm_copy = malloc(shm_size);
+
+    if ( shm == NULL || shm_copy == NULL || ! ap_net_shm_snapshot(shm, shm_size, shm_copy) )
+        ap_log_debug_log("! ERROR: shm snapshot failed: %s\n", ap_error_get_string());
+    else if ( shm_copy->stat.conn_count != tcp_pool->stat.conn_count || shm_copy->used_slots != tcp_pool->used_slots
+              || shm_copy->conns_count != tcp_pool->used_slots )
+        ap_log_debug_log("! ERROR: shm snapshot mismatch: %u conns, %d used, %d listed\n",
+            shm_copy->stat.conn_count, shm_copy->used_slots, shm_copy->conns_count);
+
+    if ( shm != NULL )
+        ap_net_shm_detach(shm, shm_size);
+
+    free(shm_copy);
+
+    ap_net_conn_pool_print_stat(tcp_pool, "tcp_pool"); /* prints the profile too */
+    ap_net_conn_pool_print_stat(udp_pool, "udp_pool");
+
+    ap_log_debug_log("test: done. Elapsed %d seconds\n", (int)(time(NULL) - start_time));
+
+    ap_net_conn_pool_destroy(tcp_pool,1);
+    ap_net_conn_pool_destroy(udp_pool,1);
+
+    /* *********************************************************** */
+    /* *********************************************************** */
+    /* *********************************************************** */
+    ap_log_remove_debug_handle(log_file_handle);
+    close(log_file_handle);
+
+    exit(0);
+}
+
+/* ******************************************************** */
+/* simulated network test: echo server and ping-pong clients over lossy link */
+int sim_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    int n;
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN && signal_type != AP_NET_SIGNAL_CONN_DATA_LEFT )
+        return 1;
+
+    n = conn->buffill - conn->bufpos;
+
+    if ( n > 1 && sim_cork ) /* both halves go out in one segment at the end of cycle */
+    {
+        assert(n / 2 == ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos, n / 2));
+        assert(n - n / 2 == ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos + n / 2, n - n / 2));
+        conn->bufpos += n;
+    }
+    else if ( n > 0 && 0 < (n = ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos, n)) )
+        conn->bufpos += n;
+
+    return 1;
+}
+
+int sim_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    struct iovec iov[3];
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN || conn->buffill < test_message_len )
+        return 1;
+
+    assert(0 == memcmp(conn->buf, test_message, test_message_len));
+
+    ++sim_echoes;
+    conn->bufpos = conn->buffill = 0;
+
+    if ( sim_cork )
+    {
+        iov[0].iov_base = (void *)test_message;
+        iov[0].iov_len = 3;
+        iov[1].iov_base = (void *)(test_message + 3);
+        iov[1].iov_len = 5;
+        iov[2].iov_base = (void *)(test_message + 8);
+        iov[2].iov_len = test_message_len - 8;
+        ap_net_conn_pool_sendv(conn->parent, conn->idx, iov, 3);
+    }
+    else
+        ap_net_conn_pool_send(conn->parent, conn->idx, (void *)test_message, test_message_len);
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* file transfer test: the request is answered by header, file and pipe contents, then the connection is closed */
+int sim_xfer_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    char header[sim_xfer_header];
+    int i;
+
+
+    switch ( signal_type )
+    {
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            conn->bufpos = conn->buffill;
+
+            for ( i = 0; i < sim_xfer_header; ++i )
+                header[i] = sim_stream_byte(i);
+
+            assert(sim_xfer_header == ap_net_conn_pool_send(conn->parent, conn->idx, header, sim_xfer_header));
+            assert(ap_net_conn_pool_sendfile(conn->parent, conn->idx, sim_xfer_file_fd, 0, 0, AP_NET_SENDFILE_CLOSE));
+            assert(ap_net_conn_pool_sendfile_active(conn->parent, conn->idx));
+            break;
+
+        case AP_NET_SIGNAL_CONN_SEND_DONE:
+            assert(! ap_net_conn_pool_sendfile_active(conn->parent, conn->idx));
+
+            if ( ++sim_xfer_done == 1 )
+                assert(ap_net_conn_pool_sendfile(conn->parent, conn->idx, sim_xfer_pipe_fd, 0, 0, AP_NET_SENDFILE_CLOSE));
+            else
+                ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+            break;
+    }
+
+    return 1;
+}
+
+int sim_xfer_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    for ( ; conn->bufpos < conn->buffill; ++conn->bufpos, ++sim_xfer_received )
+        assert(conn->buf[conn->bufpos] == sim_stream_byte(sim_xfer_received));
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* bridge test: echo backend. closes after echoing all, the proxy then passes end of data to the client */
+int sim_bridge_backend_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    int n;
+
+
+    switch ( signal_type )
+    {
+        case AP_NET_SIGNAL_CONN_ACCEPTED:
+            n = strlen(sim_bridge_greeting);
+            assert(n == ap_net_conn_pool_send(conn->parent, conn->idx, (void *)sim_bridge_greeting, n));
+            break;
+
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            n = conn->buffill - conn->bufpos;
+            assert(n == ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos, n));
+            conn->bufpos += n;
+
+            if ( (sim_bridge_echoed += n) == sim_bridge_size )
+                ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+            break;
+    }
+
+    return 1;
+}
+
+/* proxy: client side connection gets bridged to the new backend one */
+int sim_bridge_proxy_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    struct ap_net_connection_t *back;
+
+
+    switch ( signal_type )
+    {
+        case AP_NET_SIGNAL_CONN_ACCEPTED:
+            back = ap_net_conn_pool_connect_straddr(sim_bridge_back_pool, 0, localhost_str, AF_INET, sim_port + 1, 0);
+            assert(back != NULL);
+            assert(ap_net_conn_pool_bridge(conn->parent, conn->idx, sim_bridge_back_pool, back->idx));
+            assert(! ap_net_conn_pool_bridge(conn->parent, conn->idx, sim_bridge_back_pool, back->idx)); /* once only */
+            break;
+
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            assert(0); /* the data goes by the bridge */
+            break;
+
+        case AP_NET_SIGNAL_CONN_CLOSING:
+            if ( conn->parent != sim_bridge_back_pool )
+            {
+                assert(ap_net_conn_pool_bridge_get_stat(conn->parent, conn->idx, &sim_bridge_stat));
+                ++sim_bridge_closed;
+            }
+
+            break;
+    }
+
+    return 1;
+}
+
+/* client: sends the data after greeting, then half-closes and checks the echo */
+int sim_bridge_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    static char data[sim_bridge_size];
+    int i, n;
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    if ( conn->user_data == NULL )
+    {
+        n = strlen(sim_bridge_greeting);
+
+        if ( conn->buffill - conn->bufpos < n )
+            return 1;
+
+        assert(0 == memcmp(conn->buf + conn->bufpos, sim_bridge_greeting, n));
+        conn->bufpos += n;
+        conn->user_data = conn; /* greeted */
+
+        for ( i = 0; i < sim_bridge_size; ++i )
+            data[i] = sim_stream_byte(i);
+
+        assert(sim_bridge_size == ap_net_conn_pool_send(conn->parent, conn->idx, data, sim_bridge_size));
+        assert(0 == ap_net_io->shutdown(conn->fd, SHUT_WR));
+    }
+
+    for ( ; conn->bufpos < conn->buffill; ++conn->bufpos, ++sim_bridge_received )
+        assert(conn->buf[conn->bufpos] == sim_stream_byte(sim_bridge_received));
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* zero-copy test: the first four slices go at once, the rest as the memory is given back */
+static int sim_zc_offset(int slice)
+{
+    int i, off;
+
+
+    for ( i = off = 0; i < slice; ++i )
+        off += sim_zc_slice_size[i];
+
+    return off;
+}
+
+static void sim_zc_send_next(struct ap_net_connection_t *conn)
+{
+    int k;
+
+
+    k = sim_zc_sent++;
+    assert(sim_zc_slice_size[k] == ap_net_conn_pool_send(conn->parent, conn->idx, sim_zc_data + sim_zc_offset(k), sim_zc_slice_size[k]));
+}
+
+int sim_zc_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    conn->bufpos = conn->buffill;
+
+    while ( sim_zc_sent < 4 )
+        sim_zc_send_next(conn);
+
+    /* nothing is released before the kernel reports, and the copied one waits for those sent before it */
+    assert(sim_zc_released == 0 && 4 == ap_net_conn_pool_zerocopy_pending(conn->parent, conn->idx));
+
+    return 1;
+}
+
+void sim_zc_release(struct ap_net_connection_t *conn, void *data, int len)
+{
+    assert(data == sim_zc_data + sim_zc_offset(sim_zc_released) && len == sim_zc_slice_size[sim_zc_released]);
+
+    ++sim_zc_released;
+
+    if ( sim_zc_sent < sim_zc_slices )
+        sim_zc_send_next(conn);
+    else if ( sim_zc_released == sim_zc_slices )
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+}
+
+int sim_zc_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    for ( ; conn->bufpos < conn->buffill; ++conn->bufpos, ++sim_zc_received )
+        assert(conn->buf[conn->bufpos] == sim_stream_byte(sim_zc_received));
+
+    return 1;
+}
+
+int sim_zc_close_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    conn->bufpos = conn->buffill;
+
+    sim_zc_send_next(conn);
+    sim_zc_send_next(conn);
+
+    ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+    assert(sim_zc_released == 0 && conn->parent->zerocopy->orphans_count == 1);
+
+    return 1;
+}
+
+void sim_zc_orphan_release(struct ap_net_connection_t *conn, void *data, int len)
+{
+    assert(data == sim_zc_data + sim_zc_offset(sim_zc_released) && len == sim_zc_slice_size[sim_zc_released]);
+    assert(! (conn->state & AP_NET_ST_CONNECTED));
+
+    ++sim_zc_released;
+}
+
+/* ******************************************************** */
+/* direct read test: the header is parsed from the buffer, the body goes straight to its place */
+int sim_ri_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    int len, n;
+
+
+    if ( signal_type == AP_NET_SIGNAL_CONN_RECV_DONE )
+        ++sim_ri_done;
+    else if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    assert(0 == ap_net_conn_pool_recv_into_left(conn->parent, conn->idx)); /* no DATA_IN while the body is read */
+
+    while ( conn->buffill - conn->bufpos >= (int)sizeof(int) )
+    {
+        memcpy(&len, conn->buf + conn->bufpos, sizeof(int));
+        conn->bufpos += sizeof(int);
+
+        assert(sim_ri_started < sim_ri_msgs && len == sim_ri_msg_size[sim_ri_started]);
+
+        n = ap_net_conn_pool_recv_into(conn->parent, conn->idx, sim_ri_data + sim_ri_pos, len);
+        assert(n >= 0 && n <= len);
+
+        ++sim_ri_started;
+        sim_ri_pos += len;
+
+        if ( n > 0 )
+        {
+            assert(-1 == ap_net_conn_pool_recv_into(conn->parent, conn->idx, sim_ri_data, 1)); /* one at a time */
+            return 1;
+        }
+
+        ++sim_ri_at_once;
+    }
+
+    if ( sim_ri_done + sim_ri_at_once == sim_ri_msgs )
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* buffer handoff test: complete messages are taken with the buffer, the client closes after the last */
+int sim_rb_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    struct ap_net_rbuf_t *rb;
+    int len;
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
+
+    while ( conn->buffill - conn->bufpos >= (int)sizeof(int) )
+    {
+        memcpy(&len, conn->buf + conn->bufpos, sizeof(int));
+        assert(len == sim_rb_msg_size);
+
+        if ( conn->buffill - conn->bufpos < (int)sizeof(int) + len )
+        {
+            assert(NULL == ap_net_conn_pool_buf_detach(conn->parent, conn->idx, sizeof(int) + len + 1));
+            break;
+        }
+
+        rb = ap_net_conn_pool_buf_detach(conn->parent, conn->idx, sizeof(int) + len);
+        assert(rb != NULL && rb->mem != conn->buf && rb->refs == 1);
+        assert(conn->bufpos == 0 && rb->data + rb->len <= rb->mem + rb->size);
+        assert(rb->data[sizeof(int)] == sim_stream_byte(sim_rb_count * sim_rb_msg_size));
+
+        sim_rb[sim_rb_count] = rb;
+
+        if ( sim_rb_count++ % 2 == 1 )
+            ap_net_rbuf_release(rb);
+    }
+
+    if ( sim_rb_count == sim_rb_msgs )
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* framing test: checks each message as it comes */
+int sim_fr_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    char *msg;
+    int i, len;
+
+
+    assert(signal_type != AP_NET_SIGNAL_CONN_DATA_IN && signal_type != AP_NET_SIGNAL_CONN_DATA_LEFT);
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_MESSAGE )
+        return 1;
+
+    msg = ap_net_conn_pool_message(conn, &len);
+
+    assert(sim_fr_count < sim_fr_msgs && len == sim_fr_msg_len(sim_fr_count));
+
+    for ( i = 0; i < len; ++i )
+        assert(msg[i] == sim_fr_byte(sim_fr_count, i));
+
+    ++sim_fr_count;
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* framing with direct reads test: the body goes to its place right from the header's handler */
+int sim_fri_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    char *msg;
+    int len, size, left;
+
+
+    if ( signal_type == AP_NET_SIGNAL_CONN_RECV_DONE )
     {
-        printf("* !ERROR: udp_pool: %s\n", ap_error_get_string());
-        exit(1);
+        ++sim_fri_done;
+        return 1;
     }
 
-    udp_pool->poller->debug = UDP_POLLER_DEBUG;
+    if ( signal_type != AP_NET_SIGNAL_CONN_MESSAGE )
+        return 1;
 
-    log_file_handle = open(log_file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    msg = ap_net_conn_pool_message(conn, &len);
 
-    if ( log_file_handle <= 0 )
-    {
-        printf("Failed to open log file: %s %s\n", log_file_name, strerror(errno));
-        exit(1);
-    }
+    assert(sim_fri_done == sim_fri_started);
 
-    if ( ! ap_log_add_debug_handle(log_file_handle) )
+    if ( len == 3 )
     {
-        printf("Failed to register log file handle for debug output: %s\n", ap_error_get_string());
-        exit(1);
+        assert(0 == memcmp(msg, "END", 3) && sim_fri_done == sim_fri_items);
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+        return 1;
     }
 
-    /* ------------------------------------------------------------------
-       Spawning clients
-    */
-    for ( client_index = 0; client_index < max_clients; ++client_index )
+    assert(len == 4 && sim_fri_started < sim_fri_items);
+    memcpy(&size, msg, 4);
+    assert(size == sim_fri_size[sim_fri_started]);
+
+    left = ap_net_conn_pool_recv_into(conn->parent, conn->idx, sim_fri_data + sim_fri_offset, size);
+    assert(left >= 0 && left <= size);
+
+    sim_fri_offset += size;
+    ++sim_fri_started;
+
+    if ( left == 0 ) /* was in the buffer already, no signal comes */
+        ++sim_fri_done;
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* scratch arenas test: the request count lives in connection's arena, the reply is made in pool's one */
+int sim_ar_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    ap_arena_t *scratch;
+    ap_buf_t reply;
+    int *count;
+
+
+    switch ( signal_type )
     {
-        if ( 0 == fork() )
-        {
-            /* we'll reuse those varables for client's operations. also another test of correct re-use */
-            ap_net_conn_pool_destroy(tcp_pool, 1);
-            ap_net_conn_pool_destroy(udp_pool, 1);
+        case AP_NET_SIGNAL_CONN_ACCEPTED:
+            conn->user_data = ap_arena_alloc(ap_net_connection_arena(conn), sizeof(int));
+            assert(conn->user_data != NULL);
+            *(int *)conn->user_data = 0;
+            break;
 
-            go_client();
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            if ( conn->buf[conn->buffill - 1] != '\n' )
+                break;
 
-            exit(0);
-        }
+            conn->bufpos = conn->buffill;
+            count = conn->user_data;
+
+            scratch = ap_net_conn_pool_scratch(conn->parent);
+            assert(scratch != NULL && scratch->used == 0); /* reset since the previous cycle */
+
+            ap_buf_init(&reply, scratch);
+            assert(ap_buf_printf(&reply, "%-100s%d\n", "REPLY", ++*count)); /* longer than inline storage */
+            assert(reply.data != reply.inline_data && scratch->used > 0);
+            assert(reply.len == ap_net_conn_pool_send(conn->parent, conn->idx, reply.data, reply.len));
+
+            if ( *count == sim_ar_requests )
+                ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+
+            break;
+
+        case AP_NET_SIGNAL_CONN_CLOSING:
+            assert(*(int *)conn->user_data == sim_ar_requests); /* still there */
+            ++sim_ar_closed;
+            break;
     }
 
-    ap_log_debug_level = SERVER_DEBUG_LEVEL;
+    return 1;
+}
 
-/* ###############################################################################################################
- * Main loop
- * ###############################################################################################################
- */
-    start_time = last_event_time = time(NULL);
+int sim_ar_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN || conn->buf[conn->buffill - 1] != '\n' )
+        return 1;
 
-    while ( (time(NULL) - start_time < 5) || tcp_pool->used_slots > 0 || udp_pool->used_slots > 0 )
+    assert(conn->buffill - conn->bufpos == 102 && atoi(conn->buf + conn->bufpos + 100) == ++sim_ar_replies);
+    conn->bufpos = conn->buffill;
+
+    if ( sim_ar_replies < sim_ar_requests )
+        assert(4 == ap_net_conn_pool_send(conn->parent, conn->idx, "REQ\n", 4));
+
+    return 1;
+}
+
+/* ******************************************************** */
+/* moving test: each connection makes one request, the replies are checked by the client */
+int sim_mv_server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type == AP_NET_SIGNAL_CONN_RECV_DONE )
     {
-        if (time(NULL) - last_event_time > 5 )
-        {
-            ap_log_debug_log("! Finishing: last event was long ago. tcp slots used: %d, udp slots: %d\n", tcp_pool->used_slots, udp_pool->used_slots);
+        ++sim_mv_read_done;
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
+        return 1;
+    }
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
 
+    switch ( conn->buf[conn->bufpos++] )
+    {
+        case 'X':
+            ap_net_conn_pool_close_connection(conn->parent, conn->idx);
             break;
-        }
 
-        usleep(10000);
+        case 'C': /* all is held, the socket takes much less at the end of cycle */
+            sim_mv_fd[0] = conn->fd;
+            assert(sim_mv_size == ap_net_conn_pool_send(conn->parent, conn->idx, sim_mv_data, sim_mv_size));
+            break;
 
-        if ( ! ap_net_conn_pool_poll(tcp_pool) )
-        {
-            ap_log_debug_log("* !ERROR: tcp_pool: %s\n", ap_error_get_string());
-            exit(1);
-        }
+        case 'F':
+            sim_mv_fd[1] = conn->fd;
+            assert(ap_net_conn_pool_sendfile(conn->parent, conn->idx, sim_mv_file_fd, 0, sim_mv_size, 0));
+            break;
 
-        for (i = 0; i < tcp_pool->max_connections; ++i ) /* checking for unassigned Ids */
-        {
-            conn = &tcp_pool->conns[i];
-            ud = conn->user_data;
+        case 'R':
+            sim_mv_fd[2] = conn->fd;
+            assert(ap_net_conn_pool_recv_into(conn->parent, conn->idx, sim_mv_in, sim_mv_size) > 0);
+            break;
 
-            if( ! (bit_is_set(conn->state, AP_NET_ST_CONNECTED)) || ud->client_id != -1 )
-                continue;
+        default:
+            assert(0);
+    }
 
-            for( n = 0; n < ID_STACK_MAX; ++n )
-            {
-                if( id_stack[n].is_tcp && id_stack[n].port == conn->remote.addr4.sin_port )
-                    break;
-            }
+    return 1;
+}
 
-            if ( n == ID_STACK_MAX ) /* not in stack, skipping */
-                continue;
+int sim_mv_client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN )
+        return 1;
 
-            ud->test_index = id_stack[n].test_index;
-            ud->test_type  = id_stack[n].test_type;
-            ud->client_id  = id_stack[n].client_index;
-            id_stack[n].client_index = -1; /* free the stack slot */
+    assert(sim_mv_kind[conn->idx] == 'C' || sim_mv_kind[conn->idx] == 'F');
 
-            ap_log_debug_log("%c", ud->test_type);
-        }
+    for ( ; conn->bufpos < conn->buffill; ++conn->bufpos, ++sim_mv_received[conn->idx] )
+        assert(conn->buf[conn->bufpos] == sim_stream_byte(sim_mv_received[conn->idx]));
 
-        if ( tcp_pool->poller->events_count )
-            last_event_time = time(NULL);
+    if ( sim_mv_received[conn->idx] == sim_mv_size )
+        ap_net_conn_pool_close_connection(conn->parent, conn->idx);
 
-#ifdef TEST_UDP
-        if ( ! ap_net_conn_pool_poll(udp_pool) )
-        {
-            ap_log_debug_log("* !ERROR: udp_pool: %s\n", ap_error_get_string());
-            exit(1);
-        }
+    return 1;
+}
 
-        for (i = 0; i < udp_pool->max_connections; ++i ) /* checking for unassigned Ids */
-        {
-            conn = &udp_pool->conns[i];
-            ud = conn->user_data;
+int sim_mv_failing_epoll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout)
+{
+    errno = EBADF;
+    return -1;
+}
 
-            if( ! (bit_is_set(conn->state, AP_NET_ST_CONNECTED)) || ud->client_id != -1 )
-                continue;
+/* ******************************************************** */
+void sim_test(uint64_t seed, int clients, uint64_t duration_ns, const char *capture_file, struct sim_result_t *result)
+{
+    struct ap_net_sim_t *sim;
+    struct ap_net_conn_pool_t *pools[2];
+    struct ap_net_sim_link_t link = { 2000000, 1000000, 0.01, 1000000 }; /* 2 ms + up to 1 ms, 1% loss, 1 MB/s */
+    struct ap_net_connection_t *conn;
+    int i;
 
-            for( n = 0; n < ID_STACK_MAX; ++n )
-            {
-                if ( ! id_stack[n].is_tcp && id_stack[n].port == conn->remote.addr4.sin_port )
-                    break;
-            }
 
-            if ( n == ID_STACK_MAX ) /* not in stack, skipping */
-                continue;
+    memset(result, 0, sizeof(struct sim_result_t));
+    sim_echoes = 0;
 
-            ud->test_index = id_stack[n].test_index;
-            ud->test_type  = id_stack[n].test_type;
-            ud->client_id  = id_stack[n].client_index;
-            id_stack[n].client_index = -1; /* free the stack slot */
+    sim = ap_net_sim_create(seed);
+    assert(sim != NULL);
+    assert(ap_net_sim_set_link(sim, NULL, NULL, &link));
 
-            ap_log_debug_log("%c", ud->test_type);
-        }
+    pools[0] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, clients, 0, 1024, sim_server_callback);
+    pools[1] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, clients, 0, 1024, sim_client_callback);
+    assert(pools[0] != NULL && pools[1] != NULL);
 
-        if ( udp_pool->poller->events_count )
-            last_event_time = time(NULL);
-#endif
-    } /* while ( has activity ) */
+    assert(ap_net_conn_pool_set_ip4_addr(pools[0], INADDR_LOOPBACK, sim_port));
+    assert(-1 != ap_net_conn_pool_listener_create(pools[0], 1, 1));
+    assert(ap_net_conn_pool_poller_create(pools[1]));
 
-    /* *********************************************************** */
-    /* *********************************************************** */
-    /* *********************************************************** */
-    /* DONE HERE. REPORTING STATS */
-    /* *********************************************************** */
-    /* *********************************************************** */
-    /* *********************************************************** */
+    if ( capture_file != NULL )
+        assert(ap_net_conn_pool_capture_start(pools[0], capture_file, 0, 0));
 
-    ap_log_debug_log("\n");
+    if ( sim_cork )
+        assert(ap_net_conn_pool_cork_enable(pools[0], 0));
 
-    for (i = 0; i < max_clients; ++i)
+    for ( i = 0; i < clients; ++i )
     {
-        ap_log_debug_log("Client #%4d: %s\n         TCP: %s\n", i, tests[TEST_IS_TCP][i].plan, tests[TEST_IS_TCP][i].results);
-        ap_log_debug_log("\t\tTotal: %d, Good %d, Bad: %d\n", tests[TEST_IS_TCP][i].count, tests[TEST_IS_TCP][i].good, tests[TEST_IS_TCP][i].bad);
-#ifdef TEST_UDP
-        ap_log_debug_log("         UDP: %s\n", tests[TEST_IS_UDP][i].results);
-#endif
-        ap_log_debug_log("\t\tTotal: %d, Good %d, Bad: %d\n", tests[TEST_IS_UDP][i].count, tests[TEST_IS_UDP][i].good, tests[TEST_IS_UDP][i].bad);
+        conn = ap_net_conn_pool_connect_straddr(pools[1], 0, localhost_str, AF_INET, sim_port, i % 2 ? sim_expire_ms : 0);
+        assert(conn != NULL);
+        assert(test_message_len == ap_net_conn_pool_send(pools[1], conn->idx, (void *)test_message, test_message_len));
     }
 
-    for( n = i = 0; i < ID_STACK_MAX; ++i)
-        if ( id_stack[i].client_index != -1 && id_stack[i].test_type != '-' )
-        {
-            ++n;
-            ap_log_debug_log("%02d) Client #%d %s test index: %d, '%c'\n", n, id_stack[i].client_index, id_stack[i].is_tcp ? "TCP" : "UDP", id_stack[i].test_index, id_stack[i].test_type);
-        }
-
-    if(n)
-        ap_log_debug_log("! ERROR: %d id packets still in stack\n", n);
+    assert(ap_net_sim_run(sim, pools, 2, duration_ns, 1000000));
 
-    if ( tcp_pool->used_slots > max_clients )
+    if ( capture_file != NULL )
     {
-        ap_log_debug_log ("TCP pool stale connections:\n");
-
-        for (i = 0; i < tcp_pool->max_connections; ++i)
-        {
-            if ( ! (tcp_pool->conns[i].state & AP_NET_ST_CONNECTED) )
-                continue;
+        result->captured = pools[0]->capture->packets;
+        ap_net_conn_pool_capture_stop(pools[0]);
+    }
 
-            conn = &tcp_pool->conns[i];
-            ud = conn->user_data;
+    if ( sim_cork )
+    {
+        result->cork_held = pools[0]->cork->held;
+        result->cork_flushes = pools[0]->cork->flushes;
+    }
 
-            if ( ud->is_control )
-                continue;
+    result->echoes = sim_echoes;
+    result->timedout = pools[1]->stat.timedout;
+    result->server_used = pools[0]->used_slots;
+    result->bytes_in = pools[0]->stat.bytes_in;
 
-            ap_log_debug_log("%d) Client %d, expire in: %ldms, State: ", conn->idx, ud->client_id, ap_utils_timespec_elapsed(NULL, &conn->expire, NULL));
+    ap_net_conn_pool_destroy(pools[0], 1);
+    ap_net_conn_pool_destroy(pools[1], 1);
+    ap_net_sim_destroy(sim);
+}
 
-            if ( bit_is_set(conn->state, AP_NET_ST_BUSY) )
-                ap_log_debug_log(" Busy,");
+/* ******************************************************** */
+/* creates simulated network with the link given, server pools[0] listening on sim_port and client pools[1].
+ * returns the client's connection to server. nothing is sent or received until ap_net_sim_run() */
+struct ap_net_connection_t *sim_setup(struct ap_net_sim_t **sim, struct ap_net_conn_pool_t **pools, uint64_t seed, struct ap_net_sim_link_t *link,
+                                      int buf_size, ap_net_conn_pool_callback_func server_callback, ap_net_conn_pool_callback_func client_callback)
+{
+    struct ap_net_connection_t *conn;
 
-            if ( bit_is_set(conn->state, AP_NET_ST_DISCONNECTION) )
-                ap_log_debug_log(" Disc,");
 
-            if ( bit_is_set(conn->state, AP_NET_ST_ERROR) )
-                ap_log_debug_log(" Error,");
+    *sim = ap_net_sim_create(seed);
+    assert(*sim != NULL);
+    assert(ap_net_sim_set_link(*sim, NULL, NULL, link));
 
-            if ( bit_is_set(conn->state, AP_NET_ST_EXPIRED) )
-                ap_log_debug_log(" Expired,");
+    pools[0] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, sim_pool_slots, 0, buf_size, server_callback);
+    pools[1] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, sim_pool_slots, 0, buf_size, client_callback);
+    assert(pools[0] != NULL && pools[1] != NULL);
 
-            if ( bit_is_set(conn->state, AP_NET_ST_IN) )
-                ap_log_debug_log(" DataIn,");
+    assert(ap_net_conn_pool_set_ip4_addr(pools[0], INADDR_LOOPBACK, sim_port));
+    assert(-1 != ap_net_conn_pool_listener_create(pools[0], 1, 1));
+    assert(ap_net_conn_pool_poller_create(pools[1]));
 
-            if ( bit_is_set(conn->state, AP_NET_ST_OUT) )
-                ap_log_debug_log(" DataOut,");
+    conn = ap_net_conn_pool_connect_straddr(pools[1], 0, localhost_str, AF_INET, sim_port, 0);
+    assert(conn != NULL);
 
-            ap_log_debug_log(" buf p: %d, f: %d, s: %d, Test #%d '%c'\n", conn->bufpos, conn->buffill, conn->bufsize, ud->test_index, ud->test_type);
-        }
-    }
+    return conn;
+}
 
-    ap_log_debug_log("test: done. Elapsed %d seconds\n", (int)(time(NULL) - start_time));
+/* ******************************************************** */
+void sim_teardown(struct ap_net_sim_t *sim, struct ap_net_conn_pool_t **pools, int pools_count)
+{
+    int i;
 
-    ap_net_conn_pool_destroy(tcp_pool,1);
-    ap_net_conn_pool_destroy(udp_pool,1);
 
-    /* *********************************************************** */
-    /* *********************************************************** */
-    /* *********************************************************** */
-    ap_log_remove_debug_handle(log_file_handle);
-    close(log_file_handle);
+    for ( i = 0; i < pools_count; ++i )
+        ap_net_conn_pool_destroy(pools[i], 1);
 
-    exit(0);
+    ap_net_sim_destroy(sim);
 }
 
 /* ******************************************************** */
@@ -492,6 +2444,7 @@ int server_callback(struct ap_net_connection_t *conn, int signal_type)
     int i, n;
     server_userdata *ud;
     binary_id_packet *id;
+    ap_arena_t *arena;
 
 
     ud = conn->user_data;
@@ -499,29 +2452,12 @@ int server_callback(struct ap_net_connection_t *conn, int signal_type)
     switch (signal_type)
     {
         case AP_NET_SIGNAL_CONN_CREATED:
-            if( conn->user_data == NULL )
-            {
-                conn->user_data = malloc(sizeof(server_userdata));
-                if ( conn->user_data == NULL )
-                {
-                    ap_log_debug_log("* !ERROR: Server oom\n");
-                    exit(1);
-                }
-            }
-
-            ud = conn->user_data;
-            ud->is_control = 0;
-            ud->test_type = '\0';
-            ud->client_id = -1;
-            ud->test_index = -1;
-            ud->state = -1;
+            conn->user_data = NULL; /* comes from connection's arena on accept */
 
             break;
 
         /* ======================================================== */
         case AP_NET_SIGNAL_CONN_DESTROYING:
-            free(conn->user_data);
-
             break;
 
         /* ======================================================== */
@@ -531,6 +2467,13 @@ int server_callback(struct ap_net_connection_t *conn, int signal_type)
 
         /* ======================================================== */
         case AP_NET_SIGNAL_CONN_ACCEPTED:
+            if ( NULL == (arena = ap_net_connection_arena(conn)) || NULL == (ud = ap_arena_alloc(arena, sizeof(server_userdata))) )
+            {
+                ap_log_debug_log("* !ERROR: Server oom\n");
+                exit(1);
+            }
+
+            conn->user_data = ud;
             ud->state = STATE_CONNECTED;
             ud->is_control = 0;
             ud->test_type = '\0';
@@ -541,6 +2484,11 @@ int server_callback(struct ap_net_connection_t *conn, int signal_type)
 
         /* ======================================================== */
         case AP_NET_SIGNAL_CONN_CLOSING:
+            conn->user_data = NULL; /* the arena is reset after this handler. ud is still good here */
+
+            if ( ud == NULL ) /* was not accepted */
+                return 1;
+
             for ( i = 0; i < max_clients; ++i ) /* finding is this a control channel? */
                 if ( conn == control_conns[i] ) /* yep */
                 {
@@ -728,6 +2676,43 @@ int server_callback(struct ap_net_connection_t *conn, int signal_type)
     return 1;
 }
 
+/* ******************************************************** */
+/* orderly shutdown test: the data is taken, the rest is waiting for the close */
+int shutdown_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( signal_type == AP_NET_SIGNAL_CONN_DATA_IN || signal_type == AP_NET_SIGNAL_CONN_DATA_LEFT )
+        conn->bufpos = conn->buffill;
+    else if ( signal_type == AP_NET_SIGNAL_CONN_CLOSING )
+        ++shutdown_closed;
+
+    return 1;
+}
+
+/* ******************************************************** */
+int tok_reference(const char *buf, int len, const char *separators, int *starts, int *lens, int max_tokens)
+{
+    int pos, count;
+
+
+    for ( pos = count = 0; pos < len && count < max_tokens; ++count )
+    {
+        while ( pos < len && buf[pos] != '\0' && strchr(separators, buf[pos]) != NULL )
+            ++pos;
+
+        if ( pos == len )
+            break;
+
+        starts[count] = pos;
+
+        while ( pos < len && (buf[pos] == '\0' || strchr(separators, buf[pos]) == NULL) )
+            ++pos;
+
+        lens[count] = pos - starts[count];
+    }
+
+    return count;
+}
+
 /* ******************************************************** */
 int client_callback(struct ap_net_connection_t *conn, int signal_type)
 {
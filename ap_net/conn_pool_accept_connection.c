@@ -44,26 +44,32 @@ struct ap_net_connection_t *ap_net_conn_pool_accept_connection(struct ap_net_con
         remote_addr = bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? (struct sockaddr *)&conn->remote.addr6 : (struct sockaddr *)&conn->remote.addr4;
         addr_len = bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 
-        new_sock = accept(pool->listener.sock, remote_addr, &addr_len);
+        new_sock = ap_net_io->accept(pool->listener.sock, remote_addr, &addr_len);
+
+        ap_net_conn_pool_stat_add(pool, accept_calls, 1);
 
         if ( new_sock == -1 )
         {
+            ap_net_conn_pool_stat_add(pool, errors, 1);
+            ap_net_conn_pool_record(pool, AP_NET_REC_ERROR, NULL, errno);
             ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "accept()");
             ap_net_connection_unlock(conn);
             return NULL;
         }
 
-        fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL) | O_NONBLOCK);
+        ap_net_io->fcntl(new_sock, F_SETFL, ap_net_io->fcntl(new_sock, F_GETFL, 0) | O_NONBLOCK);
 
         conn->fd = new_sock;
 
+        ap_net_conn_pool_record(pool, AP_NET_REC_ACCEPT, conn, 0);
+
         if ( ! ap_net_conn_pool_poller_add_conn(pool, conn->idx) ) /* UDP adding new socket fd when do pool_connect(), so we need it here once */
         {
             ap_net_conn_pool_close_connection(pool, conn->idx);
             return NULL;
         }
 
-        if (pool->callback_func != NULL && ! pool->callback_func(conn, AP_NET_SIGNAL_CONN_ACCEPTED) ) /* user disagreed */
+        if ( ! ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_ACCEPTED) ) /* user disagreed */
         {
             ap_net_conn_pool_close_connection(pool, conn->idx);
             ap_error_set(_func_name, AP_ERRNO_ACCEPT_DENIED);
@@ -77,7 +83,7 @@ struct ap_net_connection_t *ap_net_conn_pool_accept_connection(struct ap_net_con
          * then do connect from our side to lock remote address to the new connection's socket
          */
         addr_len = sizeof(addr);
-        n = recvfrom(pool->listener.sock, &n, 1, MSG_DONTWAIT | MSG_PEEK, (struct sockaddr *)&addr, &addr_len);
+        n = ap_net_io->recvfrom(pool->listener.sock, &n, 1, MSG_DONTWAIT | MSG_PEEK, (struct sockaddr *)&addr, &addr_len);
 
         if ( n == -1 )
         {
@@ -106,7 +112,7 @@ struct ap_net_connection_t *ap_net_conn_pool_accept_connection(struct ap_net_con
             if( conn == NULL )
                 return NULL;
 
-            if (pool->callback_func != NULL && ! pool->callback_func(conn, AP_NET_SIGNAL_CONN_ACCEPTED) ) /* user disagreed */
+            if ( ! ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_ACCEPTED) ) /* user disagreed */
             {
                 ap_net_conn_pool_close_connection(pool, conn->idx);
                 ap_error_set(_func_name, AP_ERRNO_ACCEPT_DENIED);
@@ -116,13 +122,13 @@ struct ap_net_connection_t *ap_net_conn_pool_accept_connection(struct ap_net_con
 
         n = ap_net_conn_pool_recv(pool, conn->idx);
 
-        if ( n > 0 && pool->callback_func != NULL )
-                pool->callback_func(conn, AP_NET_SIGNAL_CONN_DATA_IN);
+        if ( n > 0 )
+            ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_DATA_IN);
 
         return conn;
     }
 
-    if (ap_log_debug_level)
+    if ( ap_log_debug_on(1) )
         ap_log_debug_log("* Got connected at #%d\n", conn->idx);
 
     ap_net_connection_unlock(conn);
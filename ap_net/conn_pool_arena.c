@@ -0,0 +1,164 @@
+/** \file ap_net/conn_pool_arena.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Scratch memory for callbacks
+ *
+ * The pool's arena is reset at the end of each ap_net_conn_pool_poll(), the connection's one when it is closed,
+ * so the callbacks' temporary objects cost a pointer increment and are never freed one by one.
+ */
+#include "conn_pool_internals.h"
+
+static const char *_func_name = "ap_net_connection_arena()";
+
+/* default chunk size of connection's arena */
+#define arena_conn_chunk 4096
+
+/* ********************************************************************** */
+/* makes arenas array follow the pool's size */
+static int arena_grow(struct ap_net_arenas_t *arenas, int new_size)
+{
+    void *new_mem;
+    int i;
+
+
+    new_mem = realloc(arenas->conns, new_size * sizeof(ap_arena_t));
+
+    if ( new_mem == NULL )
+        return 0;
+
+    arenas->conns = new_mem;
+
+    for ( i = arenas->conns_size; i < new_size; ++i )
+        ap_arena_init(&arenas->conns[i], arena_conn_chunk);
+
+    arenas->conns_size = new_size;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* sets up arenas state on first use */
+static struct ap_net_arenas_t *arena_get(struct ap_net_conn_pool_t *pool)
+{
+    if ( pool->arenas == NULL && NULL != (pool->arenas = calloc(1, sizeof(struct ap_net_arenas_t))) )
+        ap_arena_init(&pool->arenas->cycle, 0);
+
+    return pool->arenas;
+}
+
+/* ********************************************************************** */
+/** \brief Returns pool's arena for memory needed during the current poll cycle only
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return ap_arena_t* - use with ap_arena_alloc() or ap_buf_init(). NULL if out of memory
+ *
+ * The arena is reset at the end of each ap_net_conn_pool_poll(), so what the callbacks allocate from it
+ * is valid until they all are done. Memory taken outside of poll cycle lasts until the end of the next one.
+ * Do not give such memory to zero-copy sends: it may be reused before the kernel is done with it.
+ */
+ap_arena_t *ap_net_conn_pool_scratch(struct ap_net_conn_pool_t *pool)
+{
+    if ( arena_get(pool) == NULL )
+    {
+        ap_error_set("ap_net_conn_pool_scratch()", AP_ERRNO_OOM);
+        return NULL;
+    }
+
+    return &pool->arenas->cycle;
+}
+
+/* ********************************************************************** */
+/** \brief Returns connection's arena for memory needed while the connection lives
+ *
+ * \param conn struct ap_net_connection_t* - connection of pool
+ * \return ap_arena_t* - use with ap_arena_alloc() or ap_buf_init(). NULL if out of memory
+ *
+ * The arena is reset after AP_NET_SIGNAL_CONN_CLOSING handler returns, so it is good for conn->user_data set up
+ * on AP_NET_SIGNAL_CONN_ACCEPTED or AP_NET_SIGNAL_CONN_CONNECTED. The memory is kept for the next connection of the slot.
+ * The arena goes with the connection when it is moved to other slot or pool.
+ */
+ap_arena_t *ap_net_connection_arena(struct ap_net_connection_t *conn)
+{
+    struct ap_net_conn_pool_t *pool;
+
+
+    pool = conn->parent;
+
+    if ( arena_get(pool) == NULL || (conn->idx >= pool->arenas->conns_size && ! arena_grow(pool->arenas, pool->max_connections)) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return NULL;
+    }
+
+    return &pool->arenas->conns[conn->idx];
+}
+
+/* ********************************************************************** */
+/** \brief Forgets allocations from connection's arena
+ * \internal
+ *
+ * Used on connection close
+ */
+void ap_net_arena_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->arenas != NULL && conn_idx < pool->arenas->conns_size )
+        ap_arena_reset(&pool->arenas->conns[conn_idx]);
+}
+
+/* ********************************************************************** */
+/** \brief Makes room for connection's arena in destination slot
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved, as conn->user_data may point into the arena
+ */
+int ap_net_arena_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( src_pool->arenas == NULL || src_idx >= src_pool->arenas->conns_size )
+        return 1;
+
+    return arena_get(dst_pool) != NULL && (dst_idx < dst_pool->arenas->conns_size || arena_grow(dst_pool->arenas, dst_pool->max_connections));
+}
+
+/* ********************************************************************** */
+/** \brief Moves connection's arena along with it
+ * \internal
+ *
+ * Used by ap_net_conn_pool_move_conn() and ap_net_conn_pool_set_max_connections().
+ * The destination slot is free and prepared by ap_net_arena_move_prepare()
+ */
+void ap_net_arena_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    ap_arena_t tmp;
+
+
+    if ( src_pool->arenas == NULL || src_idx >= src_pool->arenas->conns_size )
+        return;
+
+    tmp = dst_pool->arenas->conns[dst_idx];
+    dst_pool->arenas->conns[dst_idx] = src_pool->arenas->conns[src_idx];
+    src_pool->arenas->conns[src_idx] = tmp;
+}
+
+/* ********************************************************************** */
+/** \brief Frees arenas of pool
+ * \internal
+ *
+ * Called by ap_net_conn_pool_destroy()
+ */
+void ap_net_arena_free(struct ap_net_conn_pool_t *pool)
+{
+    int i;
+
+
+    if ( pool->arenas == NULL )
+        return;
+
+    for ( i = 0; i < pool->arenas->conns_size; ++i )
+        ap_arena_destroy(&pool->arenas->conns[i]);
+
+    ap_arena_destroy(&pool->arenas->cycle);
+    free(pool->arenas->conns);
+    free(pool->arenas);
+
+    pool->arenas = NULL;
+}
@@ -0,0 +1,524 @@
+/** \file ap_net/conn_pool_bridge.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Bridging two connections
+ *
+ * The data of bridged connections goes from socket to socket with splice() through a kernel pipe per direction,
+ * without coming to user's memory. ap_net_conn_pool_poll() of each connection's pool moves it on EPOLLIN and EPOLLOUT.
+ * The end of one direction is passed on by shutdown(SHUT_WR), and the connections are closed when both are done.
+ */
+#define _GNU_SOURCE
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_bridge()";
+
+/* pipe size if F_GETPIPE_SZ is not there */
+#define bridge_default_pipe_size 65536
+
+/** \brief One direction of bridge: from end i to end 1 - i
+*/
+typedef struct bridge_dir_t
+{
+    int pipe_rd; /* kernel pipe holding the data received, not sent yet */
+    int pipe_wr;
+    int pipe_size;
+    int piped; /* bytes in pipe */
+    int eof; /* sender has shut down its output */
+    int shut; /* eof is passed on to receiver */
+    uint64_t bytes; /* received from sender */
+} bridge_dir_t;
+
+/** \brief Bridge of two connections
+*/
+typedef struct ap_net_bridge_t
+{
+    struct ap_net_conn_pool_t *pool[2]; /* NULL if the end is closed */
+    int conn_idx[2];
+    unsigned events[2]; /* epoll events registered for end */
+    bridge_dir_t dir[2]; /* dir[i] - from end i to end 1 - i */
+} ap_net_bridge_t;
+
+/* ********************************************************************** */
+/* bridge of connection or NULL */
+static struct ap_net_bridge_t *bridge_of(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->bridges == NULL || conn_idx < 0 || conn_idx >= pool->bridges->conns_size )
+        return NULL;
+
+    return pool->bridges->conns[conn_idx];
+}
+
+/* ********************************************************************** */
+/* makes room for connection slot's bridge. false if out of memory */
+static int bridge_grow(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_bridges_t *br;
+    void *new_mem;
+    int new_size;
+
+
+    if ( pool->bridges == NULL && NULL == (pool->bridges = calloc(1, sizeof(struct ap_net_bridges_t))) )
+        return 0;
+
+    br = pool->bridges;
+
+    if ( conn_idx >= br->conns_size )
+    {
+        new_size = pool->max_connections > conn_idx ? pool->max_connections : conn_idx + 1;
+
+        if ( NULL == (new_mem = realloc(br->conns, new_size * sizeof(struct ap_net_bridge_t *))) )
+            return 0;
+
+        br->conns = new_mem;
+        memset(br->conns + br->conns_size, 0, (new_size - br->conns_size) * sizeof(struct ap_net_bridge_t *));
+        br->conns_size = new_size;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* sets connection slot's bridge. false if out of memory, can not fail on the slot made by bridge_grow() */
+static int bridge_set(struct ap_net_conn_pool_t *pool, int conn_idx, struct ap_net_bridge_t *b)
+{
+    struct ap_net_bridges_t *br;
+
+
+    if ( ! bridge_grow(pool, conn_idx) )
+        return 0;
+
+    br = pool->bridges;
+
+    if ( br->conns[conn_idx] == NULL && b != NULL )
+        ++br->active;
+    else if ( br->conns[conn_idx] != NULL && b == NULL )
+        --br->active;
+
+    br->conns[conn_idx] = b;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+static void bridge_free(struct ap_net_bridge_t *b)
+{
+    int i;
+
+
+    for ( i = 0; i < 2; ++i )
+    {
+        if ( b->dir[i].pipe_rd != -1 )
+            close(b->dir[i].pipe_rd);
+
+        if ( b->dir[i].pipe_wr != -1 )
+            close(b->dir[i].pipe_wr);
+    }
+
+    free(b);
+}
+
+/* ********************************************************************** */
+/* which end of bridge the connection is */
+static int bridge_end(struct ap_net_bridge_t *b, struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    return b->pool[0] == pool && b->conn_idx[0] == conn_idx ? 0 : 1;
+}
+
+/* ********************************************************************** */
+/* receives from end i into its pipe. returns false on connection error */
+static int bridge_pull(struct ap_net_bridge_t *b, int i)
+{
+    struct ap_net_conn_pool_t *pool;
+    struct ap_net_connection_t *conn;
+    bridge_dir_t *d;
+    ssize_t n;
+
+
+    d = &b->dir[i];
+
+    if ( d->eof || d->piped >= d->pipe_size )
+        return 1;
+
+    pool = b->pool[i];
+    conn = &pool->conns[b->conn_idx[i]];
+
+    conn->state |= AP_NET_ST_IN;
+
+    n = ap_net_io->splice(conn->fd, NULL, d->pipe_wr, NULL, d->pipe_size - d->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    bit_clear(conn->state, AP_NET_ST_IN);
+
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_RECV : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_stat_add(pool, recv_calls, 1);
+
+    if ( n > 0 )
+    {
+        ap_net_conn_pool_stat_add(pool, bytes_in, n);
+        ap_net_conn_pool_stat_add(pool, msgs_in, 1);
+
+        d->piped += n;
+        d->bytes += n;
+    }
+    else if ( n == 0 )
+        d->eof = 1;
+    else if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        ap_net_conn_pool_stat_add(pool, eagain_in, 1);
+    else
+    {
+        ap_net_conn_pool_stat_add(pool, errors, 1);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* sends the pipe of direction i to end 1 - i. returns false on connection error */
+static int bridge_push(struct ap_net_bridge_t *b, int i)
+{
+    struct ap_net_conn_pool_t *pool;
+    struct ap_net_connection_t *conn;
+    bridge_dir_t *d;
+    ssize_t n;
+
+
+    d = &b->dir[i];
+    pool = b->pool[1 - i];
+
+    if ( d->piped == 0 || ap_net_conn_pool_cork_pending(pool, b->conn_idx[1 - i]) > 0 ) /* held output goes first */
+        return 1;
+
+    conn = &pool->conns[b->conn_idx[1 - i]];
+
+    conn->state |= AP_NET_ST_OUT;
+
+    n = ap_net_io->splice(d->pipe_rd, NULL, conn->fd, NULL, d->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    bit_clear(conn->state, AP_NET_ST_OUT);
+
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_SEND : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_count_send(pool, n, d->piped);
+
+    if ( n > 0 )
+        d->piped -= n;
+    else if ( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+        return 0;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* passes on the ends of directions and sets the events to wait for. returns false if bridge is done and closed */
+static int bridge_update(struct ap_net_bridge_t *b)
+{
+    struct ap_net_connection_t *conn;
+    unsigned events;
+    int i;
+
+
+    for ( i = 0; i < 2; ++i )
+    {
+        if ( b->dir[i].eof && b->dir[i].piped == 0 && ! b->dir[i].shut )
+        {
+            conn = &b->pool[1 - i]->conns[b->conn_idx[1 - i]];
+            ap_net_io->shutdown(conn->fd, SHUT_WR);
+            b->dir[i].shut = 1;
+        }
+    }
+
+    if ( b->dir[0].shut && b->dir[1].shut ) /* closing of one end closes the other */
+    {
+        ap_net_conn_pool_close_connection(b->pool[0], b->conn_idx[0]);
+        return 0;
+    }
+
+    for ( i = 0; i < 2; ++i )
+    {
+        events = (! b->dir[i].eof && b->dir[i].piped < b->dir[i].pipe_size ? EPOLLIN : 0)
+                 | (b->dir[1 - i].piped > 0 ? EPOLLOUT : 0);
+
+        if ( events != b->events[i] && ap_net_conn_pool_poller_set_events(b->pool[i], b->conn_idx[i], events) )
+            b->events[i] = events;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Bridges two connections, so the data received from one is sent to the other by kernel
+ *
+ * \param pool_a struct ap_net_conn_pool_t* - TCP pool
+ * \param conn_idx_a int
+ * \param pool_b struct ap_net_conn_pool_t* - TCP pool. The same or other one
+ * \param conn_idx_b int
+ * \return int - true/false
+ *
+ * Each direction goes through a kernel pipe by splice(), so the data does not come to user's memory.
+ * The sockets are served by ap_net_conn_pool_poll() of their pools: the data is moved on EPOLLIN and EPOLLOUT,
+ * so AP_NET_SIGNAL_CONN_DATA_IN and AP_NET_SIGNAL_CONN_CAN_SEND are not emitted for bridged connections.
+ * Unprocessed data in receive buffers (bufpos to buffill) is sent to the other side first, e.g. the data that came after
+ * proxy's handshake. Output held by corking goes before the bridged data too.
+ * When one side shuts down its output, the other one gets shutdown(SHUT_WR) after the data in between.
+ * When both directions are done the connections are closed. Error or close of one connection closes the other.
+ * Use ap_net_conn_pool_bridge_get_stat() to get byte counters, e.g. in AP_NET_SIGNAL_CONN_CLOSING handler.
+ * Do not send to bridged connections by yourself. Expiration works as usual.
+ * The bridged data is not seen by traffic capture.
+ */
+int ap_net_conn_pool_bridge(struct ap_net_conn_pool_t *pool_a, int conn_idx_a, struct ap_net_conn_pool_t *pool_b, int conn_idx_b)
+{
+    struct ap_net_bridge_t *b;
+    struct ap_net_connection_t *conn;
+    int pipe_fds[2];
+    int i, n;
+
+
+    ap_error_clear();
+
+    if ( conn_idx_a < 0 || conn_idx_a >= pool_a->max_connections || ! bit_is_set(pool_a->conns[conn_idx_a].state, AP_NET_ST_CONNECTED)
+         || conn_idx_b < 0 || conn_idx_b >= pool_b->max_connections || ! bit_is_set(pool_b->conns[conn_idx_b].state, AP_NET_ST_CONNECTED)
+         || (pool_a == pool_b && conn_idx_a == conn_idx_b) )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_INVALID_CONN_INDEX, "%d, %d", conn_idx_a, conn_idx_b);
+        return 0;
+    }
+
+    if ( ! bit_is_set(pool_a->flags, AP_NET_POOL_FLAGS_TCP) || ! bit_is_set(pool_b->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        ap_error_set_custom(_func_name, "bridging is for TCP pools only");
+        return 0;
+    }
+
+    if ( bridge_of(pool_a, conn_idx_a) != NULL || bridge_of(pool_b, conn_idx_b) != NULL
+         || ap_net_conn_pool_sendfile_active(pool_a, conn_idx_a) || ap_net_conn_pool_sendfile_active(pool_b, conn_idx_b) )
+    {
+        ap_error_set_custom(_func_name, "connection is bridged or has file transfer in progress");
+        return 0;
+    }
+
+    if ( NULL == (b = calloc(1, sizeof(struct ap_net_bridge_t))) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    b->pool[0] = pool_a;
+    b->conn_idx[0] = conn_idx_a;
+    b->pool[1] = pool_b;
+    b->conn_idx[1] = conn_idx_b;
+
+    for ( i = 0; i < 2; ++i )
+        b->dir[i].pipe_rd = b->dir[i].pipe_wr = -1;
+
+    for ( i = 0; i < 2; ++i )
+    {
+        if ( pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1 )
+        {
+            ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "pipe2()");
+            bridge_free(b);
+            return 0;
+        }
+
+        b->dir[i].pipe_rd = pipe_fds[0];
+        b->dir[i].pipe_wr = pipe_fds[1];
+
+        n = fcntl(pipe_fds[0], F_GETPIPE_SZ);
+        b->dir[i].pipe_size = n > 0 ? n : bridge_default_pipe_size;
+
+        /* the data received already goes first */
+        conn = &b->pool[i]->conns[b->conn_idx[i]];
+        n = conn->buffill - conn->bufpos;
+
+        if ( n > 0 )
+        {
+            if ( n > b->dir[i].pipe_size || n != write(pipe_fds[1], conn->buf + conn->bufpos, n) )
+            {
+                ap_error_set_custom(_func_name, "too much data is left in receive buffer");
+                bridge_free(b);
+                return 0;
+            }
+
+            b->dir[i].piped = n;
+            conn->bufpos = conn->buffill = 0;
+        }
+    }
+
+    if ( ! bridge_set(pool_a, conn_idx_a, b) || ! bridge_set(pool_b, conn_idx_b, b) )
+    {
+        bridge_set(pool_a, conn_idx_a, NULL);
+        bridge_free(b);
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    b->events[0] = b->events[1] = EPOLLIN; /* as registered by poller */
+
+    bridge_update(b);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Moves the data of bridged connection on poll event
+ * \internal
+ *
+ * \return int - false if connection is not bridged and the event is for ap_net_conn_pool_poll() to handle
+ */
+int ap_net_bridge_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, unsigned events)
+{
+    struct ap_net_bridge_t *b;
+    int i;
+
+
+    if ( NULL == (b = bridge_of(pool, conn->idx)) )
+        return 0;
+
+    i = bridge_end(b, pool, conn->idx);
+
+    if ( bit_is_set(events, EPOLLERR) )
+    {
+        conn->state |= AP_NET_ST_ERROR;
+        ap_net_conn_pool_stat_add(pool, errors, 1);
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+
+        return 1;
+    }
+
+    /* hangup comes when both ways are shut, maybe with the last data still there */
+    if ( bit_is_set(events, EPOLLIN | EPOLLHUP) && (! bridge_pull(b, i) || ! bridge_push(b, i)) )
+    {
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+        return 1;
+    }
+
+    if ( bit_is_set(events, EPOLLOUT) && ! bridge_push(b, 1 - i) )
+    {
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+        return 1;
+    }
+
+    bridge_update(b);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Detaches closing connection from its bridge and closes the other end
+ * \internal
+ *
+ * Called by ap_net_conn_pool_close_connection() after AP_NET_SIGNAL_CONN_CLOSING
+ */
+void ap_net_bridge_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_bridge_t *b;
+    int i;
+
+
+    if ( NULL == (b = bridge_of(pool, conn_idx)) )
+        return;
+
+    i = bridge_end(b, pool, conn_idx);
+
+    bridge_set(pool, conn_idx, NULL);
+    b->pool[i] = NULL;
+
+    if ( b->pool[1 - i] == NULL )
+    {
+        bridge_free(b);
+        return;
+    }
+
+    /* its release frees the bridge. b is not to be touched after that */
+    ap_net_conn_pool_close_connection(b->pool[1 - i], b->conn_idx[1 - i]);
+}
+
+/* ********************************************************************** */
+/** \brief Makes room in destination for the bridge of connection to be moved
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved
+ */
+int ap_net_bridge_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( bridge_of(src_pool, src_idx) == NULL )
+        return 1;
+
+    return bridge_grow(dst_pool, dst_idx);
+}
+
+/* ********************************************************************** */
+/** \brief Makes bridge follow its connection moved to other slot or pool
+ * \internal
+ *
+ * Called after the connection is copied and added to destination's poller.
+ * The destination slot is prepared by ap_net_bridge_move_prepare()
+ */
+void ap_net_bridge_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    struct ap_net_bridge_t *b;
+    int i;
+
+
+    if ( NULL == (b = bridge_of(src_pool, src_idx)) )
+        return;
+
+    i = bridge_end(b, src_pool, src_idx);
+
+    bridge_set(src_pool, src_idx, NULL);
+    bridge_set(dst_pool, dst_idx, b);
+
+    b->pool[i] = dst_pool;
+    b->conn_idx[i] = dst_idx;
+
+    if ( src_pool != dst_pool )
+        b->events[i] = EPOLLIN; /* as registered by poller */
+
+    bridge_update(b);
+}
+
+/* ********************************************************************** */
+/** \brief Returns bridge counters of connection
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \param dst struct ap_net_bridge_stat_t* - destination
+ * \return int - true/false. False if connection is not bridged
+ */
+int ap_net_conn_pool_bridge_get_stat(struct ap_net_conn_pool_t *pool, int conn_idx, struct ap_net_bridge_stat_t *dst)
+{
+    struct ap_net_bridge_t *b;
+    int i;
+
+
+    if ( NULL == (b = bridge_of(pool, conn_idx)) )
+        return 0;
+
+    i = bridge_end(b, pool, conn_idx);
+
+    dst->bytes_in = b->dir[i].bytes;
+    dst->bytes_out = b->dir[1 - i].bytes - b->dir[1 - i].piped;
+    dst->piped_in = b->dir[i].piped;
+    dst->piped_out = b->dir[1 - i].piped;
+    dst->eof_in = b->dir[i].eof;
+    dst->eof_out = b->dir[1 - i].shut;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Frees pool's bridges table. Connections should be closed by now
+ * \internal
+ */
+void ap_net_bridge_free(struct ap_net_conn_pool_t *pool)
+{
+    if ( pool->bridges == NULL )
+        return;
+
+    free(pool->bridges->conns);
+    free(pool->bridges);
+
+    pool->bridges = NULL;
+}
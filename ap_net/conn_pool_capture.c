@@ -0,0 +1,435 @@
+/** \file ap_net/conn_pool_capture.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Traffic capture into pcapng file
+ *
+ * The payloads received and sent by pool are written as raw IP packets with synthetic TCP or UDP headers,
+ * so Wireshark, tcpdump and tools/ap_replay can read them. TCP connections get synthetic handshake,
+ * sequence numbers and FIN, so the streams can be followed. Checksums are not calculated.
+ */
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_capture_start()";
+
+/* default output buffer size */
+#define capture_default_buf (1024 * 1024)
+/* payload split size: IP total length is 16 bits */
+#define capture_max_payload 65000
+
+/* pcapng block types and constants */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_RAW 101
+#define PCAPNG_OPT_TSRESOL 9
+
+/* synthetic TCP flags */
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+/** \brief Synthetic TCP state of the connection */
+typedef struct ap_net_capture_flow_t
+{
+    int started; /* handshake is written */
+    uint32_t seq_local; /* next sequence number of the data sent by pool */
+    uint32_t seq_remote; /* next sequence number of the data received */
+} ap_net_capture_flow_t;
+
+/* ********************************************************************** */
+static void put16(unsigned char *p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* ********************************************************************** */
+/* appends bytes to the output buffer, writing it out if there is no room */
+static int capture_put(struct ap_net_capture_t *cap, const void *data, int len)
+{
+    if ( cap->buf_fill + len > cap->buf_size )
+    {
+        if ( cap->buf_fill > 0 && len <= cap->buf_size )
+        {
+            if ( cap->buf_fill != write(cap->fd, cap->buf, cap->buf_fill) )
+                return 0;
+
+            cap->buf_fill = 0;
+        }
+
+        if ( len > cap->buf_size ) /* too big to be buffered */
+            return len == write(cap->fd, data, len);
+    }
+
+    memcpy(cap->buf + cap->buf_fill, data, len);
+    cap->buf_fill += len;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* IPv4 header checksum */
+static unsigned ip4_checksum(unsigned char *h)
+{
+    uint32_t sum;
+    int i;
+
+
+    sum = 0;
+
+    for ( i = 0; i < 20; i += 2 )
+        sum += (h[i] << 8) | h[i + 1];
+
+    while ( sum >> 16 )
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum & 0xffff;
+}
+
+/* ********************************************************************** */
+/* writes one enhanced packet block: IP + TCP/UDP headers + payload. src/dst are sockaddr_in or sockaddr_in6 */
+static int capture_packet(struct ap_net_capture_t *cap, int is_tcp, struct sockaddr *src, struct sockaddr *dst,
+                          unsigned tcp_flags, uint32_t seq, uint32_t ack, const void *data, int len)
+{
+    unsigned char hdr[28 + 40 + 20]; /* EPB header, IP header, TCP header */
+    unsigned char *ip;
+    unsigned char *l4;
+    struct timespec ts;
+    uint64_t ns;
+    int ip_len;
+    int l4_len;
+    int caplen;
+    int pad;
+    uint32_t block_len;
+    static const uint32_t zero = 0;
+
+
+    ip = hdr + 28;
+    ip_len = src->sa_family == AF_INET6 ? 40 : 20;
+    l4 = ip + ip_len;
+    l4_len = is_tcp ? 20 : 8;
+
+    caplen = ( cap->snaplen > 0 && len > cap->snaplen ) ? cap->snaplen : len;
+    pad = (4 - (ip_len + l4_len + caplen) % 4) % 4;
+    block_len = 28 + ip_len + l4_len + caplen + pad + 4;
+
+    ap_utils_clock_gettime(CLOCK_REALTIME, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    /* EPB: in host byte order, as the section header says */
+    ((uint32_t *)hdr)[0] = PCAPNG_EPB;
+    ((uint32_t *)hdr)[1] = block_len;
+    ((uint32_t *)hdr)[2] = 0; /* interface */
+    ((uint32_t *)hdr)[3] = ns >> 32;
+    ((uint32_t *)hdr)[4] = ns;
+    ((uint32_t *)hdr)[5] = ip_len + l4_len + caplen;
+    ((uint32_t *)hdr)[6] = ip_len + l4_len + len;
+
+    memset(ip, 0, ip_len + l4_len);
+
+    if ( src->sa_family == AF_INET6 )
+    {
+        put32(ip, 0x60000000);
+        put16(ip + 4, l4_len + len);
+        ip[6] = is_tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        ip[7] = 64;
+        memcpy(ip + 8, &((struct sockaddr_in6 *)src)->sin6_addr, 16);
+        memcpy(ip + 24, &((struct sockaddr_in6 *)dst)->sin6_addr, 16);
+        memcpy(l4, &((struct sockaddr_in6 *)src)->sin6_port, 2);
+        memcpy(l4 + 2, &((struct sockaddr_in6 *)dst)->sin6_port, 2);
+    }
+    else
+    {
+        ip[0] = 0x45;
+        put16(ip + 2, ip_len + l4_len + len);
+        put16(ip + 4, cap->ip_id++);
+        put16(ip + 6, 0x4000); /* don't fragment */
+        ip[8] = 64;
+        ip[9] = is_tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        memcpy(ip + 12, &((struct sockaddr_in *)src)->sin_addr, 4);
+        memcpy(ip + 16, &((struct sockaddr_in *)dst)->sin_addr, 4);
+        put16(ip + 10, ip4_checksum(ip));
+        memcpy(l4, &((struct sockaddr_in *)src)->sin_port, 2);
+        memcpy(l4 + 2, &((struct sockaddr_in *)dst)->sin_port, 2);
+    }
+
+    if ( is_tcp )
+    {
+        put32(l4 + 4, seq);
+        put32(l4 + 8, ack);
+        l4[12] = 5 << 4; /* header length in words */
+        l4[13] = tcp_flags;
+        put16(l4 + 14, 65535); /* window */
+    }
+    else
+        put16(l4 + 4, 8 + len);
+
+    if ( ! capture_put(cap, hdr, 28 + ip_len + l4_len) || (caplen > 0 && ! capture_put(cap, data, caplen))
+         || ! capture_put(cap, &zero, pad) || ! capture_put(cap, &block_len, 4) )
+    {
+        ++cap->dropped;
+        return 0;
+    }
+
+    ++cap->packets;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Starts capturing pool's traffic into pcapng file
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param file_name const char* - output file. Truncated if exists
+ * \param snaplen int - payload bytes to save per packet. 0 - all
+ * \param buf_size int - output buffer size. 0 - default of 1 MB
+ * \return int - true/false
+ *
+ * The data received by ap_net_conn_pool_recv() and sent by ap_net_conn_pool_send*() is appended to the memory buffer.
+ * It is written to file at the end of ap_net_conn_pool_poll() when half full, so the file i/o is not done in the middle
+ * of connection processing, unless the buffer overflows within one poll cycle.
+ * Timestamps are CLOCK_REALTIME in nanoseconds. The pool's side of incoming connections is shown with the listener address.
+ * Use tools/ap_replay to drive the captured sessions against a server.
+ */
+int ap_net_conn_pool_capture_start(struct ap_net_conn_pool_t *pool, const char *file_name, int snaplen, int buf_size)
+{
+    struct ap_net_capture_t *cap;
+    /* section header: type, length, byte order magic, version, unknown section length, length */
+    uint32_t shb[7] = { PCAPNG_SHB, 28, PCAPNG_BYTE_ORDER_MAGIC, 0, 0xffffffff, 0xffffffff, 28 };
+    /* interface: type, length, link type, snaplen, if_tsresol option, its value, end of options, length */
+    uint32_t idb[8] = { PCAPNG_IDB, 32, 0, 0, 0, 0, 0, 32 };
+    uint16_t pair[2];
+
+
+    ap_error_clear();
+
+    if ( pool->capture != NULL )
+    {
+        ap_error_set_custom(_func_name, "capture is already active");
+        return 0;
+    }
+
+    cap = calloc(1, sizeof(struct ap_net_capture_t));
+
+    if ( cap == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    cap->buf_size = buf_size > 0 ? buf_size : capture_default_buf;
+    cap->buf = malloc(cap->buf_size);
+    cap->snaplen = snaplen;
+    cap->flows_size = pool->max_connections;
+    cap->flows = calloc(cap->flows_size > 0 ? cap->flows_size : 1, sizeof(struct ap_net_capture_flow_t));
+
+    if ( cap->buf == NULL || cap->flows == NULL )
+    {
+        free(cap->buf);
+        free(cap->flows);
+        free(cap);
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    /* the 16 bit fields: major version 1, minor 0; link type and reserved; option code and length */
+    pair[0] = 1;
+    pair[1] = 0;
+    memcpy(&shb[3], pair, sizeof(pair));
+    pair[0] = PCAPNG_LINKTYPE_RAW;
+    memcpy(&idb[2], pair, sizeof(pair));
+    pair[0] = PCAPNG_OPT_TSRESOL;
+    pair[1] = 1;
+    memcpy(&idb[4], pair, sizeof(pair));
+    ((unsigned char *)&idb[5])[0] = 9; /* nanoseconds: 10^-9 */
+
+    cap->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if ( cap->fd == -1 || ! capture_put(cap, shb, sizeof(shb)) || ! capture_put(cap, idb, sizeof(idb)) )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "%s", file_name);
+
+        if ( cap->fd != -1 )
+            close(cap->fd);
+
+        free(cap->buf);
+        free(cap->flows);
+        free(cap);
+        return 0;
+    }
+
+    pool->capture = cap;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Writes the capture buffer to file
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return int - true/false
+ */
+int ap_net_conn_pool_capture_flush(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_capture_t *cap;
+
+
+    cap = pool->capture;
+
+    if ( cap == NULL || cap->buf_fill == 0 )
+        return 1;
+
+    if ( cap->buf_fill != write(cap->fd, cap->buf, cap->buf_fill) )
+    {
+        ap_error_set_detailed("ap_net_conn_pool_capture_flush()", AP_ERRNO_SYSTEM, "write()");
+        cap->buf_fill = 0;
+        return 0;
+    }
+
+    cap->buf_fill = 0;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Writes out the rest and stops capture
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ */
+void ap_net_conn_pool_capture_stop(struct ap_net_conn_pool_t *pool)
+{
+    if ( pool->capture == NULL )
+        return;
+
+    ap_net_conn_pool_capture_flush(pool);
+
+    close(pool->capture->fd);
+    free(pool->capture->buf);
+    free(pool->capture->flows);
+    free(pool->capture);
+
+    pool->capture = NULL;
+}
+
+/* ********************************************************************** */
+/** \brief Adds connection's payload to the capture. Use ap_net_conn_pool_capture() macro internally
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn struct ap_net_connection_t*
+ * \param is_out int - true if data was sent by pool, false if received
+ * \param data const void* - payload. NULL means that pool closes the connection: TCP FIN is written
+ * \param len int - payload length
+ * \return void
+ */
+void ap_net_capture_add(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int is_out, const void *data, int len)
+{
+    struct ap_net_capture_t *cap;
+    struct ap_net_capture_flow_t *flow;
+    struct sockaddr_storage local;
+    struct sockaddr *l;
+    struct sockaddr *r;
+    void *new_mem;
+    int is_tcp;
+    int incoming;
+    int chunk;
+
+
+    cap = pool->capture;
+    is_tcp = bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP);
+
+    if ( data != NULL && len <= 0 )
+        return;
+
+    /* the pool's side of incoming connection is the listener, as the peer sees it */
+    incoming = bit_is_set(conn->flags, AP_NET_CONN_FLAGS_UDP_IN)
+               || ( pool->listener.sock != -1 && is_tcp && (conn->local.af == 0 || conn->local.addr4.sin_port == 0
+                                                             || conn->local.addr4.sin_port == pool->listener.addr4.sin_port) );
+
+    memset(&local, 0, sizeof(local));
+
+    if ( incoming )
+        memcpy(&local, &pool->listener.addr6, sizeof(pool->listener.addr6));
+    else
+        memcpy(&local, &conn->local.addr6, sizeof(conn->local.addr6));
+
+    local.ss_family = conn->remote.af;
+    l = (struct sockaddr *)&local;
+    r = (struct sockaddr *)&conn->remote;
+
+    if ( ! is_tcp )
+    {
+        if ( data != NULL )
+            for ( ; len > 0; len -= chunk, data = (char *)data + chunk )
+            {
+                chunk = len > capture_max_payload ? capture_max_payload : len;
+                capture_packet(cap, 0, is_out ? l : r, is_out ? r : l, 0, 0, 0, data, chunk);
+            }
+
+        return;
+    }
+
+    if ( conn->idx >= cap->flows_size ) /* pool has grown */
+    {
+        new_mem = realloc(cap->flows, pool->max_connections * sizeof(struct ap_net_capture_flow_t));
+
+        if ( new_mem == NULL )
+        {
+            ++cap->dropped;
+            return;
+        }
+
+        cap->flows = new_mem;
+        memset(cap->flows + cap->flows_size, 0, (pool->max_connections - cap->flows_size) * sizeof(struct ap_net_capture_flow_t));
+        cap->flows_size = pool->max_connections;
+    }
+
+    flow = &cap->flows[conn->idx];
+
+    if ( ! flow->started )
+    {
+        if ( data == NULL ) /* closed before any data */
+            return;
+
+        /* the side that connects sends SYN with ISN 0 */
+        capture_packet(cap, 1, incoming ? r : l, incoming ? l : r, TCP_SYN, 0, 0, NULL, 0);
+        capture_packet(cap, 1, incoming ? l : r, incoming ? r : l, TCP_SYN | TCP_ACK, 0, 1, NULL, 0);
+        capture_packet(cap, 1, incoming ? r : l, incoming ? l : r, TCP_ACK, 1, 1, NULL, 0);
+
+        flow->started = 1;
+        flow->seq_local = flow->seq_remote = 1;
+    }
+
+    if ( data == NULL )
+    {
+        capture_packet(cap, 1, l, r, TCP_FIN | TCP_ACK, flow->seq_local, flow->seq_remote, NULL, 0);
+        flow->started = 0;
+        return;
+    }
+
+    for ( ; len > 0; len -= chunk, data = (char *)data + chunk )
+    {
+        chunk = len > capture_max_payload ? capture_max_payload : len;
+
+        if ( is_out )
+        {
+            capture_packet(cap, 1, l, r, TCP_PSH | TCP_ACK, flow->seq_local, flow->seq_remote, data, chunk);
+            flow->seq_local += chunk;
+        }
+        else
+        {
+            capture_packet(cap, 1, r, l, TCP_PSH | TCP_ACK, flow->seq_remote, flow->seq_local, data, chunk);
+            flow->seq_remote += chunk;
+        }
+    }
+}
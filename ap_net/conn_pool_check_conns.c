@@ -30,7 +30,7 @@ int ap_net_conn_pool_check_conns(struct ap_net_conn_pool_t *pool)
 
     poller = pool->poller;
 
-    events_count = epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
+    events_count = ap_net_io->epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
 
     if (events_count == -1)
     {
@@ -56,7 +56,7 @@ int ap_net_conn_pool_check_conns(struct ap_net_conn_pool_t *pool)
             ev.events = EPOLLIN;
             ev.data.fd = poller->events[event_idx].data.fd;
 
-            if ( -1 == epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev) )
+            if ( -1 == ap_net_io->epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev) )
             {
                 ap_error_set(_func_name, AP_ERRNO_SYSTEM);
                 return 0;
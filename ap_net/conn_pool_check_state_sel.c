@@ -33,11 +33,11 @@ int ap_net_conn_pool_check_state_sel(struct ap_net_conn_pool_t *pool, int conn_i
     if( fd <= 0 )
         return -1;
 
-    n = send(fd, &n, 0, 0);
+    n = ap_net_io->send(fd, &n, 0, 0);
 
     if ( n == -1 && errno == EPIPE )
     {
-        if (ap_log_debug_level > 10)
+        if ( ap_log_debug_on(11) )
             ap_log_debug_log("- ap_net_check_state(%d): send(%d): %d/%m\n", conn_idx, fd, n);
 
         return 4;
@@ -62,7 +62,7 @@ int ap_net_conn_pool_check_state_sel(struct ap_net_conn_pool_t *pool, int conn_i
 
     n = select(n, &fdr, &fdw, &fde, &tv);
 
-    if ( ap_log_debug_level > 10 )
+    if ( ap_log_debug_on(11) )
         ap_log_debug_log("- ap_net_check_state(%d): select() error: %m\n", conn_idx);
 
     if ( n <= 0 ) return n;
@@ -77,7 +77,7 @@ int ap_net_conn_pool_check_state_sel(struct ap_net_conn_pool_t *pool, int conn_i
     if ( FD_ISSET(fd, &fde) )
         n |= 4;
 
-    if ( ap_log_debug_level > 10 )
+    if ( ap_log_debug_on(11) )
         ap_log_debug_log("- ap_net_check_state(%d): return %d\n", conn_idx, n);
 
     return n;
@@ -14,12 +14,15 @@ static const char *_func_name = "ap_net_conn_pool_close_connection()";
  * \return void
  *
  * Emits AP_NET_SIGNAL_CONN_CLOSING signal to pool's callback function.
- * Closes socket, marking connection available, updates statistics on pool
+ * Closes socket, marking connection available, updates statistics on pool.
+ * The socket with zero-copy sends not reported yet is shut down and closed later. See ap_net_conn_pool_zerocopy_enable()
  */
 void ap_net_conn_pool_close_connection(struct ap_net_conn_pool_t *pool, int conn_idx)
 {
     struct timespec ts;
+    uint64_t total_ns;
     int used_as_debug_handle;
+    int fd_taken;
     struct ap_net_connection_t *conn;
 
 
@@ -30,8 +33,19 @@ void ap_net_conn_pool_close_connection(struct ap_net_conn_pool_t *pool, int conn
     if ( ! (conn->state & AP_NET_ST_CONNECTED) )
         return;
 
-    if (pool->callback_func != NULL)
-        pool->callback_func(conn, AP_NET_SIGNAL_CONN_CLOSING);
+    ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_CLOSING);
+
+    ap_net_cork_release_conn(pool, conn_idx); /* the last words may be held */
+    ap_net_sendfile_release_conn(pool, conn_idx);
+    ap_net_recv_into_release_conn(pool, conn_idx);
+    ap_net_framer_release_conn(pool, conn_idx);
+    ap_net_bridge_release_conn(pool, conn_idx); /* closes the other end too */
+    fd_taken = ap_net_zerocopy_release_conn(pool, conn_idx); /* the socket is kept if kernel has not reported some sends yet */
+    ap_net_arena_release_conn(pool, conn_idx); /* the last, as the memory above may come from there */
+
+    ap_net_conn_pool_record(pool, AP_NET_REC_CLOSE, conn, conn->state);
+
+    ap_net_conn_pool_capture(pool, conn, 1, NULL, 0);
 
     used_as_debug_handle = ap_log_is_debug_handle(conn->fd);
 
@@ -42,7 +56,8 @@ void ap_net_conn_pool_close_connection(struct ap_net_conn_pool_t *pool, int conn
 
     conn->state = 0;
 
-    close(conn->fd);
+    if ( ! fd_taken )
+        ap_net_io->close(conn->fd);
 
     conn->fd = -1;
 
@@ -51,10 +66,14 @@ void ap_net_conn_pool_close_connection(struct ap_net_conn_pool_t *pool, int conn
     if ( ! used_as_debug_handle && conn->parent != NULL ) /*  debug connections will not count for execution time */
     {
         ap_utils_timespec_elapsed(&conn->created_time, NULL, &ts);
-        ap_utils_timespec_add(&conn->parent->stat.total_time, &ts, &conn->parent->stat.total_time);
+        total_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        total_ns += ap_net_conn_pool_stat_add(conn->parent, total_time_ns, total_ns);
+
+        conn->parent->stat.total_time.tv_sec = total_ns / 1000000000ull; /* for the code reading it the old way */
+        conn->parent->stat.total_time.tv_nsec = total_ns % 1000000000ull;
     }
 
-    if ( ap_log_debug_level > 0 )
+    if ( ap_log_debug_on(1) )
         ap_log_debug_log("* %s: #%d closed\n", _func_name, conn_idx);
 }
 
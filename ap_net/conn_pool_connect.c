@@ -18,7 +18,7 @@ static struct ap_net_connection_t *ap_net_conn_pool_do_connect(struct ap_net_con
 
     conn = &pool->conns[conn_idx];
 
-    conn->fd = socket( conn->remote.af, bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) ? SOCK_STREAM : SOCK_DGRAM, 0 );
+    conn->fd = ap_net_io->socket( conn->remote.af, bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) ? SOCK_STREAM : SOCK_DGRAM, 0 );
 
     if ( -1 == conn->fd )
     {
@@ -33,7 +33,7 @@ static struct ap_net_connection_t *ap_net_conn_pool_do_connect(struct ap_net_con
         memset(&conn->local, 0, sizeof(conn->local));
         conn->local.af = conn->remote.af;
 
-        if ( -1 == bind(conn->fd, (struct sockaddr *)&conn->local, sizeof(conn->local)))
+        if ( -1 == ap_net_io->bind(conn->fd, (struct sockaddr *)&conn->local, sizeof(conn->local)))
         {
             ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "bind()");
             ap_net_connection_unlock(conn);
@@ -42,7 +42,7 @@ static struct ap_net_connection_t *ap_net_conn_pool_do_connect(struct ap_net_con
         }
     }
 
-    if ( 0 != connect(conn->fd, (struct sockaddr *)&conn->remote, sizeof(conn->remote)) )
+    if ( 0 != ap_net_io->connect(conn->fd, (struct sockaddr *)&conn->remote, sizeof(conn->remote)) )
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "connect()");
 
@@ -51,26 +51,28 @@ static struct ap_net_connection_t *ap_net_conn_pool_do_connect(struct ap_net_con
 
     slen = sizeof(conn->local);
 
-    if ( 0 != getsockname(conn->fd, (struct sockaddr *)&conn->local, &slen)) /* getting our side addr and port */
+    if ( 0 != ap_net_io->getsockname(conn->fd, (struct sockaddr *)&conn->local, &slen)) /* getting our side addr and port */
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "getsockname()");
 
         goto lblerror;
     }
 
-    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    ap_net_io->fcntl(conn->fd, F_SETFL, ap_net_io->fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
 
     conn->state = AP_NET_ST_CONNECTED;
 
+    /* UDP server side does reverse connect() on incoming datagrams. that is an accept in fact */
+    ap_net_conn_pool_record(pool, bit_is_set(conn->flags, AP_NET_CONN_FLAGS_UDP_IN) ? AP_NET_REC_ACCEPT : AP_NET_REC_CONNECT, conn, 0);
+
     if ( conn->parent->poller != NULL && ! ap_net_conn_pool_poller_add_conn(conn->parent, conn->idx) )
         goto lblerror;
 
     if( ! bit_is_set(conn->flags, AP_NET_CONN_FLAGS_UDP_IN) )
     {
-        if ( pool->callback_func != NULL )
-            pool->callback_func(conn, AP_NET_SIGNAL_CONN_CONNECTED);
+        ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_CONNECTED);
 
-        if (ap_log_debug_level)
+        if ( ap_log_debug_on(1) )
             ap_log_debug_log("* Outbound connection #%d initiated\n", conn->idx);
     }
 
@@ -79,7 +81,9 @@ static struct ap_net_connection_t *ap_net_conn_pool_do_connect(struct ap_net_con
     return conn;
 
 lblerror:
-    close(conn->fd);
+    ap_net_conn_pool_record(pool, AP_NET_REC_ERROR, conn, errno);
+    ap_net_conn_pool_stat_add(pool, errors, 1);
+    ap_net_io->close(conn->fd);
     conn->fd = -1;
     ap_net_connection_unlock(conn);
     bit_clear(conn->state, AP_NET_ST_CONNECTED);
@@ -100,7 +104,7 @@ static int sanity_check(struct ap_net_conn_pool_t *pool, int port, int expire_in
 
     if (pool->used_slots == pool->max_connections)
     {
-        pool->stat.queue_full_count++;
+        ap_net_conn_pool_stat_add(pool, queue_full_count, 1);
 
         ap_error_set(_func_name, AP_ERRNO_CONNLIST_FULL);
 
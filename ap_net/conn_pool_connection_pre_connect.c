@@ -47,6 +47,6 @@ void ap_net_conn_pool_connection_pre_connect(struct ap_net_conn_pool_t *pool, in
     conn->state = AP_NET_ST_CONNECTED;
 
     pool->used_slots++;
-    pool->stat.conn_count++;
-    pool->stat.active_conn_count += pool->used_slots;
+    ap_net_conn_pool_stat_add(pool, conn_count, 1);
+    ap_net_conn_pool_stat_add(pool, active_conn_count, pool->used_slots);
 }
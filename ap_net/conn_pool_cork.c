@@ -0,0 +1,439 @@
+/** \file ap_net/conn_pool_cork.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Output corking
+ *
+ * Sends made by callbacks during ap_net_conn_pool_poll() are appended to per-connection memory
+ * and sent with one system call per connection at the end of the cycle, so a response assembled by
+ * several sends goes out in full segments. Held output that outgrows the limit is sent right away with MSG_MORE.
+ */
+#include "conn_pool_internals.h"
+
+static const char *_func_name = "ap_net_conn_pool_cork_enable()";
+
+/* default of max_held */
+#define cork_default_max_held 65536
+
+/** \brief Held output of one connection */
+typedef struct ap_net_cork_conn_t
+{
+    char *buf;
+    int size; /* allocated */
+    int fill; /* held bytes */
+    int pending; /* slot is on cork->pending list */
+} ap_net_cork_conn_t;
+
+/* ********************************************************************** */
+/** \brief Enables output corking for TCP pool
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param max_held int - bytes held per connection before they are sent right away. 0 - default of 64KB
+ * \return int - true/false
+ *
+ * While inside ap_net_conn_pool_poll() the data given to ap_net_conn_pool_send*() is not sent, but appended
+ * to the connection's held output. At the end of the cycle each connection's output is sent with a single call.
+ * The send functions return the full size for the data held. Send errors show up at the end of the cycle
+ * by connection close, as for ap_net_conn_pool_send().
+ * Whatever the socket did not take stays held and goes first at the next cycle's end or the next send outside of cycle,
+ * so the order is always kept. Use ap_net_conn_pool_cork_pending() to see if a connection does not keep up.
+ * Closing connection sends what the socket takes at once and drops the rest.
+ * Moving connection to other slot or pool takes its held output along. The destination pool gets corking enabled if needed.
+ * Sends outside of poll cycle are not held.
+ */
+int ap_net_conn_pool_cork_enable(struct ap_net_conn_pool_t *pool, int max_held)
+{
+    struct ap_net_cork_t *cork;
+
+
+    ap_error_clear();
+
+    if ( ! bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        ap_error_set_custom(_func_name, "corking is for TCP pools only");
+        return 0;
+    }
+
+    if ( pool->cork != NULL )
+    {
+        pool->cork->max_held = max_held > 0 ? max_held : cork_default_max_held;
+        return 1;
+    }
+
+    cork = calloc(1, sizeof(struct ap_net_cork_t));
+
+    if ( cork == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    cork->max_held = max_held > 0 ? max_held : cork_default_max_held;
+    cork->conns_size = pool->max_connections > 0 ? pool->max_connections : 1;
+    cork->conns = calloc(cork->conns_size, sizeof(struct ap_net_cork_conn_t));
+    cork->pending = malloc(cork->conns_size * sizeof(int));
+
+    if ( cork->conns == NULL || cork->pending == NULL )
+    {
+        free(cork->conns);
+        free(cork->pending);
+        free(cork);
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    pool->cork = cork;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Sends out held output and disables corking
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ */
+void ap_net_conn_pool_cork_disable(struct ap_net_conn_pool_t *pool)
+{
+    int i;
+
+
+    if ( pool->cork == NULL )
+        return;
+
+    for ( i = 0; i < pool->cork->conns_size; ++i )
+    {
+        ap_net_cork_release_conn(pool, i);
+        free(pool->cork->conns[i].buf);
+    }
+
+    free(pool->cork->conns);
+    free(pool->cork->pending);
+    free(pool->cork);
+
+    pool->cork = NULL;
+}
+
+/* ********************************************************************** */
+/* makes cork arrays follow the pool's size */
+static int cork_grow(struct ap_net_cork_t *cork, int new_size)
+{
+    void *new_mem;
+
+
+    new_mem = realloc(cork->conns, new_size * sizeof(struct ap_net_cork_conn_t));
+
+    if ( new_mem == NULL )
+        return 0;
+
+    cork->conns = new_mem;
+    memset(cork->conns + cork->conns_size, 0, (new_size - cork->conns_size) * sizeof(struct ap_net_cork_conn_t));
+
+    new_mem = realloc(cork->pending, new_size * sizeof(int));
+
+    if ( new_mem == NULL )
+        return 0;
+
+    cork->pending = new_mem;
+    cork->conns_size = new_size;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* appends data to held output */
+static int cork_append(struct ap_net_cork_t *cork, struct ap_net_connection_t *conn, const void *data, int len)
+{
+    struct ap_net_cork_conn_t *cc;
+    void *new_mem;
+    int new_size;
+
+
+    cc = &cork->conns[conn->idx];
+
+    if ( cc->size - cc->fill < len )
+    {
+        new_size = cc->size * 2 > cc->fill + len ? cc->size * 2 : cc->fill + len;
+
+        if ( NULL == (new_mem = realloc(cc->buf, new_size)) )
+            return 0;
+
+        cc->buf = new_mem;
+        cc->size = new_size;
+    }
+
+    memcpy(cc->buf + cc->fill, data, len);
+    cc->fill += len;
+
+    if ( ! cc->pending )
+    {
+        cc->pending = 1;
+        cork->pending[cork->pending_count++] = conn->idx;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* sends held output followed by data with one call. the part not taken by socket is held.
+ * returns false on connection error: held output is dropped then, and the caller should close connection */
+static int cork_send(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, const void *data, int len, int more)
+{
+    struct ap_net_cork_conn_t *cc;
+    struct iovec iov[2];
+    struct msghdr msg;
+    int n;
+
+
+    cc = &pool->cork->conns[conn->idx];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    if ( cc->fill > 0 )
+    {
+        iov[msg.msg_iovlen].iov_base = cc->buf;
+        iov[msg.msg_iovlen++].iov_len = cc->fill;
+    }
+
+    if ( len > 0 )
+    {
+        iov[msg.msg_iovlen].iov_base = (void *)data;
+        iov[msg.msg_iovlen++].iov_len = len;
+    }
+
+    if ( msg.msg_iovlen == 0 )
+        return 1;
+
+    conn->state |= AP_NET_ST_OUT;
+
+    n = ap_net_io->sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+
+    bit_clear(conn->state, AP_NET_ST_OUT);
+
+    ++pool->cork->flushes;
+
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_SEND : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_count_send(pool, n, cc->fill + len);
+
+    if ( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+        if ( ap_log_debug_on(1) )
+            ap_log_debug_log("? ap_net_conn_pool_cork_flush(): Connection #%d is dead prematurely: %m\n", conn->idx);
+
+        cc->fill = 0;
+
+        return 0;
+    }
+
+    if ( n < 0 )
+        n = 0;
+
+    if ( pool->capture != NULL && n > 0 )
+    {
+        if ( cc->fill > 0 )
+            ap_net_capture_add(pool, conn, 1, cc->buf, n < cc->fill ? n : cc->fill);
+
+        if ( n > cc->fill )
+            ap_net_capture_add(pool, conn, 1, data, n - cc->fill);
+    }
+
+    if ( n < cc->fill )
+    {
+        memmove(cc->buf, cc->buf + n, cc->fill - n);
+        cc->fill -= n;
+        n = 0;
+    }
+    else
+    {
+        n -= cc->fill;
+        cc->fill = 0;
+    }
+
+    if ( n < len && ! cork_append(pool->cork, conn, (const char *)data + n, len - n) )
+    {
+        ap_error_set("ap_net_conn_pool_send()", AP_ERRNO_OOM);
+        return 1;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Takes the data to send on corked pool. Use ap_net_conn_pool_corked() check first
+ * \internal
+ *
+ * \return int - len or -1 if connection is closed on error
+ */
+int ap_net_cork_hold(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, const void *data, int len)
+{
+    struct ap_net_cork_t *cork;
+
+
+    cork = pool->cork;
+
+    if ( conn->idx >= cork->conns_size && ! cork_grow(cork, pool->max_connections) )
+    {
+        ap_error_set("ap_net_conn_pool_send()", AP_ERRNO_OOM);
+        return -1;
+    }
+
+    if ( cork->in_cycle && cork->conns[conn->idx].fill + len <= cork->max_held )
+    {
+        if ( ! cork_append(cork, conn, data, len) )
+        {
+            ap_error_set("ap_net_conn_pool_send()", AP_ERRNO_OOM);
+            return -1;
+        }
+
+        ++cork->held;
+
+        return len;
+    }
+
+    /* too much to hold or outside of poll cycle, with output left from previous one */
+    if ( ! cork_send(pool, conn, data, len, cork->in_cycle) )
+    {
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+        return -1;
+    }
+
+    return len;
+}
+
+/* ********************************************************************** */
+/** \brief Sends held output of all connections
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return int - count of connections with output still held because socket did not take it all
+ *
+ * Called at the end of ap_net_conn_pool_poll()
+ */
+int ap_net_conn_pool_cork_flush(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_cork_t *cork;
+    int i, n, idx;
+
+
+    cork = pool->cork;
+
+    if ( cork == NULL )
+        return 0;
+
+    /* the list may grow while sending: closing connection emits signal and the callback may send more */
+    for ( i = 0; i < cork->pending_count; ++i )
+    {
+        idx = cork->pending[i];
+
+        if ( idx < pool->max_connections && bit_is_set(pool->conns[idx].state, AP_NET_ST_CONNECTED) )
+        {
+            if ( ! cork_send(pool, &pool->conns[idx], NULL, 0, 0) )
+                ap_net_conn_pool_close_connection(pool, idx);
+        }
+        else
+            cork->conns[idx].fill = 0;
+    }
+
+    for ( i = n = 0; i < cork->pending_count; ++i ) /* keeping only those with something left */
+    {
+        idx = cork->pending[i];
+
+        if ( cork->conns[idx].fill > 0 )
+            cork->pending[n++] = idx;
+        else
+            cork->conns[idx].pending = 0;
+    }
+
+    cork->pending_count = n;
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Sends connection's held output that socket takes at once and drops the rest
+ * \internal
+ *
+ * Used on connection close
+ */
+void ap_net_cork_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_cork_conn_t *cc;
+
+
+    if ( pool->cork == NULL || conn_idx >= pool->cork->conns_size )
+        return;
+
+    cc = &pool->cork->conns[conn_idx];
+
+    if ( cc->fill > 0 && conn_idx < pool->max_connections && bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+        cork_send(pool, &pool->conns[conn_idx], NULL, 0, 0);
+
+    cc->fill = 0; /* removed from pending list by next ap_net_conn_pool_cork_flush() */
+}
+
+/* ********************************************************************** */
+/** \brief Makes room for connection's held output in destination slot
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved
+ */
+int ap_net_cork_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ap_net_conn_pool_cork_pending(src_pool, src_idx) == 0 )
+        return 1;
+
+    if ( dst_pool->cork == NULL && ! ap_net_conn_pool_cork_enable(dst_pool, src_pool->cork->max_held) )
+        return 0;
+
+    return dst_idx < dst_pool->cork->conns_size || cork_grow(dst_pool->cork, dst_pool->max_connections);
+}
+
+/* ********************************************************************** */
+/** \brief Moves connection's held output along with it to other slot or pool
+ * \internal
+ *
+ * The destination slot is free and prepared by ap_net_cork_move_prepare()
+ */
+void ap_net_cork_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    struct ap_net_cork_conn_t *src, *dst, tmp;
+
+
+    if ( ap_net_conn_pool_cork_pending(src_pool, src_idx) == 0 )
+        return;
+
+    src = &src_pool->cork->conns[src_idx];
+    dst = &dst_pool->cork->conns[dst_idx];
+
+    /* the memory is swapped, the pending marks stay with their slots' lists */
+    tmp = *dst;
+
+    dst->buf = src->buf;
+    dst->size = src->size;
+    dst->fill = src->fill;
+
+    src->buf = tmp.buf;
+    src->size = tmp.size;
+    src->fill = 0; /* the free slot had nothing held */
+
+    if ( ! dst->pending )
+    {
+        dst->pending = 1;
+        dst_pool->cork->pending[dst_pool->cork->pending_count++] = dst_idx;
+    }
+}
+
+/* ********************************************************************** */
+/** \brief Returns count of bytes held for connection
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return int - bytes. 0 if corking is disabled
+ */
+int ap_net_conn_pool_cork_pending(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->cork == NULL || conn_idx < 0 || conn_idx >= pool->cork->conns_size )
+        return 0;
+
+    return pool->cork->conns[conn_idx].fill;
+}
@@ -41,6 +41,10 @@ static const char *_func_name = "ap_net_conn_pool_create()";
  * Case two is when bufpos is past 2/3 of buffer size, the buffer is compacted, so data that left between the bufpos and buffill is mode to the buffer's begin
  * and bufpos and buffill are set to new values, possibly adding more arrived data.
  * By no means you must rely on some remembered char* pointer into the buffer. Always use relative indexes based on current value of bufpos.
+ * To keep the data without copying, take it away together with the buffer by ap_net_conn_pool_buf_detach(). conn->buf is replaced then.
+ *
+ * Every pool starts with the flight recorder of AP_NET_RECORDER_DEFAULT_EVENTS latest events enabled, so there is something to dump
+ * when the connection misbehaves. Resize it with ap_net_conn_pool_recorder_enable() or turn off by ap_net_conn_pool_recorder_disable()
  *
  * Callback function's coupled with ap_net_conn_pool_poll() main advantage is automatic handling of standard events like graceful and erroneous disconnections,
  * data arrival, registering new incoming connections in server mode and some changes to internal pool's structures such as moving connection from place to place
@@ -65,6 +69,10 @@ static const char *_func_name = "ap_net_conn_pool_create()";
  *     AP_NET_SIGNAL_CONN_TIMED_OUT - Called on expiration event. Next signal will be AP_NET_SIGNAL_CONN_CLOSING
  *     AP_NET_SIGNAL_CONN_DATA_LEFT - Funny companion to AP_NET_SIGNAL_CONN_DATA_IN. Called in poll cycle when no _new_ data was received,
  *         but buffer still contain some unprocessed stuff. trigger is bufpos < buffill.
+ *     AP_NET_SIGNAL_CONN_SEND_DONE - Transfer started by ap_net_conn_pool_sendfile() is complete. The next one can be started from here
+ *     AP_NET_SIGNAL_CONN_RECV_DONE - Read started by ap_net_conn_pool_recv_into() is complete. The next one can be started from here
+ *     AP_NET_SIGNAL_CONN_MESSAGE - Complete message is in buffer, get it by ap_net_conn_pool_message(). Emitted instead of AP_NET_SIGNAL_CONN_DATA_IN
+ *         if framing is set up by ap_net_conn_pool_framer_set()
  *
  */
 struct ap_net_conn_pool_t *ap_net_conn_pool_create(int flags, int max_connections, int connection_timeout_ms,
@@ -84,15 +92,37 @@ struct ap_net_conn_pool_t *ap_net_conn_pool_create(int flags, int max_connection
     }
 
     pool->callback_func = in_callback_func;
+    pool->state = 0;
     pool->max_connections = 0;
     pool->used_slots = 0;
     pool->conns = NULL;
+    pool->recorder = NULL;
+    pool->profile = NULL;
+    pool->shm = NULL;
+    pool->capture = NULL;
+    pool->cork = NULL;
+    pool->sendfile = NULL;
+    pool->bridges = NULL;
+    pool->zerocopy = NULL;
+    pool->recv_into = NULL;
+    pool->rbufs = NULL;
+    pool->framer = NULL;
+    pool->arenas = NULL;
+
+    memset(&pool->stat, 0, sizeof(pool->stat));
+
+    if ( ! ap_net_conn_pool_recorder_enable(pool, AP_NET_RECORDER_DEFAULT_EVENTS) )
+    {
+        free(pool);
+        return NULL;
+    }
 
     ap_net_conn_pool_set_max_connections(pool, max_connections, conn_buf_size);
 
     if ( ! ap_utils_timespec_set(&pool->max_conn_ttl, AP_UTILS_TIME_SET_FROMZERO, connection_timeout_ms) )
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_CUSTOM_MESSAGE, "max_conn_ttl setup");
+        ap_net_conn_pool_recorder_disable(pool);
         free(pool);
 
         return NULL;
@@ -105,12 +135,5 @@ struct ap_net_conn_pool_t *ap_net_conn_pool_create(int flags, int max_connection
 
     pool->flags = flags;
 
-    pool->stat.conn_count = 0;
-    pool->stat.active_conn_count = 0;
-    pool->stat.timedout = 0;
-    pool->stat.queue_full_count = 0;
-    pool->stat.total_time.tv_sec = 0;
-    pool->stat.total_time.tv_nsec = 0;
-
     return pool;
 }
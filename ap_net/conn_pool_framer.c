@@ -0,0 +1,289 @@
+/** \file ap_net/conn_pool_framer.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Message framing
+ *
+ * Received data is cut into messages by length prefix, delimiter or fixed size,
+ * and each complete message is given to the callback by AP_NET_SIGNAL_CONN_MESSAGE instead of AP_NET_SIGNAL_CONN_DATA_IN.
+ * Delimiter search remembers how far it got, so the bytes of incomplete message are not searched again on the next input.
+ */
+#include "conn_pool_internals.h"
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char *_func_name = "ap_net_conn_pool_framer_set()";
+
+/* ********************************************************************** */
+/** \brief Sets up message framing for pool
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param type int - AP_NET_FRAMER_*. AP_NET_FRAMER_NONE switches framing off
+ * \param param int - length prefix size of 1, 2 or 4 / delimiter byte / message size, depending on type
+ * \param flags int - AP_NET_FRAMER_BIG_ENDIAN for length prefix in network byte order. Little endian otherwise
+ * \return int - true/false
+ *
+ * On each input ap_net_conn_pool_poll() emits AP_NET_SIGNAL_CONN_MESSAGE for every complete message in the connection's buffer.
+ * The handler gets the message by ap_net_conn_pool_message(). It points into conn->buf and is without the prefix or delimiter.
+ * conn->bufpos is already past the message's frame during the call, so the handler may start ap_net_conn_pool_recv_into()
+ * for the bytes that follow. The messages are cut again after its AP_NET_SIGNAL_CONN_RECV_DONE and the next input.
+ * To take the message away with ap_net_conn_pool_buf_detach() set conn->bufpos back to the message start first,
+ * and detach the delimiter along with it if there is one.
+ * Incomplete message is moved to the beginning of buffer when it would not fit otherwise.
+ * The message that can not fit in connection's buffer at all makes the connection closed.
+ * AP_NET_SIGNAL_CONN_DATA_IN and AP_NET_SIGNAL_CONN_DATA_LEFT are not emitted while framing is on.
+ */
+int ap_net_conn_pool_framer_set(struct ap_net_conn_pool_t *pool, int type, int param, int flags)
+{
+    struct ap_net_framer_t *fr;
+
+
+    ap_error_clear();
+
+    if ( type == AP_NET_FRAMER_NONE )
+    {
+        ap_net_framer_free(pool);
+        return 1;
+    }
+
+    if ( (type == AP_NET_FRAMER_LENGTH && param != 1 && param != 2 && param != 4)
+         || (type == AP_NET_FRAMER_DELIMITER && (param < 0 || param > 255))
+         || (type == AP_NET_FRAMER_FIXED && param <= 0)
+         || type < AP_NET_FRAMER_NONE || type > AP_NET_FRAMER_FIXED
+       )
+    {
+        ap_error_set_custom(_func_name, "invalid framer type or parameter");
+        return 0;
+    }
+
+    if ( pool->framer == NULL )
+    {
+        if ( NULL == (fr = calloc(1, sizeof(struct ap_net_framer_t))) )
+        {
+            ap_error_set(_func_name, AP_ERRNO_OOM);
+            return 0;
+        }
+
+        pool->framer = fr;
+    }
+
+    fr = pool->framer;
+
+    fr->type = type;
+    fr->param = param;
+    fr->flags = flags;
+
+    if ( fr->conns_size > 0 ) /* the old delimiter search results are of no use */
+        memset(fr->scanned, 0, fr->conns_size * sizeof(int));
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Gives the current message to AP_NET_SIGNAL_CONN_MESSAGE handler
+ *
+ * \param conn struct ap_net_connection_t*
+ * \param len int* - message length goes here
+ * \return char* - message start. Valid until the handler returns
+ */
+char *ap_net_conn_pool_message(struct ap_net_connection_t *conn, int *len)
+{
+    *len = conn->parent->framer->msg_len;
+
+    return conn->parent->framer->msg;
+}
+
+/* ********************************************************************** */
+/* the first delimiter position in p[0..len). -1 if none */
+static int framer_find(const char *p, int len, char delim)
+{
+    int i;
+#ifdef __SSE2__
+    __m128i d;
+    unsigned m;
+#endif
+
+
+    i = 0;
+
+#ifdef __SSE2__
+    d = _mm_set1_epi8(delim);
+
+    for ( ; i + 16 <= len; i += 16 )
+    {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), d));
+
+        if ( m != 0 )
+            return i + __builtin_ctz(m);
+    }
+#endif
+
+    for ( ; i < len; ++i )
+        if ( p[i] == delim )
+            return i;
+
+    return -1;
+}
+
+/* ********************************************************************** */
+/* decodes length prefix */
+static int framer_length(struct ap_net_framer_t *fr, const unsigned char *p)
+{
+    unsigned n;
+    int i;
+
+
+    for ( i = 0, n = 0; i < fr->param; ++i )
+        n |= (unsigned)p[bit_is_set(fr->flags, AP_NET_FRAMER_BIG_ENDIAN) ? i : fr->param - 1 - i] << (8 * (fr->param - 1 - i));
+
+    return n > INT_MAX ? INT_MAX : (int)n; /* too large anyway */
+}
+
+/* ********************************************************************** */
+/** \brief Emits AP_NET_SIGNAL_CONN_MESSAGE for each complete message in connection's buffer
+ * \internal
+ *
+ * \return int - false if connection is closed
+ *
+ * Called by ap_net_conn_pool_poll() on input instead of AP_NET_SIGNAL_CONN_DATA_IN
+ */
+int ap_net_framer_run(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn)
+{
+    struct ap_net_framer_t *fr;
+    void *new_mem;
+    char *p;
+    int avail, len, need, n;
+    int *scanned;
+
+
+    fr = pool->framer;
+
+    if ( conn->idx >= fr->conns_size )
+    {
+        if ( NULL == (new_mem = realloc(fr->scanned, pool->max_connections * sizeof(int))) )
+        {
+            ap_error_set("ap_net_conn_pool_poll()", AP_ERRNO_OOM);
+            ap_net_conn_pool_close_connection(pool, conn->idx);
+            return 0;
+        }
+
+        fr->scanned = new_mem;
+        memset(fr->scanned + fr->conns_size, 0, (pool->max_connections - fr->conns_size) * sizeof(int));
+        fr->conns_size = pool->max_connections;
+    }
+
+    scanned = &fr->scanned[conn->idx];
+
+    for (;;)
+    {
+        avail = conn->buffill - conn->bufpos;
+
+        if ( avail <= 0 || ap_net_conn_pool_recv_into_left(pool, conn->idx) > 0 )
+            return 1;
+
+        p = conn->buf + conn->bufpos;
+
+        if ( fr->type == AP_NET_FRAMER_LENGTH )
+        {
+            need = fr->param;
+            len = 0;
+
+            if ( avail >= fr->param )
+            {
+                len = framer_length(fr, (const unsigned char *)p);
+                need = len > conn->bufsize - fr->param ? INT_MAX : fr->param + len;
+            }
+
+            fr->msg = p + fr->param;
+        }
+        else if ( fr->type == AP_NET_FRAMER_DELIMITER )
+        {
+            n = framer_find(p + *scanned, avail - *scanned, (char)fr->param);
+
+            fr->scanned_bytes += n == -1 ? avail - *scanned : n + 1;
+
+            if ( n == -1 )
+            {
+                *scanned = avail;
+                need = len = avail + 1;
+            }
+            else
+            {
+                len = *scanned + n;
+                need = len + 1;
+                *scanned = 0;
+            }
+
+            fr->msg = p;
+        }
+        else
+        {
+            need = len = fr->param;
+            fr->msg = p;
+        }
+
+        if ( need > conn->bufsize )
+        {
+            ++fr->oversized;
+            ap_net_conn_pool_stat_add(pool, errors, 1);
+            ap_error_set_custom("ap_net_conn_pool_poll()", "message is larger than connection's buffer");
+
+            if ( ap_log_debug_on(1) )
+                ap_log_debug_log("? Connection [%d] is closed on message larger than buffer of %d\n", conn->idx, conn->bufsize);
+
+            ap_net_conn_pool_close_connection(pool, conn->idx);
+
+            return 0;
+        }
+
+        if ( avail < need ) /* incomplete. making room for the rest if needed */
+        {
+            if ( conn->bufpos > 0 && conn->bufpos + need > conn->bufsize )
+            {
+                memmove(conn->buf, p, avail);
+                conn->bufpos = 0;
+                conn->buffill = avail;
+            }
+
+            return 1;
+        }
+
+        fr->msg_len = len;
+        ++fr->messages;
+
+        conn->bufpos += need; /* what follows is for the handler's direct read if it wants */
+
+        ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_MESSAGE);
+
+        if ( ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+            return 0;
+    }
+}
+
+/* ********************************************************************** */
+/** \brief Forgets connection's delimiter search progress
+ * \internal
+ *
+ * Used on connection close and move to other slot
+ */
+void ap_net_framer_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->framer != NULL && conn_idx < pool->framer->conns_size )
+        pool->framer->scanned[conn_idx] = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Switches framing off and frees its state
+ * \internal
+ *
+ * Called by ap_net_conn_pool_destroy() and ap_net_conn_pool_framer_set() with AP_NET_FRAMER_NONE
+ */
+void ap_net_framer_free(struct ap_net_conn_pool_t *pool)
+{
+    if ( pool->framer == NULL )
+        return;
+
+    free(pool->framer->scanned);
+    free(pool->framer);
+
+    pool->framer = NULL;
+}
@@ -12,9 +12,162 @@
 
 extern int ap_net_recv(int sh, void *buf, int size, int non_blocking);
 extern int ap_net_send(int sh, void *buf, int size, int non_blocking);
+extern void ap_net_conn_pool_count_send(struct ap_net_conn_pool_t *pool, int n, int size);
+
+extern int ap_net_cork_hold(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, const void *data, int len);
+extern void ap_net_cork_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_cork_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_cork_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+
+extern void ap_net_sendfile_resume(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn);
+extern void ap_net_sendfile_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_sendfile_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_sendfile_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+
+extern int ap_net_recv_into_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn);
+extern void ap_net_recv_into_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_recv_into_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_recv_into_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_recv_into_free(struct ap_net_conn_pool_t *pool);
+
+extern void ap_net_rbuf_free(struct ap_net_conn_pool_t *pool);
+
+extern int ap_net_framer_run(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn);
+extern void ap_net_framer_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern void ap_net_framer_free(struct ap_net_conn_pool_t *pool);
+
+extern void ap_net_arena_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_arena_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_arena_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_arena_free(struct ap_net_conn_pool_t *pool);
+
+extern int ap_net_bridge_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, unsigned events);
+extern void ap_net_bridge_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_bridge_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_bridge_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_bridge_free(struct ap_net_conn_pool_t *pool);
+
+extern int ap_net_zerocopy_send(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, void *buf, int size, int non_blocking);
+extern void ap_net_zerocopy_copied(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, void *data, int len);
+extern void ap_net_zerocopy_release(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn);
+extern unsigned ap_net_zerocopy_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, unsigned events);
+extern int ap_net_zerocopy_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern void ap_net_zerocopy_orphans(struct ap_net_conn_pool_t *pool);
+extern int ap_net_zerocopy_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_zerocopy_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
+extern void ap_net_zerocopy_free(struct ap_net_conn_pool_t *pool);
+
+extern void ap_net_recorder_add(struct ap_net_recorder_t *recorder, int type, struct ap_net_connection_t *conn, int value);
+
+extern int ap_net_conn_pool_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx);
 
 extern int ap_net_conn_pool_poller_add_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
 extern int ap_net_conn_pool_poller_remove_conn(struct ap_net_conn_pool_t *pool, int conn_idx);
+extern int ap_net_conn_pool_poller_set_out(struct ap_net_conn_pool_t *pool, int conn_idx, int on);
+extern int ap_net_conn_pool_poller_set_events(struct ap_net_conn_pool_t *pool, int conn_idx, unsigned events);
 extern int ap_net_conn_pool_poller_create(struct ap_net_conn_pool_t *pool);
 
 extern const char *ap_net_conn_pool_udp_conn_handshake;
+
+/* older C libraries do not know about zero-copy sends */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+extern ssize_t ap_net_sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+
+#ifdef AP_NET_NO_SIM
+/* Production build: the module calls libc directly instead of going through ap_net_io table.
+ * The table here is constant, so the compiler turns ap_net_io->x() into plain calls. ap_net_io variable is still there,
+ * but the module does not look at it, so the simulator and the shim are not available.
+ * The wrappers are for the exact prototypes, as in conn_pool_io.c
+ */
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+static inline int ap_net_direct_bind(int fd, const struct sockaddr *addr, socklen_t addr_len) { return bind(fd, addr, addr_len); }
+static inline int ap_net_direct_accept(int fd, struct sockaddr *addr, socklen_t *addr_len) { return accept(fd, addr, addr_len); }
+static inline int ap_net_direct_connect(int fd, const struct sockaddr *addr, socklen_t addr_len) { return connect(fd, addr, addr_len); }
+static inline int ap_net_direct_getsockname(int fd, struct sockaddr *addr, socklen_t *addr_len) { return getsockname(fd, addr, addr_len); }
+static inline int ap_net_direct_fcntl(int fd, int cmd, int arg) { return fcntl(fd, cmd, arg); }
+
+static inline ssize_t ap_net_direct_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+    return recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+static inline ssize_t ap_net_direct_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len)
+{
+    return sendto(fd, buf, len, flags, addr, addr_len);
+}
+
+static const struct ap_net_io_ops_t ap_net_io_direct =
+{
+    .socket = socket,
+    .bind = ap_net_direct_bind,
+    .listen = listen,
+    .accept = ap_net_direct_accept,
+    .connect = ap_net_direct_connect,
+    .getsockname = ap_net_direct_getsockname,
+    .getsockopt = getsockopt,
+    .setsockopt = setsockopt,
+    .fcntl = ap_net_direct_fcntl,
+    .recv = recv,
+    .recvfrom = ap_net_direct_recvfrom,
+    .recvmsg = recvmsg,
+    .send = send,
+    .sendto = ap_net_direct_sendto,
+    .sendmsg = sendmsg,
+    .sendfile = sendfile,
+    .splice = ap_net_sys_splice,
+    .shutdown = shutdown,
+    .close = close,
+    .epoll_create = epoll_create,
+    .epoll_ctl = epoll_ctl,
+    .epoll_wait = epoll_wait
+};
+
+#define ap_net_io (&ap_net_io_direct)
+#endif
+
+/* updates pool's statistics counter. relaxed atomic, so the counters may be read from other thread by ap_net_conn_pool_get_stat() */
+#define ap_net_conn_pool_stat_add(pool, field, n) __atomic_fetch_add(&(pool)->stat.field, (n), __ATOMIC_RELAXED)
+
+/* emits signal to the pool's callback function, measuring it if profiler is enabled. returns callback's result or true if no callback set */
+static inline int ap_net_conn_pool_signal(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int signal_type)
+{
+    if ( pool->callback_func == NULL )
+        return 1;
+
+    if ( signal_type >= 0 && signal_type < AP_NET_SIGNALS_COUNT )
+        ap_net_conn_pool_stat_add(pool, signals[signal_type], 1);
+
+    if ( pool->profile != NULL )
+        return ap_net_profile_callback(pool, conn, signal_type);
+
+    return pool->callback_func(conn, signal_type);
+}
+
+/* closes the current poll phase of profiler if it is enabled */
+#define ap_net_conn_pool_profile_phase(pool, phase) \
+    do { if ( (pool)->profile != NULL ) ap_net_profile_phase_end((pool)->profile, (phase)); } while(0)
+
+/* adds event to the pool's flight recorder if it is enabled */
+#define ap_net_conn_pool_record(pool, type, conn, value) \
+    do { if ( (pool)->recorder != NULL ) ap_net_recorder_add((pool)->recorder, (type), (conn), (value)); } while(0)
+
+/* true if sends on this connection go through ap_net_cork_hold() */
+#define ap_net_conn_pool_corked(pool, conn) \
+    ( (pool)->cork != NULL && ((pool)->cork->in_cycle || ap_net_conn_pool_cork_pending((pool), (conn)->idx) > 0) )
+
+/* true if connection's data goes through ap_net_conn_pool_bridge() */
+#define ap_net_conn_pool_bridged(pool, conn_idx) \
+    ( (pool)->bridges != NULL && (conn_idx) < (pool)->bridges->conns_size && (pool)->bridges->conns[(conn_idx)] != NULL )
+
+/* adds payload to the pool's traffic capture if it is enabled. is_out is true for the data sent. NULL data is FIN */
+#define ap_net_conn_pool_capture(pool, conn, is_out, data, len) \
+    do { if ( (pool)->capture != NULL ) ap_net_capture_add((pool), (conn), (is_out), (data), (len)); } while(0)
@@ -0,0 +1,109 @@
+/** \file ap_net/conn_pool_io.c
+ * \brief Part of AP's toolkit. Networking module: System calls table
+ *
+ * All socket and epoll calls of the module go through ap_net_io, so the network can be replaced by the simulator.
+ * The wrappers are here to have the exact prototypes regardless of libc's transparent unions and variadics
+ * Build with -DAP_NET_NO_SIM (see 'make nodebug') to have the module call libc directly, without the table
+ */
+#define _GNU_SOURCE
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#ifdef AP_NET_NO_SIM
+#undef ap_net_io /* the module does not use it then, see conn_pool_internals.h. defined below for the applications */
+#endif
+
+/* ********************************************************************** */
+static int sys_bind(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    return bind(fd, addr, addr_len);
+}
+
+/* ********************************************************************** */
+static int sys_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+    return accept(fd, addr, addr_len);
+}
+
+/* ********************************************************************** */
+static int sys_connect(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    return connect(fd, addr, addr_len);
+}
+
+/* ********************************************************************** */
+static int sys_getsockname(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+    return getsockname(fd, addr, addr_len);
+}
+
+/* ********************************************************************** */
+static int sys_fcntl(int fd, int cmd, int arg)
+{
+    return fcntl(fd, cmd, arg);
+}
+
+/* ********************************************************************** */
+static ssize_t sys_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+    return recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+/* ********************************************************************** */
+static ssize_t sys_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len)
+{
+    return sendto(fd, buf, len, flags, addr, addr_len);
+}
+
+/* ********************************************************************** */
+/* loff_t is GNU-only, so it is kept out of ap_net.h */
+ssize_t ap_net_sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+    loff_t in, out;
+    ssize_t n;
+
+
+    in = off_in != NULL ? *off_in : 0;
+    out = off_out != NULL ? *off_out : 0;
+
+    n = splice(fd_in, off_in != NULL ? &in : NULL, fd_out, off_out != NULL ? &out : NULL, len, flags);
+
+    if ( off_in != NULL )
+        *off_in = in;
+
+    if ( off_out != NULL )
+        *off_out = out;
+
+    return n;
+}
+
+/* ********************************************************************** */
+struct ap_net_io_ops_t ap_net_io_system =
+{
+    .socket = socket,
+    .bind = sys_bind,
+    .listen = listen,
+    .accept = sys_accept,
+    .connect = sys_connect,
+    .getsockname = sys_getsockname,
+    .getsockopt = getsockopt,
+    .setsockopt = setsockopt,
+    .fcntl = sys_fcntl,
+    .recv = recv,
+    .recvfrom = sys_recvfrom,
+    .recvmsg = recvmsg,
+    .send = send,
+    .sendto = sys_sendto,
+    .sendmsg = sendmsg,
+    .sendfile = sendfile,
+    .splice = ap_net_sys_splice,
+    .shutdown = shutdown,
+    .close = close,
+    .epoll_create = epoll_create,
+    .epoll_ctl = epoll_ctl,
+    .epoll_wait = epoll_wait
+};
+
+struct ap_net_io_ops_t *ap_net_io = &ap_net_io_system;
@@ -35,7 +35,7 @@ int ap_net_conn_pool_listener_create(struct ap_net_conn_pool_t *pool, int max_tr
         return -1;
     }
 
-    pool->listener.sock = socket( bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? AF_INET6 : AF_INET,
+    pool->listener.sock = ap_net_io->socket( bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? AF_INET6 : AF_INET,
                                   bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) ? SOCK_STREAM : SOCK_DGRAM, 0 );
 
     if ( -1 == pool->listener.sock )
@@ -57,13 +57,13 @@ int ap_net_conn_pool_listener_create(struct ap_net_conn_pool_t *pool, int max_tr
 
     for(;;)
     {
-        if ( -1 != bind( pool->listener.sock, addr, addr_len ) )
+        if ( -1 != ap_net_io->bind( pool->listener.sock, addr, addr_len ) )
             break; /*  bind OK */
 
         if ( --max_tries == 0 )
         {
             ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "bind()");
-            close(pool->listener.sock);
+            ap_net_io->close(pool->listener.sock);
             pool->listener.sock = -1;
 
             return -1;
@@ -74,7 +74,7 @@ int ap_net_conn_pool_listener_create(struct ap_net_conn_pool_t *pool, int max_tr
         sleep(retry_sleep);
     }
 
-    fcntl(pool->listener.sock, F_SETFL, fcntl(pool->listener.sock, F_GETFL) | O_NONBLOCK);
+    ap_net_io->fcntl(pool->listener.sock, F_SETFL, ap_net_io->fcntl(pool->listener.sock, F_GETFL, 0) | O_NONBLOCK);
 
     if ( pool->poller != NULL ) /* recreating. ugly, but fine for now */
     {
@@ -84,17 +84,17 @@ int ap_net_conn_pool_listener_create(struct ap_net_conn_pool_t *pool, int max_tr
 
     if ( ! ap_net_conn_pool_poller_create(pool))
     {
-        close(pool->listener.sock);
+        ap_net_io->close(pool->listener.sock);
         pool->listener.sock = -1;
 
         return -1;
     }
 
     if ( bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP)
-         && 0 != listen(pool->listener.sock, pool->max_connections) )
+         && 0 != ap_net_io->listen(pool->listener.sock, pool->max_connections) )
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "listen()");
-        close(pool->listener.sock);
+        ap_net_io->close(pool->listener.sock);
         pool->listener.sock = -1;
 
         return -1;
@@ -3,9 +3,7 @@
  */
 #include "conn_pool_internals.h"
 
-/*
 static const char *_func_name = "ap_net_conn_pool_move_conn()";
-*/
 
 /* ********************************************************************** */
 /** \brief receives available data into internal buffer
@@ -41,12 +39,39 @@ void ap_net_connection_copy(struct ap_net_connection_t *dst_conn, struct ap_net_
         dst_conn->buffill = dst_conn->bufsize;
 
     dst_conn->state = src_conn->state;
+    dst_conn->flags = src_conn->flags;
 
     tmp = dst_conn->user_data;
     dst_conn->user_data = src_conn->user_data;
     dst_conn->user_data = tmp;
 }
 
+/* ********************************************************************** */
+/** \brief Makes room in destination for the state the connection carries
+ * \internal
+ *
+ * \return int - true/false. False if out of memory, nothing is moved then
+ *
+ * Used by ap_net_conn_pool_move_conn() and ap_net_conn_pool_set_max_connections() before the connection is copied,
+ * so the move itself can not fail half way
+ */
+int ap_net_conn_pool_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ! ap_net_cork_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+         || ! ap_net_sendfile_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+         || ! ap_net_recv_into_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+         || ! ap_net_bridge_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+         || ! ap_net_zerocopy_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+         || ! ap_net_arena_move_prepare(src_pool, src_idx, dst_pool, dst_idx)
+       )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    return 1;
+}
+
 /* ********************************************************************** */
 /** \brief receives available data into internal buffer
  *
@@ -91,9 +116,18 @@ int ap_net_conn_pool_move_conn(struct ap_net_conn_pool_t *dst_pool, struct ap_ne
         if ( ! (dst_pool->conns[dst_conn_idx].state & AP_NET_ST_CONNECTED) )
             break;
 
+    if ( ! ap_net_conn_pool_move_prepare(src_pool, conn_idx, dst_pool, dst_conn_idx) )
+    {
+        ap_net_conn_pool_unlock(src_pool);
+        ap_net_conn_pool_unlock(dst_pool);
+        return 0;
+    }
+
     src_conn = &src_pool->conns[conn_idx];
     dst_conn = &dst_pool->conns[dst_conn_idx];
 
+    ap_net_framer_release_conn(src_pool, conn_idx); /* the buffer is searched for delimiter anew */
+
     ap_net_connection_copy(dst_conn, src_conn);
 
     ap_net_conn_pool_poller_remove_conn(src_pool, conn_idx);
@@ -102,15 +136,23 @@ int ap_net_conn_pool_move_conn(struct ap_net_conn_pool_t *dst_pool, struct ap_ne
 
     bit_clear(src_conn->state, AP_NET_ST_CONNECTED);
 
-    if ( src_pool->callback_func != NULL ) /* force reinit of user's data */
-        src_pool->callback_func(src_conn, AP_NET_SIGNAL_CONN_MOVED_FROM);
+    src_pool->used_slots--;
+    dst_pool->used_slots++;
+
+    ap_net_conn_pool_signal(src_pool, src_conn, AP_NET_SIGNAL_CONN_MOVED_FROM); /* force reinit of user's data */
 
     ap_net_conn_pool_unlock(src_pool);
 
     ap_net_conn_pool_poller_add_conn(dst_pool, dst_conn_idx);
 
-    if ( dst_pool->callback_func != NULL ) /* force reinit of user's data */
-        dst_pool->callback_func(dst_conn, AP_NET_SIGNAL_CONN_MOVED_TO);
+    ap_net_cork_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+    ap_net_sendfile_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+    ap_net_recv_into_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+    ap_net_bridge_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+    ap_net_zerocopy_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+    ap_net_arena_move_conn(src_pool, conn_idx, dst_pool, dst_conn_idx);
+
+    ap_net_conn_pool_signal(dst_pool, dst_conn, AP_NET_SIGNAL_CONN_MOVED_TO); /* force reinit of user's data */
 
     ap_net_conn_pool_unlock(dst_pool);
 
@@ -18,7 +18,19 @@ static const char *_func_name = "ap_net_conn_pool_poll()";
  * Closing expired connections (conn->expire > 0)
  * Calling ap_net_conn_pool_accept_connection() on incoming from listener socket. Fires AP_NET_SIGNAL_CONN_ACCEPTED inside it
  * Calling ap_net_conn_pool_recv() on incoming data available at some connection. Fires AP_NET_SIGNAL_CONN_DATA_IN signal
+ * Cuts the data into messages and fires AP_NET_SIGNAL_CONN_MESSAGE for each instead, if framing is set. See ap_net_conn_pool_framer_set()
+ * Receives into application's memory instead while direct read is in progress. Fires AP_NET_SIGNAL_CONN_RECV_DONE at the end of each. See ap_net_conn_pool_recv_into()
  * Fires AP_NET_SIGNAL_CONN_CAN_SEND on pools with AP_NET_POOL_FLAGS_ASYNC flag set and socket is ready to send data
+ * Moves the data of bridged connections on input and output events. See ap_net_conn_pool_bridge()
+ * Continues file transfers when socket is ready to send data. Fires AP_NET_SIGNAL_CONN_SEND_DONE at the end of each. See ap_net_conn_pool_sendfile()
+ * Reads zero-copy sends reports on EPOLLERR and gives their memory back to application. See ap_net_conn_pool_zerocopy_enable()
+ * Checks the reports of zero-copy sends of closed connections at the end, closing their sockets when all are done
+ * Each of the steps above is timed if profiler is enabled. See ap_net_conn_pool_profiler_enable()
+ * Statistics are published to shared memory at the end if enabled. See ap_net_conn_pool_shm_export()
+ * Traffic capture buffer is written to file at the end if it is half full. See ap_net_conn_pool_capture_start()
+ * Output held by the callbacks is sent at the end if corking is enabled. See ap_net_conn_pool_cork_enable()
+ * The steps of the end are done on error returns too
+ * The pool's scratch arena is reset at the very end. See ap_net_conn_pool_scratch()
  *
  * Return 1 if all OK, 0 if general error occurred (see ap_error_get*())
  */
@@ -27,6 +39,10 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
     int event_idx;
     int i;
     int n;
+    int sock_error;
+    int direct;
+    int retval;
+    socklen_t slen;
     struct epoll_event ev;
     struct ap_net_poll_t *poller;
     struct ap_net_connection_t *conn;
@@ -35,8 +51,15 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
 
     ap_error_clear();
 
+    retval = 0;
     poller = pool->poller;
 
+    if ( pool->profile != NULL )
+        ap_net_profile_cycle_begin(pool->profile);
+
+    if ( pool->cork != NULL )
+        pool->cork->in_cycle = 1;
+
     for (i = 0; i < pool->max_connections; ++i ) /* checking for zombies first */
     {
         conn = &pool->conns[i];
@@ -48,15 +71,21 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
         }
     }
 
-    poller->events_count = epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
+    ap_net_conn_pool_profile_phase(pool, AP_NET_PHASE_ZOMBIES);
+
+    poller->events_count = ap_net_io->epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
+
+    ap_net_conn_pool_stat_add(pool, epoll_calls, 1);
+
+    ap_net_conn_pool_profile_phase(pool, AP_NET_PHASE_EPOLL);
 
     if (poller->events_count == -1)
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "epoll_wait()");
-        return 0;
+        goto cycle_end;
     }
 
-    if( poller->debug && poller->events_count > 0 )
+    if ( ap_net_poller_debug_on(poller) && poller->events_count > 0 )
         ap_log_debug_log("---P-EVTCNT %d\n", poller->events_count);
 
     /* ==============================================================================================
@@ -72,7 +101,7 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
             if ( bit_is_set(poller->events[event_idx].events, (EPOLLERR | EPOLLHUP)) ) /* connection's ERROR? */
             {
                 ap_error_set_detailed(_func_name, AP_ERRNO_CUSTOM_MESSAGE, "epoll reports error/hangup on listener socket");
-                return 0;
+                goto cycle_end;
             }
 
             conn = ap_net_conn_pool_accept_connection(pool); /* signal AP_NET_SIGNAL_CONN_ACCEPTED emitted from there */
@@ -81,16 +110,16 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
             {
                 if ( ap_error_get() == AP_ERRNO_ACCEPT_DENIED ) /* user denied. not an error */
                 {
-                    if( poller->debug )
+                    if ( ap_net_poller_debug_on(poller) )
                         ap_log_debug_log("\t-P-NOACCEPT - denied by callback\n");
 
                     break;
                 }
 
-                return 0;
+                goto cycle_end;
             }
 
-            if( poller->debug )
+            if ( ap_net_poller_debug_on(poller) )
             {
                 if ( bit_is_set(conn->flags, AP_NET_CONN_FLAGS_UDP_IN) )
                     ap_log_debug_log("\t-P-DataIn_UDP %d %s @ %d (p:%d f:%d s:%d)\n", conn->idx,
@@ -105,6 +134,8 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
         }
     } /* if ( pool->listener.sock != -1 ) */
 
+    ap_net_conn_pool_profile_phase(pool, AP_NET_PHASE_ACCEPT);
+
     /* ==============================================================================================
      * checking ordinary connections
      */
@@ -120,50 +151,73 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
              ev.events = EPOLLIN;
              ev.data.fd = poller->events[event_idx].data.fd;
 
-             epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev);
+             ap_net_io->epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev);
 
-             if( poller->debug )
+             if ( ap_net_poller_debug_on(poller) )
                  ap_log_debug_log("\t-P-FDERR\n");
 
              continue;
          }
 
+         if ( pool->zerocopy != NULL && 0 == (poller->events[event_idx].events = ap_net_zerocopy_event(pool, conn, poller->events[event_idx].events)) )
+             continue; /* zero-copy sends reports only */
+
+         if ( pool->bridges != NULL && ap_net_bridge_event(pool, conn, poller->events[event_idx].events) ) /* bridged data goes by itself */
+             continue;
+
          if ( bit_is_set(poller->events[event_idx].events, (EPOLLERR | EPOLLHUP)) ) /* connection's ERROR? */
          {
              conn->state |= AP_NET_ST_ERROR;
 
+             ap_net_conn_pool_stat_add(pool, errors, 1);
+
+             if ( pool->recorder != NULL )
+             {
+                 sock_error = 0;
+                 slen = sizeof(sock_error);
+                 ap_net_io->getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &sock_error, &slen);
+                 ap_net_recorder_add(pool->recorder, AP_NET_REC_ERROR, conn, sock_error);
+             }
+
              ap_net_conn_pool_close_connection(pool, conn->idx);
 
-             if( poller->debug ) ap_log_debug_log("\t-P-ERR %d\n", conn->idx);
+             if ( ap_net_poller_debug_on(poller) ) ap_log_debug_log("\t-P-ERR %d\n", conn->idx);
 
              continue;
          }
 
          if ( bit_is_set(poller->events[event_idx].events, EPOLLIN) ) /*  data available for reading */
          {
-              if( poller->debug)
+              if ( ap_net_poller_debug_on(poller) )
                   ap_log_debug_log("\t-P-DATAIN %d(p:%d f:%d s:%d)", conn->idx, conn->bufpos, conn->buffill, conn->bufsize);
 
-              n = ap_net_conn_pool_recv(pool, conn->idx);
+              direct = pool->recv_into != NULL && ap_net_conn_pool_recv_into_left(pool, conn->idx) > 0;
+
+              if ( direct ) /* straight into application's memory */
+                  n = ap_net_recv_into_event(pool, conn);
+              else
+                  n = ap_net_conn_pool_recv(pool, conn->idx);
 
               if ( n > 0 ) /* something new there */
               {
-                  if( poller->debug)
+                  if ( ap_net_poller_debug_on(poller) )
                       ap_log_debug_log(" > (p:%d f:%d s:%d)\n", conn->bufpos, conn->buffill, conn->bufsize);
 
-                  if ( pool->callback_func != NULL )
-                      pool->callback_func(conn, AP_NET_SIGNAL_CONN_DATA_IN);
+                  if ( ! direct && pool->framer != NULL ) /* AP_NET_SIGNAL_CONN_MESSAGE for each complete message instead */
+                      ap_net_framer_run(pool, conn);
+                  else if ( ! direct ) /* direct read emits AP_NET_SIGNAL_CONN_RECV_DONE by itself when it is complete */
+                      ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_DATA_IN);
               }
 
-              else if ( n == 0 ) /* ap_net_recv() returns this if there is no space buffer */
+              else if ( n == 0 && ! direct ) /* ap_net_recv() returns this if there is no space buffer */
               {
-                  if( poller->debug )
+                  if ( ap_net_poller_debug_on(poller) )
                       ap_log_debug_log(" -P- buffer full --\n");
 
                   /*
                   if ( conn->bufsize == 256 )
                   {
-                      if( poller->debug)
+                      if ( ap_net_poller_debug_on(poller) )
                           ap_log_debug_log("DUMP: parent: %p, idx: %d, fd: %d\n\tladdr: %d/%d, raddr: %d/%d\n\tcre: %d.%ld, exp: %d.%ld\n\tbuf: %p, bs: %d, bp: %d, bf: %d\n\tstate: %d, ud :%p\n",
                                   conn->parent, conn->idx, conn->fd, conn->local.addr4.sin_addr.s_addr, conn->local.addr4.sin_port,
                                   conn->remote.addr4.sin_addr.s_addr,conn->remote.addr4.sin_port, conn->created_time.tv_sec, conn->created_time.tv_nsec,
@@ -176,7 +230,7 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
 
               else if ( n == -2 ) /* ap_net_recv() returns this if connection is broken and user app should close it, but there can be some data left in buffer */
               {
-                  if( poller->debug)
+                  if ( ap_net_poller_debug_on(poller) )
                       ap_log_debug_log("\t-P- Disconnect %d --\n", conn->idx);
 
                   /* freeing poller from wasting time. it will be removed on the next loop */
@@ -188,30 +242,31 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
                       ap_utils_timespec_set(&conn->expire, AP_UTILS_TIME_SET_FROM_NOW, 2000);
 
                   if ( conn->buffill - conn->bufpos > 0 ) /* maybe user need the data left in buffer */
-                  {
-                      if ( pool->callback_func != NULL )
-                           pool->callback_func(conn, AP_NET_SIGNAL_CONN_DATA_LEFT);
-                  }
+                      ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_DATA_LEFT);
 
                   continue;
               }
 
               else /* some other error */
               {
-                     if( poller->debug)
+                     if ( ap_net_poller_debug_on(poller) )
                           ap_log_debug_log("\t-P- ERROR %d --\n", conn->idx);
 
-                  return 0;
+                  goto cycle_end;
               }
          } /* EPOLLIN */
 
+         if ( pool->sendfile != NULL && bit_is_set(poller->events[event_idx].events, EPOLLOUT) ) /* file transfer can go on */
+              ap_net_sendfile_resume(pool, conn);
+
          if ( bit_is_set(pool->flags, AP_NET_POOL_FLAGS_ASYNC) && bit_is_set(poller->events[event_idx].events, EPOLLOUT) ) /* can send data */
          {
-              if ( pool->callback_func != NULL )
-                   pool->callback_func(conn, AP_NET_SIGNAL_CONN_CAN_SEND);
+              ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_CAN_SEND);
          }
     } /*  for (event_idx = 0; event_idx < events_count */
 
+    ap_net_conn_pool_profile_phase(pool, AP_NET_PHASE_RECV);
+
     /* ==============================================================================================
      * now checking all connections for expiration etc.
      */
@@ -226,22 +281,51 @@ int ap_net_conn_pool_poll(struct ap_net_conn_pool_t *pool)
         {
             conn->state |= AP_NET_ST_EXPIRED;
 
-            if ( pool->callback_func != NULL )
-                 pool->callback_func(conn, AP_NET_SIGNAL_CONN_TIMED_OUT);
+            ap_net_conn_pool_stat_add(pool, timedout, 1);
+
+            ap_net_conn_pool_record(pool, AP_NET_REC_EXPIRE, conn, 0);
+
+            ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_TIMED_OUT);
 
             ap_net_conn_pool_close_connection(pool, i);
 
-            if( poller->debug )
+            if ( ap_net_poller_debug_on(poller) )
                 ap_log_debug_log("\t-PEXPIRED %d %ld ms\n", i, ap_utils_timespec_elapsed( &conn->expire, NULL, NULL ));
         }
 
-        if ( poller->emit_old_data_signal && conn->buffill - conn->bufpos > 0 )
+        if ( poller->emit_old_data_signal && pool->framer == NULL && conn->buffill - conn->bufpos > 0 ) /* incomplete message is not news */
         {
-            if ( pool->callback_func != NULL )
-                 pool->callback_func(conn, AP_NET_SIGNAL_CONN_DATA_LEFT);
+            ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_DATA_LEFT);
         }
     }
 
-    return 1;
+    ap_net_conn_pool_profile_phase(pool, AP_NET_PHASE_EXPIRY);
+
+    retval = 1;
+
+cycle_end: /* errors above come here too, so the next cycle starts clean */
+    if ( pool->cork != NULL ) /* sending out what the callbacks have said */
+    {
+        pool->cork->in_cycle = 0;
+        ap_net_conn_pool_cork_flush(pool);
+    }
+
+    if ( pool->zerocopy != NULL && pool->zerocopy->orphans != NULL ) /* closed connections waiting for the last reports */
+        ap_net_zerocopy_orphans(pool);
+
+    if ( pool->profile != NULL ) /* the cycle is closed even if some of its phases were not reached */
+        ap_net_profile_cycle_end(pool->profile);
+
+    if ( pool->shm != NULL )
+        ap_net_conn_pool_shm_publish(pool, 0);
+
+    /* the capture is written out here, after the callbacks, not in the middle of recv/send */
+    if ( pool->capture != NULL && pool->capture->buf_fill > pool->capture->buf_size / 2 )
+        ap_net_conn_pool_capture_flush(pool);
+
+    if ( pool->arenas != NULL ) /* the callbacks are done with their temporary objects */
+        ap_arena_reset(&pool->arenas->cycle);
+
+    return retval;
 }
 
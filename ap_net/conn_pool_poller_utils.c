@@ -28,7 +28,7 @@ int ap_net_conn_pool_poller_add_conn(struct ap_net_conn_pool_t *pool, int conn_i
     ev.events = EPOLLIN;
     ev.data.fd = pool->conns[conn_idx].fd;
 
-    if (epoll_ctl(pool->poller->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1)
+    if (ap_net_io->epoll_ctl(pool->poller->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1)
     {
         ap_error_set("ap_net_conn_pool_poller_add_conn()", AP_ERRNO_SYSTEM);
         return 0;
@@ -60,7 +60,7 @@ int ap_net_conn_pool_poller_remove_conn(struct ap_net_conn_pool_t *pool, int con
     ev.data.fd = pool->conns[conn_idx].fd;
 
     /* ENOENT = 'No such file or directory'. Means that our fd is maybe from already closed conn or removed lately, so we can ignore error */
-    if ( epoll_ctl(pool->poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev) == -1 && errno != ENOENT )
+    if ( ap_net_io->epoll_ctl(pool->poller->epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev) == -1 && errno != ENOENT )
     {
         ap_error_set("ap_net_conn_pool_poller_remove_conn()", AP_ERRNO_SYSTEM);
         return 0;
@@ -69,6 +69,51 @@ int ap_net_conn_pool_poller_remove_conn(struct ap_net_conn_pool_t *pool, int con
     return 1;
 }
 
+/* ********************************************************************** */
+/** \brief Changes the events reported for connection's socket
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int - Connection index
+ * \param events unsigned - EPOLLIN and/or EPOLLOUT. Errors and hangups are reported always
+ * \return int - True on success, False on error
+ *
+ * Connection not in poller is not an error
+ */
+int ap_net_conn_pool_poller_set_events(struct ap_net_conn_pool_t *pool, int conn_idx, unsigned events)
+{
+    struct epoll_event ev;
+
+
+    if ( pool->poller == NULL )
+        return 1;
+
+    ev.events = events;
+    ev.data.fd = pool->conns[conn_idx].fd;
+
+    if ( ap_net_io->epoll_ctl(pool->poller->epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev) == -1 && errno != ENOENT )
+    {
+        ap_error_set("ap_net_conn_pool_poller_set_events()", AP_ERRNO_SYSTEM);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Turns reporting of socket's readiness for output on or off
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int - Connection index
+ * \param on int - True to get EPOLLOUT events along with EPOLLIN
+ * \return int - True on success, False on error
+ *
+ * Used by the transfers that are resumed when socket can take more data
+ */
+int ap_net_conn_pool_poller_set_out(struct ap_net_conn_pool_t *pool, int conn_idx, int on)
+{
+    return ap_net_conn_pool_poller_set_events(pool, conn_idx, on ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
 /* ********************************************************************** */
 /** \brief Creates poller for the given pool
  *
@@ -3,6 +3,75 @@
  */
 #include "conn_pool_internals.h"
 
+/** How many times ap_net_conn_pool_get_stat() retries to get the counters unchanged between two reads */
+#define max_snapshot_tries 4
+
+#define load_counter(field) dst->field = __atomic_load_n(&src->field, __ATOMIC_RELAXED)
+
+/* ********************************************************************** */
+/* copies all counters one by one with relaxed atomic loads */
+static void load_stat(struct ap_net_stat_t *dst, struct ap_net_stat_t *src)
+{
+    int i;
+
+
+    load_counter(conn_count);
+    load_counter(timedout);
+    load_counter(queue_full_count);
+    load_counter(active_conn_count);
+    load_counter(total_time_ns);
+    dst->total_time.tv_sec = dst->total_time_ns / 1000000000ull; /* not loaded, as it is not updated atomically */
+    dst->total_time.tv_nsec = dst->total_time_ns % 1000000000ull;
+    load_counter(bytes_in);
+    load_counter(bytes_out);
+    load_counter(msgs_in);
+    load_counter(msgs_out);
+    load_counter(recv_calls);
+    load_counter(send_calls);
+    load_counter(epoll_calls);
+    load_counter(accept_calls);
+    load_counter(eagain_in);
+    load_counter(eagain_out);
+    load_counter(partial_sends);
+    load_counter(buf_full);
+    load_counter(errors);
+
+    for ( i = 0; i < AP_NET_SIGNALS_COUNT; ++i )
+        load_counter(signals[i]);
+}
+
+/* ********************************************************************** */
+/** \brief Copies pool's statistics counters. Safe to call from other thread than the one doing ap_net_conn_pool_poll()
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param dst struct ap_net_stat_t* - destination
+ * \return int - true if the snapshot is consistent, false if the counters kept changing while being copied
+ *
+ * The counters are read twice and compared to make sure no update slipped in between.
+ * If the pool is too busy for this to succeed after several tries, then the latest copy is left in dst anyway.
+ * Every single counter in it is still valid, but they may be off by an update or so relative to each other.
+ */
+int ap_net_conn_pool_get_stat(struct ap_net_conn_pool_t *pool, struct ap_net_stat_t *dst)
+{
+    struct ap_net_stat_t check;
+    int try;
+
+
+    memset(dst, 0, sizeof(struct ap_net_stat_t)); /* clearing struct's padding for memcmp() */
+    memset(&check, 0, sizeof(struct ap_net_stat_t));
+
+    for ( try = 0; try < max_snapshot_tries; ++try )
+    {
+        load_stat(dst, &pool->stat);
+        load_stat(&check, &pool->stat);
+
+        if ( 0 == memcmp(dst, &check, sizeof(struct ap_net_stat_t)) )
+            return 1;
+    }
+
+    return 0;
+}
+
 /* ********************************************************************** */
 /** \brief Prints to debugging channel(s) summary from statistics gathered on given pool
  *
@@ -13,14 +82,39 @@
 void ap_net_conn_pool_print_stat(struct ap_net_conn_pool_t *pool, char *intro_message)
 {
     long n;
+    int i;
+    struct ap_net_stat_t stat;
+
+
+    ap_net_conn_pool_get_stat(pool, &stat);
+
+    n = stat.conn_count == 0 ? 0 : (long)stat.active_conn_count * 100 / stat.conn_count;
+
+    ap_log_debug_log("\n# ap_net statistics: %s\n\ttotal conns: %u, avg: %ld.%02ld, t/o count: %u, queue full: %u times\n",
+         intro_message, stat.conn_count, n / 100, n % 100, stat.timedout, stat.queue_full_count);
+
+    /* average connection time in milliseconds */
+    n = stat.conn_count == 0 ? 0 : (long)(stat.total_time_ns / 1000000 / stat.conn_count);
+
+    ap_log_debug_log("\ttotal time: %ld sec, avg per conn: %ld.%03ld sec\n", (long)(stat.total_time_ns / 1000000000ull), n / 1000, n % 1000);
+
+    ap_log_debug_log("\tin: %llu bytes, %llu msgs; out: %llu bytes, %llu msgs, %llu partial\n",
+         (unsigned long long)stat.bytes_in, (unsigned long long)stat.msgs_in,
+         (unsigned long long)stat.bytes_out, (unsigned long long)stat.msgs_out, (unsigned long long)stat.partial_sends);
 
+    ap_log_debug_log("\tcalls: recv %llu, send %llu, epoll_wait %llu, accept %llu; EAGAIN in: %llu, out: %llu; buffer full: %llu; errors: %llu\n",
+         (unsigned long long)stat.recv_calls, (unsigned long long)stat.send_calls,
+         (unsigned long long)stat.epoll_calls, (unsigned long long)stat.accept_calls,
+         (unsigned long long)stat.eagain_in, (unsigned long long)stat.eagain_out,
+         (unsigned long long)stat.buf_full, (unsigned long long)stat.errors);
 
-    n = pool->stat.active_conn_count * 100 / pool->stat.conn_count;
+    ap_log_debug_log("\tsignals:");
 
-    ap_log_debug_log("\n# ap_net statistics: %s\n\ttotal conns: %u, avg: %d.%02d, t/o count: %u, queue full: %u times\n",
-         intro_message, pool->stat.conn_count, n / 100, n % 100, pool->stat.timedout, pool->stat.queue_full_count);
+    for ( i = 0; i < AP_NET_SIGNALS_COUNT; ++i )
+        ap_log_debug_log(" %d:%llu", i, (unsigned long long)stat.signals[i]);
 
-    n = pool->stat.total_time.tv_sec * 1000000 + pool->stat.total_time.tv_nsec / 1000000;
+    ap_log_debug_log("\n");
 
-    ap_log_debug_log("\ttotal time: %ld sec, avg per conn: %ld.%03d\n", pool->stat.total_time.tv_sec, n / 1000000, n % 1000000);
+    if ( pool->profile != NULL )
+        ap_net_conn_pool_print_profile(pool, intro_message);
 }
@@ -0,0 +1,370 @@
+/** \file ap_net/conn_pool_profiler.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Poll cycle phases and callbacks profiler
+ */
+#include "conn_pool_internals.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_profiler_enable()";
+
+static const char *phase_names[AP_NET_PHASES_COUNT] = { "zombies", "epoll", "accept", "recv", "callback", "expiry", "cycle" };
+
+static const char *signal_names[AP_NET_SIGNALS_COUNT] = { "CREATED", "DESTROYING", "CONNECTED", "ACCEPTED", "CLOSING",
+    "MOVED_TO", "MOVED_FROM", "DATA_IN", "CAN_SEND", "TIMED_OUT", "DATA_LEFT", "SEND_DONE", "RECV_DONE",
+    "MESSAGE" };
+
+/* read() layout of perf_event group with PERF_FORMAT_GROUP */
+struct hw_read_t
+{
+    uint64_t nr;
+    uint64_t values[2];
+};
+
+/* ********************************************************************** */
+/* opens one user-space only hardware counter. group_fd is -1 for the group leader */
+static int open_hw_counter(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* ********************************************************************** */
+/* reads both counters of the group. returns false if not available */
+static int read_hw_counters(struct ap_net_profile_t *profile, uint64_t *values)
+{
+    struct hw_read_t data;
+
+
+    if ( read(profile->hw_fd, &data, sizeof(data)) != sizeof(data) )
+        return 0;
+
+    values[0] = data.values[0];
+    values[1] = data.values[1];
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Enables poll cycle profiler for the pool
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param flags int - AP_NET_PROFILE_* bits
+ * \param slow_callback_us int - callbacks running longer than this are counted as slow and logged to debug channel. 0 to disable
+ * \return int - true/false
+ *
+ * Each ap_net_conn_pool_poll() call is split into the phases:
+ * AP_NET_PHASE_ZOMBIES - closing connections that are disconnected on previous cycle,
+ * AP_NET_PHASE_EPOLL - epoll_wait() itself,
+ * AP_NET_PHASE_ACCEPT - listener events processing, AP_NET_PHASE_RECV - connections events processing,
+ * AP_NET_PHASE_EXPIRY - scan for expired connections and sending of held output (see ap_net_conn_pool_cork_enable()). Time spent in user's callback is excluded from the phases above and
+ * accumulated in AP_NET_PHASE_CALLBACK instead. AP_NET_PHASE_CYCLE is the whole call.
+ * Phase times per cycle and callback times per signal are collected in log-linear histograms (see ap_utils_hist_add())
+ * using CLOCK_MONOTONIC, which is vDSO-backed and TSC-based on most of the systems.
+ * With AP_NET_PROFILE_HW_COUNTERS flag the CPU cycles and cache misses spent inside ap_net_conn_pool_poll() are counted too.
+ * It is not an error if the system does not allow perf_event_open(): the hw_fd field of pool->profile will be -1 then.
+ * Calling it again on the pool with enabled profiler resets the data.
+ */
+int ap_net_conn_pool_profiler_enable(struct ap_net_conn_pool_t *pool, int flags, int slow_callback_us)
+{
+    struct ap_net_profile_t *profile;
+
+
+    ap_error_clear();
+
+    if ( slow_callback_us < 0 )
+    {
+        ap_error_set_custom(_func_name, "bad slow callback threshold: %d", slow_callback_us);
+        return 0;
+    }
+
+    if ( pool->profile != NULL )
+        ap_net_conn_pool_profiler_disable(pool);
+
+    profile = malloc(sizeof(struct ap_net_profile_t));
+
+    if ( profile == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    profile->flags = flags;
+    profile->slow_callback_ns = (uint64_t)slow_callback_us * 1000;
+    profile->hw_fd = -1;
+    profile->hw_fd_misses = -1;
+
+    if ( bit_is_set(flags, AP_NET_PROFILE_HW_COUNTERS) )
+    {
+        profile->hw_fd = open_hw_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+
+        if ( profile->hw_fd != -1 )
+        {
+            profile->hw_fd_misses = open_hw_counter(PERF_COUNT_HW_CACHE_MISSES, profile->hw_fd);
+
+            if ( profile->hw_fd_misses == -1 )
+            {
+                close(profile->hw_fd);
+                profile->hw_fd = -1;
+            }
+            else
+                ioctl(profile->hw_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+
+        if ( profile->hw_fd == -1 && ap_log_debug_on(1) )
+            ap_log_debug_log("* profiler: hardware counters are not available: %s\n", strerror(errno));
+    }
+
+    pool->profile = profile;
+
+    ap_net_conn_pool_profiler_reset(pool);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Disables poll cycle profiler and frees it's memory
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ */
+void ap_net_conn_pool_profiler_disable(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_profile_t *profile;
+
+
+    profile = pool->profile;
+
+    if ( profile == NULL )
+        return;
+
+    pool->profile = NULL;
+
+    if ( profile->hw_fd != -1 )
+    {
+        close(profile->hw_fd_misses);
+        close(profile->hw_fd);
+    }
+
+    free(profile);
+}
+
+/* ********************************************************************** */
+/** \brief Clears the data collected by profiler, keeping it enabled
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ */
+void ap_net_conn_pool_profiler_reset(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_profile_t *profile;
+    int i;
+
+
+    profile = pool->profile;
+
+    if ( profile == NULL )
+        return;
+
+    for ( i = 0; i < AP_NET_PHASES_COUNT; ++i )
+        ap_utils_hist_clear(&profile->phase[i]);
+
+    for ( i = 0; i < AP_NET_SIGNALS_COUNT; ++i )
+        ap_utils_hist_clear(&profile->signal[i]);
+
+    profile->slow_callbacks = 0;
+    profile->slowest_callback_ns = 0;
+    profile->slowest_signal = -1;
+    profile->hw_cycles = 0;
+    profile->hw_cache_misses = 0;
+    profile->callback_ns = 0;
+    profile->in_cycle = 0;
+    profile->callback_depth = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Calls pool's callback function, measuring it's execution time
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn struct ap_net_connection_t*
+ * \param signal_type int - AP_NET_SIGNAL_*
+ * \return int - callback's result
+ *
+ * Internal thing. Used via ap_net_conn_pool_signal() inside toolkit when profiler is enabled
+ */
+int ap_net_profile_callback(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int signal_type)
+{
+    struct ap_net_profile_t *profile;
+    uint64_t start;
+    uint64_t elapsed;
+    int retval;
+
+
+    profile = pool->profile;
+
+    ++profile->callback_depth;
+
+    start = ap_utils_clock_ns();
+    retval = pool->callback_func(conn, signal_type);
+    elapsed = ap_utils_clock_ns() - start;
+
+    --profile->callback_depth;
+
+    if ( signal_type >= 0 && signal_type < AP_NET_SIGNALS_COUNT )
+        ap_utils_hist_add(&profile->signal[signal_type], elapsed);
+
+    if ( profile->in_cycle && profile->callback_depth == 0 ) /* nested ones are already counted by the outer */
+        profile->callback_ns += elapsed;
+
+    if ( profile->slow_callback_ns != 0 && elapsed > profile->slow_callback_ns )
+    {
+        ++profile->slow_callbacks;
+
+        if ( ap_log_debug_on(1) )
+            ap_log_debug_log("* profiler: slow callback on conn #%d, signal %d: %llu us\n", conn->idx, signal_type,
+                    (unsigned long long)(elapsed / 1000));
+    }
+
+    if ( elapsed > profile->slowest_callback_ns )
+    {
+        profile->slowest_callback_ns = elapsed;
+        profile->slowest_signal = signal_type;
+    }
+
+    return retval;
+}
+
+/* ********************************************************************** */
+/** \brief Starts new poll cycle measurement
+ *
+ * \param profile struct ap_net_profile_t*
+ * \return void
+ *
+ * Internal thing. Called from ap_net_conn_pool_poll()
+ */
+void ap_net_profile_cycle_begin(struct ap_net_profile_t *profile)
+{
+    if ( profile->hw_fd != -1 && ! read_hw_counters(profile, profile->hw_start) )
+        profile->hw_start[0] = profile->hw_start[1] = 0;
+
+    profile->cycle_start = profile->mark = ap_utils_clock_ns();
+    profile->callback_ns = 0;
+    profile->mark_callback_ns = 0;
+    profile->in_cycle = 1;
+}
+
+/* ********************************************************************** */
+/** \brief Closes the current phase of poll cycle
+ *
+ * \param profile struct ap_net_profile_t*
+ * \param phase int - AP_NET_PHASE_*
+ * \return void
+ *
+ * Internal thing. Used via ap_net_conn_pool_profile_phase() macro inside ap_net_conn_pool_poll().
+ * Callbacks time spent since the previous phase end is subtracted.
+ */
+void ap_net_profile_phase_end(struct ap_net_profile_t *profile, int phase)
+{
+    uint64_t now;
+    uint64_t elapsed;
+
+
+    now = ap_utils_clock_ns();
+    elapsed = now - profile->mark - (profile->callback_ns - profile->mark_callback_ns);
+
+    ap_utils_hist_add(&profile->phase[phase], elapsed);
+
+    profile->mark = now;
+    profile->mark_callback_ns = profile->callback_ns;
+}
+
+/* ********************************************************************** */
+/** \brief Ends poll cycle measurement
+ *
+ * \param profile struct ap_net_profile_t*
+ * \return void
+ *
+ * Internal thing. Called from ap_net_conn_pool_poll()
+ */
+void ap_net_profile_cycle_end(struct ap_net_profile_t *profile)
+{
+    uint64_t hw_end[2];
+
+
+    ap_utils_hist_add(&profile->phase[AP_NET_PHASE_CALLBACK], profile->callback_ns);
+    ap_utils_hist_add(&profile->phase[AP_NET_PHASE_CYCLE], profile->mark - profile->cycle_start);
+
+    if ( profile->hw_fd != -1 && read_hw_counters(profile, hw_end) )
+    {
+        profile->hw_cycles += hw_end[0] - profile->hw_start[0];
+        profile->hw_cache_misses += hw_end[1] - profile->hw_start[1];
+    }
+
+    profile->in_cycle = 0;
+}
+
+/* ********************************************************************** */
+/* prints one histogram line. times are in microseconds */
+static void print_hist(const char *name, struct ap_utils_hist_t *hist)
+{
+    if ( hist->count == 0 )
+        return;
+
+    ap_log_debug_log("\t%-12s count: %llu, avg: %.3f, p50: %.3f, p99: %.3f, p99.9: %.3f, max: %.3f\n", name,
+        (unsigned long long)hist->count, (double)hist->sum / hist->count / 1000.0,
+        ap_utils_hist_percentile(hist, 50.0) / 1000.0, ap_utils_hist_percentile(hist, 99.0) / 1000.0,
+        ap_utils_hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+}
+
+/* ********************************************************************** */
+/** \brief Prints to debugging channel(s) summary of the data collected by profiler
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param intro_message char * - Introduction message printed before the numbers start showing
+ * \return void
+ *
+ * Also called from ap_net_conn_pool_print_stat() if profiler is enabled.
+ * For the raw data use pool->profile fields directly.
+ */
+void ap_net_conn_pool_print_profile(struct ap_net_conn_pool_t *pool, char *intro_message)
+{
+    struct ap_net_profile_t *profile;
+    int i;
+
+
+    profile = pool->profile;
+
+    if ( profile == NULL )
+        return;
+
+    ap_log_debug_log("\n# ap_net profile: %s\n\tphase times per poll cycle, us:\n", intro_message);
+
+    for ( i = 0; i < AP_NET_PHASES_COUNT; ++i )
+        print_hist(phase_names[i], &profile->phase[i]);
+
+    ap_log_debug_log("\tcallback times per signal, us:\n");
+
+    for ( i = 0; i < AP_NET_SIGNALS_COUNT; ++i )
+        print_hist(signal_names[i], &profile->signal[i]);
+
+    ap_log_debug_log("\tslow callbacks: %llu, slowest: %.3f us (signal %d)\n", (unsigned long long)profile->slow_callbacks,
+        profile->slowest_callback_ns / 1000.0, profile->slowest_signal);
+
+    if ( profile->hw_fd != -1 && profile->phase[AP_NET_PHASE_CYCLE].count != 0 )
+        ap_log_debug_log("\tCPU cycles: %llu (%llu per poll), cache misses: %llu (%llu per poll)\n",
+            (unsigned long long)profile->hw_cycles, (unsigned long long)(profile->hw_cycles / profile->phase[AP_NET_PHASE_CYCLE].count),
+            (unsigned long long)profile->hw_cache_misses,
+            (unsigned long long)(profile->hw_cache_misses / profile->phase[AP_NET_PHASE_CYCLE].count));
+}
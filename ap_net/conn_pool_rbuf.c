@@ -0,0 +1,229 @@
+/** \file ap_net/conn_pool_rbuf.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Receiving buffers handoff to application
+ *
+ * The connection's buffer with the data application wants to keep is given away as is, and the connection
+ * gets a fresh one of the same size from the pool's free list. The buffer comes back to the list when the last reference
+ * is released, which may be done by any thread. Pool's thread takes the returned buffers to the free list when it needs one.
+ */
+#include "conn_pool_internals.h"
+
+static const char *_func_name = "ap_net_conn_pool_buf_detach()";
+
+/* ********************************************************************** */
+/* frees buffers of the list */
+static void rbuf_free_list(struct ap_net_rbuf_t *rb)
+{
+    struct ap_net_rbuf_t *next;
+
+
+    for ( ; rb != NULL; rb = next )
+    {
+        next = rb->next;
+        free(rb->mem);
+        free(rb);
+    }
+}
+
+/* ********************************************************************** */
+/* gets buffer of given size for connection. NULL if out of memory */
+static struct ap_net_rbuf_t *rbuf_get(struct ap_net_rbufs_t *rbufs, int size)
+{
+    struct ap_net_rbuf_t *rb;
+    void *new_mem;
+
+
+    if ( rbufs->free_list == NULL ) /* taking all released by now at once */
+        rbufs->free_list = __atomic_exchange_n(&rbufs->returned, NULL, __ATOMIC_ACQUIRE);
+
+    rb = rbufs->free_list;
+
+    if ( rb != NULL )
+    {
+        rbufs->free_list = rb->next;
+
+        if ( rb->size != size ) /* pool's buffer size was changed */
+        {
+            if ( NULL == (new_mem = realloc(rb->mem, size)) )
+            {
+                rb->next = rbufs->free_list;
+                rbufs->free_list = rb;
+                return NULL;
+            }
+
+            rb->mem = new_mem;
+            rb->size = size;
+        }
+
+        return rb;
+    }
+
+    if ( NULL == (rb = malloc(sizeof(struct ap_net_rbuf_t))) )
+        return NULL;
+
+    if ( NULL == (rb->mem = malloc(size)) )
+    {
+        free(rb);
+        return NULL;
+    }
+
+    rb->size = size;
+    rb->owner = rbufs;
+    ++rbufs->allocated;
+
+    return rb;
+}
+
+/* ********************************************************************** */
+/** \brief Takes unprocessed data of connection's buffer away from pool, to be used without copying
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \param len int - bytes to take from conn->bufpos on. 0 - all up to conn->buffill
+ * \return struct ap_net_rbuf_t* - the buffer with data/len set to the detached part. NULL on error
+ *
+ * The connection gets a fresh buffer from the pool's free list, the data after the detached part (if any) is copied there
+ * and bufpos is set to 0. So detaching a message when the next one is not here yet costs no copying at all.
+ * The returned buffer has one reference. Give it to other threads as is or with more references by ap_net_rbuf_ref()
+ * and call ap_net_rbuf_release() for each when done. Then it goes back to the free list.
+ * Buffers released after ap_net_conn_pool_destroy() are freed.
+ */
+struct ap_net_rbuf_t *ap_net_conn_pool_buf_detach(struct ap_net_conn_pool_t *pool, int conn_idx, int len)
+{
+    struct ap_net_connection_t *conn;
+    struct ap_net_rbuf_t *rb;
+    char *mem;
+    int tail;
+
+
+    ap_error_clear();
+
+    if ( conn_idx < 0 || conn_idx >= pool->max_connections || ! bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_INVALID_CONN_INDEX, "%d", conn_idx);
+        return NULL;
+    }
+
+    conn = &pool->conns[conn_idx];
+
+    if ( len == 0 )
+        len = conn->buffill - conn->bufpos;
+
+    if ( len <= 0 || len > conn->buffill - conn->bufpos )
+    {
+        ap_error_set_custom(_func_name, "no such data in buffer");
+        return NULL;
+    }
+
+    if ( pool->rbufs == NULL )
+    {
+        if ( NULL == (pool->rbufs = calloc(1, sizeof(struct ap_net_rbufs_t))) )
+        {
+            ap_error_set(_func_name, AP_ERRNO_OOM);
+            return NULL;
+        }
+
+        pool->rbufs->refs = 1; /* pool's own */
+    }
+
+    if ( NULL == (rb = rbuf_get(pool->rbufs, conn->bufsize)) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return NULL;
+    }
+
+    /* swapping the memory: the filled one goes with rb */
+    mem = rb->mem;
+    rb->mem = conn->buf;
+    conn->buf = mem;
+
+    rb->data = rb->mem + conn->bufpos;
+    rb->len = len;
+    rb->refs = 1;
+
+    tail = conn->buffill - conn->bufpos - len;
+
+    if ( tail > 0 )
+        memcpy(conn->buf, rb->data + len, tail);
+
+    conn->bufpos = 0;
+    conn->buffill = tail;
+
+    __atomic_fetch_add(&pool->rbufs->refs, 1, __ATOMIC_RELAXED);
+    ++pool->rbufs->detached;
+    pool->rbufs->tail_bytes += tail;
+
+    return rb;
+}
+
+/* ********************************************************************** */
+/** \brief Adds reference to detached buffer. Thread safe
+ *
+ * \param rb struct ap_net_rbuf_t* - buffer from ap_net_conn_pool_buf_detach()
+ * \return void
+ */
+void ap_net_rbuf_ref(struct ap_net_rbuf_t *rb)
+{
+    __atomic_fetch_add(&rb->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* ********************************************************************** */
+/** \brief Drops reference to detached buffer. The last one gives it back to the pool. Thread safe
+ *
+ * \param rb struct ap_net_rbuf_t* - buffer from ap_net_conn_pool_buf_detach()
+ * \return void
+ *
+ * The buffer's memory should not be used after that.
+ */
+void ap_net_rbuf_release(struct ap_net_rbuf_t *rb)
+{
+    struct ap_net_rbufs_t *rbufs;
+    struct ap_net_rbuf_t *head;
+
+
+    if ( __atomic_sub_fetch(&rb->refs, 1, __ATOMIC_ACQ_REL) != 0 )
+        return;
+
+    rbufs = rb->owner;
+
+    /* push only, the pool takes the whole list at once, so there is no ABA problem */
+    head = __atomic_load_n(&rbufs->returned, __ATOMIC_RELAXED);
+
+    do
+        rb->next = head;
+    while ( ! __atomic_compare_exchange_n(&rbufs->returned, &head, rb, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+
+    if ( __atomic_sub_fetch(&rbufs->refs, 1, __ATOMIC_ACQ_REL) == 0 ) /* the pool is destroyed already */
+    {
+        rbuf_free_list(__atomic_exchange_n(&rbufs->returned, NULL, __ATOMIC_ACQUIRE));
+        free(rbufs);
+    }
+}
+
+/* ********************************************************************** */
+/** \brief Frees the buffers in pool's hands. The ones detached are freed on their release
+ * \internal
+ *
+ * Called by ap_net_conn_pool_destroy()
+ */
+void ap_net_rbuf_free(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_rbufs_t *rbufs;
+
+
+    if ( pool->rbufs == NULL )
+        return;
+
+    rbufs = pool->rbufs;
+    pool->rbufs = NULL;
+
+    rbuf_free_list(rbufs->free_list);
+    rbufs->free_list = NULL;
+
+    rbuf_free_list(__atomic_exchange_n(&rbufs->returned, NULL, __ATOMIC_ACQUIRE));
+
+    if ( __atomic_sub_fetch(&rbufs->refs, 1, __ATOMIC_ACQ_REL) == 0 )
+    {
+        rbuf_free_list(__atomic_exchange_n(&rbufs->returned, NULL, __ATOMIC_ACQUIRE)); /* released meanwhile */
+        free(rbufs);
+    }
+}
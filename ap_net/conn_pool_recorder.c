@@ -0,0 +1,394 @@
+/** \file ap_net/conn_pool_recorder.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Flight recorder of connections lifecycle events
+ */
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_recorder_enable()";
+
+/** Maximum count of recorders that can be dumped at once by ap_net_recorder_dump_all() */
+#define max_recorders 64
+
+static struct ap_net_recorder_t *recorders[max_recorders]; /* registered recorders. slot is NULL if free */
+static char dump_file_name[PATH_MAX]; /* output file for ap_net_recorder_dump_on_signal() */
+static int dumps_running; /* dumps in progress, maybe from signal handlers. disabling recorder waits for them to end */
+
+static const char *event_names[] = { "?", "ACCEPT", "CONNECT", "RECV", "SEND", "CLOSE", "EXPIRE", "ERROR" };
+
+/* ********************************************************************** */
+/** \brief Enables always-on flight recorder for the pool
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param max_events int - ring size. Rounded up to the power of two. The oldest events are overwritten when it is full
+ * \return int - true/false
+ *
+ * The recorder is cheap enough to be left on permanently in production, unlike poller->debug.
+ * It stores the latest accept, connect, recv (bytes count), send (bytes count), close (state bits), expire and error (errno) events
+ * for each connection of pool along with CLOCK_MONOTONIC timestamps.
+ * Recording is lock-free: the slot is reserved by atomic increment, so it is safe to record from many threads at once.
+ * Use ap_net_conn_pool_recorder_dump() or ap_net_recorder_dump_all() to get the events out. Both are safe to call from signal handler,
+ * so ap_net_recorder_dump_on_signal() can be used to get the dump on SIGUSR1 or crash.
+ * Calling it again on the pool with enabled recorder re-creates it, dropping recorded events.
+ */
+int ap_net_conn_pool_recorder_enable(struct ap_net_conn_pool_t *pool, int max_events)
+{
+    struct ap_net_recorder_t *rec;
+    struct ap_net_recorder_t *expected;
+    unsigned long size;
+    int i;
+
+
+    ap_error_clear();
+
+    if ( max_events <= 0 )
+    {
+        ap_error_set_custom(_func_name, "bad events count: %d", max_events);
+        return 0;
+    }
+
+    if ( pool->recorder != NULL )
+        ap_net_conn_pool_recorder_disable(pool);
+
+    for ( size = 1; size < (unsigned long)max_events; size <<= 1 )
+        ;
+
+    rec = malloc(sizeof(struct ap_net_recorder_t));
+
+    if ( rec == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    rec->events = calloc(size, sizeof(struct ap_net_recorder_event_t));
+
+    if ( rec->events == NULL )
+    {
+        free(rec);
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    rec->size_mask = size - 1;
+    rec->head = 0;
+    rec->id = -1;
+
+    for ( i = 0; i < max_recorders; ++i ) /* registering for ap_net_recorder_dump_all(). not fatal if there is no free slots */
+    {
+        expected = NULL;
+
+        if ( __atomic_compare_exchange_n(&recorders[i], &expected, rec, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
+        {
+            rec->id = i;
+            break;
+        }
+    }
+
+    pool->recorder = rec;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Disables flight recorder and frees it's memory
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ *
+ * Waits for the dumps started before the recorder was unregistered to end, as they may still read it.
+ * So it should not be called from signal handler.
+ */
+void ap_net_conn_pool_recorder_disable(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_recorder_t *rec;
+
+
+    rec = pool->recorder;
+
+    if ( rec == NULL )
+        return;
+
+    __atomic_store_n(&pool->recorder, NULL, __ATOMIC_SEQ_CST);
+
+    if ( rec->id != -1 )
+        __atomic_store_n(&recorders[rec->id], NULL, __ATOMIC_SEQ_CST);
+
+    /* the dumps starting from now on can not see it anymore */
+    while ( __atomic_load_n(&dumps_running, __ATOMIC_SEQ_CST) > 0 )
+        usleep(1000);
+
+    free(rec->events);
+    free(rec);
+}
+
+/* ********************************************************************** */
+/** \brief Adds new event to the recorder
+ *
+ * \param recorder struct ap_net_recorder_t *
+ * \param type int - AP_NET_REC_*
+ * \param conn struct ap_net_connection_t * - connection the event belongs to. Can be NULL
+ * \param value int - event's data: bytes count, state bits or errno
+ * \return void
+ *
+ * Internal thing. Used via ap_net_conn_pool_record() macro inside toolkit
+ */
+void ap_net_recorder_add(struct ap_net_recorder_t *recorder, int type, struct ap_net_connection_t *conn, int value)
+{
+    unsigned long seq;
+    struct timespec ts;
+    struct ap_net_recorder_event_t *ev;
+
+
+    seq = __atomic_fetch_add(&recorder->head, 1, __ATOMIC_RELAXED);
+    ev = &recorder->events[seq & recorder->size_mask];
+
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED); /* marking slot as being written */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ap_utils_clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ev->time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    ev->type = type;
+    ev->conn_idx = conn == NULL ? -1 : conn->idx;
+    ev->fd = conn == NULL ? -1 : conn->fd;
+    ev->value = value;
+
+    __atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* ********************************************************************** */
+/* async-signal safe number formatting. returns pointer past the last char written */
+static char *put_number(char *dst, long long n, int min_digits)
+{
+    char tmp[24];
+    int len;
+    unsigned long long u;
+
+
+    if ( n < 0 )
+    {
+        *dst++ = '-';
+        u = -(unsigned long long)n;
+    }
+    else
+        u = n;
+
+    len = 0;
+
+    do
+    {
+        tmp[len++] = '0' + u % 10;
+        u /= 10;
+    } while ( u != 0 );
+
+    for ( ; len < min_digits; --min_digits )
+        *dst++ = '0';
+
+    while ( len )
+        *dst++ = tmp[--len];
+
+    return dst;
+}
+
+/* ********************************************************************** */
+static char *put_string(char *dst, const char *s)
+{
+    while ( *s )
+        *dst++ = *s++;
+
+    return dst;
+}
+
+/* ********************************************************************** */
+/* dumps one recorder. skipping slots being written at the moment */
+static int dump_recorder(struct ap_net_recorder_t *rec, int fd)
+{
+    unsigned long head;
+    unsigned long seq;
+    unsigned long first;
+    int count;
+    char line[160];
+    char *p;
+    struct ap_net_recorder_event_t ev;
+    struct ap_net_recorder_event_t *slot;
+
+
+    head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+    first = head > rec->size_mask + 1 ? head - rec->size_mask - 1 : 0;
+    count = 0;
+
+    for ( seq = first; seq < head; ++seq )
+    {
+        slot = &rec->events[seq & rec->size_mask];
+
+        if ( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1 )
+            continue; /* overwritten or incomplete */
+
+        ev = *slot;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if ( __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1 )
+            continue; /* overwritten while we were copying */
+
+        p = put_number(line, ev.time_ns / 1000000000ull, 1);
+        *p++ = '.';
+        p = put_number(p, ev.time_ns % 1000000000ull, 9);
+        p = put_string(p, " rec#");
+        p = put_number(p, rec->id, 1);
+        p = put_string(p, " conn #");
+        p = put_number(p, ev.conn_idx, 1);
+        p = put_string(p, " fd ");
+        p = put_number(p, ev.fd, 1);
+        *p++ = ' ';
+        p = put_string(p, (ev.type > 0 && ev.type <= AP_NET_REC_ERROR) ? event_names[ev.type] : event_names[0]);
+        *p++ = ' ';
+        p = put_number(p, ev.value, 1);
+        *p++ = '\n';
+
+        if ( write(fd, line, p - line) <= 0 )
+            return -1;
+
+        ++count;
+    }
+
+    return count;
+}
+
+/* ********************************************************************** */
+/** \brief Writes pool's recorded events into given file or socket descriptor, oldest first
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param fd int - output file or socket descriptor
+ * \return int - count of events written or -1 on error
+ *
+ * Line format is: "seconds.nanoseconds rec#N conn #idx fd FD TYPE value"
+ * The function is async-signal safe and do not allocate memory, so it can be called from crash handler
+ */
+int ap_net_conn_pool_recorder_dump(struct ap_net_conn_pool_t *pool, int fd)
+{
+    struct ap_net_recorder_t *rec;
+    int n;
+
+
+    __atomic_add_fetch(&dumps_running, 1, __ATOMIC_SEQ_CST);
+
+    rec = __atomic_load_n(&pool->recorder, __ATOMIC_SEQ_CST);
+    n = rec == NULL ? 0 : dump_recorder(rec, fd);
+
+    __atomic_sub_fetch(&dumps_running, 1, __ATOMIC_SEQ_CST);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Writes recorded events of all pools with enabled recorder into given file or socket descriptor
+ *
+ * \param fd int - output file or socket descriptor
+ * \return int - count of events written or -1 on error
+ *
+ * Async-signal safe. See ap_net_conn_pool_recorder_dump() for the format
+ */
+int ap_net_recorder_dump_all(int fd)
+{
+    int i;
+    int n;
+    int total;
+    struct ap_net_recorder_t *rec;
+
+
+    total = 0;
+
+    __atomic_add_fetch(&dumps_running, 1, __ATOMIC_SEQ_CST); /* holds off the recorders being freed */
+
+    for ( i = 0; i < max_recorders; ++i )
+    {
+        rec = __atomic_load_n(&recorders[i], __ATOMIC_SEQ_CST);
+
+        if ( rec == NULL )
+            continue;
+
+        n = dump_recorder(rec, fd);
+
+        if ( n == -1 )
+        {
+            total = -1;
+            break;
+        }
+
+        total += n;
+    }
+
+    __atomic_sub_fetch(&dumps_running, 1, __ATOMIC_SEQ_CST);
+
+    return total;
+}
+
+/* ********************************************************************** */
+/* signal handler for ap_net_recorder_dump_on_signal() */
+static void dump_signal_handler(int signal_number)
+{
+    int fd;
+    int saved_errno;
+
+
+    saved_errno = errno;
+
+    fd = open(dump_file_name, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+    if ( fd != -1 )
+    {
+        ap_net_recorder_dump_all(fd);
+        close(fd);
+    }
+
+    errno = saved_errno;
+}
+
+/* ********************************************************************** */
+/** \brief Installs signal handler that appends all recorders data to the file
+ *
+ * \param signal_number int - SIGUSR1 for on-demand dumps or crash signal like SIGSEGV, SIGBUS, SIGABRT
+ * \param file_name const char* - output file. Opened in append mode on each signal
+ * \return int - true/false
+ *
+ * For the crash signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT) the handler is one-shot,
+ * so the default action (core dump) is performed after the recorders are dumped.
+ * The file name is common for all signals, the last call sets it.
+ */
+int ap_net_recorder_dump_on_signal(int signal_number, const char *file_name)
+{
+    struct sigaction sa;
+
+
+    ap_error_clear();
+
+    if ( strlen(file_name) >= sizeof(dump_file_name) )
+    {
+        ap_error_set_custom("ap_net_recorder_dump_on_signal()", "file name is too long");
+        return 0;
+    }
+
+    strcpy(dump_file_name, file_name);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if ( signal_number == SIGSEGV || signal_number == SIGBUS || signal_number == SIGFPE
+         || signal_number == SIGILL || signal_number == SIGABRT )
+        sa.sa_flags |= SA_RESETHAND;
+
+    if ( -1 == sigaction(signal_number, &sa, NULL) )
+    {
+        ap_error_set_detailed("ap_net_recorder_dump_on_signal()", AP_ERRNO_SYSTEM, "sigaction()");
+        return 0;
+    }
+
+    return 1;
+}
@@ -50,7 +50,10 @@ int ap_net_conn_pool_recv(struct ap_net_conn_pool_t *pool, int conn_idx)
     space_left = conn->bufsize - conn->buffill;
 
     if ( space_left == 0 )
+    {
+        ap_net_conn_pool_stat_add(pool, buf_full, 1);
         return 0;
+    }
 
     conn->state |= AP_NET_ST_IN;
 
@@ -59,7 +62,7 @@ int ap_net_conn_pool_recv(struct ap_net_conn_pool_t *pool, int conn_idx)
         /* this UDP connection is outgoing only and we're doing trick with data moving from listener socket into this conn's buffer */
         slen = (conn->remote.af == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 
-        n = recvfrom(pool->listener.sock, conn->buf + conn->buffill, space_left, MSG_DONTWAIT | MSG_NOSIGNAL,
+        n = ap_net_io->recvfrom(pool->listener.sock, conn->buf + conn->buffill, space_left, MSG_DONTWAIT | MSG_NOSIGNAL,
                 (struct sockaddr*)&conn->remote, &slen
             );
     }
@@ -70,12 +73,31 @@ int ap_net_conn_pool_recv(struct ap_net_conn_pool_t *pool, int conn_idx)
 
     bit_clear(conn->state, AP_NET_ST_IN);
 
-    if ( n == 0 && errno != EAGAIN && errno != EWOULDBLOCK )/* remote is orderly shut down */
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_RECV : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_stat_add(pool, recv_calls, 1);
+
+    if ( n > 0 )
+    {
+        ap_net_conn_pool_stat_add(pool, bytes_in, n);
+        ap_net_conn_pool_stat_add(pool, msgs_in, 1);
+    }
+    else if ( n == -1 )
+    {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            ap_net_conn_pool_stat_add(pool, eagain_in, 1);
+        else
+            ap_net_conn_pool_stat_add(pool, errors, 1);
+    }
+
+    /* there was a room in buffer, so zero means remote is orderly shut down. errno is not set in this case and may be stale.
+     * for UDP it is just an empty datagram */
+    if ( n == 0 && bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
         return -2;
 
     if ( n == -1 )
     {
-        if (ap_log_debug_level)
+        if ( ap_log_debug_on(1) )
             ap_log_debug_log("? Connection [%d] is dead prematurely. retcode %d, error %s\n", conn_idx, n, EBADF, ap_error_get_string());
 
         ap_net_conn_pool_close_connection(pool, conn_idx);
@@ -83,6 +105,8 @@ int ap_net_conn_pool_recv(struct ap_net_conn_pool_t *pool, int conn_idx)
         return -1;
     }
 
+    ap_net_conn_pool_capture(pool, conn, 0, conn->buf + conn->buffill, n);
+
     conn->buffill += n;
 
     return n;
@@ -0,0 +1,316 @@
+/** \file ap_net/conn_pool_recv_into.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Direct reads into application's memory
+ *
+ * The next N bytes of connection are received straight into the destination given by application,
+ * bypassing the connection's buffer. The read goes on through as many poll cycles as needed.
+ * The end of it is reported by AP_NET_SIGNAL_CONN_RECV_DONE.
+ */
+#include "conn_pool_internals.h"
+
+static const char *_func_name = "ap_net_conn_pool_recv_into()";
+
+/** \brief Direct read of one connection
+*/
+typedef struct ap_net_recv_into_conn_t
+{
+    char *dst; /* NULL if no read */
+    int len; /* bytes asked for */
+    int done; /* bytes received so far */
+} ap_net_recv_into_conn_t;
+
+/* ********************************************************************** */
+/* makes reads array follow the pool's size */
+static int recv_into_grow(struct ap_net_recv_into_t *ri, int new_size)
+{
+    void *new_mem;
+
+
+    new_mem = realloc(ri->conns, new_size * sizeof(struct ap_net_recv_into_conn_t));
+
+    if ( new_mem == NULL )
+        return 0;
+
+    ri->conns = new_mem;
+    memset(ri->conns + ri->conns_size, 0, (new_size - ri->conns_size) * sizeof(struct ap_net_recv_into_conn_t));
+    ri->conns_size = new_size;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Starts receiving the next len bytes of connection straight into dst
+ *
+ * \param pool struct ap_net_conn_pool_t* - TCP pool
+ * \param conn_idx int
+ * \param dst void* - destination. Should stay valid until the read is done, cancelled or the connection is closed
+ * \param len int - bytes to receive
+ * \return int - bytes still to come. 0 if all is here already and no signal follows. -1 on error
+ *
+ * Meant for bulk payloads, which are usually copied from the connection's buffer by application anyway.
+ * Call it from AP_NET_SIGNAL_CONN_DATA_IN or AP_NET_SIGNAL_CONN_MESSAGE handler after parsing the header that tells the size.
+ * What is left unprocessed in the connection's buffer (bufpos..buffill) is taken first and bufpos is advanced past it.
+ * The rest is received by ap_net_conn_pool_poll() directly into dst, with no AP_NET_SIGNAL_CONN_DATA_IN meanwhile.
+ * When all len bytes are there AP_NET_SIGNAL_CONN_RECV_DONE is emitted. The callback may start the next read from there.
+ * Only one read per connection at a time. It is dropped when connection is closed,
+ * AP_NET_SIGNAL_CONN_CLOSING handler can check how far it got with ap_net_conn_pool_recv_into_left(). It goes on when connection is moved.
+ */
+int ap_net_conn_pool_recv_into(struct ap_net_conn_pool_t *pool, int conn_idx, void *dst, int len)
+{
+    struct ap_net_recv_into_t *ri;
+    struct ap_net_recv_into_conn_t *rc;
+    struct ap_net_connection_t *conn;
+    int n;
+
+
+    ap_error_clear();
+
+    if ( conn_idx < 0 || conn_idx >= pool->max_connections || ! bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_INVALID_CONN_INDEX, "%d", conn_idx);
+        return -1;
+    }
+
+    if ( ! bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        ap_error_set_custom(_func_name, "direct reads are for TCP pools only");
+        return -1;
+    }
+
+    if ( ap_net_conn_pool_bridged(pool, conn_idx) )
+    {
+        ap_error_set_custom(_func_name, "connection is bridged");
+        return -1;
+    }
+
+    if ( dst == NULL || len <= 0 )
+    {
+        ap_error_set_custom(_func_name, "no destination");
+        return -1;
+    }
+
+    if ( pool->recv_into == NULL && NULL == (pool->recv_into = calloc(1, sizeof(struct ap_net_recv_into_t))) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return -1;
+    }
+
+    ri = pool->recv_into;
+
+    if ( conn_idx >= ri->conns_size && ! recv_into_grow(ri, pool->max_connections) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return -1;
+    }
+
+    rc = &ri->conns[conn_idx];
+
+    if ( rc->dst != NULL )
+    {
+        ap_error_set_custom(_func_name, "connection has read in progress");
+        return -1;
+    }
+
+    conn = &pool->conns[conn_idx];
+
+    n = conn->buffill - conn->bufpos; /* already received part */
+
+    if ( n > len )
+        n = len;
+
+    if ( n > 0 )
+    {
+        memcpy(dst, conn->buf + conn->bufpos, n);
+        conn->bufpos += n;
+    }
+
+    if ( n == len )
+        return 0;
+
+    rc->dst = dst;
+    rc->len = len;
+    rc->done = n;
+
+    ++ri->active;
+
+    return len - n;
+}
+
+/* ********************************************************************** */
+/** \brief Receives the next part of direct read. Emits AP_NET_SIGNAL_CONN_RECV_DONE at the end
+ * \internal
+ *
+ * \return int - as ap_net_conn_pool_recv(): bytes received, -1 on error (the connection is closed), -2 on connection shutdown
+ *
+ * Called by ap_net_conn_pool_poll() on EPOLLIN instead of ap_net_conn_pool_recv() while ap_net_conn_pool_recv_into_left() > 0
+ */
+int ap_net_recv_into_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn)
+{
+    struct ap_net_recv_into_conn_t *rc;
+    int n;
+
+
+    rc = &pool->recv_into->conns[conn->idx];
+
+    conn->state |= AP_NET_ST_IN;
+
+    n = ap_net_recv(conn->fd, rc->dst + rc->done, rc->len - rc->done, 0);
+
+    bit_clear(conn->state, AP_NET_ST_IN);
+
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_RECV : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_stat_add(pool, recv_calls, 1);
+
+    if ( n == 0 ) /* there was a room, so it is the orderly shutdown */
+        return -2;
+
+    if ( n == -1 )
+    {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        {
+            ap_net_conn_pool_stat_add(pool, eagain_in, 1);
+            return 0;
+        }
+
+        ap_net_conn_pool_stat_add(pool, errors, 1);
+
+        if ( ap_log_debug_on(1) )
+            ap_log_debug_log("? Connection [%d] is dead prematurely during direct read: %m\n", conn->idx);
+
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+
+        return -1;
+    }
+
+    ap_net_conn_pool_stat_add(pool, bytes_in, n);
+    ap_net_conn_pool_stat_add(pool, msgs_in, 1);
+
+    ap_net_conn_pool_capture(pool, conn, 0, rc->dst + rc->done, n);
+
+    rc->done += n;
+    pool->recv_into->bytes += n;
+
+    if ( rc->done < rc->len )
+        return n;
+
+    ++pool->recv_into->completed;
+
+    ap_net_recv_into_release_conn(pool, conn->idx); /* before the signal, so the callback can start the next one */
+
+    ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_RECV_DONE);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Forgets connection's direct read
+ * \internal
+ *
+ * Used on read end and connection close
+ */
+void ap_net_recv_into_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->recv_into == NULL || conn_idx >= pool->recv_into->conns_size || pool->recv_into->conns[conn_idx].dst == NULL )
+        return;
+
+    pool->recv_into->conns[conn_idx].dst = NULL;
+    --pool->recv_into->active;
+}
+
+/* ********************************************************************** */
+/** \brief Makes room for connection's direct read in destination slot
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved
+ */
+int ap_net_recv_into_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ap_net_conn_pool_recv_into_left(src_pool, src_idx) == 0 )
+        return 1;
+
+    if ( dst_pool->recv_into == NULL && NULL == (dst_pool->recv_into = calloc(1, sizeof(struct ap_net_recv_into_t))) )
+        return 0;
+
+    return dst_idx < dst_pool->recv_into->conns_size || recv_into_grow(dst_pool->recv_into, dst_pool->max_connections);
+}
+
+/* ********************************************************************** */
+/** \brief Moves connection's direct read along with it to other slot or pool
+ * \internal
+ *
+ * The destination slot is free and prepared by ap_net_recv_into_move_prepare()
+ */
+void ap_net_recv_into_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ap_net_conn_pool_recv_into_left(src_pool, src_idx) == 0 )
+        return;
+
+    dst_pool->recv_into->conns[dst_idx] = src_pool->recv_into->conns[src_idx];
+    src_pool->recv_into->conns[src_idx].dst = NULL;
+
+    --src_pool->recv_into->active;
+    ++dst_pool->recv_into->active;
+}
+
+/* ********************************************************************** */
+/** \brief Returns count of bytes the connection's direct read still waits for
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return int - bytes. 0 if there is no read in progress
+ */
+int ap_net_conn_pool_recv_into_left(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_recv_into_conn_t *rc;
+
+
+    if ( pool->recv_into == NULL || conn_idx < 0 || conn_idx >= pool->recv_into->conns_size )
+        return 0;
+
+    rc = &pool->recv_into->conns[conn_idx];
+
+    return rc->dst == NULL ? 0 : rc->len - rc->done;
+}
+
+/* ********************************************************************** */
+/** \brief Stops connection's direct read without AP_NET_SIGNAL_CONN_RECV_DONE
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return int - bytes put into destination so far. -1 if there was no read in progress
+ *
+ * The following data goes to the connection's buffer as usual
+ */
+int ap_net_conn_pool_recv_into_cancel(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    int n;
+
+
+    if ( ap_net_conn_pool_recv_into_left(pool, conn_idx) == 0 )
+        return -1;
+
+    n = pool->recv_into->conns[conn_idx].done;
+
+    ap_net_recv_into_release_conn(pool, conn_idx);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Drops all direct reads of pool and frees their state
+ * \internal
+ *
+ * Called by ap_net_conn_pool_destroy()
+ */
+void ap_net_recv_into_free(struct ap_net_conn_pool_t *pool)
+{
+    if ( pool->recv_into == NULL )
+        return;
+
+    free(pool->recv_into->conns);
+    free(pool->recv_into);
+
+    pool->recv_into = NULL;
+}
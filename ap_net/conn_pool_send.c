@@ -6,6 +6,30 @@
 
 static const char *_func_name = "ap_net_conn_pool_send()";
 
+/* ********************************************************************** */
+/** \brief Updates pool's statistics after single send() call
+ * \internal
+ *
+ * n is the call result, size is amount requested by user
+ */
+void ap_net_conn_pool_count_send(struct ap_net_conn_pool_t *pool, int n, int size)
+{
+    ap_net_conn_pool_stat_add(pool, send_calls, 1);
+
+    if ( n > 0 )
+    {
+        ap_net_conn_pool_stat_add(pool, bytes_out, n);
+        ap_net_conn_pool_stat_add(pool, msgs_out, 1);
+
+        if ( n < size )
+            ap_net_conn_pool_stat_add(pool, partial_sends, 1);
+    }
+    else if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+        ap_net_conn_pool_stat_add(pool, eagain_out, 1);
+    else
+        ap_net_conn_pool_stat_add(pool, errors, 1);
+}
+
 /* ********************************************************************** */
 /** \brief send data _asynchronously_ from user's buffer
  *
@@ -16,6 +40,8 @@ static const char *_func_name = "ap_net_conn_pool_send()";
  * \return int - actual amount sent
  *
  *  Tries to send as much data as possible in one run.
+ *  On pool with corking enabled the data may be held till the end of poll cycle, see ap_net_conn_pool_cork_enable()
+ *  On zero-copy connection src_buf should be kept until it is released, see ap_net_conn_pool_zerocopy_enable()
  */
 int ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, void *src_buf, int size)
 {
@@ -35,6 +61,16 @@ int ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, v
         return 0;
     }
 
+    if ( ap_net_conn_pool_corked(pool, conn) )
+    {
+        n = ap_net_cork_hold(pool, conn, src_buf, size);
+
+        if ( pool->zerocopy != NULL )
+            ap_net_zerocopy_copied(pool, conn, src_buf, n);
+
+        return n;
+    }
+
     conn->state |= AP_NET_ST_OUT;
 
     slen = bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
@@ -44,14 +80,25 @@ int ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, v
     for(;;)
     {
         if ( bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
-            n = ap_net_send(conn->fd, src_buf, send_chunk, 1);
+            n = pool->zerocopy != NULL ? ap_net_zerocopy_send(pool, conn, src_buf, send_chunk, 1) : ap_net_send(conn->fd, src_buf, send_chunk, 1);
         else
-            n = sendto(conn->fd, src_buf, send_chunk, 0, (struct sockaddr *)&conn->remote, slen);
+            n = ap_net_io->sendto(conn->fd, src_buf, send_chunk, 0, (struct sockaddr *)&conn->remote, slen);
 
         bit_clear(conn->state, AP_NET_ST_OUT);
 
+        ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_SEND : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+        ap_net_conn_pool_count_send(pool, n, size);
+
         if ( n > 0 )
+        {
+            ap_net_conn_pool_capture(pool, conn, 1, src_buf, n);
+
+            if ( pool->zerocopy != NULL ) /* copied data is given back right away */
+                ap_net_zerocopy_release(pool, conn);
+
             break;
+        }
 
         if ( errno == EAGAIN || errno == EWOULDBLOCK )
         {
@@ -64,7 +111,7 @@ int ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, v
 
         else if ( (n == -1 && errno == EPIPE) || n == 0)
         {
-            if (ap_log_debug_level)
+            if ( ap_log_debug_on(1) )
                 ap_log_debug_log("? ap_net_conn_pool_send(): Connection #%d is dead prematurely: %m\n", conn_idx);
 
             ap_net_conn_pool_close_connection(pool, conn_idx);
@@ -87,6 +134,8 @@ int ap_net_conn_pool_send_async(struct ap_net_conn_pool_t *pool, int conn_idx, v
  * This function send data synchronously with blocking if no AP_NET_POOL_FLAGS_ASYNC flag is set on pool
  * In other case the ap_net_conn_pool_send_async() called in place
  * If error detected on connection, then ap_net_conn_pool_close_connection() is called
+ * On pool with corking enabled the data may be held till the end of poll cycle, see ap_net_conn_pool_cork_enable()
+ * On zero-copy connection src_buf should be kept until it is released, see ap_net_conn_pool_zerocopy_enable()
  */
 int ap_net_conn_pool_send(struct ap_net_conn_pool_t *pool, int conn_idx, void *src_buf, int size)
 {
@@ -107,15 +156,35 @@ int ap_net_conn_pool_send(struct ap_net_conn_pool_t *pool, int conn_idx, void *s
         return 0;
     }
 
+    if ( ap_net_conn_pool_corked(pool, conn) )
+    {
+        n = ap_net_cork_hold(pool, conn, src_buf, size);
+
+        if ( pool->zerocopy != NULL )
+            ap_net_zerocopy_copied(pool, conn, src_buf, n);
+
+        return n;
+    }
+
     conn->state |= AP_NET_ST_OUT;
 
-    n = ap_net_send(conn->fd, src_buf, size, 0);
+    n = pool->zerocopy != NULL ? ap_net_zerocopy_send(pool, conn, src_buf, size, 0) : ap_net_send(conn->fd, src_buf, size, 0);
 
     bit_clear(conn->state, AP_NET_ST_OUT);
 
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_SEND : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_count_send(pool, n, size);
+
+    if ( n > 0 )
+        ap_net_conn_pool_capture(pool, conn, 1, src_buf, n);
+
+    if ( n > 0 && pool->zerocopy != NULL ) /* copied data is given back right away */
+        ap_net_zerocopy_release(pool, conn);
+
     if (n == -1 && errno == EPIPE)
     {
-        if (ap_log_debug_level)
+        if ( ap_log_debug_on(1) )
             ap_log_debug_log("? ap_net_conn_pool_send(): Connection #%d is dead prematurely: %m\n", conn_idx);
 
         ap_net_conn_pool_close_connection(pool, conn_idx);
@@ -124,3 +193,88 @@ int ap_net_conn_pool_send(struct ap_net_conn_pool_t *pool, int conn_idx, void *s
     return n;
 }
 
+/* ********************************************************************** */
+/** \brief Sends data gathered from several buffers with one system call
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \param iov const struct iovec* - buffers
+ * \param iovcnt int - count of buffers. Up to IOV_MAX
+ * \return int - actual amount sent or -1 on error
+ *
+ * Header and body go out together without copying them into one buffer. For UDP pools it is one datagram.
+ * Blocks like ap_net_conn_pool_send() unless pool has AP_NET_POOL_FLAGS_ASYNC flag. Partial sends are not retried.
+ * On pool with corking enabled the data may be held till the end of poll cycle, see ap_net_conn_pool_cork_enable()
+ * If error detected on connection, then ap_net_conn_pool_close_connection() is called
+ */
+int ap_net_conn_pool_sendv(struct ap_net_conn_pool_t *pool, int conn_idx, const struct iovec *iov, int iovcnt)
+{
+    int i;
+    int n;
+    int size;
+    int left;
+    struct msghdr msg;
+    struct ap_net_connection_t *conn;
+
+
+    ap_error_clear();
+
+    if ( conn_idx < 0 || conn_idx >= pool->max_connections || ! bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+    {
+        ap_error_set_detailed("ap_net_conn_pool_sendv()", AP_ERRNO_INVALID_CONN_INDEX, "%d", conn_idx);
+        return 0;
+    }
+
+    conn = &pool->conns[conn_idx];
+
+    for ( i = size = 0; i < iovcnt; ++i )
+        size += iov[i].iov_len;
+
+    if ( ap_net_conn_pool_corked(pool, conn) )
+    {
+        for ( i = 0; i < iovcnt; ++i )
+            if ( iov[i].iov_len > 0 && -1 == ap_net_cork_hold(pool, conn, iov[i].iov_base, iov[i].iov_len) )
+                return -1;
+
+        return size;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    if ( ! bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        msg.msg_name = &conn->remote;
+        msg.msg_namelen = bit_is_set(pool->flags, AP_NET_POOL_FLAGS_IPV6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    }
+
+    conn->state |= AP_NET_ST_OUT;
+
+    n = ap_net_io->sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (bit_is_set(pool->flags, AP_NET_POOL_FLAGS_ASYNC) ? MSG_DONTWAIT : 0));
+
+    bit_clear(conn->state, AP_NET_ST_OUT);
+
+    ap_net_conn_pool_record(pool, n >= 0 ? AP_NET_REC_SEND : AP_NET_REC_ERROR, conn, n >= 0 ? n : errno);
+
+    ap_net_conn_pool_count_send(pool, n, size);
+
+    if ( pool->capture != NULL )
+        for ( i = 0, left = n; i < iovcnt && left > 0; left -= iov[i++].iov_len )
+            ap_net_capture_add(pool, conn, 1, iov[i].iov_base, left < (int)iov[i].iov_len ? left : (int)iov[i].iov_len);
+
+    if ( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+        ap_error_set_detailed("ap_net_conn_pool_sendv()", AP_ERRNO_SYSTEM, "sock %d", conn->fd);
+
+        if ( errno == EPIPE || errno == ECONNRESET )
+        {
+            if ( ap_log_debug_on(1) )
+                ap_log_debug_log("? ap_net_conn_pool_sendv(): Connection #%d is dead prematurely: %m\n", conn_idx);
+
+            ap_net_conn_pool_close_connection(pool, conn_idx);
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,439 @@
+/** \file ap_net/conn_pool_sendfile.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: File and pipe transfers
+ *
+ * The contents of a file go to the socket by sendfile(), of a pipe by splice(), so the data never comes to user's memory.
+ * What the socket does not take at once is sent when it reports EPOLLOUT to ap_net_conn_pool_poll().
+ * The end of transfer is reported by AP_NET_SIGNAL_CONN_SEND_DONE.
+ */
+#define _GNU_SOURCE
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_sendfile()";
+
+/* bytes sent to one connection per poll event, so a fast peer does not hold up the others */
+#define sendfile_max_per_event (1024 * 1024)
+/* file data is read for traffic capture by this size */
+#define sendfile_capture_chunk 65536
+
+/** \brief Transfer of one connection
+*/
+typedef struct ap_net_sendfile_conn_t
+{
+    int fd; /* source. -1 if no transfer */
+    int flags; /* AP_NET_SENDFILE_* */
+    int is_pipe; /* splice() instead of sendfile() */
+    off_t offset; /* file: the next byte to send */
+    off_t left; /* bytes to send. -1: pipe until EOF */
+} ap_net_sendfile_conn_t;
+
+/* ********************************************************************** */
+/* makes transfers array follow the pool's size */
+static int sendfile_grow(struct ap_net_sendfile_t *sf, int new_size)
+{
+    void *new_mem;
+    int i;
+
+
+    new_mem = realloc(sf->conns, new_size * sizeof(struct ap_net_sendfile_conn_t));
+
+    if ( new_mem == NULL )
+        return 0;
+
+    sf->conns = new_mem;
+
+    for ( i = sf->conns_size; i < new_size; ++i )
+        sf->conns[i].fd = -1;
+
+    sf->conns_size = new_size;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* copies the part of file that was just sent into the traffic capture */
+static void sendfile_capture(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, int fd, off_t pos, int len)
+{
+    struct ap_net_sendfile_t *sf;
+    int chunk, n;
+
+
+    sf = pool->sendfile;
+
+    if ( sf->capture_buf == NULL && NULL == (sf->capture_buf = malloc(sendfile_capture_chunk)) )
+        return;
+
+    for ( ; len > 0; len -= n, pos += n )
+    {
+        chunk = len < sendfile_capture_chunk ? len : sendfile_capture_chunk;
+
+        if ( 0 >= (n = pread(fd, sf->capture_buf, chunk, pos)) )
+            return;
+
+        ap_net_capture_add(pool, conn, 1, sf->capture_buf, n);
+    }
+}
+
+/* ********************************************************************** */
+/* sends what the socket takes. returns false if connection should be closed */
+static int sendfile_run(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn)
+{
+    struct ap_net_sendfile_conn_t *sc;
+    off_t pos;
+    size_t chunk;
+    int total;
+    ssize_t n;
+
+
+    sc = &pool->sendfile->conns[conn->idx];
+
+    if ( ap_net_conn_pool_cork_pending(pool, conn->idx) > 0 ) /* held output goes first */
+        return 1;
+
+    for ( total = 0; sc->left != 0 && total < sendfile_max_per_event; total += n )
+    {
+        chunk = sendfile_max_per_event - total;
+
+        if ( sc->left > 0 && (off_t)chunk > sc->left )
+            chunk = sc->left;
+
+        pos = sc->offset;
+
+        conn->state |= AP_NET_ST_OUT;
+
+        if ( sc->is_pipe )
+            n = ap_net_io->splice(sc->fd, NULL, conn->fd, NULL, chunk,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | ((off_t)chunk != sc->left ? SPLICE_F_MORE : 0));
+        else
+            n = ap_net_io->sendfile(conn->fd, sc->fd, &sc->offset, chunk);
+
+        bit_clear(conn->state, AP_NET_ST_OUT);
+
+        if ( n == 0 ) /* end of source */
+        {
+            ap_net_conn_pool_stat_add(pool, send_calls, 1);
+
+            if ( sc->is_pipe && sc->left == -1 )
+            {
+                sc->left = 0;
+                break;
+            }
+
+            ap_error_set_custom(_func_name, "source ended before the count given");
+            ap_net_conn_pool_record(pool, AP_NET_REC_ERROR, conn, 0);
+
+            return 0;
+        }
+
+        ap_net_conn_pool_count_send(pool, n, chunk);
+
+        if ( n == -1 )
+        {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) /* socket is full or pipe is empty */
+                break;
+
+            ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, sc->is_pipe ? "splice()" : "sendfile()");
+            ap_net_conn_pool_record(pool, AP_NET_REC_ERROR, conn, errno);
+
+            if ( ap_log_debug_on(1) )
+                ap_log_debug_log("? %s: Connection #%d transfer failed: %m\n", _func_name, conn->idx);
+
+            return 0;
+        }
+
+        ap_net_conn_pool_record(pool, AP_NET_REC_SEND, conn, n);
+
+        if ( pool->capture != NULL && ! sc->is_pipe ) /* pipe data is gone already */
+            sendfile_capture(pool, conn, sc->fd, pos, n);
+
+        pool->sendfile->bytes += n;
+
+        if ( sc->left > 0 )
+            sc->left -= n;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Starts sending file or pipe contents to the connection
+ *
+ * \param pool struct ap_net_conn_pool_t* - TCP pool
+ * \param conn_idx int
+ * \param fd int - source: regular file or pipe opened for reading
+ * \param offset off_t - file: where to start from. Ignored for pipes
+ * \param count off_t - bytes to send. 0 - file: up to its current end, pipe: until writer closes it
+ * \param flags int - AP_NET_SENDFILE_* bits
+ * \return int - true/false
+ *
+ * The data is moved by kernel with sendfile() or splice() and does not touch user's memory.
+ * The first part is sent right away. The rest is sent from ap_net_conn_pool_poll() each time the socket can take more,
+ * up to 1 MB per connection per cycle. When all is sent AP_NET_SIGNAL_CONN_SEND_DONE is emitted by ap_net_conn_pool_poll(),
+ * even if the transfer is done in this call. The callback may start the next transfer from there.
+ * Only one transfer per connection at a time. Do not send anything else to connection while it is in progress,
+ * or the data gets mixed. Output held by corking is sent before the transfer starts, see ap_net_conn_pool_cork_enable().
+ * If source or connection fails, the connection is closed. The transfer is dropped when connection is closed,
+ * AP_NET_SIGNAL_CONN_CLOSING handler can check it with ap_net_conn_pool_sendfile_active(). It goes on when connection is moved.
+ * The source descriptor stays yours, unless AP_NET_SENDFILE_CLOSE flag is given. It is never closed when false is returned.
+ * Pipe is read in non-blocking mode. While it is empty, the transfer is retried in each poll cycle.
+ * Traffic capture gets the file data by reading it once more, the pipe data is not captured.
+ */
+int ap_net_conn_pool_sendfile(struct ap_net_conn_pool_t *pool, int conn_idx, int fd, off_t offset, off_t count, int flags)
+{
+    struct ap_net_sendfile_t *sf;
+    struct ap_net_sendfile_conn_t *sc;
+    struct ap_net_connection_t *conn;
+    struct stat st;
+
+
+    ap_error_clear();
+
+    if ( conn_idx < 0 || conn_idx >= pool->max_connections || ! bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_INVALID_CONN_INDEX, "%d", conn_idx);
+        return 0;
+    }
+
+    if ( ! bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        ap_error_set_custom(_func_name, "file transfers are for TCP pools only");
+        return 0;
+    }
+
+    if ( ap_net_conn_pool_bridged(pool, conn_idx) )
+    {
+        ap_error_set_custom(_func_name, "connection is bridged");
+        return 0;
+    }
+
+    if ( fstat(fd, &st) == -1 )
+    {
+        ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "fstat()");
+        return 0;
+    }
+
+    if ( ! S_ISREG(st.st_mode) && ! S_ISFIFO(st.st_mode) )
+    {
+        ap_error_set_custom(_func_name, "source should be regular file or pipe");
+        return 0;
+    }
+
+    if ( count < 0 || (S_ISREG(st.st_mode) && (offset < 0 || offset > st.st_size)) )
+    {
+        ap_error_set_custom(_func_name, "offset or count is out of file");
+        return 0;
+    }
+
+    if ( pool->sendfile == NULL && NULL == (pool->sendfile = calloc(1, sizeof(struct ap_net_sendfile_t))) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    sf = pool->sendfile;
+
+    if ( conn_idx >= sf->conns_size && ! sendfile_grow(sf, pool->max_connections) )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    sc = &sf->conns[conn_idx];
+
+    if ( sc->fd != -1 )
+    {
+        ap_error_set_custom(_func_name, "connection has transfer in progress");
+        return 0;
+    }
+
+    if ( S_ISFIFO(st.st_mode) && ! bit_is_set(fcntl(fd, F_GETFL), O_NONBLOCK) )
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    conn = &pool->conns[conn_idx];
+
+    sc->fd = fd;
+    sc->flags = flags;
+    sc->is_pipe = S_ISFIFO(st.st_mode);
+    sc->offset = sc->is_pipe ? 0 : offset;
+
+    if ( count > 0 )
+        sc->left = count;
+    else
+        sc->left = sc->is_pipe ? -1 : st.st_size - offset;
+
+    ++sf->active;
+
+    if ( ! ap_net_conn_pool_poller_set_out(pool, conn_idx, 1) )
+    {
+        sc->fd = -1; /* not by ap_net_sendfile_release_conn(): the call fails, so the source stays with the caller */
+        --sf->active;
+        return 0;
+    }
+
+    if ( ! sendfile_run(pool, conn) )
+    {
+        bit_clear(sc->flags, AP_NET_SENDFILE_CLOSE); /* the call fails, so the source stays with the caller */
+        ap_net_conn_pool_close_connection(pool, conn_idx);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Continues the transfer when socket is ready for output. Emits AP_NET_SIGNAL_CONN_SEND_DONE at the end
+ * \internal
+ *
+ * Called by ap_net_conn_pool_poll() on EPOLLOUT
+ */
+void ap_net_sendfile_resume(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn)
+{
+    struct ap_net_sendfile_conn_t *sc;
+
+
+    if ( pool->sendfile == NULL || conn->idx >= pool->sendfile->conns_size || ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+        return;
+
+    sc = &pool->sendfile->conns[conn->idx];
+
+    if ( sc->fd == -1 )
+        return;
+
+    if ( ! sendfile_run(pool, conn) )
+    {
+        ap_net_conn_pool_close_connection(pool, conn->idx);
+        return;
+    }
+
+    if ( sc->left != 0 )
+        return;
+
+    ++pool->sendfile->completed;
+
+    ap_net_sendfile_release_conn(pool, conn->idx); /* before the signal, so the callback can start the next one */
+
+    ap_net_conn_pool_signal(pool, conn, AP_NET_SIGNAL_CONN_SEND_DONE);
+}
+
+/* ********************************************************************** */
+/** \brief Forgets connection's transfer, closing the source if asked to
+ * \internal
+ *
+ * Used on transfer end and connection close
+ */
+void ap_net_sendfile_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_sendfile_conn_t *sc;
+
+
+    if ( pool->sendfile == NULL || conn_idx >= pool->sendfile->conns_size || pool->sendfile->conns[conn_idx].fd == -1 )
+        return;
+
+    sc = &pool->sendfile->conns[conn_idx];
+
+    if ( bit_is_set(sc->flags, AP_NET_SENDFILE_CLOSE) )
+        close(sc->fd);
+
+    sc->fd = -1;
+    --pool->sendfile->active;
+
+    if ( bit_is_set(pool->conns[conn_idx].state, AP_NET_ST_CONNECTED) )
+        ap_net_conn_pool_poller_set_out(pool, conn_idx, 0);
+}
+
+/* ********************************************************************** */
+/** \brief Makes room for connection's transfer in destination slot
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved
+ */
+int ap_net_sendfile_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ! ap_net_conn_pool_sendfile_active(src_pool, src_idx) )
+        return 1;
+
+    if ( dst_pool->sendfile == NULL && NULL == (dst_pool->sendfile = calloc(1, sizeof(struct ap_net_sendfile_t))) )
+        return 0;
+
+    return dst_idx < dst_pool->sendfile->conns_size || sendfile_grow(dst_pool->sendfile, dst_pool->max_connections);
+}
+
+/* ********************************************************************** */
+/** \brief Moves connection's transfer along with it to other slot or pool
+ * \internal
+ *
+ * The destination slot is free and prepared by ap_net_sendfile_move_prepare(). Called after it is added to destination's poller
+ */
+void ap_net_sendfile_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ! ap_net_conn_pool_sendfile_active(src_pool, src_idx) )
+        return;
+
+    dst_pool->sendfile->conns[dst_idx] = src_pool->sendfile->conns[src_idx];
+    src_pool->sendfile->conns[src_idx].fd = -1;
+
+    --src_pool->sendfile->active;
+    ++dst_pool->sendfile->active;
+
+    ap_net_conn_pool_poller_set_out(dst_pool, dst_idx, 1); /* the rest goes on EPOLLOUT there */
+}
+
+/* ********************************************************************** */
+/** \brief Checks if connection has transfer in progress
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return int - true/false
+ */
+int ap_net_conn_pool_sendfile_active(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->sendfile == NULL || conn_idx < 0 || conn_idx >= pool->sendfile->conns_size )
+        return 0;
+
+    return pool->sendfile->conns[conn_idx].fd != -1;
+}
+
+/* ********************************************************************** */
+/** \brief Stops connection's transfer without AP_NET_SIGNAL_CONN_SEND_DONE
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return void
+ *
+ * The peer gets what is sent so far, the connection stays open. The source is closed if AP_NET_SENDFILE_CLOSE was given
+ */
+void ap_net_conn_pool_sendfile_cancel(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( conn_idx >= 0 && conn_idx < pool->max_connections )
+        ap_net_sendfile_release_conn(pool, conn_idx);
+}
+
+/* ********************************************************************** */
+/** \brief Drops all transfers of pool and frees their state
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ *
+ * Called by ap_net_conn_pool_destroy()
+ */
+void ap_net_conn_pool_sendfile_free(struct ap_net_conn_pool_t *pool)
+{
+    int i;
+
+
+    if ( pool->sendfile == NULL )
+        return;
+
+    for ( i = 0; i < pool->sendfile->conns_size && i < pool->max_connections; ++i )
+        ap_net_sendfile_release_conn(pool, i);
+
+    free(pool->sendfile->conns);
+    free(pool->sendfile->capture_buf);
+    free(pool->sendfile);
+
+    pool->sendfile = NULL;
+}
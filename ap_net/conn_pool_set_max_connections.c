@@ -61,24 +61,33 @@ int ap_net_conn_pool_set_max_connections(struct ap_net_conn_pool_t *pool, int ne
 
     if ( new_max < pool->max_connections )
     {
-        n = -1;
+        n = 0;
 
-        /* defragmenting. moving active connections from end to free slots at the beginning of connections list */
-        for ( i = new_max - 1; i < pool->max_connections; ++i )
+        /* defragmenting. moving active connections from the tail being removed to free slots at the beginning of connections list */
+        for ( i = new_max; i < pool->max_connections; ++i )
         {
-            for (++n;; ++n ) /* finding free slot */
-                if ( ! (pool->conns[n].state & AP_NET_ST_CONNECTED) )
-                    break;
+            if ( ! (pool->conns[i].state & AP_NET_ST_CONNECTED) )
+                continue;
 
+            while ( pool->conns[n].state & AP_NET_ST_CONNECTED ) /* finding free slot. there is one below new_max as checked above */
+                ++n;
+
+            if ( ! ap_net_conn_pool_move_prepare(pool, i, pool, n) )
+                goto unlock;
+
+            ap_net_framer_release_conn(pool, i);
             ap_net_connection_copy(&pool->conns[n], &pool->conns[i]);
             bit_clear(pool->conns[i].state, AP_NET_ST_CONNECTED);
             pool->conns[i].fd = -1;
-
-            if ( pool->callback_func != NULL )
-            {
-                pool->callback_func(&pool->conns[n], AP_NET_SIGNAL_CONN_MOVED_TO);
-                pool->callback_func(&pool->conns[i], AP_NET_SIGNAL_CONN_MOVED_FROM);
-            }
+            ap_net_cork_move_conn(pool, i, pool, n);
+            ap_net_sendfile_move_conn(pool, i, pool, n);
+            ap_net_recv_into_move_conn(pool, i, pool, n);
+            ap_net_bridge_move_conn(pool, i, pool, n);
+            ap_net_zerocopy_move_conn(pool, i, pool, n);
+            ap_net_arena_move_conn(pool, i, pool, n);
+
+            ap_net_conn_pool_signal(pool, &pool->conns[n], AP_NET_SIGNAL_CONN_MOVED_TO);
+            ap_net_conn_pool_signal(pool, &pool->conns[i], AP_NET_SIGNAL_CONN_MOVED_FROM);
         }
 
         for ( i = new_max; i < pool->max_connections; ++i ) /* destroying extra */
@@ -104,6 +113,7 @@ int ap_net_conn_pool_set_max_connections(struct ap_net_conn_pool_t *pool, int ne
             pool->conns[i].parent = pool;
 
             pool->conns[i].state = 0;
+            pool->conns[i].flags = 0;
 
             pool->conns[i].bufpos = 0;
             pool->conns[i].buffill = 0;
@@ -120,8 +130,7 @@ int ap_net_conn_pool_set_max_connections(struct ap_net_conn_pool_t *pool, int ne
 
             pool->conns[i].user_data = NULL;
 
-            if ( pool->callback_func != NULL )
-                pool->callback_func(&pool->conns[i], AP_NET_SIGNAL_CONN_CREATED);
+            ap_net_conn_pool_signal(pool, &pool->conns[i], AP_NET_SIGNAL_CONN_CREATED);
 
         }
     }
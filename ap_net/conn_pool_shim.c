@@ -0,0 +1,906 @@
+/** \file ap_net/conn_pool_shim.c
+ * \brief Part of AP's toolkit. Networking module: Impairment shim - delay, jitter, reordering, loss and bandwidth cap on real sockets
+ *
+ * ap_net_shim_enable() puts itself on top of the current ap_net_io table. Outgoing data is held in the shim's queue
+ * and handed to the kernel when it is due. The queue is flushed on every call going through ap_net_io,
+ * and ap_net_conn_pool_poll() makes at least one each cycle. No root and no netem needed.
+ *
+ * Only the sending side is impaired. When both ends are in the same process and use ap_net_io, both directions are.
+ * Not thread-safe: use it from the polling thread only.
+ */
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef AP_NET_NO_SIM
+#undef ap_net_io /* the module does not use the table, so ap_net_shim_enable() refuses to work */
+#endif
+
+static const char *_func_name = "ap_net_shim_enable()";
+
+/* default bytes held per socket */
+#define shim_default_queue (1024 * 1024)
+/* minimal retransmission timeout for lost TCP data */
+#define shim_min_rto_ns 200000000ull
+/* the hold time of reordered datagram if there is no delay set */
+#define shim_min_reorder_ns 1000000ull
+/* TCP: no more simulated retransmissions than that for one send */
+#define shim_max_retransmits 16
+/* descriptors above are passed through. the simulator's ones are there */
+#define shim_max_fd (1024 * 1024)
+
+typedef struct shim_packet_t
+{
+    struct shim_packet_t *next; /* in the list of blocked ones */
+    uint64_t time; /* when to hand it to kernel */
+    uint64_t seq; /* creation order */
+    int fd;
+    int flags; /* send()/sendto() flags */
+    struct sockaddr_storage to; /* sendto() address */
+    socklen_t to_len; /* zero for send() */
+    int len;
+    int off; /* TCP: already taken by kernel */
+    char data[];
+} shim_packet_t;
+
+/* per descriptor state */
+typedef struct shim_fd_t
+{
+    int type; /* SOCK_STREAM, SOCK_DGRAM. zero if not known yet */
+    int queued; /* bytes held */
+    int error; /* TCP: the kernel's error on delayed send. returned by the next send() */
+    int blocked; /* TCP: kernel's buffer is full in this flush round */
+    uint64_t busy_until; /* when the last send leaves, for bandwidth cap */
+    uint64_t last_time; /* TCP: keeps the data in order */
+} shim_fd_t;
+
+static int shim_active;
+static struct ap_net_shim_params_t shim_params;
+static struct ap_net_shim_stat_t shim_stat;
+static struct ap_net_io_ops_t *shim_lower; /* the table we are on top of */
+static struct ap_net_io_ops_t shim_io;
+static uint64_t shim_rnd;
+static uint64_t shim_seq;
+static shim_packet_t **shim_heap; /* held data, ordered by (time, seq) */
+static int shim_heap_count;
+static int shim_heap_size;
+static shim_fd_t *shim_fds;
+static int shim_fds_size;
+
+/* ********************************************************************** */
+/* xorshift64* */
+static uint64_t shim_random(void)
+{
+    shim_rnd ^= shim_rnd >> 12;
+    shim_rnd ^= shim_rnd << 25;
+    shim_rnd ^= shim_rnd >> 27;
+
+    return shim_rnd * 2685821657736338717ull;
+}
+
+/* uniform in [0, 1) */
+static double shim_random_unit(void)
+{
+    return (shim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ********************************************************************** */
+static int shim_before(shim_packet_t *a, shim_packet_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void shim_sift_down(int i)
+{
+    shim_packet_t *p;
+    int child;
+
+
+    p = shim_heap[i];
+
+    for ( ; (child = i * 2 + 1) < shim_heap_count; i = child )
+    {
+        if ( child + 1 < shim_heap_count && shim_before(shim_heap[child + 1], shim_heap[child]) )
+            ++child;
+
+        if ( ! shim_before(shim_heap[child], p) )
+            break;
+
+        shim_heap[i] = shim_heap[child];
+    }
+
+    shim_heap[i] = p;
+}
+
+static int shim_push(shim_packet_t *p)
+{
+    void *new_mem;
+    int i;
+
+
+    if ( shim_heap_count == shim_heap_size )
+    {
+        new_mem = realloc(shim_heap, (shim_heap_size * 2 + 64) * sizeof(shim_packet_t *));
+
+        if ( new_mem == NULL )
+            return 0;
+
+        shim_heap = new_mem;
+        shim_heap_size = shim_heap_size * 2 + 64;
+    }
+
+    for ( i = shim_heap_count++; i > 0 && shim_before(p, shim_heap[(i - 1) / 2]); i = (i - 1) / 2 )
+        shim_heap[i] = shim_heap[(i - 1) / 2];
+
+    shim_heap[i] = p;
+
+    return 1;
+}
+
+static shim_packet_t *shim_pop(void)
+{
+    shim_packet_t *top;
+
+
+    top = shim_heap[0];
+    shim_heap[0] = shim_heap[--shim_heap_count];
+
+    if ( shim_heap_count > 0 )
+        shim_sift_down(0);
+
+    return top;
+}
+
+/* ********************************************************************** */
+static shim_fd_t *shim_fd(int fd)
+{
+    void *new_mem;
+    int new_size;
+    socklen_t len;
+
+
+    if ( fd < 0 || fd >= shim_max_fd )
+        return NULL;
+
+    if ( fd >= shim_fds_size )
+    {
+        new_size = fd + 1 > shim_fds_size * 2 ? fd + 1 : shim_fds_size * 2;
+        new_mem = realloc(shim_fds, new_size * sizeof(shim_fd_t));
+
+        if ( new_mem == NULL )
+            return NULL;
+
+        shim_fds = new_mem;
+        memset(shim_fds + shim_fds_size, 0, (new_size - shim_fds_size) * sizeof(shim_fd_t));
+        shim_fds_size = new_size;
+    }
+
+    if ( shim_fds[fd].type == 0 )
+    {
+        len = sizeof(shim_fds[fd].type);
+
+        if ( 0 != shim_lower->getsockopt(fd, SOL_SOCKET, SO_TYPE, &shim_fds[fd].type, &len) )
+            shim_fds[fd].type = SOCK_DGRAM; /* not a socket: no ordering, no retransmits */
+    }
+
+    return &shim_fds[fd];
+}
+
+/* ********************************************************************** */
+/* hands the packet to kernel. returns false if TCP kernel buffer is full and the packet should wait */
+static int shim_deliver(shim_packet_t *p)
+{
+    shim_fd_t *st;
+    int n;
+
+
+    st = &shim_fds[p->fd];
+
+    if ( st->type != SOCK_STREAM )
+    {
+        if ( p->to_len > 0 )
+            n = shim_lower->sendto(p->fd, p->data, p->len, p->flags | MSG_DONTWAIT, (struct sockaddr *)&p->to, p->to_len);
+        else
+            n = shim_lower->send(p->fd, p->data, p->len, p->flags | MSG_DONTWAIT);
+
+        if ( n < 0 )
+            ++shim_stat.lost;
+        else
+        {
+            ++shim_stat.packets;
+            shim_stat.bytes += n;
+        }
+
+        return 1;
+    }
+
+    while ( st->error == 0 && p->off < p->len )
+    {
+        n = shim_lower->send(p->fd, p->data + p->off, p->len - p->off, p->flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if ( n < 0 )
+        {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                st->blocked = 1;
+                return 0;
+            }
+
+            if ( errno != EINTR )
+                st->error = errno; /* the rest of connection's data is discarded */
+
+            continue;
+        }
+
+        ++shim_stat.packets;
+        shim_stat.bytes += n;
+        p->off += n;
+    }
+
+    return 1;
+}
+
+/* ********************************************************************** */
+static void shim_free_packet(shim_packet_t *p)
+{
+    shim_fds[p->fd].queued -= p->len;
+    shim_stat.queued_bytes -= p->len;
+    free(p);
+}
+
+/* ********************************************************************** */
+/** \brief Hands the due data to kernel
+ *
+ * \return int - count of sends held yet
+ *
+ * Called from every shim's call. Call it yourself if you wait for something without ap_net_io calls.
+ */
+int ap_net_shim_flush(void)
+{
+    shim_packet_t *p;
+    shim_packet_t *waiting; /* TCP data blocked by the full kernel buffer */
+    shim_packet_t **tail;
+    uint64_t now;
+
+
+    if ( ! shim_active || shim_heap_count == 0 )
+        return shim_heap_count;
+
+    now = ap_utils_clock_ns();
+    waiting = NULL;
+    tail = &waiting;
+
+    while ( shim_heap_count > 0 && shim_heap[0]->time <= now )
+    {
+        p = shim_pop();
+
+        if ( shim_fds[p->fd].blocked || ! shim_deliver(p) )
+        {
+            /* keeping it aside until the next round. the order is kept, as they are popped in order */
+            p->next = NULL;
+            *tail = p;
+            tail = &p->next;
+            continue;
+        }
+
+        shim_free_packet(p);
+    }
+
+    while ( waiting != NULL )
+    {
+        p = waiting;
+        waiting = p->next;
+        shim_fds[p->fd].blocked = 0;
+
+        if ( ! shim_push(p) )
+            shim_free_packet(p);
+    }
+
+    return shim_heap_count;
+}
+
+/* ********************************************************************** */
+/* sends out or drops all held data of the descriptor. in order */
+static void shim_flush_fd(int fd, int send_it)
+{
+    shim_packet_t **own;
+    shim_packet_t *p;
+    int count;
+    int i;
+    int j;
+
+
+    if ( fd < 0 || fd >= shim_fds_size || shim_fds[fd].queued == 0 )
+        return;
+
+    own = malloc(shim_heap_count * sizeof(shim_packet_t *));
+    count = 0;
+
+    for ( i = j = 0; i < shim_heap_count; ++i )
+    {
+        if ( shim_heap[i]->fd == fd && own != NULL )
+            own[count++] = shim_heap[i];
+        else
+            shim_heap[j++] = shim_heap[i];
+    }
+
+    if ( own == NULL ) /* out of memory: leaving them to the regular flush */
+        return;
+
+    shim_heap_count = j;
+
+    for ( i = shim_heap_count / 2 - 1; i >= 0; --i )
+        shim_sift_down(i);
+
+    /* sorting by seq. there are few of them usually */
+    for ( i = 1; i < count; ++i )
+    {
+        p = own[i];
+
+        for ( j = i - 1; j >= 0 && own[j]->seq > p->seq; --j )
+            own[j + 1] = own[j];
+
+        own[j + 1] = p;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( send_it )
+            shim_deliver(own[i]);
+
+        shim_free_packet(own[i]);
+    }
+
+    free(own);
+}
+
+/* ********************************************************************** */
+/* computes when the data should go. returns 0 if it is lost */
+static uint64_t shim_schedule(shim_fd_t *st, int len)
+{
+    uint64_t now;
+    uint64_t start;
+    uint64_t t;
+    uint64_t rto;
+    int i;
+
+
+    now = ap_utils_clock_ns();
+    start = st->busy_until > now ? st->busy_until : now;
+
+    if ( shim_params.bandwidth > 0 )
+        start += (uint64_t)len * 1000000000ull / shim_params.bandwidth;
+
+    st->busy_until = start;
+
+    t = start + shim_params.delay_ns;
+
+    if ( shim_params.jitter_ns > 0 )
+        t += shim_random() % (shim_params.jitter_ns + 1);
+
+    if ( st->type == SOCK_STREAM )
+    {
+        rto = shim_params.delay_ns * 2 + shim_params.jitter_ns;
+
+        if ( rto < shim_min_rto_ns )
+            rto = shim_min_rto_ns;
+
+        for ( i = 0; i < shim_max_retransmits && shim_params.loss > 0 && shim_random_unit() < shim_params.loss; ++i )
+        {
+            t += rto;
+            ++shim_stat.retransmits;
+        }
+
+        if ( t < st->last_time )
+            t = st->last_time;
+
+        st->last_time = t;
+
+        return t;
+    }
+
+    if ( shim_params.loss > 0 && shim_random_unit() < shim_params.loss )
+    {
+        ++shim_stat.lost;
+        return 0;
+    }
+
+    if ( shim_params.reorder > 0 && shim_random_unit() < shim_params.reorder )
+    {
+        t += shim_params.delay_ns + shim_params.jitter_ns > 0 ? shim_params.delay_ns + shim_params.jitter_ns : shim_min_reorder_ns;
+        ++shim_stat.reordered;
+    }
+
+    return t;
+}
+
+/* ********************************************************************** */
+static ssize_t shim_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len)
+{
+    shim_fd_t *st;
+    shim_packet_t *p;
+    uint64_t t;
+    int max_queue;
+
+
+    ap_net_shim_flush();
+
+    st = shim_fd(fd);
+
+    if ( st == NULL )
+        return addr != NULL ? shim_lower->sendto(fd, buf, len, flags, addr, addr_len) : shim_lower->send(fd, buf, len, flags);
+
+    if ( st->error )
+    {
+        errno = st->error;
+        return -1;
+    }
+
+    max_queue = shim_params.max_queue > 0 ? shim_params.max_queue : shim_default_queue;
+
+    if ( st->type == SOCK_STREAM )
+    {
+        if ( st->queued >= max_queue )
+        {
+            ++shim_stat.queue_full;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if ( len > (size_t)(max_queue - st->queued) )
+            len = max_queue - st->queued;
+
+        addr = NULL;
+    }
+    else if ( st->queued + len > (size_t)max_queue )
+    {
+        ++shim_stat.queue_full;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    t = shim_schedule(st, len);
+
+    if ( t == 0 ) /* lost datagram looks sent for the caller */
+        return len;
+
+    p = malloc(sizeof(shim_packet_t) + len);
+
+    if ( p == NULL )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    p->time = t;
+    p->seq = shim_seq++;
+    p->fd = fd;
+    p->flags = flags & ~(MSG_DONTWAIT | MSG_ZEROCOPY); /* the data is copied here */
+    p->to_len = 0;
+    p->len = len;
+    p->off = 0;
+    memcpy(p->data, buf, len);
+
+    if ( addr != NULL && addr_len > 0 )
+    {
+        p->to_len = addr_len > sizeof(p->to) ? sizeof(p->to) : addr_len;
+        memcpy(&p->to, addr, p->to_len);
+    }
+
+    if ( ! shim_push(p) )
+    {
+        free(p);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    st->queued += len;
+    shim_stat.queued_bytes += len;
+
+    ap_net_shim_flush(); /* it may be due already */
+
+    return len;
+}
+
+/* ********************************************************************** */
+static ssize_t shim_send(int fd, const void *buf, size_t len, int flags)
+{
+    return shim_sendto(fd, buf, len, flags, NULL, 0);
+}
+
+/* ********************************************************************** */
+/* gathers the buffers into one send. held data is copied anyway */
+static ssize_t shim_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    char *buf;
+    size_t len, off;
+    ssize_t n;
+    int i;
+
+
+    if ( shim_fd(fd) == NULL )
+        return shim_lower->sendmsg(fd, msg, flags);
+
+    for ( i = 0, len = 0; i < (int)msg->msg_iovlen; ++i )
+        len += msg->msg_iov[i].iov_len;
+
+    if ( NULL == (buf = malloc(len > 0 ? len : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for ( i = 0, off = 0; i < (int)msg->msg_iovlen; off += msg->msg_iov[i++].iov_len )
+        memcpy(buf + off, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+
+    n = shim_sendto(fd, buf, len, flags, msg->msg_name, msg->msg_namelen);
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* room for TCP data in the queue of managed socket. -1 if the descriptor is passed through */
+static int shim_stream_room(int fd)
+{
+    shim_fd_t *st;
+    int max_queue;
+
+
+    st = shim_fd(fd);
+
+    if ( st == NULL || st->type != SOCK_STREAM )
+        return -1;
+
+    max_queue = shim_params.max_queue > 0 ? shim_params.max_queue : shim_default_queue;
+
+    return st->queued < max_queue ? max_queue - st->queued : 0;
+}
+
+/* ********************************************************************** */
+/* the file data is read and held as for send() */
+static ssize_t shim_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    char *buf;
+    off_t pos;
+    ssize_t n;
+    int room;
+
+
+    if ( 0 > (room = shim_stream_room(out_fd)) )
+        return shim_lower->sendfile(out_fd, in_fd, offset, count);
+
+    if ( count > (size_t)room )
+        count = room > 0 ? room : 1; /* full queue makes shim_sendto() return EAGAIN */
+
+    if ( NULL == (buf = malloc(count > 0 ? count : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    pos = offset != NULL ? *offset : lseek(in_fd, 0, SEEK_CUR);
+
+    if ( 0 < (n = pread(in_fd, buf, count, pos)) && 0 < (n = shim_sendto(out_fd, buf, n, 0, NULL, 0)) )
+    {
+        if ( offset != NULL )
+            *offset += n;
+        else
+            lseek(in_fd, pos + n, SEEK_SET);
+    }
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* pipe to managed socket goes through the queue. the pipe is read no more than the queue takes */
+static ssize_t shim_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+    char *buf;
+    ssize_t n;
+    int room;
+
+
+    ap_net_shim_flush();
+
+    if ( 0 > (room = shim_stream_room(fd_out)) )
+        return shim_lower->splice(fd_in, off_in, fd_out, off_out, len, flags);
+
+    if ( room == 0 )
+    {
+        ++shim_stat.queue_full;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if ( len > (size_t)room )
+        len = room;
+
+    if ( NULL == (buf = malloc(len > 0 ? len : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if ( 0 < (n = read(fd_in, buf, len)) )
+        n = shim_sendto(fd_out, buf, n, 0, NULL, 0);
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+static ssize_t shim_recv(int fd, void *buf, size_t len, int flags)
+{
+    ap_net_shim_flush();
+
+    return shim_lower->recv(fd, buf, len, flags);
+}
+
+/* ********************************************************************** */
+static ssize_t shim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+    ap_net_shim_flush();
+
+    return shim_lower->recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+/* ********************************************************************** */
+/* zero-copy is refused for managed sockets: the data held is a copy, so the kernel would never report it */
+static int shim_setsockopt(int fd, int level, int name, const void *value, socklen_t value_len)
+{
+    if ( level == SOL_SOCKET && name == SO_ZEROCOPY && shim_fd(fd) != NULL )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return shim_lower->setsockopt(fd, level, name, value, value_len);
+}
+
+/* ********************************************************************** */
+/* FIN should not overtake the data held, so it is sent out first */
+static int shim_shutdown(int fd, int how)
+{
+    if ( how != SHUT_RD )
+        shim_flush_fd(fd, 1);
+
+    return shim_lower->shutdown(fd, how);
+}
+
+/* ********************************************************************** */
+/* the data held is sent out at once, as the kernel would keep sending it after close() */
+static int shim_close(int fd)
+{
+    shim_flush_fd(fd, 1);
+
+    if ( fd >= 0 && fd < shim_fds_size )
+        memset(&shim_fds[fd], 0, sizeof(shim_fd_t));
+
+    return shim_lower->close(fd);
+}
+
+/* ********************************************************************** */
+/* waits no longer than till the next held data is due */
+static int shim_epoll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout)
+{
+    uint64_t now;
+    uint64_t due_ms;
+    int n;
+
+
+    ap_net_shim_flush();
+
+    if ( timeout != 0 && shim_heap_count > 0 )
+    {
+        now = ap_utils_clock_ns();
+        due_ms = shim_heap[0]->time > now ? (shim_heap[0]->time - now + 999999) / 1000000 : 0;
+
+        if ( timeout < 0 || (uint64_t)timeout > due_ms )
+            timeout = due_ms;
+    }
+
+    n = shim_lower->epoll_wait(epoll_fd, events, max_events, timeout);
+
+    ap_net_shim_flush();
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Starts impairing the sends of all sockets used via ap_net_io
+ *
+ * \param params struct ap_net_shim_params_t* - delay, jitter, loss, etc. Can be called again to change them on the fly
+ * \param seed uint64_t - pseudo-random generator seed for jitter, losses and reordering
+ * \return int - true/false
+ *
+ * The data of TCP connection keeps its order, its losses are turned into retransmission delays.
+ * UDP datagrams are dropped, reordered by jitter and by params->reorder.
+ * Blocking sends return at once, the data is held by shim.
+ */
+int ap_net_shim_enable(struct ap_net_shim_params_t *params, uint64_t seed)
+{
+    ap_error_clear();
+
+#ifdef AP_NET_NO_SIM
+    ap_error_set_custom(_func_name, "compiled out by AP_NET_NO_SIM");
+    return 0;
+#endif
+
+    if ( params->loss < 0 || params->loss > 1.0 || params->reorder < 0 || params->reorder > 1.0 )
+    {
+        ap_error_set_custom(_func_name, "loss and reorder should be in 0.0 - 1.0 range");
+        return 0;
+    }
+
+    shim_params = *params;
+    shim_rnd = seed != 0 ? seed : 0x9e3779b97f4a7c15ull;
+
+    if ( shim_active )
+        return 1;
+
+    memset(&shim_stat, 0, sizeof(shim_stat));
+
+    shim_lower = ap_net_io;
+    shim_io = *shim_lower;
+
+    shim_io.send = shim_send;
+    shim_io.sendto = shim_sendto;
+    shim_io.sendmsg = shim_sendmsg;
+    shim_io.sendfile = shim_sendfile;
+    shim_io.splice = shim_splice;
+    shim_io.shutdown = shim_shutdown;
+    shim_io.setsockopt = shim_setsockopt;
+    shim_io.recv = shim_recv;
+    shim_io.recvfrom = shim_recvfrom;
+    shim_io.close = shim_close;
+    shim_io.epoll_wait = shim_epoll_wait;
+
+    ap_net_io = &shim_io;
+    shim_active = 1;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Sends out everything held and restores the previous ap_net_io table
+ *
+ * \return void
+ */
+void ap_net_shim_disable(void)
+{
+    int fd;
+
+
+    if ( ! shim_active )
+        return;
+
+    for ( fd = 0; fd < shim_fds_size && shim_heap_count > 0; ++fd )
+        shim_flush_fd(fd, 1);
+
+    free(shim_heap);
+    free(shim_fds);
+    shim_heap = NULL;
+    shim_fds = NULL;
+    shim_heap_count = shim_heap_size = shim_fds_size = 0;
+
+    ap_net_io = shim_lower;
+    shim_active = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Copies shim counters
+ *
+ * \param dst struct ap_net_shim_stat_t*
+ * \return void
+ */
+void ap_net_shim_get_stat(struct ap_net_shim_stat_t *dst)
+{
+    *dst = shim_stat;
+}
+
+/* ********************************************************************** */
+static int shim_is_key(const char *p, size_t key_len, const char *key)
+{
+    return key_len == strlen(key) && 0 == strncmp(p, key, key_len);
+}
+
+/* ********************************************************************** */
+/** \brief Fills shim parameters from text
+ *
+ * \param dst struct ap_net_shim_params_t* - zeroed first
+ * \param spec const char* - comma separated list: delay=T,jitter=T,loss=P,reorder=P,bw=B,queue=B
+ * \return int - true/false
+ *
+ * T is time with ns, us, ms or s suffix, microseconds by default.
+ * P is probability 0.0 - 1.0 or percent with % suffix.
+ * B is bytes (per second for bw) with optional k, m or g suffix (powers of 1000).
+ * Example: "delay=20ms,jitter=5ms,loss=1%,bw=10m"
+ */
+int ap_net_shim_params_parse(struct ap_net_shim_params_t *dst, const char *spec)
+{
+    const char *p;
+    char *end;
+    double v;
+    size_t key_len;
+
+
+    ap_error_clear();
+
+    memset(dst, 0, sizeof(struct ap_net_shim_params_t));
+
+    for ( p = spec; *p != '\0'; )
+    {
+        key_len = strcspn(p, "=");
+
+        if ( p[key_len] != '=' )
+            break;
+
+        v = strtod(p + key_len + 1, &end);
+
+        if ( end == p + key_len + 1 )
+            break;
+
+        if ( shim_is_key(p, key_len, "delay") || shim_is_key(p, key_len, "jitter") )
+        {
+            if ( 0 == strncmp(end, "ns", 2) ) { end += 2; }
+            else if ( 0 == strncmp(end, "us", 2) ) { v *= 1e3; end += 2; }
+            else if ( 0 == strncmp(end, "ms", 2) ) { v *= 1e6; end += 2; }
+            else if ( *end == 's' ) { v *= 1e9; ++end; }
+            else v *= 1e3;
+
+            if ( *p == 'd' )
+                dst->delay_ns = v;
+            else
+                dst->jitter_ns = v;
+        }
+        else if ( shim_is_key(p, key_len, "loss") || shim_is_key(p, key_len, "reorder") )
+        {
+            if ( *end == '%' )
+            {
+                v /= 100;
+                ++end;
+            }
+
+            if ( *p == 'l' )
+                dst->loss = v;
+            else
+                dst->reorder = v;
+        }
+        else if ( shim_is_key(p, key_len, "bw") || shim_is_key(p, key_len, "queue") )
+        {
+            switch ( *end )
+            {
+                case 'k': case 'K': v *= 1e3; ++end; break;
+                case 'm': case 'M': v *= 1e6; ++end; break;
+                case 'g': case 'G': v *= 1e9; ++end; break;
+            }
+
+            if ( *p == 'b' )
+                dst->bandwidth = v;
+            else
+                dst->max_queue = v;
+        }
+        else
+            break;
+
+        if ( *end == ',' )
+            ++end;
+        else if ( *end != '\0' )
+            break;
+
+        p = end;
+    }
+
+    if ( *p != '\0' || dst->loss < 0 || dst->loss > 1.0 || dst->reorder < 0 || dst->reorder > 1.0 )
+    {
+        ap_error_set_custom("ap_net_shim_params_parse()", "bad impairment spec at: %s", p);
+        return 0;
+    }
+
+    return 1;
+}
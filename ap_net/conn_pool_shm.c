@@ -0,0 +1,319 @@
+/** \file ap_net/conn_pool_shm.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Statistics export via shared memory
+ */
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *_func_name = "ap_net_conn_pool_shm_export()";
+
+/** How many times ap_net_shm_snapshot() retries if the writer is busy updating the segment */
+#define max_snapshot_tries 1000
+
+/* ********************************************************************** */
+/** \brief Starts publishing of pool's statistics into named shared memory segment
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param name const char* - segment name for shm_open(), like "/myapp.pool1". Shows up in /dev/shm/
+ * \param flags int - AP_NET_SHM_* bits
+ * \param interval_ms int - minimal time between updates. 0 to update on each ap_net_conn_pool_poll() call
+ * \return int - true/false
+ *
+ * The segment is updated at the end of ap_net_conn_pool_poll() and is laid out as struct ap_net_shm_t.
+ * The writer is protected by seqlock, so it never waits for the readers. Readers should use ap_net_shm_attach()
+ * and ap_net_shm_snapshot() to get the consistent copy. See tools/ap_netstat.c for example.
+ * With AP_NET_SHM_CONNS flag the summaries of connected connections are published too.
+ * The room for them is reserved for pool's max_connections at the time of this call.
+ * The segment is removed by ap_net_conn_pool_shm_close() or on pool destroy.
+ */
+int ap_net_conn_pool_shm_export(struct ap_net_conn_pool_t *pool, const char *name, int flags, int interval_ms)
+{
+    struct ap_net_shm_export_t *exp;
+    int fd;
+    int capacity;
+
+
+    ap_error_clear();
+
+    if ( interval_ms < 0 || strlen(name) >= sizeof(exp->name) )
+    {
+        ap_error_set_custom(_func_name, "bad name or interval");
+        return 0;
+    }
+
+    if ( pool->shm != NULL )
+        ap_net_conn_pool_shm_close(pool);
+
+    exp = malloc(sizeof(struct ap_net_shm_export_t));
+
+    if ( exp == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return 0;
+    }
+
+    strcpy(exp->name, name);
+    exp->interval_ns = (uint64_t)interval_ms * 1000000;
+    exp->last_ns = 0;
+
+    capacity = bit_is_set(flags, AP_NET_SHM_CONNS) ? pool->max_connections : 0;
+    exp->size = sizeof(struct ap_net_shm_t) + capacity * sizeof(struct ap_net_shm_conn_t);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if ( fd == -1 )
+    {
+        free(exp);
+        ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "shm_open(%s)", name);
+        return 0;
+    }
+
+    if ( -1 == ftruncate(fd, exp->size) )
+    {
+        close(fd);
+        shm_unlink(name);
+        free(exp);
+        ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "ftruncate()");
+        return 0;
+    }
+
+    exp->shm = mmap(NULL, exp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if ( exp->shm == MAP_FAILED )
+    {
+        shm_unlink(name);
+        free(exp);
+        ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "mmap()");
+        return 0;
+    }
+
+    /* fresh segment is zero-filled, so seq is 0 already */
+    exp->shm->version = AP_NET_SHM_VERSION;
+    exp->shm->pid = getpid();
+    exp->shm->flags = flags;
+    exp->shm->conns_capacity = capacity;
+
+    pool->shm = exp;
+
+    ap_net_conn_pool_shm_publish(pool, 1);
+
+    /* magic goes last, so readers will not attach to half-initialized segment */
+    __atomic_store_n(&exp->shm->magic, AP_NET_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Stops statistics publishing and removes shared memory segment
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \return void
+ *
+ * Readers that are already attached can continue to read the last published data.
+ * The segment is removed only by the exporting process, so destroying of the pool inherited by fork() child is safe
+ */
+void ap_net_conn_pool_shm_close(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_shm_export_t *exp;
+
+
+    exp = pool->shm;
+
+    if ( exp == NULL )
+        return;
+
+    pool->shm = NULL;
+
+    if ( exp->shm->pid == getpid() )
+        shm_unlink(exp->name);
+
+    munmap(exp->shm, exp->size);
+    free(exp);
+}
+
+/* ********************************************************************** */
+/** \brief Updates shared memory statistics segment
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param force int - if false then update is skipped if it is too early, according to interval given to ap_net_conn_pool_shm_export()
+ * \return void
+ *
+ * Called from ap_net_conn_pool_poll(). Call it with force set if you need the readers to see the changes made outside of poll immediately
+ */
+void ap_net_conn_pool_shm_publish(struct ap_net_conn_pool_t *pool, int force)
+{
+    struct ap_net_shm_export_t *exp;
+    struct ap_net_shm_t *shm;
+    struct ap_net_shm_conn_t *dst;
+    struct ap_net_connection_t *conn;
+    uint64_t now;
+    uint64_t seq;
+    int i;
+    int n;
+
+
+    exp = pool->shm;
+
+    if ( exp == NULL )
+        return;
+
+    now = ap_utils_clock_ns();
+
+    if ( ! force && now - exp->last_ns < exp->interval_ns )
+        return;
+
+    exp->last_ns = now;
+    shm = exp->shm;
+
+    seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED); /* odd: update in progress */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->publish_ns = now;
+    shm->publish_count++;
+    shm->max_connections = pool->max_connections;
+    shm->used_slots = pool->used_slots;
+
+    ap_net_conn_pool_get_stat(pool, &shm->stat);
+
+    n = 0;
+
+    for ( i = 0; i < pool->max_connections && n < shm->conns_capacity; ++i )
+    {
+        conn = &pool->conns[i];
+
+        if ( ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+            continue;
+
+        dst = &shm->conns[n++];
+
+        dst->idx = conn->idx;
+        dst->fd = conn->fd;
+        dst->state = conn->state;
+        dst->flags = conn->flags;
+        dst->af = conn->remote.af;
+        dst->buffered = conn->buffill - conn->bufpos;
+        dst->bufsize = conn->bufsize;
+        dst->age_ms = ap_utils_timespec_elapsed(&conn->created_time, NULL, NULL);
+
+        memset(dst->remote_addr, 0, sizeof(dst->remote_addr));
+
+        if ( conn->remote.af == AF_INET6 )
+        {
+            dst->remote_port = ntohs(conn->remote.addr6.sin6_port);
+            memcpy(dst->remote_addr, &conn->remote.addr6.sin6_addr, 16);
+        }
+        else
+        {
+            dst->remote_port = ntohs(conn->remote.addr4.sin_port);
+            memcpy(dst->remote_addr, &conn->remote.addr4.sin_addr, 4);
+        }
+    }
+
+    shm->conns_count = n;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* ********************************************************************** */
+/** \brief Maps shared memory statistics segment for reading
+ *
+ * \param name const char* - segment name as given to ap_net_conn_pool_shm_export()
+ * \param size size_t* - mapped size is placed here. Use it for ap_net_shm_snapshot() and ap_net_shm_detach()
+ * \return struct ap_net_shm_t* - mapped segment or NULL on error
+ *
+ * Fails with AP_ERRNO_CUSTOM_MESSAGE if segment is not initialized yet or is of incompatible version
+ */
+struct ap_net_shm_t *ap_net_shm_attach(const char *name, size_t *size)
+{
+    int fd;
+    struct stat st;
+    struct ap_net_shm_t *shm;
+
+
+    ap_error_clear();
+
+    fd = shm_open(name, O_RDONLY, 0);
+
+    if ( fd == -1 )
+    {
+        ap_error_set_detailed("ap_net_shm_attach()", AP_ERRNO_SYSTEM, "shm_open(%s)", name);
+        return NULL;
+    }
+
+    if ( -1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(struct ap_net_shm_t) )
+    {
+        close(fd);
+        ap_error_set_custom("ap_net_shm_attach()", "%s: segment is too small", name);
+        return NULL;
+    }
+
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if ( shm == MAP_FAILED )
+    {
+        ap_error_set_detailed("ap_net_shm_attach()", AP_ERRNO_SYSTEM, "mmap()");
+        return NULL;
+    }
+
+    if ( __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != AP_NET_SHM_MAGIC || shm->version != AP_NET_SHM_VERSION )
+    {
+        munmap(shm, st.st_size);
+        ap_error_set_custom("ap_net_shm_attach()", "%s: not initialized or version mismatch", name);
+        return NULL;
+    }
+
+    *size = st.st_size;
+
+    return shm;
+}
+
+/* ********************************************************************** */
+/** \brief Makes consistent copy of shared memory statistics segment
+ *
+ * \param shm struct ap_net_shm_t* - segment mapped by ap_net_shm_attach()
+ * \param size size_t - mapped size returned by ap_net_shm_attach()
+ * \param dst struct ap_net_shm_t* - destination buffer of size bytes
+ * \return int - true/false. false if the writer was updating the segment all the time we tried
+ */
+int ap_net_shm_snapshot(struct ap_net_shm_t *shm, size_t size, struct ap_net_shm_t *dst)
+{
+    uint64_t seq;
+    int try;
+
+
+    for ( try = 0; try < max_snapshot_tries; ++try )
+    {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+
+        if ( seq & 1 ) /* writer is in progress */
+            continue;
+
+        memcpy(dst, shm, size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if ( __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq )
+            return 1;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/** \brief Unmaps shared memory statistics segment
+ *
+ * \param shm struct ap_net_shm_t* - segment mapped by ap_net_shm_attach()
+ * \param size size_t - mapped size returned by ap_net_shm_attach()
+ * \return void
+ */
+void ap_net_shm_detach(struct ap_net_shm_t *shm, size_t size)
+{
+    munmap(shm, size);
+}
@@ -0,0 +1,2093 @@
+/** \file ap_net/conn_pool_sim.c
+ * \brief Part of AP's toolkit. Networking module: Deterministic in-memory network simulator with virtual clock
+ *
+ * ap_net_sim_create() replaces the system calls table ap_net_io and the clock read by ap_utils_timespec_*() and
+ * ap_utils_clock_ns() with the simulated ones, so the pools work unchanged on top of it.
+ * Time stands still until ap_net_sim_advance() or ap_net_sim_run() moves it. The packets are delivered in the order
+ * of their arrival times computed from the link properties, with the pseudo-random jitter and losses taken from the seed.
+ * The same seed and the same sequence of calls give exactly the same run.
+ *
+ * Limitations: nothing ever blocks. Blocking calls that would wait return EAGAIN instead, connect() completes at once.
+ * Bandwidth is applied to each flow separately, there is no congestion between them. Only one simulator can be active.
+ */
+#include "conn_pool_internals.h"
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+
+#ifdef AP_NET_NO_SIM
+#undef ap_net_io /* the module does not use the table, so ap_net_sim_create() refuses to work */
+#endif
+
+static const char *_func_name = "ap_net_sim_create()";
+
+/* simulated descriptors start here, so they never clash with the real ones */
+#define sim_fd_base 0x10000000
+/* TCP: unread by peer plus in flight bytes of one connection */
+#define sim_sndbuf (256 * 1024)
+/* TCP: data is sent in segments of up to this size */
+#define sim_mss 16384
+/* UDP: receive queue length in datagrams */
+#define sim_max_dgrams 256
+#define sim_max_dgram_size 65507
+/* TCP: minimal retransmission timeout for lost segments */
+#define sim_min_rto_ns 200000000ull
+#define sim_max_links 64
+#define sim_first_port 32768
+#define sim_last_port 60999
+/* virtual clock starts here: zero timespec means "not set" for ap_utils_timespec_*() */
+#define sim_epoch_ns 1000000000000ull
+
+/* socket kinds */
+#define SIM_STREAM 1
+#define SIM_DGRAM  2
+#define SIM_EPOLL  3
+
+/* event types */
+#define SIM_EV_SYN   1
+#define SIM_EV_DATA  2
+#define SIM_EV_FIN   3
+#define SIM_EV_DGRAM 4
+
+typedef struct sim_dgram_t
+{
+    struct sim_dgram_t *next;
+    struct sockaddr_storage from;
+    int len;
+    char data[];
+} sim_dgram_t;
+
+typedef struct sim_sock_t
+{
+    int slot; /* index in sim->socks */
+    int fd; /* -1 for the accepted connection that was not taken by accept() yet */
+    int kind; /* SIM_STREAM, SIM_DGRAM or SIM_EPOLL */
+    int af;
+    int nonblock;
+    int bound; /* local address is set. if by bind() then the port is counted in sim->port_refs */
+    int port_ref;
+    int connected;
+    int listening;
+    int backlog;
+    int eof; /* TCP: FIN from peer has arrived */
+    int wr_shut; /* TCP: shutdown(SHUT_WR) is done, FIN is sent */
+    int error; /* pending error, returned by the next i/o and SO_ERROR */
+    int zerocopy; /* TCP: SO_ZEROCOPY is set */
+    uint32_t zc_next; /* number of the next MSG_ZEROCOPY send */
+    uint64_t *zc_times; /* ring: when MSG_ZEROCOPY sends not reported yet are done, i.e. their last segment arrives */
+    int zc_head;
+    int zc_count;
+    int zc_size;
+    struct sockaddr_storage local;
+    struct sockaddr_storage remote;
+    struct sim_sock_t *peer; /* TCP: the other end. NULL if closed */
+    char *rx; /* TCP: received data */
+    int rx_len;
+    int rx_size;
+    int in_flight; /* TCP: sent to peer, not arrived yet */
+    uint64_t busy_until; /* when the last packet sent leaves, for bandwidth limit */
+    uint64_t last_arrival; /* TCP: keeps the segments in order */
+    struct sim_sock_t **accept_q; /* listener: connections arrived, not accepted yet */
+    int accept_count;
+    sim_dgram_t *dq_head; /* UDP: received datagrams */
+    sim_dgram_t *dq_tail;
+    int dq_count;
+    int *reg_fds; /* epoll: registered descriptors */
+    struct epoll_event *regs;
+    int regs_count;
+    int regs_size;
+} sim_sock_t;
+
+typedef struct sim_event_t
+{
+    uint64_t time;
+    uint64_t seq; /* creation order, for the events of the same time */
+    int type;
+    int dst_slot; /* destination socket. for SYN it is a listener */
+    unsigned dst_gen;
+    int src_slot; /* sending socket. for SYN it is the server's end of new connection */
+    unsigned src_gen;
+    struct sockaddr_storage from; /* UDP */
+    struct sockaddr_storage to;
+    int len;
+    char data[];
+} sim_event_t;
+
+typedef struct sim_link_rec_t
+{
+    struct sockaddr_storage a;
+    struct sockaddr_storage b;
+    struct ap_net_sim_link_t link;
+} sim_link_rec_t;
+
+struct ap_net_sim_t
+{
+    uint64_t now;
+    uint64_t seq;
+    uint64_t rnd;
+    sim_sock_t **socks; /* all sockets, including not accepted ones */
+    unsigned *gens; /* slot generation, so the events for the closed socket will not go to the new one */
+    int socks_size;
+    sim_sock_t **fds; /* descriptors table */
+    int fds_size;
+    sim_event_t **heap; /* packets in flight, ordered by arrival */
+    int heap_count;
+    int heap_size;
+    struct ap_net_sim_link_t default_link;
+    sim_link_rec_t links[sim_max_links];
+    int links_count;
+    struct sockaddr_in source4;
+    struct sockaddr_in6 source6;
+    int next_port;
+    unsigned short port_refs[2][65536]; /* [kind - 1][port] bound sockets count */
+};
+
+static struct ap_net_sim_t *sim; /* the active one */
+static struct ap_net_io_ops_t sim_io;
+
+/* ********************************************************************** */
+/* xorshift64* */
+static uint64_t sim_random(void)
+{
+    sim->rnd ^= sim->rnd >> 12;
+    sim->rnd ^= sim->rnd << 25;
+    sim->rnd ^= sim->rnd >> 27;
+
+    return sim->rnd * 2685821657736338717ull;
+}
+
+/* ********************************************************************** */
+/* uniform in [0, 1) */
+static double sim_random_unit(void)
+{
+    return (sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ********************************************************************** */
+/* addresses helpers */
+static socklen_t sim_addr_len(int af)
+{
+    return af == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static int sim_port(struct sockaddr_storage *ss)
+{
+    return ntohs(ss->ss_family == AF_INET6 ? ((struct sockaddr_in6 *)ss)->sin6_port : ((struct sockaddr_in *)ss)->sin_port);
+}
+
+static void sim_set_port(struct sockaddr_storage *ss, int port)
+{
+    if ( ss->ss_family == AF_INET6 )
+        ((struct sockaddr_in6 *)ss)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)ss)->sin_port = htons(port);
+}
+
+static int sim_ip_is_any(struct sockaddr_storage *ss)
+{
+    if ( ss->ss_family == AF_INET6 )
+        return 0 == memcmp(&((struct sockaddr_in6 *)ss)->sin6_addr, &in6addr_any, sizeof(struct in6_addr));
+
+    return ((struct sockaddr_in *)ss)->sin_addr.s_addr == htonl(INADDR_ANY);
+}
+
+static int sim_same_ip(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+    if ( a->ss_family != b->ss_family )
+        return 0;
+
+    if ( a->ss_family == AF_INET6 )
+        return 0 == memcmp(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr));
+
+    return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+/* local address a accepts packets for b */
+static int sim_ip_match(struct sockaddr_storage *local, struct sockaddr_storage *b)
+{
+    return local->ss_family == b->ss_family && (sim_ip_is_any(local) || sim_same_ip(local, b));
+}
+
+/* the source address of packets sent from socket bound to the "any" address */
+static void sim_set_source_ip(struct sockaddr_storage *ss)
+{
+    int port;
+
+
+    port = sim_port(ss);
+
+    if ( ss->ss_family == AF_INET6 )
+        memcpy(ss, &sim->source6, sizeof(struct sockaddr_in6));
+    else
+        memcpy(ss, &sim->source4, sizeof(struct sockaddr_in));
+
+    sim_set_port(ss, port);
+}
+
+/* ********************************************************************** */
+/* event queue: binary heap by (time, seq) */
+static int sim_event_before(sim_event_t *a, sim_event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int sim_event_push(sim_event_t *ev)
+{
+    void *new_mem;
+    int i;
+
+
+    if ( sim->heap_count == sim->heap_size )
+    {
+        new_mem = realloc(sim->heap, (sim->heap_size * 2 + 64) * sizeof(sim_event_t *));
+
+        if ( new_mem == NULL )
+            return 0;
+
+        sim->heap = new_mem;
+        sim->heap_size = sim->heap_size * 2 + 64;
+    }
+
+    ev->seq = sim->seq++;
+
+    for ( i = sim->heap_count++; i > 0 && sim_event_before(ev, sim->heap[(i - 1) / 2]); i = (i - 1) / 2 )
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+
+    sim->heap[i] = ev;
+
+    return 1;
+}
+
+static sim_event_t *sim_event_pop(void)
+{
+    sim_event_t *top;
+    sim_event_t *last;
+    int i;
+    int child;
+
+
+    if ( sim->heap_count == 0 )
+        return NULL;
+
+    top = sim->heap[0];
+    last = sim->heap[--sim->heap_count];
+
+    for ( i = 0; (child = i * 2 + 1) < sim->heap_count; i = child )
+    {
+        if ( child + 1 < sim->heap_count && sim_event_before(sim->heap[child + 1], sim->heap[child]) )
+            ++child;
+
+        if ( ! sim_event_before(sim->heap[child], last) )
+            break;
+
+        sim->heap[i] = sim->heap[child];
+    }
+
+    if ( sim->heap_count > 0 )
+        sim->heap[i] = last;
+
+    return top;
+}
+
+static sim_event_t *sim_event_new(int type, int len)
+{
+    sim_event_t *ev;
+
+
+    ev = malloc(sizeof(sim_event_t) + len);
+
+    if ( ev == NULL )
+        return NULL;
+
+    memset(ev, 0, sizeof(sim_event_t));
+    ev->type = type;
+    ev->len = len;
+
+    return ev;
+}
+
+/* ********************************************************************** */
+/* sockets and descriptors tables */
+static sim_sock_t *sim_sock_new(int kind, int af)
+{
+    sim_sock_t *s;
+    void *new_mem;
+    int slot;
+
+
+    for ( slot = 0; slot < sim->socks_size; ++slot )
+        if ( sim->socks[slot] == NULL )
+            break;
+
+    if ( slot == sim->socks_size )
+    {
+        new_mem = realloc(sim->socks, (sim->socks_size * 2 + 64) * sizeof(sim_sock_t *));
+
+        if ( new_mem == NULL )
+            return NULL;
+
+        sim->socks = new_mem;
+
+        new_mem = realloc(sim->gens, (sim->socks_size * 2 + 64) * sizeof(unsigned));
+
+        if ( new_mem == NULL )
+            return NULL;
+
+        sim->gens = new_mem;
+
+        memset(sim->socks + sim->socks_size, 0, (sim->socks_size + 64) * sizeof(sim_sock_t *));
+        memset(sim->gens + sim->socks_size, 0, (sim->socks_size + 64) * sizeof(unsigned));
+        sim->socks_size = sim->socks_size * 2 + 64;
+    }
+
+    s = calloc(1, sizeof(sim_sock_t));
+
+    if ( s == NULL )
+        return NULL;
+
+    s->slot = slot;
+    s->fd = -1;
+    s->kind = kind;
+    s->af = af;
+    s->local.ss_family = af;
+    s->remote.ss_family = af;
+
+    sim->socks[slot] = s;
+
+    return s;
+}
+
+static sim_sock_t *sim_sock_by_slot(int slot, unsigned gen)
+{
+    if ( slot < 0 || slot >= sim->socks_size || sim->gens[slot] != gen )
+        return NULL;
+
+    return sim->socks[slot];
+}
+
+static int sim_fd_alloc(sim_sock_t *s)
+{
+    void *new_mem;
+    int i;
+
+
+    for ( i = 0; i < sim->fds_size; ++i )
+        if ( sim->fds[i] == NULL )
+            break;
+
+    if ( i == sim->fds_size )
+    {
+        new_mem = realloc(sim->fds, (sim->fds_size * 2 + 64) * sizeof(sim_sock_t *));
+
+        if ( new_mem == NULL )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        sim->fds = new_mem;
+        memset(sim->fds + sim->fds_size, 0, (sim->fds_size + 64) * sizeof(sim_sock_t *));
+        sim->fds_size = sim->fds_size * 2 + 64;
+    }
+
+    sim->fds[i] = s;
+    s->fd = sim_fd_base + i;
+
+    return s->fd;
+}
+
+static sim_sock_t *sim_sock_by_fd(int fd)
+{
+    if ( sim == NULL || fd < sim_fd_base || fd - sim_fd_base >= sim->fds_size || sim->fds[fd - sim_fd_base] == NULL )
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return sim->fds[fd - sim_fd_base];
+}
+
+/* ********************************************************************** */
+/* computes arrival time of the packet sent from s. returns 0 if it is lost for good */
+static uint64_t sim_transmit(sim_sock_t *s, struct sockaddr_storage *dst, int len, int reliable)
+{
+    struct ap_net_sim_link_t *link;
+    struct sockaddr_storage src;
+    uint64_t start;
+    uint64_t arrival;
+    uint64_t rto;
+    int i;
+
+
+    src = s->local;
+
+    if ( sim_ip_is_any(&src) )
+        sim_set_source_ip(&src);
+
+    link = &sim->default_link;
+
+    for ( i = 0; i < sim->links_count; ++i )
+        if ( (sim_same_ip(&sim->links[i].a, &src) && sim_same_ip(&sim->links[i].b, dst))
+             || (sim_same_ip(&sim->links[i].a, dst) && sim_same_ip(&sim->links[i].b, &src)) )
+        {
+            link = &sim->links[i].link;
+            break;
+        }
+
+    start = s->busy_until > sim->now ? s->busy_until : sim->now;
+
+    if ( link->bandwidth > 0 )
+        start += (uint64_t)len * 1000000000ull / link->bandwidth;
+
+    s->busy_until = start;
+
+    arrival = start + link->delay_ns;
+
+    if ( link->jitter_ns > 0 )
+        arrival += sim_random() % (link->jitter_ns + 1);
+
+    if ( link->loss > 0 )
+    {
+        if ( ! reliable || link->loss >= 1.0 )
+        {
+            if ( sim_random_unit() < link->loss )
+                return 0;
+        }
+        else /* retransmitting until it goes through */
+        {
+            rto = link->delay_ns * 2 + link->jitter_ns;
+
+            if ( rto < sim_min_rto_ns )
+                rto = sim_min_rto_ns;
+
+            while ( sim_random_unit() < link->loss )
+                arrival += rto;
+        }
+    }
+
+    if ( reliable )
+    {
+        if ( arrival < s->last_arrival )
+            arrival = s->last_arrival;
+
+        s->last_arrival = arrival;
+    }
+
+    return arrival;
+}
+
+/* ********************************************************************** */
+/* assigns ephemeral port and the default address */
+static int sim_autobind(sim_sock_t *s)
+{
+    int i;
+    int port;
+    int kind;
+
+
+    kind = s->kind - 1;
+
+    for ( i = sim_first_port; i <= sim_last_port; ++i )
+    {
+        port = sim->next_port++;
+
+        if ( sim->next_port > sim_last_port )
+            sim->next_port = sim_first_port;
+
+        if ( sim->port_refs[kind][port] == 0 )
+            break;
+    }
+
+    if ( i > sim_last_port )
+    {
+        errno = EADDRNOTAVAIL;
+        return 0;
+    }
+
+    if ( ! s->bound )
+    {
+        memset(&s->local, 0, sizeof(s->local));
+        s->local.ss_family = s->af;
+    }
+
+    sim_set_port(&s->local, port);
+
+    s->bound = 1;
+    s->port_ref = 1;
+    ++sim->port_refs[kind][port];
+
+    return 1;
+}
+
+/* ********************************************************************** */
+static void sim_sock_free(sim_sock_t *s);
+
+/* stream end is going away: FIN to peer */
+static void sim_stream_disconnect(sim_sock_t *s)
+{
+    sim_sock_t *peer;
+    sim_event_t *ev;
+    uint64_t arrival;
+
+
+    peer = s->peer;
+
+    if ( peer == NULL )
+        return;
+
+    s->peer = NULL;
+    peer->peer = NULL;
+
+    arrival = sim_transmit(s, &s->remote, 0, 1);
+
+    if ( arrival == 0 || NULL == (ev = sim_event_new(SIM_EV_FIN, 0)) )
+        return;
+
+    ev->time = arrival;
+    ev->dst_slot = peer->slot;
+    ev->dst_gen = sim->gens[peer->slot];
+
+    if ( ! sim_event_push(ev) )
+        free(ev);
+}
+
+static void sim_sock_free(sim_sock_t *s)
+{
+    sim_dgram_t *d;
+    int i;
+
+
+    if ( s->kind == SIM_STREAM )
+        sim_stream_disconnect(s);
+
+    for ( i = 0; i < s->accept_count; ++i )
+        sim_sock_free(s->accept_q[i]);
+
+    while ( s->dq_head != NULL )
+    {
+        d = s->dq_head;
+        s->dq_head = d->next;
+        free(d);
+    }
+
+    if ( s->port_ref )
+        --sim->port_refs[s->kind - 1][sim_port(&s->local)];
+
+    if ( s->fd != -1 )
+        sim->fds[s->fd - sim_fd_base] = NULL;
+
+    sim->socks[s->slot] = NULL;
+    ++sim->gens[s->slot];
+
+    free(s->rx);
+    free(s->zc_times);
+    free(s->accept_q);
+    free(s->reg_fds);
+    free(s->regs);
+    free(s);
+}
+
+/* ********************************************************************** */
+/* simulated system calls */
+static int sim_socket(int domain, int type, int protocol)
+{
+    sim_sock_t *s;
+    int kind;
+
+
+    if ( domain != AF_INET && domain != AF_INET6 )
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    switch ( type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC) )
+    {
+        case SOCK_STREAM: kind = SIM_STREAM; break;
+        case SOCK_DGRAM: kind = SIM_DGRAM; break;
+
+        default:
+            errno = ESOCKTNOSUPPORT;
+            return -1;
+    }
+
+    s = sim_sock_new(kind, domain);
+
+    if ( s == NULL )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    s->nonblock = bit_is_set(type, SOCK_NONBLOCK);
+
+    if ( -1 == sim_fd_alloc(s) )
+    {
+        sim_sock_free(s);
+        return -1;
+    }
+
+    return s->fd;
+}
+
+/* ********************************************************************** */
+static int sim_bind(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    sim_sock_t *s;
+    sim_sock_t *other;
+    struct sockaddr_storage ss;
+    int i;
+    int port;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( s->bound || addr->sa_family != s->af || addr_len < sim_addr_len(s->af) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    memcpy(&ss, addr, sim_addr_len(s->af));
+
+    port = sim_port(&ss);
+
+    if ( port != 0 )
+    {
+        for ( i = 0; i < sim->socks_size; ++i )
+        {
+            other = sim->socks[i];
+
+            if ( other != NULL && other->port_ref && other->kind == s->kind && sim_port(&other->local) == port
+                 && (sim_ip_is_any(&other->local) || sim_ip_is_any(&ss) || sim_same_ip(&other->local, &ss)) )
+            {
+                errno = EADDRINUSE;
+                return -1;
+            }
+        }
+
+        s->local = ss;
+        s->bound = 1;
+        s->port_ref = 1;
+        ++sim->port_refs[s->kind - 1][port];
+
+        return 0;
+    }
+
+    s->local = ss;
+    s->bound = 1;
+
+    return sim_autobind(s) ? 0 : -1;
+}
+
+/* ********************************************************************** */
+static int sim_listen(int fd, int backlog)
+{
+    sim_sock_t *s;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( s->kind != SIM_STREAM || s->connected )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ( ! s->bound && ! sim_autobind(s) )
+        return -1;
+
+    s->listening = 1;
+    s->backlog = backlog > 0 ? backlog : 1;
+
+    if ( s->accept_q == NULL && NULL == (s->accept_q = malloc(s->backlog * sizeof(sim_sock_t *))) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+    sim_sock_t *s;
+    sim_sock_t *conn;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( ! s->listening )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( s->accept_count == 0 )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    conn = s->accept_q[0];
+
+    if ( -1 == sim_fd_alloc(conn) )
+        return -1;
+
+    memmove(s->accept_q, s->accept_q + 1, --s->accept_count * sizeof(sim_sock_t *));
+
+    if ( addr != NULL && addr_len != NULL )
+    {
+        if ( *addr_len > sim_addr_len(conn->af) )
+            *addr_len = sim_addr_len(conn->af);
+
+        memcpy(addr, &conn->remote, *addr_len);
+    }
+
+    return conn->fd;
+}
+
+/* ********************************************************************** */
+static int sim_connect(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    sim_sock_t *s;
+    sim_sock_t *listener;
+    sim_sock_t *conn;
+    sim_event_t *ev;
+    struct sockaddr_storage dst;
+    uint64_t arrival;
+    int i;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( addr->sa_family != s->af || addr_len < sim_addr_len(s->af) )
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    memset(&dst, 0, sizeof(dst));
+    memcpy(&dst, addr, sim_addr_len(s->af));
+
+    if ( ! s->bound && ! sim_autobind(s) )
+        return -1;
+
+    if ( s->kind == SIM_DGRAM )
+    {
+        s->remote = dst;
+        s->connected = 1;
+
+        return 0;
+    }
+
+    if ( s->connected || s->listening )
+    {
+        errno = EISCONN;
+        return -1;
+    }
+
+    listener = NULL;
+
+    for ( i = 0; i < sim->fds_size && listener == NULL; ++i )
+        if ( sim->fds[i] != NULL && sim->fds[i]->listening && sim->fds[i]->af == s->af
+             && sim_port(&sim->fds[i]->local) == sim_port(&dst) && sim_ip_match(&sim->fds[i]->local, &dst) )
+            listener = sim->fds[i];
+
+    if ( listener == NULL )
+    {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    if ( sim_ip_is_any(&s->local) )
+        sim_set_source_ip(&s->local);
+
+    conn = sim_sock_new(SIM_STREAM, s->af); /* server's end */
+    ev = sim_event_new(SIM_EV_SYN, 0);
+
+    if ( conn == NULL || ev == NULL )
+    {
+        if ( conn != NULL )
+            sim_sock_free(conn);
+
+        free(ev);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    conn->local = dst;
+    conn->remote = s->local;
+    conn->bound = 1;
+    conn->connected = 1;
+    conn->nonblock = 1;
+    conn->peer = s;
+
+    s->remote = dst;
+    s->connected = 1;
+    s->peer = conn;
+
+    arrival = sim_transmit(s, &dst, 0, 1);
+
+    if ( arrival == 0 ) /* the link is down */
+    {
+        s->peer = NULL;
+        conn->peer = NULL;
+        s->connected = 0;
+        sim_sock_free(conn);
+        free(ev);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    ev->time = arrival;
+    ev->dst_slot = listener->slot;
+    ev->dst_gen = sim->gens[listener->slot];
+    ev->src_slot = conn->slot;
+    ev->src_gen = sim->gens[conn->slot];
+
+    if ( ! sim_event_push(ev) )
+    {
+        free(ev);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_getsockname(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+    sim_sock_t *s;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( *addr_len > sim_addr_len(s->af) )
+        *addr_len = sim_addr_len(s->af);
+
+    memcpy(addr, &s->local, *addr_len);
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_getsockopt(int fd, int level, int name, void *value, socklen_t *value_len)
+{
+    sim_sock_t *s;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    memset(value, 0, *value_len);
+
+    if ( level == SOL_SOCKET && name == SO_ERROR && *value_len >= sizeof(int) )
+    {
+        *(int *)value = s->error;
+        s->error = 0;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/* only SO_ZEROCOPY matters, the rest is taken silently */
+static int sim_setsockopt(int fd, int level, int name, const void *value, socklen_t value_len)
+{
+    sim_sock_t *s;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( level == SOL_SOCKET && name == SO_ZEROCOPY && value_len >= sizeof(int) )
+    {
+        if ( s->kind != SIM_STREAM )
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        s->zerocopy = *(const int *)value != 0;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_fcntl(int fd, int cmd, int arg)
+{
+    sim_sock_t *s;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( cmd == F_GETFL )
+        return O_RDWR | (s->nonblock ? O_NONBLOCK : 0);
+
+    if ( cmd == F_SETFL )
+        s->nonblock = bit_is_set(arg, O_NONBLOCK);
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static ssize_t sim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+    sim_sock_t *s;
+    sim_dgram_t *d;
+    int n;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( s->kind == SIM_DGRAM )
+    {
+        d = s->dq_head;
+
+        if ( d == NULL )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        n = (size_t)d->len < len ? d->len : (int)len; /* the rest of datagram is lost, as usual */
+        memcpy(buf, d->data, n);
+
+        if ( addr != NULL && addr_len != NULL )
+        {
+            if ( *addr_len > sim_addr_len(s->af) )
+                *addr_len = sim_addr_len(s->af);
+
+            memcpy(addr, &d->from, *addr_len);
+        }
+
+        if ( ! bit_is_set(flags, MSG_PEEK) )
+        {
+            s->dq_head = d->next;
+
+            if ( s->dq_head == NULL )
+                s->dq_tail = NULL;
+
+            --s->dq_count;
+            free(d);
+        }
+
+        return n;
+    }
+
+    if ( s->rx_len > 0 )
+    {
+        n = (size_t)s->rx_len < len ? s->rx_len : (int)len;
+        memcpy(buf, s->rx, n);
+
+        if ( ! bit_is_set(flags, MSG_PEEK) )
+        {
+            s->rx_len -= n;
+            memmove(s->rx, s->rx + n, s->rx_len);
+        }
+
+        return n;
+    }
+
+    if ( s->error )
+    {
+        errno = s->error;
+        s->error = 0;
+        return -1;
+    }
+
+    if ( s->eof )
+        return 0;
+
+    errno = s->connected ? EAGAIN : ENOTCONN;
+
+    return -1;
+}
+
+/* ********************************************************************** */
+static ssize_t sim_recv(int fd, void *buf, size_t len, int flags)
+{
+    return sim_recvfrom(fd, buf, len, flags, NULL, NULL);
+}
+
+/* ********************************************************************** */
+/* count of MSG_ZEROCOPY sends done by now. they are done in order */
+static int sim_zerocopy_done(sim_sock_t *s)
+{
+    int n;
+
+
+    for ( n = 0; n < s->zc_count && s->zc_times[(s->zc_head + n) % s->zc_size] <= sim->now; ++n )
+        ;
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* the error queue has zero-copy reports only. data is read as by recvfrom() into the first buffer */
+static ssize_t sim_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    struct sock_extended_err serr;
+    struct cmsghdr *cm;
+    sim_sock_t *s;
+    int n;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( ! bit_is_set(flags, MSG_ERRQUEUE) )
+    {
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+
+        if ( msg->msg_iovlen == 0 )
+            return 0;
+
+        return sim_recvfrom(fd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags, msg->msg_name, &msg->msg_namelen);
+    }
+
+    if ( 0 == (n = sim_zerocopy_done(s)) )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    msg->msg_flags = MSG_ERRQUEUE;
+
+    if ( msg->msg_controllen < CMSG_SPACE(sizeof(serr)) )
+    {
+        msg->msg_flags |= MSG_CTRUNC;
+        msg->msg_controllen = 0;
+        return 0;
+    }
+
+    /* all done ones are reported as one range, as the kernel does for consecutive sends */
+    memset(&serr, 0, sizeof(serr));
+    serr.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+    serr.ee_info = s->zc_next - s->zc_count;
+    serr.ee_data = serr.ee_info + n - 1;
+
+    s->zc_head = (s->zc_head + n) % s->zc_size;
+    s->zc_count -= n;
+
+    cm = (struct cmsghdr *)msg->msg_control;
+    cm->cmsg_level = s->af == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    cm->cmsg_type = s->af == AF_INET6 ? IPV6_RECVERR : IP_RECVERR;
+    cm->cmsg_len = CMSG_LEN(sizeof(serr));
+    memcpy(CMSG_DATA(cm), &serr, sizeof(serr));
+    msg->msg_controllen = CMSG_SPACE(sizeof(serr));
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/* makes room to record one more MSG_ZEROCOPY send */
+static int sim_zerocopy_reserve(sim_sock_t *s)
+{
+    uint64_t *new_times;
+    int new_size, i;
+
+
+    if ( s->zc_count < s->zc_size )
+        return 1;
+
+    new_size = s->zc_size * 2 + 16;
+
+    if ( NULL == (new_times = malloc(new_size * sizeof(uint64_t))) )
+        return 0;
+
+    for ( i = 0; i < s->zc_count; ++i )
+        new_times[i] = s->zc_times[(s->zc_head + i) % s->zc_size];
+
+    free(s->zc_times);
+    s->zc_times = new_times;
+    s->zc_size = new_size;
+    s->zc_head = 0;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+static ssize_t sim_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len)
+{
+    sim_sock_t *s;
+    sim_event_t *ev;
+    struct sockaddr_storage dst;
+    uint64_t arrival;
+    int n;
+    int space;
+    int off;
+    int chunk;
+    int zerocopy;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( s->kind == SIM_DGRAM )
+    {
+        if ( addr != NULL && addr_len >= sim_addr_len(s->af) )
+        {
+            memset(&dst, 0, sizeof(dst));
+            memcpy(&dst, addr, sim_addr_len(s->af));
+        }
+        else if ( s->connected )
+            dst = s->remote;
+        else
+        {
+            errno = EDESTADDRREQ;
+            return -1;
+        }
+
+        if ( len > sim_max_dgram_size )
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        if ( ! s->bound && ! sim_autobind(s) )
+            return -1;
+
+        arrival = sim_transmit(s, &dst, len, 0);
+
+        if ( arrival == 0 ) /* lost */
+            return len;
+
+        if ( NULL == (ev = sim_event_new(SIM_EV_DGRAM, len)) )
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        ev->time = arrival;
+        ev->from = s->local;
+        ev->to = dst;
+        memcpy(ev->data, buf, len);
+
+        if ( sim_ip_is_any(&ev->from) )
+            sim_set_source_ip(&ev->from);
+
+        if ( ! sim_event_push(ev) )
+        {
+            free(ev);
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        return len;
+    }
+
+    if ( s->error )
+    {
+        errno = s->error;
+        s->error = 0;
+        return -1;
+    }
+
+    if ( ! s->connected )
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if ( s->peer == NULL || s->wr_shut )
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    space = sim_sndbuf - s->in_flight - s->peer->rx_len;
+
+    if ( space <= 0 )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    n = (size_t)space < len ? space : (int)len;
+
+    zerocopy = s->zerocopy && bit_is_set(flags, MSG_ZEROCOPY);
+
+    if ( zerocopy && ! sim_zerocopy_reserve(s) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for ( off = 0; off < n; off += chunk )
+    {
+        chunk = n - off < sim_mss ? n - off : sim_mss;
+
+        arrival = sim_transmit(s, &s->remote, chunk, 1);
+
+        if ( arrival == 0 ) /* the link is down: the connection just stalls */
+            continue;
+
+        if ( NULL == (ev = sim_event_new(SIM_EV_DATA, chunk)) )
+            break;
+
+        ev->time = arrival;
+        ev->dst_slot = s->peer->slot;
+        ev->dst_gen = sim->gens[s->peer->slot];
+        ev->src_slot = s->slot;
+        ev->src_gen = sim->gens[s->slot];
+        memcpy(ev->data, (char *)buf + off, chunk);
+
+        if ( ! sim_event_push(ev) )
+        {
+            free(ev);
+            break;
+        }
+
+        s->in_flight += chunk;
+    }
+
+    if ( off == 0 )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if ( zerocopy ) /* the memory is "ours" till the last segment arrives */
+    {
+        s->zc_times[(s->zc_head + s->zc_count++) % s->zc_size] = s->last_arrival > sim->now ? s->last_arrival : sim->now;
+        ++s->zc_next;
+    }
+
+    return off;
+}
+
+/* ********************************************************************** */
+static ssize_t sim_send(int fd, const void *buf, size_t len, int flags)
+{
+    return sim_sendto(fd, buf, len, flags, NULL, 0);
+}
+
+/* ********************************************************************** */
+/* gathers the buffers, so the data goes as one datagram or one sequence of segments */
+static ssize_t sim_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    char *buf;
+    size_t len, off;
+    ssize_t n;
+    int i;
+
+
+    for ( i = 0, len = 0; i < (int)msg->msg_iovlen; ++i )
+        len += msg->msg_iov[i].iov_len;
+
+    if ( NULL == (buf = malloc(len > 0 ? len : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for ( i = 0, off = 0; i < (int)msg->msg_iovlen; off += msg->msg_iov[i++].iov_len )
+        memcpy(buf + off, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+
+    n = sim_sendto(fd, buf, len, flags, msg->msg_name, msg->msg_namelen);
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* the file is read and sent as usual. the offset moves by what was taken */
+static ssize_t sim_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    char *buf;
+    off_t pos;
+    ssize_t n;
+
+
+    if ( NULL == sim_sock_by_fd(out_fd) )
+        return -1;
+
+    if ( count > sim_sndbuf )
+        count = sim_sndbuf;
+
+    if ( NULL == (buf = malloc(count > 0 ? count : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    pos = offset != NULL ? *offset : lseek(in_fd, 0, SEEK_CUR);
+
+    if ( 0 < (n = pread(in_fd, buf, count, pos)) && 0 < (n = sim_sendto(out_fd, buf, n, 0, NULL, 0)) )
+    {
+        if ( offset != NULL )
+            *offset += n;
+        else
+            lseek(in_fd, pos + n, SEEK_SET);
+    }
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* one end is a real pipe. the room is checked or the data peeked first, so nothing is lost when the other end is full */
+static ssize_t sim_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+    sim_sock_t *s;
+    char *buf;
+    ssize_t n;
+    int space;
+
+
+    if ( fd_in < sim_fd_base && fd_out < sim_fd_base )
+        return ap_net_io_system.splice(fd_in, off_in, fd_out, off_out, len, flags);
+
+    if ( fd_in >= sim_fd_base && fd_out >= sim_fd_base )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( NULL == (s = sim_sock_by_fd(fd_in >= sim_fd_base ? fd_in : fd_out)) )
+        return -1;
+
+    if ( len > sim_sndbuf )
+        len = sim_sndbuf;
+
+    if ( fd_out >= sim_fd_base && s->kind == SIM_STREAM && s->peer != NULL && s->error == 0 )
+    {
+        space = sim_sndbuf - s->in_flight - s->peer->rx_len;
+
+        if ( space <= 0 )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if ( len > (size_t)space )
+            len = space;
+    }
+
+    if ( NULL == (buf = malloc(len > 0 ? len : 1)) )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if ( fd_out >= sim_fd_base )
+    {
+        if ( 0 < (n = read(fd_in, buf, len)) )
+            n = sim_sendto(fd_out, buf, n, 0, NULL, 0);
+    }
+    else if ( 0 < (n = sim_recvfrom(fd_in, buf, len, MSG_PEEK, NULL, NULL)) && 0 < (n = write(fd_out, buf, n)) )
+        sim_recvfrom(fd_in, buf, n, 0, NULL, NULL);
+
+    free(buf);
+
+    return n;
+}
+
+/* ********************************************************************** */
+/* FIN goes after the data sent, the peer can still send back */
+static int sim_shutdown(int fd, int how)
+{
+    sim_sock_t *s;
+    sim_event_t *ev;
+    uint64_t arrival;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    if ( s->kind != SIM_STREAM || ! s->connected )
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if ( how == SHUT_RD || s->wr_shut || s->peer == NULL )
+        return 0;
+
+    s->wr_shut = 1;
+
+    arrival = sim_transmit(s, &s->remote, 0, 1);
+
+    if ( arrival == 0 || NULL == (ev = sim_event_new(SIM_EV_FIN, 0)) )
+        return 0;
+
+    ev->time = arrival;
+    ev->dst_slot = s->peer->slot;
+    ev->dst_gen = sim->gens[s->peer->slot];
+
+    if ( ! sim_event_push(ev) )
+        free(ev);
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_close(int fd)
+{
+    sim_sock_t *s;
+    sim_sock_t *ep;
+    int i;
+    int r;
+
+
+    if ( NULL == (s = sim_sock_by_fd(fd)) )
+        return -1;
+
+    for ( i = 0; i < sim->fds_size; ++i ) /* dropping from all epoll sets */
+    {
+        ep = sim->fds[i];
+
+        if ( ep == NULL || ep->kind != SIM_EPOLL )
+            continue;
+
+        for ( r = 0; r < ep->regs_count; ++r )
+            if ( ep->reg_fds[r] == fd )
+            {
+                --ep->regs_count;
+                memmove(ep->reg_fds + r, ep->reg_fds + r + 1, (ep->regs_count - r) * sizeof(int));
+                memmove(ep->regs + r, ep->regs + r + 1, (ep->regs_count - r) * sizeof(struct epoll_event));
+                break;
+            }
+    }
+
+    sim_sock_free(s);
+
+    return 0;
+}
+
+/* ********************************************************************** */
+static int sim_epoll_create(int size)
+{
+    sim_sock_t *s;
+
+
+    s = sim_sock_new(SIM_EPOLL, AF_UNSPEC);
+
+    if ( s == NULL )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( -1 == sim_fd_alloc(s) )
+    {
+        sim_sock_free(s);
+        return -1;
+    }
+
+    return s->fd;
+}
+
+/* ********************************************************************** */
+static int sim_epoll_ctl(int epoll_fd, int op, int fd, struct epoll_event *event)
+{
+    sim_sock_t *ep;
+    void *new_mem;
+    int r;
+
+
+    if ( NULL == (ep = sim_sock_by_fd(epoll_fd)) || NULL == sim_sock_by_fd(fd) )
+        return -1;
+
+    if ( ep->kind != SIM_EPOLL )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for ( r = 0; r < ep->regs_count; ++r )
+        if ( ep->reg_fds[r] == fd )
+            break;
+
+    switch ( op )
+    {
+        case EPOLL_CTL_ADD:
+            if ( r < ep->regs_count )
+            {
+                errno = EEXIST;
+                return -1;
+            }
+
+            if ( ep->regs_count == ep->regs_size )
+            {
+                new_mem = realloc(ep->reg_fds, (ep->regs_size * 2 + 16) * sizeof(int));
+
+                if ( new_mem == NULL )
+                {
+                    errno = ENOMEM;
+                    return -1;
+                }
+
+                ep->reg_fds = new_mem;
+
+                new_mem = realloc(ep->regs, (ep->regs_size * 2 + 16) * sizeof(struct epoll_event));
+
+                if ( new_mem == NULL )
+                {
+                    errno = ENOMEM;
+                    return -1;
+                }
+
+                ep->regs = new_mem;
+                ep->regs_size = ep->regs_size * 2 + 16;
+            }
+
+            ep->reg_fds[ep->regs_count] = fd;
+            ep->regs[ep->regs_count] = *event;
+            ++ep->regs_count;
+
+            return 0;
+
+        case EPOLL_CTL_MOD:
+        case EPOLL_CTL_DEL:
+            if ( r == ep->regs_count )
+            {
+                errno = ENOENT;
+                return -1;
+            }
+
+            if ( op == EPOLL_CTL_MOD )
+            {
+                ep->regs[r] = *event;
+                return 0;
+            }
+
+            --ep->regs_count;
+            memmove(ep->reg_fds + r, ep->reg_fds + r + 1, (ep->regs_count - r) * sizeof(int));
+            memmove(ep->regs + r, ep->regs + r + 1, (ep->regs_count - r) * sizeof(struct epoll_event));
+
+            return 0;
+    }
+
+    errno = EINVAL;
+
+    return -1;
+}
+
+/* ********************************************************************** */
+/* level-triggered readiness of socket */
+static unsigned sim_ready_events(sim_sock_t *s)
+{
+    unsigned ev;
+
+
+    ev = 0;
+
+    if ( s->kind == SIM_DGRAM )
+        return (s->dq_count > 0 ? EPOLLIN : 0) | EPOLLOUT;
+
+    if ( s->listening )
+        return s->accept_count > 0 ? EPOLLIN : 0;
+
+    if ( s->rx_len > 0 || s->eof || s->error )
+        ev |= EPOLLIN;
+
+    if ( s->eof )
+        ev |= EPOLLRDHUP;
+
+    if ( s->error || sim_zerocopy_done(s) > 0 )
+        ev |= EPOLLERR;
+
+    if ( s->peer != NULL && s->in_flight + s->peer->rx_len < sim_sndbuf )
+        ev |= EPOLLOUT;
+
+    return ev;
+}
+
+/* ********************************************************************** */
+/* never waits: time is moved by ap_net_sim_advance() only */
+static int sim_epoll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout)
+{
+    sim_sock_t *ep;
+    sim_sock_t *s;
+    unsigned ready;
+    int r;
+    int n;
+
+
+    if ( NULL == (ep = sim_sock_by_fd(epoll_fd)) )
+        return -1;
+
+    n = 0;
+
+    for ( r = 0; r < ep->regs_count && n < max_events; ++r )
+    {
+        s = sim->fds[ep->reg_fds[r] - sim_fd_base];
+        ready = sim_ready_events(s) & (ep->regs[r].events | EPOLLERR | EPOLLHUP);
+
+        if ( ready == 0 )
+            continue;
+
+        events[n].events = ready;
+        events[n].data = ep->regs[r].data;
+        ++n;
+    }
+
+    return n;
+}
+
+/* ********************************************************************** */
+static int sim_clock_gettime(clockid_t clock_id, struct timespec *ts)
+{
+    if ( sim == NULL )
+        return clock_gettime(clock_id, ts);
+
+    ts->tv_sec = sim->now / 1000000000ull;
+    ts->tv_nsec = sim->now % 1000000000ull;
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/* the packet has arrived */
+static void sim_deliver(sim_event_t *ev)
+{
+    sim_sock_t *dst;
+    sim_sock_t *src;
+    sim_sock_t *s;
+    sim_dgram_t *d;
+    void *new_mem;
+    int i;
+
+
+    switch ( ev->type )
+    {
+        case SIM_EV_SYN:
+            dst = sim_sock_by_slot(ev->dst_slot, ev->dst_gen);
+            src = sim_sock_by_slot(ev->src_slot, ev->src_gen);
+
+            if ( src == NULL ) /* client is gone already */
+                return;
+
+            if ( dst == NULL || ! dst->listening || dst->accept_count >= dst->backlog ) /* refused */
+            {
+                if ( src->peer != NULL )
+                {
+                    src->peer->error = ECONNREFUSED;
+                    src->peer->eof = 1;
+                    src->peer->peer = NULL;
+                    src->peer = NULL;
+                }
+
+                sim_sock_free(src);
+                return;
+            }
+
+            dst->accept_q[dst->accept_count++] = src;
+            return;
+
+        case SIM_EV_DATA:
+            dst = sim_sock_by_slot(ev->dst_slot, ev->dst_gen);
+            src = sim_sock_by_slot(ev->src_slot, ev->src_gen);
+
+            if ( src != NULL )
+                src->in_flight -= ev->len;
+
+            if ( dst == NULL )
+            {
+                if ( src != NULL ) /* RST */
+                    src->error = ECONNRESET;
+
+                return;
+            }
+
+            if ( dst->rx_len + ev->len > dst->rx_size )
+            {
+                new_mem = realloc(dst->rx, dst->rx_len + ev->len + sim_mss);
+
+                if ( new_mem == NULL )
+                    return;
+
+                dst->rx = new_mem;
+                dst->rx_size = dst->rx_len + ev->len + sim_mss;
+            }
+
+            memcpy(dst->rx + dst->rx_len, ev->data, ev->len);
+            dst->rx_len += ev->len;
+            return;
+
+        case SIM_EV_FIN:
+            dst = sim_sock_by_slot(ev->dst_slot, ev->dst_gen);
+
+            if ( dst != NULL )
+                dst->eof = 1;
+
+            return;
+
+        case SIM_EV_DGRAM:
+            dst = NULL;
+
+            for ( i = 0; i < sim->fds_size; ++i ) /* the connected socket wins over the unconnected one */
+            {
+                s = sim->fds[i];
+
+                if ( s == NULL || s->kind != SIM_DGRAM || ! s->bound
+                     || sim_port(&s->local) != sim_port(&ev->to) || ! sim_ip_match(&s->local, &ev->to) )
+                    continue;
+
+                if ( ! s->connected )
+                {
+                    if ( dst == NULL )
+                        dst = s;
+
+                    continue;
+                }
+
+                if ( sim_same_ip(&s->remote, &ev->from) && sim_port(&s->remote) == sim_port(&ev->from) )
+                {
+                    dst = s;
+                    break;
+                }
+            }
+
+            if ( dst == NULL || dst->dq_count >= sim_max_dgrams ) /* nobody listens or queue is full */
+                return;
+
+            if ( NULL == (d = malloc(sizeof(sim_dgram_t) + ev->len)) )
+                return;
+
+            d->next = NULL;
+            d->from = ev->from;
+            d->len = ev->len;
+            memcpy(d->data, ev->data, ev->len);
+
+            if ( dst->dq_tail == NULL )
+                dst->dq_head = d;
+            else
+                dst->dq_tail->next = d;
+
+            dst->dq_tail = d;
+            ++dst->dq_count;
+            return;
+    }
+}
+
+/* ********************************************************************** */
+/** \brief Creates network simulator and switches networking functions and the clock to it
+ *
+ * \param seed uint64_t - pseudo-random generator seed for jitter and losses. The same seed gives the same run
+ * \return struct ap_net_sim_t* - NULL on error
+ *
+ * From now on all sockets created by the pools are in-memory ones, and ap_utils_timespec_*() and ap_utils_clock_ns()
+ * return the virtual time, which starts at 1000 seconds and stands still until ap_net_sim_advance() or ap_net_sim_run().
+ * Default link has 50 microseconds delay with no jitter, losses or bandwidth limit. See ap_net_sim_set_link().
+ * Outgoing connections are made from 127.0.0.1 and ::1 unless changed by ap_net_sim_set_source_addr().
+ * Create pools after this call and destroy them before ap_net_sim_destroy().
+ */
+struct ap_net_sim_t *ap_net_sim_create(uint64_t seed)
+{
+    ap_error_clear();
+
+#ifdef AP_NET_NO_SIM
+    ap_error_set_custom(_func_name, "compiled out by AP_NET_NO_SIM");
+    return NULL;
+#endif
+
+    if ( sim != NULL )
+    {
+        ap_error_set_custom(_func_name, "another simulator is active");
+        return NULL;
+    }
+
+    sim = calloc(1, sizeof(struct ap_net_sim_t));
+
+    if ( sim == NULL )
+    {
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        return NULL;
+    }
+
+    sim->now = sim_epoch_ns;
+    sim->rnd = seed != 0 ? seed : 0x9e3779b97f4a7c15ull;
+    sim->default_link.delay_ns = 50000;
+    sim->next_port = sim_first_port;
+
+    sim->source4.sin_family = AF_INET;
+    sim->source4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sim->source6.sin6_family = AF_INET6;
+    sim->source6.sin6_addr = in6addr_loopback;
+
+    sim_io.socket = sim_socket;
+    sim_io.bind = sim_bind;
+    sim_io.listen = sim_listen;
+    sim_io.accept = sim_accept;
+    sim_io.connect = sim_connect;
+    sim_io.getsockname = sim_getsockname;
+    sim_io.getsockopt = sim_getsockopt;
+    sim_io.setsockopt = sim_setsockopt;
+    sim_io.fcntl = sim_fcntl;
+    sim_io.recv = sim_recv;
+    sim_io.recvfrom = sim_recvfrom;
+    sim_io.recvmsg = sim_recvmsg;
+    sim_io.send = sim_send;
+    sim_io.sendto = sim_sendto;
+    sim_io.sendmsg = sim_sendmsg;
+    sim_io.sendfile = sim_sendfile;
+    sim_io.splice = sim_splice;
+    sim_io.shutdown = sim_shutdown;
+    sim_io.close = sim_close;
+    sim_io.epoll_create = sim_epoll_create;
+    sim_io.epoll_ctl = sim_epoll_ctl;
+    sim_io.epoll_wait = sim_epoll_wait;
+
+    ap_net_io = &sim_io;
+    ap_utils_clock_gettime = sim_clock_gettime;
+
+    return sim;
+}
+
+/* ********************************************************************** */
+/** \brief Frees simulator and switches networking and the clock back to the system ones
+ *
+ * \param s struct ap_net_sim_t*
+ * \return void
+ *
+ * The sockets that are still open are freed too, so their descriptors become invalid.
+ */
+void ap_net_sim_destroy(struct ap_net_sim_t *s)
+{
+    int i;
+
+
+    if ( s == NULL || s != sim )
+        return;
+
+    for ( i = 0; i < sim->socks_size; ++i )
+        if ( sim->socks[i] != NULL )
+        {
+            sim->socks[i]->peer = NULL; /* no FINs */
+            sim_sock_free(sim->socks[i]);
+        }
+
+    for ( i = 0; i < sim->heap_count; ++i )
+        free(sim->heap[i]);
+
+    free(sim->heap);
+    free(sim->socks);
+    free(sim->gens);
+    free(sim->fds);
+    free(sim);
+
+    sim = NULL;
+
+    ap_net_io = &ap_net_io_system;
+    ap_utils_clock_gettime = clock_gettime;
+}
+
+/* ********************************************************************** */
+/* numeric IPv4 or IPv6 address */
+static int sim_parse_addr(const char *address, struct sockaddr_storage *ss)
+{
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+
+    if ( 1 == inet_pton(AF_INET, address, &((struct sockaddr_in *)ss)->sin_addr) )
+    {
+        ss->ss_family = AF_INET;
+        return 1;
+    }
+
+    if ( 1 == inet_pton(AF_INET6, address, &((struct sockaddr_in6 *)ss)->sin6_addr) )
+    {
+        ss->ss_family = AF_INET6;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* ********************************************************************** */
+/** \brief Sets the properties of the link between two addresses, in both directions
+ *
+ * \param s struct ap_net_sim_t*
+ * \param address1 const char* - numeric IPv4 or IPv6 address. NULL to set the default link used for all other pairs
+ * \param address2 const char* - the other end address. NULL to set the default link
+ * \param link struct ap_net_sim_link_t* - delay, jitter, loss and bandwidth
+ * \return int - true/false
+ *
+ * Ports do not matter: the link is between the hosts. Changes apply to the packets sent after the call
+ */
+int ap_net_sim_set_link(struct ap_net_sim_t *s, const char *address1, const char *address2, struct ap_net_sim_link_t *link)
+{
+    struct sockaddr_storage a;
+    struct sockaddr_storage b;
+    int i;
+
+
+    ap_error_clear();
+
+    if ( link->loss < 0 || link->loss > 1.0 )
+    {
+        ap_error_set_custom("ap_net_sim_set_link()", "loss should be in 0.0 - 1.0 range");
+        return 0;
+    }
+
+    if ( address1 == NULL && address2 == NULL )
+    {
+        s->default_link = *link;
+        return 1;
+    }
+
+    if ( address1 == NULL || address2 == NULL || ! sim_parse_addr(address1, &a) || ! sim_parse_addr(address2, &b) )
+    {
+        ap_error_set_custom("ap_net_sim_set_link()", "bad address");
+        return 0;
+    }
+
+    for ( i = 0; i < s->links_count; ++i )
+        if ( (sim_same_ip(&s->links[i].a, &a) && sim_same_ip(&s->links[i].b, &b))
+             || (sim_same_ip(&s->links[i].a, &b) && sim_same_ip(&s->links[i].b, &a)) )
+            break;
+
+    if ( i == sim_max_links )
+    {
+        ap_error_set_custom("ap_net_sim_set_link()", "too many links, max is %d", sim_max_links);
+        return 0;
+    }
+
+    if ( i == s->links_count )
+        ++s->links_count;
+
+    s->links[i].a = a;
+    s->links[i].b = b;
+    s->links[i].link = *link;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Sets the address outgoing connections are made from
+ *
+ * \param s struct ap_net_sim_t*
+ * \param address const char* - numeric IPv4 or IPv6 address. It replaces the one of the same family only
+ * \return int - true/false
+ *
+ * Use it to put the clients on different simulated hosts, with their own links to server
+ */
+int ap_net_sim_set_source_addr(struct ap_net_sim_t *s, const char *address)
+{
+    struct sockaddr_storage ss;
+
+
+    ap_error_clear();
+
+    if ( ! sim_parse_addr(address, &ss) )
+    {
+        ap_error_set_custom("ap_net_sim_set_source_addr()", "bad address: %s", address);
+        return 0;
+    }
+
+    if ( ss.ss_family == AF_INET6 )
+        memcpy(&s->source6, &ss, sizeof(struct sockaddr_in6));
+    else
+        memcpy(&s->source4, &ss, sizeof(struct sockaddr_in));
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Returns virtual clock
+ *
+ * \param s struct ap_net_sim_t*
+ * \return uint64_t - nanoseconds
+ */
+uint64_t ap_net_sim_now(struct ap_net_sim_t *s)
+{
+    return s->now;
+}
+
+/* ********************************************************************** */
+/** \brief Returns the arrival time of the next packet in flight
+ *
+ * \param s struct ap_net_sim_t*
+ * \return uint64_t - nanoseconds. 0 if nothing is in flight
+ */
+uint64_t ap_net_sim_next_event(struct ap_net_sim_t *s)
+{
+    return s->heap_count > 0 ? s->heap[0]->time : 0;
+}
+
+/* ********************************************************************** */
+/** \brief Moves the virtual clock forward, delivering the packets that arrive till then
+ *
+ * \param s struct ap_net_sim_t*
+ * \param ns uint64_t - nanoseconds. 0 delivers the packets that are due now
+ * \return int - count of packets delivered
+ */
+int ap_net_sim_advance(struct ap_net_sim_t *s, uint64_t ns)
+{
+    sim_event_t *ev;
+    uint64_t target;
+    int n;
+
+
+    target = s->now + ns;
+    n = 0;
+
+    while ( s->heap_count > 0 && s->heap[0]->time <= target )
+    {
+        ev = sim_event_pop();
+
+        if ( ev->time > s->now )
+            s->now = ev->time;
+
+        sim_deliver(ev);
+        free(ev);
+        ++n;
+    }
+
+    s->now = target;
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Runs the pools on simulated network for some virtual time
+ *
+ * \param s struct ap_net_sim_t*
+ * \param pools struct ap_net_conn_pool_t** - pools to poll
+ * \param pools_count int
+ * \param duration_ns uint64_t - virtual time to run
+ * \param tick_ns uint64_t - clock step between poll rounds. It is the time resolution the pools see events with
+ * \return int - true/false. false if some ap_net_conn_pool_poll() failed
+ *
+ * Each round polls all pools once, then advances the clock by tick_ns.
+ * Thousands of connections and minutes of traffic take seconds this way. The run does not depend on the real time
+ */
+int ap_net_sim_run(struct ap_net_sim_t *s, struct ap_net_conn_pool_t **pools, int pools_count, uint64_t duration_ns, uint64_t tick_ns)
+{
+    uint64_t end;
+    int i;
+
+
+    end = s->now + duration_ns;
+
+    if ( tick_ns == 0 )
+        tick_ns = 1000000;
+
+    while ( s->now < end )
+    {
+        for ( i = 0; i < pools_count; ++i )
+            if ( ! ap_net_conn_pool_poll(pools[i]) )
+                return 0;
+
+        ap_net_sim_advance(s, end - s->now < tick_ns ? end - s->now : tick_ns);
+    }
+
+    return 1;
+}
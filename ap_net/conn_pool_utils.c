@@ -166,8 +166,8 @@ struct ap_net_connection_t *ap_net_conn_pool_get_conn_by_address(struct ap_net_c
  */
 void ap_net_connection_destroy(struct ap_net_connection_t *conn, int free_this)
 {
-    if (conn->parent != NULL && conn->parent->callback_func != NULL )
-        conn->parent->callback_func(conn, AP_NET_SIGNAL_CONN_DESTROYING );
+    if ( conn->parent != NULL )
+        ap_net_conn_pool_signal(conn->parent, conn, AP_NET_SIGNAL_CONN_DESTROYING);
 
     free(conn->buf);
 
@@ -203,10 +203,17 @@ void ap_net_conn_pool_destroy(struct ap_net_conn_pool_t *pool, int free_this)
 
 
     if ( pool->listener.sock != -1 )
-        close(pool->listener.sock);
+        ap_net_io->close(pool->listener.sock);
+
+    ap_net_conn_pool_sendfile_free(pool);
 
     if ( pool->poller != NULL )
+    {
         ap_net_poller_destroy(pool->poller);
+        pool->poller = NULL; /* closing connections below would use it */
+    }
+
+    ap_net_conn_pool_cork_disable(pool); /* held output goes out before the connections are closed */
 
     for ( i = 0; i < pool->max_connections; ++i)
     {
@@ -218,6 +225,18 @@ void ap_net_conn_pool_destroy(struct ap_net_conn_pool_t *pool, int free_this)
 
     free(pool->conns);
 
+    ap_net_bridge_free(pool);
+    ap_net_zerocopy_free(pool);
+    ap_net_recv_into_free(pool);
+    ap_net_rbuf_free(pool);
+    ap_net_framer_free(pool);
+    ap_net_arena_free(pool);
+
+    ap_net_conn_pool_recorder_disable(pool);
+    ap_net_conn_pool_profiler_disable(pool);
+    ap_net_conn_pool_shm_close(pool);
+    ap_net_conn_pool_capture_stop(pool);
+
     if ( free_this )
         free(pool);
 }
@@ -236,7 +255,7 @@ struct ap_net_connection_t *ap_net_conn_pool_find_free_slot(struct ap_net_conn_p
 
     if (pool->used_slots == pool->max_connections)
     {
-        pool->stat.queue_full_count++;
+        ap_net_conn_pool_stat_add(pool, queue_full_count, 1);
 
         ap_error_set("ap_net_conn_pool_find_free_slot()", AP_ERRNO_CONNLIST_FULL);
 
@@ -265,12 +284,12 @@ int ap_net_recv(int sh, void *buf, int size, int non_blocking)
 
     ap_error_clear();
 
-    retval = fcntl(sh, F_GETFL);
+    retval = ap_net_io->fcntl(sh, F_GETFL, 0);
 
     if ( retval != -1 )
     {
         flags = (non_blocking ? MSG_DONTWAIT : 0) | MSG_NOSIGNAL;
-        retval = recv(sh, buf, size, flags);
+        retval = ap_net_io->recv(sh, buf, size, flags);
     }
 
     if ( retval < 0 )
@@ -289,12 +308,12 @@ int ap_net_send(int sh, void *buf, int size, int non_blocking)
 
     ap_error_clear();
 
-    retval = fcntl(sh, F_GETFL);
+    retval = ap_net_io->fcntl(sh, F_GETFL, 0);
 
     if ( retval != -1 )
     {
         flags = (non_blocking ? MSG_DONTWAIT : 0) | MSG_NOSIGNAL;
-        retval = send(sh, buf, size, flags);
+        retval = ap_net_io->send(sh, buf, size, flags);
     }
 
     if ( retval <= 0 )
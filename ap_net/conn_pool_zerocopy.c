@@ -0,0 +1,657 @@
+/** \file ap_net/conn_pool_zerocopy.c
+ * \brief Part of AP's toolkit. Networking module, Connection pool: Zero-copy sends
+ *
+ * Large sends go with MSG_ZEROCOPY: the kernel sends right from the user's memory instead of copying it.
+ * The memory is given back to application by release function when the kernel reports the send complete
+ * through the socket's error queue. ap_net_conn_pool_poll() reads it on EPOLLERR.
+ * The socket of closed connection is kept open until all its sends are reported, as the kernel may still send from that memory.
+ */
+#include "conn_pool_internals.h"
+#include <linux/errqueue.h>
+
+static const char *_func_name = "ap_net_conn_pool_zerocopy_enable()";
+
+/* default of min_size. copying smaller data costs less than the page pinning and the notification */
+#define zerocopy_default_min_size 32768
+
+/* ap_net_zerocopy_conn_t.mode */
+#define zerocopy_mode_pool 0 /* as set by all_conns */
+#define zerocopy_mode_on   1
+#define zerocopy_mode_off  2
+
+/** \brief Send waiting for release
+*/
+typedef struct zerocopy_send_t
+{
+    void *data;
+    int len;
+    int done; /* copied, or the kernel has reported it */
+    uint32_t id; /* the kernel's number of zero-copy send on this socket */
+} zerocopy_send_t;
+
+/** \brief Zero-copy state of one connection
+*/
+typedef struct ap_net_zerocopy_conn_t
+{
+    int mode; /* zerocopy_mode_* */
+    int sock; /* SO_ZEROCOPY: 0 - not set yet, 1 - set, -1 - refused or the kernel copies anyway */
+    uint32_t next_id; /* number of the next zero-copy send. the kernel counts them from 0 for each socket */
+    struct zerocopy_send_t *q; /* ring of sends not released yet, in order of sending */
+    int q_size;
+    int q_head;
+    int q_count;
+} ap_net_zerocopy_conn_t;
+
+/** \brief Closed connection with sends not reported yet
+*/
+typedef struct ap_net_zerocopy_orphan_t
+{
+    struct ap_net_connection_t conn; /* copy as it was closed, with the socket kept open. given to release function */
+    struct ap_net_zerocopy_conn_t zcc;
+    struct ap_net_zerocopy_orphan_t *next;
+} ap_net_zerocopy_orphan_t;
+
+/* ********************************************************************** */
+/** \brief Enables zero-copy sends for TCP pool
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param min_size int - smaller sends are copied as usual. 0 - default of 32KB
+ * \param all_conns int - true: all connections, false: only those switched on by ap_net_conn_pool_zerocopy_conn()
+ * \param release_func ap_net_zerocopy_release_func - called when the memory of each send may be reused
+ * \return int - true/false
+ *
+ * The data given to ap_net_conn_pool_send() and ap_net_conn_pool_send_async() on zero-copy connection
+ * must stay untouched until release_func is called with its pointer and the amount that was sent.
+ * It is called once for every send that sent something, in the order of sends:
+ * from ap_net_conn_pool_poll() when the kernel reports the data is sent, or right before the send function returns
+ * if the data was copied: smaller than min_size, held by corking or refused by socket.
+ * On loopback the kernel copies anyway, so the connection switches to copying sends after the first report of that.
+ * When connection is closed, its socket is shut down but not closed until the sends not reported yet are reported.
+ * ap_net_conn_pool_poll() checks for that in each cycle and calls release_func with the copy of connection as it was closed.
+ * The sends not reported by ap_net_conn_pool_destroy() are never released: their memory may still be read by the kernel.
+ * ap_net_conn_pool_sendv() and file transfers are not affected. Calling again changes the settings.
+ */
+int ap_net_conn_pool_zerocopy_enable(struct ap_net_conn_pool_t *pool, int min_size, int all_conns, ap_net_zerocopy_release_func release_func)
+{
+    struct ap_net_zerocopy_t *zc;
+
+
+    ap_error_clear();
+
+    if ( ! bit_is_set(pool->flags, AP_NET_POOL_FLAGS_TCP) )
+    {
+        ap_error_set_custom(_func_name, "zero-copy sends are for TCP pools only");
+        return 0;
+    }
+
+    if ( release_func == NULL )
+    {
+        ap_error_set_custom(_func_name, "release function is required");
+        return 0;
+    }
+
+    zc = pool->zerocopy;
+
+    if ( zc == NULL )
+    {
+        if ( NULL == (zc = calloc(1, sizeof(struct ap_net_zerocopy_t))) )
+        {
+            ap_error_set(_func_name, AP_ERRNO_OOM);
+            return 0;
+        }
+
+        pool->zerocopy = zc;
+    }
+
+    zc->min_size = min_size > 0 ? min_size : zerocopy_default_min_size;
+    zc->all_conns = all_conns;
+    zc->release_func = release_func;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* returns connection's state, growing the array to the pool's size if needed. NULL if out of memory */
+static struct ap_net_zerocopy_conn_t *zerocopy_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_zerocopy_t *zc;
+    void *new_mem;
+    int new_size;
+
+
+    zc = pool->zerocopy;
+
+    if ( conn_idx < zc->conns_size )
+        return &zc->conns[conn_idx];
+
+    new_size = pool->max_connections > conn_idx ? pool->max_connections : conn_idx + 1;
+
+    if ( NULL == (new_mem = realloc(zc->conns, new_size * sizeof(struct ap_net_zerocopy_conn_t))) )
+        return NULL;
+
+    zc->conns = new_mem;
+    memset(zc->conns + zc->conns_size, 0, (new_size - zc->conns_size) * sizeof(struct ap_net_zerocopy_conn_t));
+    zc->conns_size = new_size;
+
+    return &zc->conns[conn_idx];
+}
+
+/* ********************************************************************** */
+/* true if connection's sends go through the release queue */
+static int zerocopy_wanted(struct ap_net_zerocopy_t *zc, struct ap_net_zerocopy_conn_t *zcc)
+{
+    return zcc->mode == zerocopy_mode_on || (zcc->mode == zerocopy_mode_pool && zc->all_conns);
+}
+
+/* ********************************************************************** */
+/* makes room for one more send record. false if out of memory */
+static int zerocopy_reserve(struct ap_net_zerocopy_conn_t *zcc)
+{
+    struct zerocopy_send_t *new_q;
+    int new_size, i;
+
+
+    if ( zcc->q_count < zcc->q_size )
+        return 1;
+
+    new_size = zcc->q_size > 0 ? zcc->q_size * 2 : 16;
+
+    if ( NULL == (new_q = malloc(new_size * sizeof(struct zerocopy_send_t))) )
+        return 0;
+
+    for ( i = 0; i < zcc->q_count; ++i ) /* unwrapping the ring */
+        new_q[i] = zcc->q[(zcc->q_head + i) % zcc->q_size];
+
+    free(zcc->q);
+
+    zcc->q = new_q;
+    zcc->q_size = new_size;
+    zcc->q_head = 0;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* adds send record. the room should be reserved */
+static void zerocopy_push(struct ap_net_zerocopy_t *zc, struct ap_net_zerocopy_conn_t *zcc, void *data, int len, int done, uint32_t id)
+{
+    struct zerocopy_send_t *zs;
+
+
+    zs = &zcc->q[(zcc->q_head + zcc->q_count++) % zcc->q_size];
+
+    zs->data = data;
+    zs->len = len;
+    zs->done = done;
+    zs->id = id;
+
+    ++zc->in_flight;
+}
+
+/* ********************************************************************** */
+/* gives back the memory of the sends done, in order. force - all of them, done or not */
+static void zerocopy_release_head(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, struct ap_net_zerocopy_conn_t *zcc, int force)
+{
+    struct zerocopy_send_t zs;
+
+
+    /* the record is taken off first: release function may send again or close the connection */
+    while ( zcc->q_count > 0 && (force || zcc->q[zcc->q_head].done) )
+    {
+        zs = zcc->q[zcc->q_head];
+        zcc->q_head = (zcc->q_head + 1) % zcc->q_size;
+        --zcc->q_count;
+        --pool->zerocopy->in_flight;
+
+        pool->zerocopy->release_func(conn, zs.data, zs.len);
+    }
+}
+
+/* ********************************************************************** */
+/* reads completion reports from socket's error queue. returns count of reports */
+static int zerocopy_read_errqueue(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, struct ap_net_zerocopy_conn_t *zcc)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct sock_extended_err serr;
+    struct zerocopy_send_t *zs;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    int count, i;
+
+
+    for ( count = 0;; )
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( -1 == ap_net_io->recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) )
+            break;
+
+        for ( cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm) )
+        {
+            if ( ! (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR)
+                 && ! (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR) )
+                continue;
+
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+
+            if ( serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+                continue;
+
+            ++count;
+
+            /* sends ee_info to ee_data are complete. the range may wrap around */
+            for ( i = 0; i < zcc->q_count; ++i )
+            {
+                zs = &zcc->q[(zcc->q_head + i) % zcc->q_size];
+
+                if ( ! zs->done && (int32_t)(zs->id - serr.ee_info) >= 0 && (int32_t)(serr.ee_data - zs->id) >= 0 )
+                    zs->done = 1;
+            }
+
+            if ( bit_is_set(serr.ee_code, SO_EE_CODE_ZEROCOPY_COPIED) )
+            {
+                pool->zerocopy->copied += serr.ee_data - serr.ee_info + 1;
+                zcc->sock = -1; /* no gain on this route. the next sends are copied by us */
+            }
+        }
+    }
+
+    return count;
+}
+
+/* ********************************************************************** */
+/** \brief Sends data of connection, with MSG_ZEROCOPY if it is enabled and the data is large enough
+ * \internal
+ *
+ * ap_net_send() replacement for pools with zero-copy sends enabled.
+ * The caller should call ap_net_zerocopy_release() after it is done with the data, e.g. after capture
+ */
+int ap_net_zerocopy_send(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, void *buf, int size, int non_blocking)
+{
+    struct ap_net_zerocopy_t *zc;
+    struct ap_net_zerocopy_conn_t *zcc;
+    int n, on;
+
+
+    zc = pool->zerocopy;
+
+    if ( NULL == (zcc = zerocopy_conn(pool, conn->idx)) || ! zerocopy_wanted(zc, zcc) )
+        return ap_net_send(conn->fd, buf, size, non_blocking);
+
+    if ( ! zerocopy_reserve(zcc) ) /* the send could not be recorded. caller may try again later */
+    {
+        ap_error_set("ap_net_conn_pool_send()", AP_ERRNO_OOM);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if ( size >= zc->min_size && zcc->sock == 0 )
+    {
+        on = 1;
+        zcc->sock = 0 == ap_net_io->setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) ? 1 : -1;
+    }
+
+    if ( size >= zc->min_size && zcc->sock == 1 )
+    {
+        n = ap_net_io->send(conn->fd, buf, size, MSG_ZEROCOPY | MSG_NOSIGNAL | (non_blocking ? MSG_DONTWAIT : 0));
+
+        if ( n > 0 )
+        {
+            zerocopy_push(zc, zcc, buf, n, 0, zcc->next_id++);
+            ++zc->sends;
+            return n;
+        }
+
+        if ( n == -1 && errno != ENOBUFS ) /* ENOBUFS: too many sends are not reported yet. copying this one */
+        {
+            ap_error_set_detailed("ap_net_send", AP_ERRNO_SYSTEM, "sock %d", conn->fd);
+            return n;
+        }
+    }
+
+    n = ap_net_send(conn->fd, buf, size, non_blocking);
+
+    if ( n > 0 )
+    {
+        zerocopy_push(zc, zcc, buf, n, 1, 0);
+
+        if ( size >= zc->min_size )
+            ++zc->fallbacks;
+    }
+
+    return n;
+}
+
+/* ********************************************************************** */
+/** \brief Queues release of data that was copied, e.g. by corking, and releases what is done
+ * \internal
+ */
+void ap_net_zerocopy_copied(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, void *data, int len)
+{
+    struct ap_net_zerocopy_conn_t *zcc;
+
+
+    if ( len <= 0 || NULL == (zcc = zerocopy_conn(pool, conn->idx)) || ! zerocopy_wanted(pool->zerocopy, zcc) )
+        return;
+
+    if ( ! zerocopy_reserve(zcc) ) /* out of order then, but not lost */
+    {
+        pool->zerocopy->release_func(conn, data, len);
+        return;
+    }
+
+    zerocopy_push(pool->zerocopy, zcc, data, len, 1, 0);
+    zerocopy_release_head(pool, conn, zcc, 0);
+}
+
+/* ********************************************************************** */
+/** \brief Releases connection's sends that are done
+ * \internal
+ */
+void ap_net_zerocopy_release(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn)
+{
+    if ( conn->idx < pool->zerocopy->conns_size )
+        zerocopy_release_head(pool, conn, &pool->zerocopy->conns[conn->idx], 0);
+}
+
+/* ********************************************************************** */
+/** \brief Handles EPOLLERR of connection with zero-copy sends
+ * \internal
+ *
+ * \return unsigned - events left for poller. EPOLLERR is removed if it was for completion reports only.
+ *         0 if the connection was closed by release function
+ */
+unsigned ap_net_zerocopy_event(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, unsigned events)
+{
+    struct ap_net_zerocopy_conn_t *zcc;
+
+
+    if ( ! bit_is_set(events, EPOLLERR) || conn->idx >= pool->zerocopy->conns_size )
+        return events;
+
+    zcc = &pool->zerocopy->conns[conn->idx];
+
+    if ( zcc->sock == 0 ) /* never had MSG_ZEROCOPY sends */
+        return events;
+
+    /* real error comes with EPOLLHUP or shows up again on the next wait, when the queue is empty */
+    if ( zerocopy_read_errqueue(pool, conn, zcc) > 0 && ! bit_is_set(events, EPOLLHUP) )
+        bit_clear(events, EPOLLERR);
+
+    zerocopy_release_head(pool, conn, zcc, 0);
+
+    return bit_is_set(conn->state, AP_NET_ST_CONNECTED) ? events : 0;
+}
+
+/* ********************************************************************** */
+/* makes connection's state as of free slot. the ring memory is kept */
+static void zerocopy_conn_reset(struct ap_net_zerocopy_conn_t *zcc)
+{
+    zcc->mode = zerocopy_mode_pool;
+    zcc->sock = 0;
+    zcc->next_id = 0;
+    zcc->q_head = zcc->q_count = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Releases the sends of closing connection that are done and resets its state
+ * \internal
+ *
+ * \return int - true if the socket is taken over to wait for the reports of the rest. The caller should not close it then
+ *
+ * The reports already queued are read first. The sends still not reported are not released:
+ * the kernel may send or retransmit from that memory until it reports them. So the socket is shut down and
+ * kept with them on the pool's orphans list until ap_net_zerocopy_orphans() gets all the reports.
+ */
+int ap_net_zerocopy_release_conn(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_zerocopy_t *zc;
+    struct ap_net_zerocopy_conn_t *zcc;
+    struct ap_net_zerocopy_orphan_t *o;
+    struct ap_net_connection_t *conn;
+
+
+    zc = pool->zerocopy;
+
+    if ( zc == NULL || conn_idx >= zc->conns_size )
+        return 0;
+
+    zcc = &zc->conns[conn_idx];
+    conn = &pool->conns[conn_idx];
+
+    if ( zcc->q_count > 0 && zcc->sock != 0 && conn->fd != -1 )
+        zerocopy_read_errqueue(pool, conn, zcc);
+
+    zerocopy_release_head(pool, conn, zcc, 0);
+
+    if ( zcc->q_count == 0 || conn->fd == -1 )
+    {
+        zerocopy_conn_reset(zcc);
+        return 0;
+    }
+
+    if ( NULL == (o = malloc(sizeof(struct ap_net_zerocopy_orphan_t))) )
+    {
+        /* can not wait for the reports. the memory is never given back then, which is better than corrupted data */
+        ap_error_set(_func_name, AP_ERRNO_OOM);
+        zc->in_flight -= zcc->q_count;
+        zc->lost += zcc->q_count;
+        zerocopy_conn_reset(zcc);
+        return 0;
+    }
+
+    o->conn = *conn;
+    bit_clear(o->conn.state, AP_NET_ST_CONNECTED);
+    o->zcc = *zcc;
+
+    o->next = zc->orphans;
+    zc->orphans = o;
+    ++zc->orphans_count;
+
+    /* the ring goes with orphan */
+    zcc->q = NULL;
+    zcc->q_size = 0;
+    zerocopy_conn_reset(zcc);
+
+    ap_net_io->shutdown(conn->fd, SHUT_RDWR); /* the peer sees the close as usual, the queued data is still sent */
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/* gets reports of orphan's sends. returns true if all are released */
+static int zerocopy_orphan_check(struct ap_net_conn_pool_t *pool, struct ap_net_zerocopy_orphan_t *o)
+{
+    zerocopy_read_errqueue(pool, &o->conn, &o->zcc);
+    zerocopy_release_head(pool, &o->conn, &o->zcc, 0);
+
+    return o->zcc.q_count == 0;
+}
+
+/* ********************************************************************** */
+/** \brief Releases the sends of closed connections reported since the last check. Closes their sockets when all are done
+ * \internal
+ *
+ * Called by ap_net_conn_pool_poll() in each cycle while there are orphans
+ */
+void ap_net_zerocopy_orphans(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_zerocopy_orphan_t **link, *o;
+
+
+    for ( link = &pool->zerocopy->orphans; *link != NULL; )
+    {
+        o = *link;
+
+        if ( ! zerocopy_orphan_check(pool, o) )
+        {
+            link = &o->next;
+            continue;
+        }
+
+        *link = o->next;
+        --pool->zerocopy->orphans_count;
+
+        ap_net_io->close(o->conn.fd);
+        free(o->zcc.q);
+        free(o);
+    }
+}
+
+/* ********************************************************************** */
+/* true if connection has zero-copy state to move */
+static int zerocopy_has_state(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    struct ap_net_zerocopy_conn_t *zcc;
+
+
+    if ( pool->zerocopy == NULL || conn_idx >= pool->zerocopy->conns_size )
+        return 0;
+
+    zcc = &pool->zerocopy->conns[conn_idx];
+
+    return zcc->sock != 0 || zcc->q_count != 0 || zcc->mode != zerocopy_mode_pool;
+}
+
+/* ********************************************************************** */
+/** \brief Makes room for connection's zero-copy state in destination slot
+ * \internal
+ *
+ * \return int - true/false. False if out of memory
+ *
+ * The socket keeps reporting to the new place, so the destination pool gets zero-copy enabled with the same settings.
+ * Called by ap_net_conn_pool_move_prepare() before anything is moved
+ */
+int ap_net_zerocopy_move_prepare(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    if ( ! zerocopy_has_state(src_pool, src_idx) )
+        return 1;
+
+    if ( dst_pool->zerocopy == NULL && ! ap_net_conn_pool_zerocopy_enable(dst_pool, src_pool->zerocopy->min_size, 0, src_pool->zerocopy->release_func) )
+        return 0;
+
+    return NULL != zerocopy_conn(dst_pool, dst_idx);
+}
+
+/* ********************************************************************** */
+/** \brief Moves zero-copy state along with connection to other slot or pool
+ * \internal
+ *
+ * The destination slot is free and prepared by ap_net_zerocopy_move_prepare()
+ */
+void ap_net_zerocopy_move_conn(struct ap_net_conn_pool_t *src_pool, int src_idx, struct ap_net_conn_pool_t *dst_pool, int dst_idx)
+{
+    struct ap_net_zerocopy_t *zc;
+    struct ap_net_zerocopy_conn_t *src, *dst, tmp;
+
+
+    if ( ! zerocopy_has_state(src_pool, src_idx) )
+        return;
+
+    zc = src_pool->zerocopy;
+    src = &zc->conns[src_idx];
+    dst = &dst_pool->zerocopy->conns[dst_idx];
+
+    tmp = *dst; /* the free slot's ring memory goes to source */
+    *dst = *src;
+    *src = tmp;
+
+    dst->mode = zerocopy_wanted(zc, dst) ? zerocopy_mode_on : zerocopy_mode_off;
+    zerocopy_conn_reset(src);
+
+    zc->in_flight -= dst->q_count;
+    dst_pool->zerocopy->in_flight += dst->q_count;
+}
+
+/* ********************************************************************** */
+/** \brief Frees pool's zero-copy state. Connections should be closed by now
+ * \internal
+ *
+ * The orphans' sends reported by now are released, the rest are not. Their sockets are closed
+ */
+void ap_net_zerocopy_free(struct ap_net_conn_pool_t *pool)
+{
+    struct ap_net_zerocopy_orphan_t *o;
+    int i;
+
+
+    if ( pool->zerocopy == NULL )
+        return;
+
+    while ( NULL != (o = pool->zerocopy->orphans) )
+    {
+        if ( ! zerocopy_orphan_check(pool, o) )
+            pool->zerocopy->lost += o->zcc.q_count;
+
+        pool->zerocopy->orphans = o->next;
+
+        ap_net_io->close(o->conn.fd);
+        free(o->zcc.q);
+        free(o);
+    }
+
+    for ( i = 0; i < pool->zerocopy->conns_size; ++i )
+        free(pool->zerocopy->conns[i].q);
+
+    free(pool->zerocopy->conns);
+    free(pool->zerocopy);
+
+    pool->zerocopy = NULL;
+}
+
+/* ********************************************************************** */
+/** \brief Switches zero-copy sends on or off for connection
+ *
+ * \param pool struct ap_net_conn_pool_t* - pool with zero-copy enabled
+ * \param conn_idx int
+ * \param on int - true/false
+ * \return int - true/false
+ *
+ * Sends made before switching off are still released as usual. The setting is reset when connection closes
+ */
+int ap_net_conn_pool_zerocopy_conn(struct ap_net_conn_pool_t *pool, int conn_idx, int on)
+{
+    struct ap_net_zerocopy_conn_t *zcc;
+
+
+    ap_error_clear();
+
+    if ( pool->zerocopy == NULL )
+    {
+        ap_error_set_custom("ap_net_conn_pool_zerocopy_conn()", "zero-copy sends are not enabled");
+        return 0;
+    }
+
+    if ( conn_idx < 0 || conn_idx >= pool->max_connections )
+    {
+        ap_error_set_detailed("ap_net_conn_pool_zerocopy_conn()", AP_ERRNO_INVALID_CONN_INDEX, "%d", conn_idx);
+        return 0;
+    }
+
+    if ( NULL == (zcc = zerocopy_conn(pool, conn_idx)) )
+    {
+        ap_error_set("ap_net_conn_pool_zerocopy_conn()", AP_ERRNO_OOM);
+        return 0;
+    }
+
+    zcc->mode = on ? zerocopy_mode_on : zerocopy_mode_off;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Returns count of connection's sends not released yet
+ *
+ * \param pool struct ap_net_conn_pool_t*
+ * \param conn_idx int
+ * \return int - sends. 0 if zero-copy is not enabled
+ */
+int ap_net_conn_pool_zerocopy_pending(struct ap_net_conn_pool_t *pool, int conn_idx)
+{
+    if ( pool->zerocopy == NULL || conn_idx < 0 || conn_idx >= pool->zerocopy->conns_size )
+        return 0;
+
+    return pool->zerocopy->conns[conn_idx].q_count;
+}
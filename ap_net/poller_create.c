@@ -32,7 +32,7 @@ struct ap_net_poll_t *ap_net_poller_create(int listen_socket_fd, int max_connect
     if (listen_socket_fd > 0)
         ++max_connections;
 
-    epoll_fd = epoll_create(max_connections);
+    epoll_fd = ap_net_io->epoll_create(max_connections);
 
     if (epoll_fd == -1)
     {
@@ -44,7 +44,7 @@ struct ap_net_poll_t *ap_net_poller_create(int listen_socket_fd, int max_connect
 
     if ( poller == NULL )
     {
-        close(epoll_fd);
+        ap_net_io->close(epoll_fd);
         return NULL;
     }
 
@@ -52,7 +52,7 @@ struct ap_net_poll_t *ap_net_poller_create(int listen_socket_fd, int max_connect
 
     if ( poller->events == NULL )
     {
-        close(epoll_fd);
+        ap_net_io->close(epoll_fd);
         free(poller);
         return NULL;
     }
@@ -70,10 +70,10 @@ struct ap_net_poll_t *ap_net_poller_create(int listen_socket_fd, int max_connect
         ev.events = EPOLLIN;
         ev.data.fd = listen_socket_fd;
 
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket_fd, &ev) == -1)
+        if (ap_net_io->epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket_fd, &ev) == -1)
         {
             ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "epoll_ctl() add listen_socket_fd");
-            close(epoll_fd);
+            ap_net_io->close(epoll_fd);
             free(poller->events);
             free(poller);
 
@@ -87,7 +87,7 @@ struct ap_net_poll_t *ap_net_poller_create(int listen_socket_fd, int max_connect
 /* ********************************************************************** */
 void ap_net_poller_destroy(struct ap_net_poll_t *poller)
 {
-    close(poller->epoll_fd);
+    ap_net_io->close(poller->epoll_fd);
     free(poller->events);
     free(poller);
 }
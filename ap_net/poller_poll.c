@@ -32,7 +32,7 @@ int ap_net_poller_poll(struct ap_net_poll_t *poller)
     if ( poller->events_count <= 0 || poller->last_event_index < 0 || poller->last_event_index >= poller->events_count )
     {
         poller->last_event_index = -1;
-        poller->events_count = epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
+        poller->events_count = ap_net_io->epoll_wait(poller->epoll_fd, poller->events, poller->max_events, 0);
     }
 
     if (poller->events_count == -1)
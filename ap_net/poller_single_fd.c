@@ -29,7 +29,7 @@ int ap_net_poller_single_fd(int fd)
     struct epoll_event ev;
 
 
-    epoll_fd = epoll_create(1);
+    epoll_fd = ap_net_io->epoll_create(1);
 
     if (epoll_fd == -1)
     {
@@ -40,15 +40,15 @@ int ap_net_poller_single_fd(int fd)
     ev.events = EPOLLIN | EPOLLOUT;
     ev.data.fd = fd;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    if (ap_net_io->epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
     {
         ap_error_set_detailed(_func_name, AP_ERRNO_SYSTEM, "epoll_ctl() add listen_socket_fd");
-        close(epoll_fd);
+        ap_net_io->close(epoll_fd);
 
         return -1;
     }
 
-    poll_status = epoll_wait(epoll_fd, &ev, 1, 0);
+    poll_status = ap_net_io->epoll_wait(epoll_fd, &ev, 1, 0);
 
     if (poll_status == -1)
     {
@@ -56,7 +56,7 @@ int ap_net_poller_single_fd(int fd)
         return -1;
     }
 
-    close(epoll_fd);
+    ap_net_io->close(epoll_fd);
 
     poll_status = 0;
 
@@ -6,9 +6,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <sys/socket.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "ap_log.h"
 #include "ap_str.h"
@@ -90,20 +94,29 @@ void *ap_str_getmem(int size, char *errmsg)
  *
  * Useful helper for standard trios of buffer/buffer_pos/buffer_size
  * Call it before copying or receiving known amount of data into buffer
- * to enlarge it if it needed. updates dst_buf_size variable as well
+ * to enlarge it if it needed. updates dst_buf and dst_buf_size variables as well
+ * The size is at least doubled, so a series of small appends costs O(1) each. See ap_buf.h for a buffer type doing this
  */
 int ap_str_fix_buf_size(char **dst_buf, int *dst_buf_size, int *dst_buf_pos, int need_bytes)
 {
+    char *new_buf;
     int n;
 
 
     if ( *dst_buf_size - *dst_buf_pos < need_bytes )
     {
-        n = *dst_buf_size + need_bytes - (*dst_buf_size - *dst_buf_pos);
+        if ( need_bytes > INT_MAX - *dst_buf_pos )
+            return 0;
+
+        n = ( *dst_buf_size > INT_MAX / 2 ) ? INT_MAX : *dst_buf_size * 2;
+
+        if ( n < *dst_buf_pos + need_bytes )
+            n = *dst_buf_pos + need_bytes;
 
-        if ( NULL == realloc(*dst_buf, n) )
+        if ( NULL == (new_buf = realloc(*dst_buf, n)) )
             return 0;
 
+        *dst_buf = new_buf;
         *dst_buf_size = n;
     }
 
@@ -334,3 +347,309 @@ int ap_str_parse_get_bool(ap_str_parse_rec_t *r)
 
     return -1;
 }
+
+/* ********************************************************************** */
+/* zero-copy tokenizer */
+/* ********************************************************************** */
+
+/* space and tab */
+static const ap_str_tok_sep_t default_separators = { { [' '] = 1, ['\t'] = 1 }, { ' ', '\t', ' ', ' ' }, 2 };
+
+/* ********************************************************************** */
+/* bit i is set if p[pos + i] is a separator or is past the end.
+ * 16 bytes per step for the sets of up to 4 separators, the last incomplete block is copied to be read in full */
+static __attribute__((noinline)) uint64_t tok_mask(const ap_str_tok_sep_t *sep, const unsigned char *p, int pos, int len)
+{
+    uint64_t mask;
+    int i;
+    int n;
+#ifdef __SSE2__
+    __m128i c0, c1, c2, c3, v;
+    unsigned char tail[64];
+#endif
+
+
+    n = ( len - pos < 64 ) ? len - pos : 64;
+
+#ifdef __SSE2__
+    if ( sep->count > 0 && sep->count <= 4 )
+    {
+        if ( n < 64 )
+        {
+            memcpy(tail, p + pos, n);
+            p = tail;
+            pos = 0;
+        }
+
+        c0 = _mm_set1_epi8(sep->chars[0]);
+        c1 = _mm_set1_epi8(sep->chars[1]);
+        c2 = _mm_set1_epi8(sep->chars[2]);
+        c3 = _mm_set1_epi8(sep->chars[3]);
+
+        for ( mask = 0, i = 0; i < n; i += 16 )
+        {
+            v = _mm_loadu_si128((const __m128i *)(p + pos + i));
+            v = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+            mask |= (uint64_t)(unsigned)_mm_movemask_epi8(v) << i;
+        }
+    }
+    else
+#endif
+    {
+        for ( mask = 0, i = 0; i < n; ++i )
+            if ( sep->map[p[pos + i]] )
+                mask |= 1ull << i;
+    }
+
+    if ( n < 64 )
+        mask |= ~0ull << n;
+
+    return mask;
+}
+
+/* ********************************************************************** */
+/* the first position starting from pos, where the char is a separator (want_separator = 1) or not (0). len if none */
+static inline int tok_scan(ap_str_tok_t *t, int pos, int want_separator)
+{
+    uint64_t m;
+
+
+    while ( pos < t->len )
+    {
+        if ( pos < t->mask_pos || pos >= t->mask_pos + 64 || t->mask_pos < 0 )
+        {
+            t->mask_pos = pos;
+            t->mask = tok_mask(t->sep, (const unsigned char *)t->buf, pos, t->len);
+        }
+
+        m = ( want_separator ? t->mask : ~t->mask ) >> (pos - t->mask_pos);
+
+        if ( m != 0 )
+            return pos + __builtin_ctzll(m);
+
+        pos = t->mask_pos + 64;
+    }
+
+    return t->len;
+}
+
+/* ********************************************************************** */
+/** \brief Builds separators set for ap_str_tok_init(). Do it once, the set can be shared by any number of tokenizers
+ *
+ * \param sep ap_str_tok_sep_t* - set to fill
+ * \param separators const char* - separator chars. NULL - space and tab
+ * \return void
+ */
+void ap_str_tok_sep_init(ap_str_tok_sep_t *sep, const char *separators)
+{
+    const unsigned char *c;
+    int i;
+
+
+    if ( separators == NULL )
+    {
+        *sep = default_separators;
+        return;
+    }
+
+    memset(sep, 0, sizeof(ap_str_tok_sep_t));
+
+    for ( c = (const unsigned char *)separators; *c; ++c )
+    {
+        if ( sep->map[*c] )
+            continue;
+
+        sep->map[*c] = 1;
+
+        if ( sep->count < 4 )
+            sep->chars[sep->count] = *c;
+
+        ++sep->count;
+    }
+
+    for ( i = sep->count; i < 4; ++i )
+        sep->chars[i] = sep->chars[0];
+}
+
+/* ********************************************************************** */
+/** \brief Starts tokenizing of buffer in place. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state. Usually a local variable
+ * \param buf const char* - data. Need not be zero-terminated, is not modified
+ * \param len int - length of data
+ * \param sep const ap_str_tok_sep_t* - separators made by ap_str_tok_sep_init(). NULL - space and tab
+ * \return void
+ *
+ * Unlike ap_str_parse_*() the runs of separators are skipped, so there are no empty tokens.
+ * Nothing is allocated, the tokens point into buf, so it should not change while they are in use.
+ * Example for a line in connection buffer:
+ * ap_str_tok_t t;
+ * ap_str_slice_t cmd;
+ * char *eol = memchr(conn->buf + conn->bufpos, '\n', conn->buffill - conn->bufpos);
+ *
+ * ap_str_tok_init(&t, conn->buf + conn->bufpos, eol - (conn->buf + conn->bufpos), &separators_with_cr);
+ * if ( ap_str_tok_next(&t, &cmd) && ap_str_slice_eq(&cmd, "get") ) ...
+ */
+void ap_str_tok_init(ap_str_tok_t *t, const char *buf, int len, const ap_str_tok_sep_t *sep)
+{
+    t->buf = buf;
+    t->len = len;
+    t->pos = 0;
+    t->sep = ( sep != NULL ) ? sep : &default_separators;
+    t->history_count = 0;
+    t->history_high = 0;
+    t->mask_pos = -1;
+}
+
+/* ********************************************************************** */
+/** \brief Gets the next token. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \param token ap_str_slice_t* - the token is returned here
+ * \return int - true/false. False if there are no more tokens
+ */
+int ap_str_tok_next(ap_str_tok_t *t, ap_str_slice_t *token)
+{
+    int pos, start;
+
+
+    start = tok_scan(t, t->pos, 0);
+
+    if ( start >= t->len )
+    {
+        t->pos = t->len;
+        return 0;
+    }
+
+    pos = tok_scan(t, start + 1, 1);
+
+    token->s = t->buf + start;
+    token->len = pos - start;
+
+    t->history[(unsigned)t->history_count % AP_STR_TOK_HISTORY] = start;
+    ++t->history_count;
+    t->pos = pos;
+
+    if ( t->history_count > t->history_high )
+        t->history_high = t->history_count;
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Returns current position to come back to later. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \return int - position for ap_str_tok_restore()
+ */
+int ap_str_tok_save(ap_str_tok_t *t)
+{
+    return t->pos;
+}
+
+/* ********************************************************************** */
+/** \brief Returns to the saved position. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \param saved_pos int - value returned by ap_str_tok_save()
+ * \return void
+ *
+ * ap_str_tok_rollback() can't go back past this point
+ */
+void ap_str_tok_restore(ap_str_tok_t *t, int saved_pos)
+{
+    t->pos = ( saved_pos < 0 || saved_pos > t->len ) ? t->len : saved_pos;
+    t->history_count = 0;
+    t->history_high = 0;
+}
+
+/* ********************************************************************** */
+/** \brief Returns roll_count tokens back to get them again. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \param roll_count int - how many tokens to go back. 1 - the last one returned
+ * \return int - true/false. False if there were less tokens or the token is out of the last AP_STR_TOK_HISTORY got, nothing is changed then
+ *
+ * The window is counted from the furthest token got, so several rollbacks in a row can't go more than AP_STR_TOK_HISTORY back in total
+ */
+int ap_str_tok_rollback(ap_str_tok_t *t, int roll_count)
+{
+    if ( roll_count <= 0 )
+        return 1;
+
+    /* the ring slots of older tokens are overwritten already, even if the later ones are rolled back */
+    if ( roll_count > t->history_count || t->history_count - roll_count < t->history_high - AP_STR_TOK_HISTORY )
+        return 0;
+
+    t->history_count -= roll_count;
+    t->pos = t->history[t->history_count % AP_STR_TOK_HISTORY];
+
+    return 1;
+}
+
+/* ********************************************************************** */
+/** \brief Returns the rest of buffer w/o parsing. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \param rest ap_str_slice_t* - the rest starting from the next token. Zero length if none
+ * \return void
+ */
+void ap_str_tok_remaining(ap_str_tok_t *t, ap_str_slice_t *rest)
+{
+    int pos;
+
+
+    pos = tok_scan(t, t->pos, 0);
+
+    rest->s = t->buf + pos;
+    rest->len = t->len - pos;
+}
+
+/* ********************************************************************** */
+/** \brief Returns int 0 or 1 as a boolean value of next token. -1 if unrecognized. Zero-copy companion set of ap_str_parse_*()
+ *
+ * \param t ap_str_tok_t* - tokenizer state set up by ap_str_tok_init()
+ * \return int
+ *
+ * understands the same pairs as ap_str_parse_get_bool()
+ */
+int ap_str_tok_get_bool(ap_str_tok_t *t)
+{
+    ap_str_slice_t s;
+    int i;
+
+
+    if ( ! ap_str_tok_next(t, &s) )
+        return -1;
+
+    for( i = 0; i < GET_BOOL_KW_COUNT; ++i )
+        if ( ap_str_slice_caseeq(&s, keywords[i].s) )
+            return keywords[i].result;
+
+    return -1;
+}
+
+/* ********************************************************************** */
+/** \brief Compares slice with string
+ *
+ * \param slice const ap_str_slice_t* - token
+ * \param str const char* - zero-terminated string
+ * \return int - true if equal
+ */
+int ap_str_slice_eq(const ap_str_slice_t *slice, const char *str)
+{
+    return (int)strlen(str) == slice->len && 0 == memcmp(slice->s, str, slice->len);
+}
+
+/* ********************************************************************** */
+/** \brief Compares slice with string ignoring case
+ *
+ * \param slice const ap_str_slice_t* - token
+ * \param str const char* - zero-terminated string
+ * \return int - true if equal
+ */
+int ap_str_slice_caseeq(const ap_str_slice_t *slice, const char *str)
+{
+    return (int)strlen(str) == slice->len && 0 == strncasecmp(slice->s, str, slice->len);
+}
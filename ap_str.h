@@ -5,6 +5,10 @@
 #define AP_STR_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+/* how many token starts ap_str_tok_rollback() can go back */
+#define AP_STR_TOK_HISTORY 8
 
 /** \brief strtok() wrapper functions data storage
 */
@@ -16,6 +20,38 @@ typedef struct ap_str_parse_rec
   char *separators;
 } ap_str_parse_rec_t;
 
+/** \brief Piece of some buffer. Not zero-terminated
+*/
+typedef struct ap_str_slice_t
+{
+  const char *s;
+  int len;
+} ap_str_slice_t;
+
+/** \brief Separators set for ap_str_tok_*(). Made by ap_str_tok_sep_init()
+*/
+typedef struct ap_str_tok_sep_t
+{
+  unsigned char map[256]; /* non-zero for separator char codes */
+  unsigned char chars[4]; /* up to 4 separators are also listed here for SIMD search. the unused are copies of the first */
+  int count; /* of different separators */
+} ap_str_tok_sep_t;
+
+/** \brief In-place tokenizer over (pointer, length). Lives on stack, nothing to free
+*/
+typedef struct ap_str_tok_t
+{
+  const char *buf;
+  int len;
+  int pos; /* where the next token search starts */
+  const ap_str_tok_sep_t *sep;
+  int history[AP_STR_TOK_HISTORY]; /* starts of the last tokens. ring buffer */
+  int history_count; /* tokens got since init or restore, less the rolled back */
+  int history_high; /* the most history_count has ever been. the ring holds the starts of tokens from history_high - AP_STR_TOK_HISTORY */
+  uint64_t mask; /* bit per byte from mask_pos: 1 for separators and past the end */
+  int mask_pos; /* -1 if mask is not filled */
+} ap_str_tok_t;
+
 
 extern void *ap_str_getmem(int size, char *errmsg); /**< malloc with err checking. if errmsg != NULL it is reported via dosyslog and exit(1) called */
 extern int ap_str_makestr(char **d, const char *s); /**< strdup with auto free/malloc d - destination ptr, s - source */
@@ -37,4 +73,16 @@ extern char *ap_str_parse_skip(ap_str_parse_rec_t *r, int skip_count); /**< skip
 /* get next arg as boolean value (on/off 1/0 true/false). -1 in case of error */
 extern int ap_str_parse_get_bool(ap_str_parse_rec_t *r);
 
+/* zero-copy tokenizer. ap_str_parse_*() replacement: no allocations, no copying, the buffer is not modified */
+extern void ap_str_tok_sep_init(ap_str_tok_sep_t *sep, const char *separators); /**< NULL - space + tab */
+extern void ap_str_tok_init(ap_str_tok_t *t, const char *buf, int len, const ap_str_tok_sep_t *sep);
+extern int ap_str_tok_next(ap_str_tok_t *t, ap_str_slice_t *token); /**< false if no more tokens */
+extern int ap_str_tok_save(ap_str_tok_t *t); /**< position to return to with ap_str_tok_restore() */
+extern void ap_str_tok_restore(ap_str_tok_t *t, int saved_pos);
+extern int ap_str_tok_rollback(ap_str_tok_t *t, int roll_count); /**< up to AP_STR_TOK_HISTORY tokens back */
+extern void ap_str_tok_remaining(ap_str_tok_t *t, ap_str_slice_t *rest); /**< unparsed rest, without leading separators */
+extern int ap_str_tok_get_bool(ap_str_tok_t *t); /**< as ap_str_parse_get_bool() */
+extern int ap_str_slice_eq(const ap_str_slice_t *slice, const char *str); /**< slice equals zero-terminated str */
+extern int ap_str_slice_caseeq(const ap_str_slice_t *slice, const char *str); /**< the same, ignoring case */
+
 #endif
@@ -3,11 +3,14 @@
  */
 #define AP_UTILS_C
 #include "ap_utils.h"
+#include "ap_crc.h"
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+int (*ap_utils_clock_gettime)(clockid_t clock_id, struct timespec *ts) = clock_gettime;
+
 /*=========================================================*/
 /** \brief Compares struct timeval against current time, returning result of then <=> now
  *
@@ -96,7 +99,7 @@ int ap_utils_timespec_cmp_to_now(struct timespec *ts)
 {
     struct timespec now;
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    ap_utils_clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 
     if ( ts->tv_sec > now.tv_sec )
         return 1;
@@ -146,7 +149,7 @@ int ap_utils_timespec_set(struct timespec *ts, int mode, int msec)
             break;
 
         case AP_UTILS_TIME_SET_FROM_NOW:
-            clock_gettime(CLOCK_MONOTONIC_RAW, ts);
+            ap_utils_clock_gettime(CLOCK_MONOTONIC_RAW, ts);
             ts->tv_nsec += msec * 1000000l;
             break;
 
@@ -268,13 +271,13 @@ long ap_utils_timespec_elapsed(struct timespec *begin, struct timespec *end, str
 
     if ( begin == NULL )
     {
-        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        ap_utils_clock_gettime(CLOCK_MONOTONIC_RAW, &now);
         begin = &now;
     }
 
     else if ( end == NULL )
     {
-        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        ap_utils_clock_gettime(CLOCK_MONOTONIC_RAW, &now);
         end = &now;
     }
 
@@ -311,22 +314,167 @@ long ap_utils_timespec_to_milliseconds(struct timespec *ts)
  * \param mem void * - Memory block to process
  * \param len int - length of data
  * \return uint16_t counted CRC 16
+ *
+ * CRC-16/KERMIT. Kept for compatibility, see ap_crc16() and the streaming functions in ap_crc.h
  */
 uint16_t count_crc16(void *mem, int len)
 {
-    uint16_t a, crc16;
-    uint8_t *pch;
+    if ( len <= 0 )
+        return 0;
+
+    return ap_crc16(mem, len);
+}
+
+/*=========================================================*/
+/** \brief Returns CLOCK_MONOTONIC clock value in nanoseconds
+ *
+ * \return uint64_t nanoseconds
+ *
+ * Cheap timestamp for interval measurements. CLOCK_MONOTONIC is served from vDSO without system call
+ */
+uint64_t ap_utils_clock_ns(void)
+{
+    struct timespec ts;
+
+
+    ap_utils_clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * MAX_NSEC + ts.tv_nsec;
+}
+
+/*=========================================================*/
+/** \brief Resets histogram to the empty state
+ *
+ * \param hist struct ap_utils_hist_t *
+ * \return void
+ */
+void ap_utils_hist_clear(struct ap_utils_hist_t *hist)
+{
+    memset(hist, 0, sizeof(struct ap_utils_hist_t));
+    hist->min = UINT64_MAX;
+}
+
+/* bucket index of the value. see AP_UTILS_HIST_* for the geometry */
+static int hist_bucket(uint64_t value)
+{
+    int msb;
+
+
+    if ( value < AP_UTILS_HIST_SUB_BUCKETS )
+        return (int)value;
+
+    msb = 63 - __builtin_clzll(value);
+
+    return (msb - AP_UTILS_HIST_SUB_BITS + 1) * AP_UTILS_HIST_SUB_BUCKETS
+           + (int)(value >> (msb - AP_UTILS_HIST_SUB_BITS)) - AP_UTILS_HIST_SUB_BUCKETS;
+}
+
+/* the middle of bucket's values range */
+static uint64_t hist_bucket_value(int bucket)
+{
+    int group;
+    int shift;
+
+
+    if ( bucket < AP_UTILS_HIST_SUB_BUCKETS )
+        return bucket;
+
+    group = bucket / AP_UTILS_HIST_SUB_BUCKETS;
+    shift = group - 1;
+
+    return ((uint64_t)(AP_UTILS_HIST_SUB_BUCKETS + bucket % AP_UTILS_HIST_SUB_BUCKETS) << shift) + ((1ull << shift) >> 1);
+}
+
+/*=========================================================*/
+/** \brief Adds value to the histogram
+ *
+ * \param hist struct ap_utils_hist_t *
+ * \param value uint64_t - value to add. Usually a time in nanoseconds
+ * \return void
+ */
+void ap_utils_hist_add(struct ap_utils_hist_t *hist, uint64_t value)
+{
+    hist->buckets[hist_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
 
-    pch = (uint8_t *)mem;
-    crc16 = 0;
+    if ( value < hist->min )
+        hist->min = value;
+
+    if ( value > hist->max )
+        hist->max = value;
+}
+
+/*=========================================================*/
+/** \brief Adds all values from source histogram to destination
+ *
+ * \param destination struct ap_utils_hist_t *
+ * \param source struct ap_utils_hist_t *
+ * \return void
+ */
+void ap_utils_hist_merge(struct ap_utils_hist_t *destination, struct ap_utils_hist_t *source)
+{
+    int i;
+
+
+    for ( i = 0; i < AP_UTILS_HIST_BUCKETS; ++i )
+        destination->buckets[i] += source->buckets[i];
+
+    destination->count += source->count;
+    destination->sum += source->sum;
+
+    if ( source->min < destination->min )
+        destination->min = source->min;
+
+    if ( source->max > destination->max )
+        destination->max = source->max;
+}
 
-    while(len--)
+/*=========================================================*/
+/** \brief Returns value at given percentile
+ *
+ * \param hist struct ap_utils_hist_t *
+ * \param percentile double - 0.0 to 100.0, e.g. 99.9
+ * \return uint64_t value. 0 if histogram is empty
+ *
+ * The value is approximated by the middle of bucket's range, but it is clipped to the real min/max values seen
+ */
+uint64_t ap_utils_hist_percentile(struct ap_utils_hist_t *hist, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen;
+    uint64_t value;
+    int i;
+
+
+    if ( hist->count == 0 )
+        return 0;
+
+    if ( percentile >= 100.0 )
+        return hist->max;
+
+    rank = (uint64_t)(percentile / 100.0 * hist->count);
+
+    if ( rank >= hist->count )
+        rank = hist->count - 1;
+
+    seen = 0;
+
+    for ( i = 0; i < AP_UTILS_HIST_BUCKETS; ++i )
     {
-      crc16 ^= *pch;
-      a = (crc16 ^ (crc16 << 4)) & 0x00FF;
-      crc16 = (crc16 >> 8) ^ (a << 8) ^ (a << 3) ^ (a >> 4);
-      ++pch;
+        seen += hist->buckets[i];
+
+        if ( seen > rank )
+            break;
     }
 
-    return(crc16);
+    value = hist_bucket_value(i);
+
+    if ( value < hist->min )
+        value = hist->min;
+
+    if ( value > hist->max )
+        value = hist->max;
+
+    return value;
 }
@@ -7,6 +7,7 @@
 
 #include <sys/time.h>
 #include <stdint.h>
+#include <time.h>
 
     /* for ap_utils_time*_set():
      adds to current value */
@@ -18,6 +19,24 @@
     /* set value to offset only */
 #define AP_UTILS_TIME_SET_FROMZERO 3
 
+/* log-linear (HDR-style) histogram geometry:
+ * values below AP_UTILS_HIST_SUB_BUCKETS are counted exactly, the higher ones are grouped by power of two ranges,
+ * each range split into AP_UTILS_HIST_SUB_BUCKETS linear sub-buckets. So relative error is below 1/AP_UTILS_HIST_SUB_BUCKETS */
+#define AP_UTILS_HIST_SUB_BITS 5
+#define AP_UTILS_HIST_SUB_BUCKETS (1 << AP_UTILS_HIST_SUB_BITS)
+#define AP_UTILS_HIST_BUCKETS ((64 - AP_UTILS_HIST_SUB_BITS + 1) * AP_UTILS_HIST_SUB_BUCKETS)
+
+/** \brief Values distribution storage. Used for latencies measurement
+*/
+typedef struct ap_utils_hist_t
+{
+    uint64_t count; /**< Count of values added */
+    uint64_t sum; /**< Sum of values added. use for average = sum / count */
+    uint64_t min; /**< Minimal value added. UINT64_MAX if none */
+    uint64_t max; /**< Maximal value added */
+    uint64_t buckets[AP_UTILS_HIST_BUCKETS]; /**< Values counts */
+} ap_utils_hist_t;
+
 #ifndef AP_UTILS_C
 extern int  ap_utils_timeval_cmp_to_now(struct timeval *tv); /* performs tv cmp now, returning -1 if less, 0 if == now and 1 if past current time */
 extern int  ap_utils_timeval_set(struct timeval *tv, int mode, int msec);
@@ -31,6 +50,17 @@ extern void ap_utils_timespec_sub(struct timespec *a, struct timespec *b, struct
 extern long ap_utils_timespec_elapsed(struct timespec *begin, struct timespec *end, struct timespec *destination);
 extern long ap_utils_timespec_to_milliseconds(struct timespec *ts);
 extern uint16_t count_crc16(void *mem, int len);
+
+extern uint64_t ap_utils_clock_ns(void); /* CLOCK_MONOTONIC in nanoseconds */
+
+/* all timespec functions and ap_utils_clock_ns() read the time through this. clock_gettime() by default,
+ * replaced by the virtual clock of network simulator, see ap_net_sim_create() */
+extern int (*ap_utils_clock_gettime)(clockid_t clock_id, struct timespec *ts);
+
+extern void ap_utils_hist_clear(struct ap_utils_hist_t *hist);
+extern void ap_utils_hist_add(struct ap_utils_hist_t *hist, uint64_t value);
+extern void ap_utils_hist_merge(struct ap_utils_hist_t *destination, struct ap_utils_hist_t *source);
+extern uint64_t ap_utils_hist_percentile(struct ap_utils_hist_t *hist, double percentile);
 #endif
 
 #define bit_get(p,m) ((p) & (m))
@@ -0,0 +1,154 @@
+/** \file bench/bench_common.c
+ * \brief Part of AP's toolkit. Benchmarks: common helpers
+ */
+#include "bench_common.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ********************************************************************** */
+/* every object starts with the benchmark name and wall clock time of measurement */
+void bench_json_begin(FILE *out, const char *bench_name)
+{
+    fprintf(out, "{\"bench\":\"%s\",\"time\":%lld", bench_name, (long long)time(NULL));
+}
+
+/* ********************************************************************** */
+void bench_json_str(FILE *out, const char *key, const char *value)
+{
+    fprintf(out, ",\"%s\":\"%s\"", key, value);
+}
+
+/* ********************************************************************** */
+void bench_json_int(FILE *out, const char *key, long long value)
+{
+    fprintf(out, ",\"%s\":%lld", key, value);
+}
+
+/* ********************************************************************** */
+void bench_json_num(FILE *out, const char *key, double value)
+{
+    fprintf(out, ",\"%s\":%.3f", key, value);
+}
+
+/* ********************************************************************** */
+void bench_json_hist(FILE *out, const char *key, struct ap_utils_hist_t *hist)
+{
+    if ( hist->count == 0 )
+    {
+        fprintf(out, ",\"%s\":{\"count\":0}", key);
+        return;
+    }
+
+    fprintf(out, ",\"%s\":{\"count\":%llu,\"min\":%llu,\"avg\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+        key, (unsigned long long)hist->count, (unsigned long long)hist->min, (double)hist->sum / hist->count,
+        (unsigned long long)ap_utils_hist_percentile(hist, 50.0), (unsigned long long)ap_utils_hist_percentile(hist, 90.0),
+        (unsigned long long)ap_utils_hist_percentile(hist, 99.0), (unsigned long long)ap_utils_hist_percentile(hist, 99.9),
+        (unsigned long long)hist->max);
+}
+
+/* ********************************************************************** */
+void bench_json_end(FILE *out)
+{
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+/* ********************************************************************** */
+FILE *bench_open_output(const char *file_name)
+{
+    FILE *out;
+
+
+    if ( file_name == NULL )
+        return stdout;
+
+    out = fopen(file_name, "a");
+
+    if ( out == NULL )
+    {
+        fprintf(stderr, "Can't open %s: %s\n", file_name, strerror(errno));
+        exit(1);
+    }
+
+    return out;
+}
+
+/* ********************************************************************** */
+volatile uint64_t bench_sink;
+int bench_repetitions = 5;
+int bench_min_time_ms = 50;
+
+/* ********************************************************************** */
+static int cmp_double(const void *a, const void *b)
+{
+    return *(double *)a < *(double *)b ? -1 : *(double *)a > *(double *)b;
+}
+
+/* ********************************************************************** */
+void bench_measure(FILE *out, const char *group, const char *name, long n, long bytes_per_op, bench_func_t func, void *arg)
+{
+    long iterations;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t min_time;
+    double *ns_per_op;
+    double median;
+    int i;
+
+
+    min_time = (uint64_t)bench_min_time_ms * 1000000;
+
+    /* calibration. doubles as the warm-up */
+    for ( iterations = 1;; iterations *= 2 )
+    {
+        start = ap_utils_clock_ns();
+        func(arg, iterations);
+        elapsed = ap_utils_clock_ns() - start;
+
+        if ( elapsed >= min_time )
+            break;
+
+        if ( elapsed > min_time / 16 ) /* close enough to jump there directly */
+        {
+            iterations = (long)((double)iterations * min_time / elapsed) + 1;
+            break;
+        }
+    }
+
+    ns_per_op = malloc(bench_repetitions * sizeof(double));
+
+    if ( ns_per_op == NULL )
+        exit(1);
+
+    for ( i = 0; i < bench_repetitions; ++i )
+    {
+        start = ap_utils_clock_ns();
+        func(arg, iterations);
+        elapsed = ap_utils_clock_ns() - start;
+
+        ns_per_op[i] = (double)elapsed / iterations;
+    }
+
+    qsort(ns_per_op, bench_repetitions, sizeof(double), cmp_double);
+
+    median = ns_per_op[bench_repetitions / 2];
+
+    bench_json_begin(out, "micro");
+    bench_json_str(out, "group", group);
+    bench_json_str(out, "name", name);
+    bench_json_int(out, "n", n);
+    bench_json_int(out, "iterations", iterations);
+    bench_json_int(out, "reps", bench_repetitions);
+    bench_json_num(out, "ns_per_op", median);
+    bench_json_num(out, "ns_per_op_min", ns_per_op[0]);
+    bench_json_num(out, "ns_per_op_max", ns_per_op[bench_repetitions - 1]);
+
+    if ( bytes_per_op > 0 )
+        bench_json_num(out, "mbytes_per_sec", bytes_per_op / median * 1e3);
+
+    bench_json_end(out);
+
+    free(ns_per_op);
+}
@@ -0,0 +1,44 @@
+/** \file bench/bench_common.h
+ * \brief Part of AP's toolkit. Benchmarks: common helpers
+ *
+ * Results are written as JSON Lines: one object per measurement, so the outputs of different releases can be diffed or loaded into anything
+ */
+#ifndef AP_BENCH_COMMON_H
+#define AP_BENCH_COMMON_H
+
+#include "../ap_utils.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* ********************************************************************** */
+/* JSON Lines output. Usage:
+ *   bench_json_begin(out, "net");
+ *   bench_json_str(out, "mode", "echo");
+ *   bench_json_num(out, "ops_per_sec", ops / sec);
+ *   bench_json_end(out);
+ */
+extern void bench_json_begin(FILE *out, const char *bench_name);
+extern void bench_json_str(FILE *out, const char *key, const char *value);
+extern void bench_json_int(FILE *out, const char *key, long long value);
+extern void bench_json_num(FILE *out, const char *key, double value);
+extern void bench_json_hist(FILE *out, const char *key, struct ap_utils_hist_t *hist); /* count, min, avg, p50, p90, p99, p999, max */
+extern void bench_json_end(FILE *out);
+
+/* opens output file given with -o option or returns stdout if name is NULL. exits on error */
+extern FILE *bench_open_output(const char *file_name);
+
+/* ********************************************************************** */
+/* micro benchmarks timing framework.
+ * measured function should do its work the given number of times and put something into bench_sink,
+ * so the compiler will not throw the work away */
+typedef void (*bench_func_t)(void *arg, long iterations);
+
+extern volatile uint64_t bench_sink;
+extern int bench_repetitions; /* timed runs count. the result is the median */
+extern int bench_min_time_ms; /* iterations count is raised until one run takes at least this long */
+
+/* calibrates, warms up and runs func, printing JSON line with ns/op and bytes/s if bytes_per_op > 0
+ * n is the problem size: pool size, input length etc. */
+extern void bench_measure(FILE *out, const char *group, const char *name, long n, long bytes_per_op, bench_func_t func, void *arg);
+
+#endif
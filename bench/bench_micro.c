@@ -0,0 +1,719 @@
+/** \file bench/bench_micro.c
+ * \brief Part of AP's toolkit. Benchmarks: toolkit's primitives used on the hot paths
+ *
+ * Each primitive is run across realistic pool sizes or input lengths, see the n field of output.
+ * Pool lookups are done on the pools filled with fake connections (no sockets behind) and random targets.
+ *
+ * Usage: bench_micro [-f filter] [-r repetitions] [-t min_run_ms] [-o output.json]
+ *   -f - run only benchmarks with "group/name" containing this substring
+ */
+#include "bench_common.h"
+#include "../ap_net/ap_net.h"
+#include "../ap_log.h"
+#include "../ap_str.h"
+#include "../ap_crc.h"
+#include "../ap_buf.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* count of precomputed random lookup targets */
+#define TARGETS 1024
+
+const int pool_sizes[] = { 16, 256, 4096, 65536 };
+const int data_lengths[] = { 16, 256, 4096, 65536 };
+#define count_of(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+const char *filter;
+FILE *out;
+
+/** \brief pool lookups arguments */
+typedef struct
+{
+    struct ap_net_conn_pool_t *pool;
+    int fds[TARGETS];
+    struct sockaddr_storage addrs[TARGETS];
+} pool_arg_t;
+
+/** \brief memory buffers functions arguments */
+typedef struct
+{
+    char *data;
+    int len;
+    char *buf;
+    int bufsize;
+    int buffill;
+} mem_arg_t;
+
+/* ******************************************************* */
+static void measure(const char *group, const char *name, long n, long bytes_per_op, bench_func_t func, void *arg)
+{
+    char full_name[200];
+
+
+    snprintf(full_name, sizeof(full_name), "%s/%s", group, name);
+
+    if ( filter != NULL && strstr(full_name, filter) == NULL )
+        return;
+
+    bench_measure(out, group, name, n, bytes_per_op, func, arg);
+}
+
+/* ******************************************************* */
+/* pool with size-1 fake connected connections. the last slot is free */
+static struct ap_net_conn_pool_t *make_pool(int size)
+{
+    struct ap_net_conn_pool_t *pool;
+    struct ap_net_connection_t *conn;
+    int i;
+
+
+    pool = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, size, 0, 16, NULL);
+
+    if ( pool == NULL )
+    {
+        fprintf(stderr, "pool create: %s\n", ap_error_get_string());
+        exit(1);
+    }
+
+    for ( i = 0; i < size - 1; ++i )
+    {
+        conn = &pool->conns[i];
+        conn->state |= AP_NET_ST_CONNECTED;
+        conn->fd = 100000 + i;
+        ap_net_set_ip4_addr(&conn->remote.addr4, INADDR_LOOPBACK + (i >> 16), 1 + (i & 0xffff));
+    }
+
+    pool->used_slots = size - 1;
+
+    return pool;
+}
+
+/* ******************************************************* */
+/* un-faking connections, so destroy will not try to close them */
+static void free_pool(struct ap_net_conn_pool_t *pool)
+{
+    int i;
+
+
+    for ( i = 0; i < pool->max_connections; ++i )
+    {
+        pool->conns[i].state = 0;
+        pool->conns[i].fd = -1;
+    }
+
+    pool->used_slots = 0;
+
+    ap_net_conn_pool_destroy(pool, 1);
+}
+
+/* ******************************************************* */
+static void b_get_conn_by_fd(void *arg, long iterations)
+{
+    pool_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += (uintptr_t)ap_net_conn_pool_get_conn_by_fd(a->pool, a->fds[i % TARGETS]);
+}
+
+/* ******************************************************* */
+static void b_get_conn_by_address(void *arg, long iterations)
+{
+    pool_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += (uintptr_t)ap_net_conn_pool_get_conn_by_address(a->pool, &a->addrs[i % TARGETS], 0);
+}
+
+/* ******************************************************* */
+static void b_find_free_slot(void *arg, long iterations)
+{
+    pool_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += (uintptr_t)ap_net_conn_pool_find_free_slot(a->pool);
+}
+
+/* ******************************************************* */
+static void bench_pool(void)
+{
+    pool_arg_t *a;
+    int s;
+    int i;
+    int idx;
+
+
+    a = malloc(sizeof(pool_arg_t));
+
+    if ( a == NULL )
+        exit(1);
+
+    for ( s = 0; s < count_of(pool_sizes); ++s )
+    {
+        a->pool = make_pool(pool_sizes[s]);
+
+        for ( i = 0; i < TARGETS; ++i )
+        {
+            idx = rand() % (pool_sizes[s] - 1);
+            a->fds[i] = a->pool->conns[idx].fd;
+            memset(&a->addrs[i], 0, sizeof(struct sockaddr_storage));
+            memcpy(&a->addrs[i], &a->pool->conns[idx].remote.addr4, sizeof(struct sockaddr_in));
+        }
+
+        measure("pool", "get_conn_by_fd", pool_sizes[s], 0, b_get_conn_by_fd, a);
+        measure("pool", "get_conn_by_address", pool_sizes[s], 0, b_get_conn_by_address, a);
+        measure("pool", "find_free_slot", pool_sizes[s], 0, b_find_free_slot, a);
+
+        free_pool(a->pool);
+    }
+
+    free(a);
+}
+
+/* ******************************************************* */
+static void b_timespec_set(void *arg, long iterations)
+{
+    struct timespec ts;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        ap_utils_timespec_set(&ts, AP_UTILS_TIME_SET_FROM_NOW, 1000);
+        bench_sink += ts.tv_nsec;
+    }
+}
+
+/* ******************************************************* */
+static void b_timespec_cmp_to_now(void *arg, long iterations)
+{
+    struct timespec *ts = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_utils_timespec_cmp_to_now(ts);
+}
+
+/* ******************************************************* */
+static void b_timespec_elapsed(void *arg, long iterations)
+{
+    struct timespec *ts = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_utils_timespec_elapsed(ts, NULL, NULL);
+}
+
+/* ******************************************************* */
+static void b_timespec_add(void *arg, long iterations)
+{
+    struct timespec *ts = arg;
+    struct timespec sum;
+    long i;
+
+
+    sum = *ts;
+
+    for ( i = 0; i < iterations; ++i )
+        ap_utils_timespec_add(&sum, ts, &sum);
+
+    bench_sink += sum.tv_nsec;
+}
+
+/* ******************************************************* */
+static void b_clock_ns(void *arg, long iterations)
+{
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_utils_clock_ns();
+}
+
+/* ******************************************************* */
+static void b_crc16(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += count_crc16(a->data, a->len);
+}
+
+/* ******************************************************* */
+static void b_ap_crc16(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_crc16(a->data, a->len);
+}
+
+/* ******************************************************* */
+static void b_ap_crc32c(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_crc32c(a->data, a->len);
+}
+
+/* ******************************************************* */
+static void bench_utils(void)
+{
+    const char *crc_impl_names[] = { "auto", "bitwise", "table", "simd" };
+    struct timespec ts;
+    mem_arg_t a;
+    char name[64];
+    int i;
+    int impl;
+
+
+    ap_utils_timespec_set(&ts, AP_UTILS_TIME_SET_FROM_NOW, 1000);
+
+    measure("utils", "timespec_set_from_now", 1, 0, b_timespec_set, NULL);
+    measure("utils", "timespec_cmp_to_now", 1, 0, b_timespec_cmp_to_now, &ts);
+    measure("utils", "timespec_elapsed", 1, 0, b_timespec_elapsed, &ts);
+    measure("utils", "timespec_add", 1, 0, b_timespec_add, &ts);
+    measure("utils", "clock_ns", 1, 0, b_clock_ns, NULL);
+
+    a.data = malloc(data_lengths[count_of(data_lengths) - 1]);
+
+    if ( a.data == NULL )
+        exit(1);
+
+    for ( i = 0; i < data_lengths[count_of(data_lengths) - 1]; ++i )
+        a.data[i] = rand();
+
+    for ( i = 0; i < count_of(data_lengths); ++i )
+    {
+        a.len = data_lengths[i];
+        measure("utils", "count_crc16", a.len, a.len, b_crc16, &a);
+    }
+
+    /* the same data through each of checksum implementations. SIMD is skipped if CPU lacks it */
+    for ( impl = AP_CRC_IMPL_BITWISE; impl <= AP_CRC_IMPL_SIMD; ++impl )
+    {
+        if ( ! ap_crc_set_impl(impl) )
+            continue;
+
+        for ( i = 0; i < count_of(data_lengths); ++i )
+        {
+            a.len = data_lengths[i];
+            snprintf(name, sizeof(name), "crc16_%s", crc_impl_names[impl]);
+            measure("crc", name, a.len, a.len, b_ap_crc16, &a);
+            snprintf(name, sizeof(name), "crc32c_%s", crc_impl_names[impl]);
+            measure("crc", name, a.len, a.len, b_ap_crc32c, &a);
+        }
+    }
+
+    ap_crc_set_impl(AP_CRC_IMPL_AUTO);
+
+    free(a.data);
+}
+
+/* ******************************************************* */
+/* full parse cycle: init, tokenize to the end, free */
+static void b_parse(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    ap_str_parse_rec_t *r;
+    char *tok;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        r = ap_str_parse_init(a->data, NULL);
+
+        while ( NULL != (tok = ap_str_parse_next_arg(r)) )
+            bench_sink += *tok;
+
+        ap_str_parse_end(r);
+    }
+}
+
+/* ******************************************************* */
+/* appends into the buffer that is big enough, so it is not resized on the way */
+static void b_put_to_buf(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        if ( a->buffill + a->len > a->bufsize )
+            a->buffill = 0;
+
+        bench_sink += ap_str_put_to_buf(&a->buf, &a->bufsize, &a->buffill, a->data, a->len);
+    }
+}
+
+/* ******************************************************* */
+/* the same with in-place tokenizer */
+static void b_tok(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    ap_str_tok_t t;
+    ap_str_slice_t tok;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        ap_str_tok_init(&t, a->data, a->len, NULL);
+
+        while ( ap_str_tok_next(&t, &tok) )
+            bench_sink += *tok.s;
+    }
+}
+
+/* ******************************************************* */
+static void bench_str(void)
+{
+    mem_arg_t a;
+    const int tokens[] = { 4, 16, 64 };
+    int i;
+    int n;
+
+
+    for ( i = 0; i < count_of(tokens); ++i ) /* "word word ..." lines */
+    {
+        a.data = malloc(tokens[i] * 8 + 1);
+
+        if ( a.data == NULL )
+            exit(1);
+
+        for ( n = 0; n < tokens[i]; ++n )
+            memcpy(a.data + n * 8, n % 2 ? "param=1 " : "command\t", 8);
+
+        a.data[tokens[i] * 8 - 1] = '\0';
+
+        measure("str", "parse_line", tokens[i], tokens[i] * 8, b_parse, &a);
+
+        a.len = tokens[i] * 8 - 1;
+        measure("str", "tok_line", tokens[i], tokens[i] * 8, b_tok, &a);
+
+        free(a.data);
+    }
+
+    a.bufsize = 1 << 20;
+    a.buf = malloc(a.bufsize);
+    a.data = malloc(data_lengths[count_of(data_lengths) - 1]);
+
+    if ( a.buf == NULL || a.data == NULL )
+        exit(1);
+
+    memset(a.data, 'x', data_lengths[count_of(data_lengths) - 1]);
+
+    for ( i = 0; i < count_of(data_lengths); ++i )
+    {
+        a.len = data_lengths[i];
+        a.buffill = 0;
+        measure("str", "put_to_buf", a.len, a.len, b_put_to_buf, &a);
+    }
+
+    free(a.buf);
+    free(a.data);
+}
+
+/* ******************************************************* */
+static void b_debug_log(void *arg, long iterations)
+{
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        ap_log_debug_log("* conn #%ld: got %d bytes, state %x\n", i, 123, 0x11);
+}
+
+/* ******************************************************* */
+/* the same message is collapsed into "repeated N times" */
+static void b_debug_log_repeat(void *arg, long iterations)
+{
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        ap_log_debug_log("* the same message again\n");
+}
+
+/* ******************************************************* */
+/* admin interface report of 64 lines with one write() per line */
+static void b_report_hprintf(void *arg, long iterations)
+{
+    int fd = *(int *)arg;
+    long i;
+    int n;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        for ( n = 0; n < 64; ++n )
+            ap_log_hprintf(fd, "conn #%d: %s, %d bytes\n", n, "connected", 123);
+
+        ap_log_hputc('\n', fd);
+    }
+}
+
+/* ******************************************************* */
+/* the same report through ap_log_writer_t */
+static void b_report_writer(void *arg, long iterations)
+{
+    int fd = *(int *)arg;
+    ap_log_writer_t w;
+    long i;
+    int n;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        ap_log_writer_init(&w, fd, 0);
+
+        for ( n = 0; n < 64; ++n )
+            ap_log_writer_printf(&w, "conn #%d: %s, %d bytes\n", n, "connected", 123);
+
+        ap_log_writer_putc(&w, '\n');
+        ap_log_writer_destroy(&w);
+    }
+}
+
+/* ******************************************************* */
+/* hexdump line by line with snprintf() per byte, as ap_log_mem_dump_to_fd() did */
+static void b_hexdump_printf(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+    int n, pos;
+    unsigned char *s = (unsigned char *)a->data;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        a->buffill = 0;
+
+        for ( pos = 0; pos < a->len; ++pos )
+        {
+            if ( pos % 16 == 0 && pos > 0 )
+                a->buf[a->buffill++] = '\n';
+
+            n = snprintf(a->buf + a->buffill, a->bufsize - a->buffill, "%02x %c ", s[pos], isprint(s[pos]) ? s[pos] : '.');
+            a->buffill += n;
+        }
+
+        bench_sink += a->buffill;
+    }
+}
+
+/* ******************************************************* */
+static void b_hexdump(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    long i;
+
+
+    for ( i = 0; i < iterations; ++i )
+        bench_sink += ap_log_hexdump(a->buf, a->data, a->len, 0, 0);
+}
+
+/* ******************************************************* */
+/* message of a->len 16-byte pieces into a new buffer, as a sender assembles one */
+static void b_assemble_put_to_buf(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    char *buf;
+    int size, fill;
+    long i;
+    int n;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        buf = NULL;
+        size = fill = 0;
+
+        for ( n = 0; n < a->len; ++n )
+            ap_str_put_to_buf(&buf, &size, &fill, a->data, 16);
+
+        bench_sink += fill;
+        free(buf);
+    }
+}
+
+/* ******************************************************* */
+static void b_assemble_buf(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    ap_buf_t buf;
+    long i;
+    int n;
+
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        ap_buf_init(&buf, NULL);
+
+        for ( n = 0; n < a->len; ++n )
+            ap_buf_append(&buf, a->data, 16);
+
+        bench_sink += buf.len;
+        ap_buf_free(&buf);
+    }
+}
+
+/* ******************************************************* */
+/* the same on arena that is reset after each message */
+static void b_assemble_buf_arena(void *arg, long iterations)
+{
+    mem_arg_t *a = arg;
+    ap_arena_t arena;
+    ap_buf_t buf;
+    long i;
+    int n;
+
+
+    ap_arena_init(&arena, 0);
+
+    for ( i = 0; i < iterations; ++i )
+    {
+        ap_buf_init(&buf, &arena);
+
+        for ( n = 0; n < a->len; ++n )
+            ap_buf_append(&buf, a->data, 16);
+
+        bench_sink += buf.len;
+        ap_arena_reset(&arena);
+    }
+
+    ap_arena_destroy(&arena);
+}
+
+/* ******************************************************* */
+static void bench_buf(void)
+{
+    mem_arg_t a;
+    const int pieces[] = { 4, 64, 1024 };
+    char piece[16];
+    int i;
+
+
+    memset(piece, 'x', sizeof(piece));
+    a.data = piece;
+
+    for ( i = 0; i < count_of(pieces); ++i )
+    {
+        a.len = pieces[i];
+        measure("buf", "assemble_put_to_buf", a.len, a.len * 16, b_assemble_put_to_buf, &a);
+        measure("buf", "assemble_ap_buf", a.len, a.len * 16, b_assemble_buf, &a);
+        measure("buf", "assemble_ap_buf_arena", a.len, a.len * 16, b_assemble_buf_arena, &a);
+    }
+}
+
+/* ******************************************************* */
+static void bench_hexdump(void)
+{
+    mem_arg_t a;
+    int i;
+
+
+    a.bufsize = ap_log_hexdump_size(data_lengths[count_of(data_lengths) - 1]);
+    a.buf = malloc(a.bufsize);
+    a.data = malloc(data_lengths[count_of(data_lengths) - 1]);
+
+    for ( i = 0; i < data_lengths[count_of(data_lengths) - 1]; ++i )
+        a.data[i] = rand();
+
+    for ( i = 0; i < count_of(data_lengths); ++i )
+    {
+        a.len = data_lengths[i];
+        measure("log", "hexdump_printf", a.len, a.len, b_hexdump_printf, &a);
+
+        ap_log_hexdump_set_simd(0);
+        measure("log", "hexdump_table", a.len, a.len, b_hexdump, &a);
+
+        if ( ap_log_hexdump_set_simd(1) )
+            measure("log", "hexdump_simd", a.len, a.len, b_hexdump, &a);
+    }
+
+    free(a.buf);
+    free(a.data);
+}
+
+/* ******************************************************* */
+static void bench_log(void)
+{
+    int fd;
+
+
+    fd = open("/dev/null", O_WRONLY);
+
+    if ( fd == -1 || ! ap_log_add_debug_handle(fd) )
+    {
+        fprintf(stderr, "can't add /dev/null as debug handle\n");
+        exit(1);
+    }
+
+    ap_log_debug_to_tty = 0;
+
+    measure("log", "debug_log_devnull", 1, 0, b_debug_log, NULL);
+    measure("log", "debug_log_repeat", 1, 0, b_debug_log_repeat, NULL);
+    measure("log", "report_hprintf", 64, 0, b_report_hprintf, &fd);
+    measure("log", "report_writer", 64, 0, b_report_writer, &fd);
+
+    ap_log_remove_debug_handle(fd);
+    close(fd);
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    const char *opt_output;
+
+
+    opt_output = NULL;
+
+    while ( -1 != (opt = getopt(argc, argv, "f:r:t:o:")) )
+    {
+        switch ( opt )
+        {
+            case 'f': filter = optarg; break;
+            case 'r': bench_repetitions = atoi(optarg); break;
+            case 't': bench_min_time_ms = atoi(optarg); break;
+            case 'o': opt_output = optarg; break;
+            default:
+                fprintf(stderr, "Usage: bench_micro [-f filter] [-r repetitions] [-t min_run_ms] [-o output.json]\n");
+                return 2;
+        }
+    }
+
+    if ( bench_repetitions <= 0 || bench_min_time_ms <= 0 )
+        return 2;
+
+    out = bench_open_output(opt_output);
+
+    srand(1);
+
+    bench_pool();
+    bench_utils();
+    bench_str();
+    bench_buf();
+    bench_log();
+    bench_hexdump();
+
+    return 0;
+}
@@ -0,0 +1,463 @@
+/** \file bench/bench_net.c
+ * \brief Part of AP's toolkit. Benchmarks: end-to-end TCP/UDP throughput and latency of connection pool over loopback
+ *
+ * The server side is a connection pool with listener, the client side is a set of plain non-blocking sockets.
+ * Both are served from the same thread: one ap_net_conn_pool_poll() call on server, then one pass over the clients,
+ * so the numbers do not depend on the scheduler and the cores count, and the regressions of the poll loop show up directly.
+ *
+ * Modes:
+ *   echo   - each connection sends a message and waits for it to return. Round-trip latency histogram
+ *   rate   - same, but with -w messages in flight per connection. Requests per second
+ *   stream - clients send as fast as they can, server discards. Throughput
+ *
+ * -I runs everything through the impairment shim (see ap_net_shim_params_parse() for the format), on both sides,
+ * so the numbers show the pool under delay, jitter, loss and bandwidth cap: -I delay=10ms,jitter=2ms,loss=1%
+ *
+ * Usage: bench_net [-m echo|rate|stream|all] [-p tcp|udp|all] [-c conns] [-s msg_size] [-S stream_chunk]
+ *                  [-w window] [-d seconds] [-W warmup_ms] [-P base_port] [-I impairment] [-o output.json]
+ */
+#include "bench_common.h"
+#include "../ap_net/ap_net.h"
+#include "../ap_error/ap_error.h"
+#include <unistd.h>
+#include <fcntl.h>
+
+#define MODE_ECHO   0
+#define MODE_RATE   1
+#define MODE_STREAM 2
+
+const char *mode_names[] = { "echo", "rate", "stream" };
+
+#define MAX_WINDOW 256
+/* UDP message is considered lost if there is no answer for that long */
+#define UDP_LOSS_TIMEOUT_NS 100000000ull
+
+/** \brief client side connection */
+typedef struct
+{
+    int fd;
+    int outstanding; /* messages sent, but not answered yet */
+    int received; /* bytes of the current answer received so far (TCP) */
+    int send_left; /* bytes of the current message yet to send */
+    int ring_head, ring_tail; /* send times FIFO */
+    uint64_t sent_ns[MAX_WINDOW];
+    uint64_t last_activity;
+} client_t;
+
+/* options */
+int opt_conns = 10;
+int opt_size = 64;
+int opt_stream_size = 16384;
+int opt_window = 16;
+int opt_duration = 2;
+int opt_warmup_ms = 200;
+int opt_port = 23000;
+const char *opt_impairment = NULL;
+struct ap_net_shim_params_t impairment;
+
+/* current run state */
+int bench_mode;
+int bench_is_tcp;
+int measuring; /* false during warm-up */
+uint64_t server_bytes; /* received by server in stream mode */
+uint64_t ops; /* completed round-trips */
+uint64_t client_bytes; /* sent in stream mode, received back otherwise */
+uint64_t lost; /* UDP messages without answer */
+struct ap_utils_hist_t latency;
+char *message;
+
+/* ******************************************************* */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench_net [-m echo|rate|stream|all] [-p tcp|udp|all] [-c conns] [-s msg_size] [-S stream_chunk]\n"
+        "\t[-w window] [-d seconds] [-W warmup_ms] [-P base_port] [-I impairment] [-o output.json]\n");
+    exit(2);
+}
+
+/* ******************************************************* */
+/* echoes the data back or discards it in stream mode */
+static int server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    int n;
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN && signal_type != AP_NET_SIGNAL_CONN_DATA_LEFT )
+        return 1;
+
+    n = conn->buffill - conn->bufpos;
+
+    if ( n <= 0 )
+        return 1;
+
+    if ( bench_mode == MODE_STREAM )
+    {
+        if ( measuring )
+            server_bytes += n;
+
+        conn->bufpos = conn->buffill;
+
+        return 1;
+    }
+
+    n = ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos, n);
+
+    if ( n > 0 ) /* the rest, if any, will be sent on AP_NET_SIGNAL_CONN_DATA_LEFT */
+        conn->bufpos += n;
+
+    return 1;
+}
+
+/* ******************************************************* */
+static int client_open(client_t *c, int port)
+{
+    struct sockaddr_in addr;
+
+
+    memset(c, 0, sizeof(client_t));
+
+    c->fd = socket(AF_INET, bench_is_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+
+    if ( c->fd == -1 )
+        return 0;
+
+    ap_net_set_ip4_addr(&addr, INADDR_LOOPBACK, port);
+
+    /* UDP socket is left unconnected: the answers come from the server connection's own socket, not from the listener */
+    if ( bench_is_tcp && -1 == connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) )
+        return 0;
+
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* one pass of client's work in echo and rate modes */
+static void client_service_echo(client_t *c, int window, struct sockaddr_in *server_addr, uint64_t now)
+{
+    int n;
+    char buf[65536];
+
+
+    for (;;) /* reading answers */
+    {
+        n = ap_net_io->recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+        if ( n <= 0 )
+            break;
+
+        c->last_activity = now;
+
+        if ( bench_is_tcp )
+            c->received += n;
+        else
+            c->received = opt_size; /* datagram is the whole message */
+
+        while ( c->received >= opt_size && c->outstanding > 0 )
+        {
+            c->received -= opt_size;
+            --c->outstanding;
+
+            if ( measuring )
+            {
+                ap_utils_hist_add(&latency, now - c->sent_ns[c->ring_tail]);
+                ++ops;
+                client_bytes += opt_size;
+            }
+
+            c->ring_tail = (c->ring_tail + 1) % MAX_WINDOW;
+        }
+    }
+
+    if ( ! bench_is_tcp && c->outstanding > 0 && now - c->last_activity > UDP_LOSS_TIMEOUT_NS + 4 * (impairment.delay_ns + impairment.jitter_ns) )
+    {
+        lost += c->outstanding;
+        c->outstanding = 0;
+        c->ring_tail = c->ring_head;
+        c->last_activity = now; /* the next timeout counts from the resend */
+    }
+
+    while ( c->send_left > 0 || c->outstanding < window ) /* sending new ones */
+    {
+        if ( c->send_left == 0 )
+        {
+            c->send_left = opt_size;
+            c->sent_ns[c->ring_head] = now;
+            c->ring_head = (c->ring_head + 1) % MAX_WINDOW;
+            ++c->outstanding;
+
+            if ( c->last_activity == 0 )
+                c->last_activity = now;
+        }
+
+        if ( bench_is_tcp )
+            n = ap_net_io->send(c->fd, message + opt_size - c->send_left, c->send_left, MSG_DONTWAIT | MSG_NOSIGNAL);
+        else
+            n = ap_net_io->sendto(c->fd, message, opt_size, MSG_DONTWAIT, (struct sockaddr *)server_addr, sizeof(struct sockaddr_in));
+
+        if ( n <= 0 )
+            break;
+
+        c->send_left -= n;
+    }
+}
+
+/* ******************************************************* */
+/* one pass of client's work in stream mode */
+static void client_service_stream(client_t *c, struct sockaddr_in *server_addr)
+{
+    int i;
+    int n;
+
+
+    for ( i = 0; i < 8; ++i ) /* not too much at once, giving server a chance */
+    {
+        if ( bench_is_tcp )
+            n = ap_net_io->send(c->fd, message, opt_stream_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        else
+            n = ap_net_io->sendto(c->fd, message, opt_stream_size, MSG_DONTWAIT, (struct sockaddr *)server_addr, sizeof(struct sockaddr_in));
+
+        if ( n <= 0 )
+            break;
+
+        if ( measuring )
+        {
+            client_bytes += n;
+            ++ops;
+        }
+    }
+}
+
+/* ******************************************************* */
+static int run(FILE *out, int mode, int is_tcp, int port)
+{
+    struct ap_net_conn_pool_t *server;
+    struct ap_net_shim_stat_t shim_stat;
+    client_t *clients;
+    struct sockaddr_in server_addr;
+    uint64_t start, now, end, warmup_end;
+    uint64_t polls;
+    int i;
+    int window;
+    int bufsize;
+    double sec;
+
+
+    bench_mode = mode;
+    bench_is_tcp = is_tcp;
+    measuring = 0;
+    server_bytes = ops = client_bytes = lost = polls = 0;
+    ap_utils_hist_clear(&latency);
+
+    window = mode == MODE_RATE ? opt_window : 1;
+    bufsize = mode == MODE_STREAM ? opt_stream_size * 4 : opt_size * window * 2;
+
+    if ( bufsize < 65536 )
+        bufsize = 65536;
+
+    fprintf(stderr, "* %s %s: %d conns, port %d\n", is_tcp ? "tcp" : "udp", mode_names[mode], opt_conns, port);
+
+    if ( opt_impairment != NULL && ! ap_net_shim_enable(&impairment, port) )
+    {
+        fprintf(stderr, "! shim: %s\n", ap_error_get_string());
+        return 0;
+    }
+
+    server = ap_net_conn_pool_create(is_tcp ? AP_NET_POOL_FLAGS_TCP : 0, opt_conns, 0, bufsize, server_callback);
+
+    if ( server == NULL
+        || ! ap_net_conn_pool_set_ip4_addr(server, INADDR_LOOPBACK, port)
+        || -1 == ap_net_conn_pool_listener_create(server, 1, 1) )
+    {
+        fprintf(stderr, "! server: %s\n", ap_error_get_string());
+        return 0;
+    }
+
+    server->poller->emit_old_data_signal = 1;
+    ap_net_set_ip4_addr(&server_addr, INADDR_LOOPBACK, port);
+
+    clients = malloc(opt_conns * sizeof(client_t));
+
+    if ( clients == NULL )
+    {
+        fprintf(stderr, "! out of memory\n");
+        return 0;
+    }
+
+    for ( i = 0; i < opt_conns; ++i )
+    {
+        if ( ! client_open(&clients[i], port) )
+        {
+            fprintf(stderr, "! client %d: %s\n", i, strerror(errno));
+            return 0;
+        }
+
+        while ( is_tcp && server->used_slots <= i ) /* accepting one by one, so backlog will not overflow */
+        {
+            if ( ! ap_net_conn_pool_poll(server) )
+            {
+                fprintf(stderr, "! server poll: %s\n", ap_error_get_string());
+                return 0;
+            }
+        }
+    }
+
+    start = ap_utils_clock_ns();
+    warmup_end = start + (uint64_t)opt_warmup_ms * 1000000;
+    end = warmup_end + (uint64_t)opt_duration * 1000000000;
+
+    for ( now = start; now < end; now = ap_utils_clock_ns() )
+    {
+        if ( ! measuring && now >= warmup_end )
+        {
+            measuring = 1;
+            polls = 0;
+        }
+
+        if ( ! ap_net_conn_pool_poll(server) )
+        {
+            fprintf(stderr, "! server poll: %s\n", ap_error_get_string());
+            return 0;
+        }
+
+        ++polls;
+
+        for ( i = 0; i < opt_conns; ++i )
+        {
+            if ( mode == MODE_STREAM )
+                client_service_stream(&clients[i], &server_addr);
+            else
+                client_service_echo(&clients[i], window, &server_addr, now);
+        }
+    }
+
+    sec = (now - warmup_end) / 1e9;
+
+    bench_json_begin(out, "net");
+    bench_json_str(out, "proto", is_tcp ? "tcp" : "udp");
+    bench_json_str(out, "mode", mode_names[mode]);
+    bench_json_int(out, "conns", opt_conns);
+    bench_json_int(out, "size", mode == MODE_STREAM ? opt_stream_size : opt_size);
+    bench_json_int(out, "window", window);
+    bench_json_num(out, "seconds", sec);
+    bench_json_int(out, "polls", polls);
+    bench_json_num(out, "polls_per_sec", polls / sec);
+
+    if ( mode == MODE_STREAM )
+    {
+        bench_json_int(out, "sent_bytes", client_bytes);
+        bench_json_int(out, "received_bytes", server_bytes);
+        bench_json_num(out, "mbytes_per_sec", server_bytes / sec / 1e6);
+    }
+    else
+    {
+        bench_json_int(out, "ops", ops);
+        bench_json_num(out, "ops_per_sec", ops / sec);
+        bench_json_num(out, "mbytes_per_sec", client_bytes / sec / 1e6);
+        bench_json_int(out, "lost", lost);
+        bench_json_hist(out, "latency_ns", &latency);
+    }
+
+    if ( opt_impairment != NULL )
+    {
+        ap_net_shim_get_stat(&shim_stat);
+        bench_json_str(out, "impairment", opt_impairment);
+        bench_json_int(out, "shim_lost", shim_stat.lost);
+        bench_json_int(out, "shim_retransmits", shim_stat.retransmits);
+        bench_json_int(out, "shim_reordered", shim_stat.reordered);
+        bench_json_int(out, "shim_queue_full", shim_stat.queue_full);
+    }
+
+    bench_json_end(out);
+
+    /* clients close first, so the server's port will not stay in TIME_WAIT */
+    for ( i = 0; i < opt_conns; ++i )
+        ap_net_io->close(clients[i].fd);
+
+    free(clients);
+
+    start = ap_utils_clock_ns();
+
+    while ( is_tcp && server->used_slots > 0 && ap_utils_clock_ns() - start < 1000000000ull )
+        ap_net_conn_pool_poll(server);
+
+    ap_net_conn_pool_destroy(server, 1);
+    ap_net_shim_disable();
+
+    return 1;
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    int mode;
+    int proto;
+    int port;
+    const char *opt_mode;
+    const char *opt_proto;
+    const char *opt_output;
+    FILE *out;
+
+
+    opt_mode = "all";
+    opt_proto = "all";
+    opt_output = NULL;
+
+    while ( -1 != (opt = getopt(argc, argv, "m:p:c:s:S:w:d:W:P:I:o:")) )
+    {
+        switch ( opt )
+        {
+            case 'm': opt_mode = optarg; break;
+            case 'p': opt_proto = optarg; break;
+            case 'c': opt_conns = atoi(optarg); break;
+            case 's': opt_size = atoi(optarg); break;
+            case 'S': opt_stream_size = atoi(optarg); break;
+            case 'w': opt_window = atoi(optarg); break;
+            case 'd': opt_duration = atoi(optarg); break;
+            case 'W': opt_warmup_ms = atoi(optarg); break;
+            case 'P': opt_port = atoi(optarg); break;
+            case 'I': opt_impairment = optarg; break;
+            case 'o': opt_output = optarg; break;
+            default: usage();
+        }
+    }
+
+    if ( opt_conns <= 0 || opt_size <= 0 || opt_size > 65000 || opt_stream_size <= 0 || opt_stream_size > 65000
+         || opt_window <= 0 || opt_window >= MAX_WINDOW || opt_duration <= 0 || opt_warmup_ms < 0 )
+        usage();
+
+    if ( opt_impairment != NULL && ! ap_net_shim_params_parse(&impairment, opt_impairment) )
+    {
+        fprintf(stderr, "! %s\n", ap_error_get_string());
+        return 2;
+    }
+
+    out = bench_open_output(opt_output);
+
+    message = malloc(opt_size > opt_stream_size ? opt_size : opt_stream_size);
+
+    if ( message == NULL )
+        return 1;
+
+    memset(message, 'x', opt_size > opt_stream_size ? opt_size : opt_stream_size);
+
+    port = opt_port;
+
+    for ( proto = 1; proto >= 0; --proto )
+    {
+        if ( strcmp(opt_proto, "all") != 0 && strcmp(opt_proto, proto ? "tcp" : "udp") != 0 )
+            continue;
+
+        for ( mode = 0; mode <= MODE_STREAM; ++mode )
+        {
+            if ( strcmp(opt_mode, "all") != 0 && strcmp(opt_mode, mode_names[mode]) != 0 )
+                continue;
+
+            if ( ! run(out, mode, proto, port++) )
+                return 1;
+        }
+    }
+
+    return 0;
+}
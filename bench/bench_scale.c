@@ -0,0 +1,428 @@
+/** \file bench/bench_scale.c
+ * \brief Part of AP's toolkit. Benchmarks: connection pool behaviour with 100k+ mostly idle TCP connections
+ *
+ * One server pool, one process, loopback only. The client sockets are bound to 127.0.0.2, 127.0.0.3, ...
+ * with -A connections per source address, so the ephemeral ports will not run out.
+ * Each socket end takes a descriptor, so the process needs 2 * conns + some of them:
+ * the limit is raised up to the hard one automatically, raise the hard one with ulimit -Hn or limits.conf if needed.
+ *
+ * Stages and the output:
+ *   connect - clients connect with limited number in flight while the server polls and accepts. Accept rate
+ *   memory  - RSS growth of the pool and kernel Slab growth per connection (the latter is for both socket ends)
+ *   idle    - the cost of one ap_net_conn_pool_poll() cycle when nothing happens
+ *   active  - -a evenly spread connections do echo round-trips, the rest stay idle.
+ *             Round-trip latency and poll cycle cost histograms
+ *
+ * Usage: bench_scale [-c conns] [-a active] [-A conns_per_source_addr] [-s msg_size] [-b conn_buf_size]
+ *                    [-i idle_cycles] [-d seconds] [-P port] [-o output.json]
+ */
+#include "bench_common.h"
+#include "../ap_net/ap_net.h"
+#include "../ap_error/ap_error.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+/* connect() calls ahead of server's accepts */
+#define MAX_IN_FLIGHT 256
+
+/** \brief active client connection */
+typedef struct
+{
+    int fd;
+    int received; /* bytes of the current answer received so far */
+    int send_left; /* bytes of the current message yet to send */
+    uint64_t sent_ns;
+} client_t;
+
+/* options */
+int opt_conns = 100000;
+int opt_active = 100;
+int opt_per_addr = 20000;
+int opt_size = 64;
+int opt_bufsize = 1024;
+int opt_idle_cycles = 1000;
+int opt_duration = 2;
+int opt_port = 24000;
+
+char *message;
+
+/* ******************************************************* */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench_scale [-c conns] [-a active] [-A conns_per_source_addr] [-s msg_size] [-b conn_buf_size]\n"
+        "\t[-i idle_cycles] [-d seconds] [-P port] [-o output.json]\n");
+    exit(2);
+}
+
+/* ******************************************************* */
+static int server_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    int n;
+
+
+    if ( signal_type != AP_NET_SIGNAL_CONN_DATA_IN && signal_type != AP_NET_SIGNAL_CONN_DATA_LEFT )
+        return 1;
+
+    n = conn->buffill - conn->bufpos;
+
+    if ( n <= 0 )
+        return 1;
+
+    n = ap_net_conn_pool_send(conn->parent, conn->idx, conn->buf + conn->bufpos, n);
+
+    if ( n > 0 )
+        conn->bufpos += n;
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* resident set size in bytes */
+static long long get_rss(void)
+{
+    FILE *f;
+    long long size, rss;
+
+
+    f = fopen("/proc/self/statm", "r");
+
+    if ( f == NULL )
+        return 0;
+
+    if ( 2 != fscanf(f, "%lld %lld", &size, &rss) )
+        rss = 0;
+
+    fclose(f);
+
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* ******************************************************* */
+/* kernel's slab allocations in bytes. socket structures live there */
+static long long get_slab(void)
+{
+    FILE *f;
+    char line[200];
+    long long kb;
+
+
+    f = fopen("/proc/meminfo", "r");
+
+    if ( f == NULL )
+        return 0;
+
+    kb = 0;
+
+    while ( fgets(line, sizeof(line), f) != NULL )
+        if ( 1 == sscanf(line, "Slab: %lld", &kb) )
+            break;
+
+    fclose(f);
+
+    return kb * 1024;
+}
+
+/* ******************************************************* */
+static int raise_fd_limit(int need)
+{
+    struct rlimit rl;
+
+
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+        return 0;
+
+    if ( rl.rlim_cur >= (rlim_t)need )
+        return 1;
+
+    if ( rl.rlim_max < (rlim_t)need )
+    {
+        fprintf(stderr, "! %d descriptors are needed, but the hard limit is %llu. Raise it or use less connections\n",
+            need, (unsigned long long)rl.rlim_max);
+        return 0;
+    }
+
+    rl.rlim_cur = need;
+
+    return 0 == setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/* ******************************************************* */
+/* non-blocking connect from 127.0.0.(2 + k / opt_per_addr) */
+static int client_connect(int k)
+{
+    int fd;
+    struct sockaddr_in addr;
+
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if ( fd == -1 )
+        return -1;
+
+    memset(&addr, 0, sizeof(addr)); /* port 0: kernel picks the free one for this source address */
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + k / opt_per_addr);
+
+    if ( -1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) )
+    {
+        close(fd);
+        return -1;
+    }
+
+    ap_net_set_ip4_addr(&addr, INADDR_LOOPBACK, opt_port);
+
+    if ( -1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS )
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* ******************************************************* */
+static int poll_server(struct ap_net_conn_pool_t *server)
+{
+    if ( ap_net_conn_pool_poll(server) )
+        return 1;
+
+    fprintf(stderr, "! server poll: %s\n", ap_error_get_string());
+    exit(1);
+}
+
+/* ******************************************************* */
+/* one pass of active client's echo work */
+static void client_service(client_t *c, struct ap_utils_hist_t *latency, uint64_t *ops)
+{
+    int n;
+    uint64_t now;
+    char buf[65536];
+
+
+    while ( 0 < (n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) )
+    {
+        c->received += n;
+
+        if ( c->received >= opt_size )
+        {
+            now = ap_utils_clock_ns();
+            ap_utils_hist_add(latency, now - c->sent_ns);
+            ++*ops;
+            c->received = 0;
+        }
+    }
+
+    if ( c->received == 0 && c->send_left == 0 ) /* previous answer is in, starting the new round-trip */
+    {
+        c->send_left = opt_size;
+        c->sent_ns = ap_utils_clock_ns();
+    }
+
+    if ( c->send_left > 0 )
+    {
+        n = send(c->fd, message + opt_size - c->send_left, c->send_left, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if ( n > 0 )
+            c->send_left -= n;
+    }
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    int i;
+    int *fds;
+    int opened;
+    const char *opt_output;
+    FILE *out;
+    struct ap_net_conn_pool_t *server;
+    client_t *active;
+    struct ap_utils_hist_t poll_ns;
+    struct ap_utils_hist_t latency;
+    uint64_t start, now, end;
+    uint64_t ops;
+    uint64_t polls;
+    long long rss_before, rss_pool, rss_conns;
+    long long slab_before, slab_conns;
+    double sec;
+
+
+    opt_output = NULL;
+
+    while ( -1 != (opt = getopt(argc, argv, "c:a:A:s:b:i:d:P:o:")) )
+    {
+        switch ( opt )
+        {
+            case 'c': opt_conns = atoi(optarg); break;
+            case 'a': opt_active = atoi(optarg); break;
+            case 'A': opt_per_addr = atoi(optarg); break;
+            case 's': opt_size = atoi(optarg); break;
+            case 'b': opt_bufsize = atoi(optarg); break;
+            case 'i': opt_idle_cycles = atoi(optarg); break;
+            case 'd': opt_duration = atoi(optarg); break;
+            case 'P': opt_port = atoi(optarg); break;
+            case 'o': opt_output = optarg; break;
+            default: usage();
+        }
+    }
+
+    if ( opt_conns <= 0 || opt_active < 0 || opt_active > opt_conns || opt_per_addr <= 0 || opt_per_addr > 28000
+         || opt_size <= 0 || opt_size > opt_bufsize || opt_idle_cycles <= 0 || opt_duration <= 0 )
+        usage();
+
+    out = bench_open_output(opt_output);
+
+    if ( ! raise_fd_limit(opt_conns * 2 + 64) )
+        return 1;
+
+    message = malloc(opt_size);
+    fds = malloc(opt_conns * sizeof(int));
+    active = malloc((opt_active + 1) * sizeof(client_t));
+
+    if ( message == NULL || fds == NULL || active == NULL )
+        return 1;
+
+    memset(message, 'x', opt_size);
+
+    /* ------------------------------------------------------------ */
+    rss_before = get_rss();
+    slab_before = get_slab();
+
+    server = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_TCP, opt_conns, 0, opt_bufsize, server_callback);
+
+    if ( server == NULL
+        || ! ap_net_conn_pool_set_ip4_addr(server, INADDR_LOOPBACK, opt_port)
+        || -1 == ap_net_conn_pool_listener_create(server, 1, 1) )
+    {
+        fprintf(stderr, "! server: %s\n", ap_error_get_string());
+        return 1;
+    }
+
+    server->poller->emit_old_data_signal = 1;
+
+    rss_pool = get_rss();
+
+    fprintf(stderr, "* connecting %d\n", opt_conns);
+
+    start = ap_utils_clock_ns();
+
+    for ( opened = 0; opened < opt_conns || server->used_slots < opt_conns; )
+    {
+        while ( opened < opt_conns && opened - server->used_slots < MAX_IN_FLIGHT )
+        {
+            fds[opened] = client_connect(opened);
+
+            if ( fds[opened] == -1 )
+            {
+                fprintf(stderr, "! client %d: %s\n", opened, strerror(errno));
+                return 1;
+            }
+
+            ++opened;
+        }
+
+        poll_server(server);
+    }
+
+    sec = (ap_utils_clock_ns() - start) / 1e9;
+
+    rss_conns = get_rss();
+    slab_conns = get_slab();
+
+    bench_json_begin(out, "scale");
+    bench_json_str(out, "stage", "connect");
+    bench_json_int(out, "conns", opt_conns);
+    bench_json_num(out, "seconds", sec);
+    bench_json_num(out, "accepts_per_sec", opt_conns / sec);
+    bench_json_end(out);
+
+    bench_json_begin(out, "scale");
+    bench_json_str(out, "stage", "memory");
+    bench_json_int(out, "conns", opt_conns);
+    bench_json_int(out, "conn_buf_size", opt_bufsize);
+    bench_json_int(out, "pool_rss_bytes", rss_pool - rss_before);
+    bench_json_num(out, "pool_rss_bytes_per_conn", (double)(rss_conns - rss_before) / opt_conns);
+    bench_json_num(out, "kernel_slab_bytes_per_conn", (double)(slab_conns - slab_before) / opt_conns);
+    bench_json_end(out);
+
+    /* ------------------------------------------------------------ */
+    ap_utils_hist_clear(&poll_ns);
+
+    for ( i = 0; i < opt_idle_cycles; ++i )
+    {
+        start = ap_utils_clock_ns();
+        poll_server(server);
+        ap_utils_hist_add(&poll_ns, ap_utils_clock_ns() - start);
+    }
+
+    bench_json_begin(out, "scale");
+    bench_json_str(out, "stage", "idle");
+    bench_json_int(out, "conns", opt_conns);
+    bench_json_hist(out, "poll_ns", &poll_ns);
+    bench_json_num(out, "poll_ns_per_conn", (double)poll_ns.sum / poll_ns.count / opt_conns);
+    bench_json_end(out);
+
+    /* ------------------------------------------------------------ */
+    if ( opt_active > 0 )
+    {
+        for ( i = 0; i < opt_active; ++i ) /* spread over the whole range, so the pool slots are too */
+        {
+            memset(&active[i], 0, sizeof(client_t));
+            active[i].fd = fds[(long)i * opt_conns / opt_active];
+        }
+
+        ap_utils_hist_clear(&poll_ns);
+        ap_utils_hist_clear(&latency);
+        ops = polls = 0;
+
+        start = ap_utils_clock_ns();
+        end = start + (uint64_t)opt_duration * 1000000000;
+
+        for ( now = start; now < end; now = ap_utils_clock_ns() )
+        {
+            poll_server(server);
+            ap_utils_hist_add(&poll_ns, ap_utils_clock_ns() - now);
+            ++polls;
+
+            for ( i = 0; i < opt_active; ++i )
+                client_service(&active[i], &latency, &ops);
+        }
+
+        sec = (now - start) / 1e9;
+
+        bench_json_begin(out, "scale");
+        bench_json_str(out, "stage", "active");
+        bench_json_int(out, "conns", opt_conns);
+        bench_json_int(out, "active", opt_active);
+        bench_json_int(out, "size", opt_size);
+        bench_json_num(out, "seconds", sec);
+        bench_json_int(out, "ops", ops);
+        bench_json_num(out, "ops_per_sec", ops / sec);
+        bench_json_num(out, "polls_per_sec", polls / sec);
+        bench_json_hist(out, "poll_ns", &poll_ns);
+        bench_json_hist(out, "latency_ns", &latency);
+        bench_json_end(out);
+    }
+
+    /* ------------------------------------------------------------ */
+    fprintf(stderr, "* closing\n");
+
+    /* clients close first, so the server's port will not stay in TIME_WAIT */
+    for ( i = 0; i < opt_conns; ++i )
+        close(fds[i]);
+
+    start = ap_utils_clock_ns();
+
+    while ( server->used_slots > 0 && ap_utils_clock_ns() - start < 10000000000ull )
+        poll_server(server);
+
+    ap_net_conn_pool_destroy(server, 1);
+
+    free(fds);
+    free(active);
+    free(message);
+
+    return 0;
+}
@@ -0,0 +1,426 @@
+/** \file tools/ap_loadgen.c
+ * \brief Part of AP's toolkit. Open-loop load generator for request-response servers, built on the client connection pool
+ *
+ * Requests are issued on a fixed schedule that does not depend on the server's answers: either with constant
+ * interval or with Poisson arrivals (exponential intervals), round-robin over the connections.
+ * A slow server can't slow the load down this way, so the queueing delay it causes is seen in the numbers
+ * instead of being hidden (the "coordinated omission" of closed-loop clients).
+ *
+ * Each request is a payload of -s bytes, the answer is expected to be -R bytes (the payload size by default: echo server).
+ * The answers are matched to requests in order. Two latency histograms are reported:
+ *   latency      - from the time request was scheduled to be sent to the end of answer. This is what users see
+ *   service time - from the time request was actually handed to the kernel. This is what closed-loop tools report
+ *
+ * UDP: the connected socket receives only the answers coming from the address the requests were sent to.
+ * UDP requests without answer for -T milliseconds are counted as lost. TCP answers are waited for -T ms after the end of run.
+ *
+ * Usage: ap_loadgen [-p tcp|udp] [-h host] [-c conns] [-r rate] [-a const|poisson] [-s size] [-R answer_size]
+ *                   [-d seconds] [-W warmup_ms] [-T timeout_ms] [-j] port
+ *   -j - print results as one JSON object instead of the table
+ */
+#include "../ap_net/ap_net.h"
+#include "../ap_error/ap_error.h"
+#include <math.h>
+#include <unistd.h>
+
+/* requests queued on connection, but not answered yet */
+#define MAX_QUEUE 4096
+
+/** \brief per-connection state. attached to conn->user_data */
+typedef struct
+{
+    uint64_t intended_ns[MAX_QUEUE]; /* scheduled send times */
+    uint64_t sent_ns[MAX_QUEUE]; /* actual send times */
+    int head; /* next free */
+    int tail; /* oldest unanswered */
+    int unsent; /* index of the request being sent */
+    int send_off; /* bytes of the unsent request already sent */
+    int received; /* bytes of the current answer received so far */
+} lg_conn_t;
+
+/* options */
+int opt_is_tcp = 1;
+const char *opt_host = "127.0.0.1";
+int opt_conns = 1;
+double opt_rate = 1000;
+int opt_poisson = 0;
+int opt_size = 64;
+int opt_answer_size = -1;
+int opt_duration = 10;
+int opt_warmup_ms = 1000;
+int opt_timeout_ms = 1000;
+int opt_json = 0;
+int opt_port;
+
+char *payload;
+uint64_t measure_from_ns; /* the end of warm-up */
+int running; /* false on pool destroy */
+
+/* results */
+struct ap_utils_hist_t latency;
+struct ap_utils_hist_t service;
+uint64_t sent, answered, lost, queue_full, errors;
+
+/* ******************************************************* */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ap_loadgen [-p tcp|udp] [-h host] [-c conns] [-r rate] [-a const|poisson] [-s size] [-R answer_size]\n"
+        "\t[-d seconds] [-W warmup_ms] [-T timeout_ms] [-j] port\n");
+    exit(2);
+}
+
+/* ******************************************************* */
+#define queue_next(i) (((i) + 1) % MAX_QUEUE)
+
+/* ******************************************************* */
+/* answer of the oldest request is complete */
+static void complete_request(lg_conn_t *lc, uint64_t now)
+{
+    if ( lc->intended_ns[lc->tail] >= measure_from_ns )
+    {
+        ap_utils_hist_add(&latency, now - lc->intended_ns[lc->tail]);
+        ap_utils_hist_add(&service, now - lc->sent_ns[lc->tail]);
+        ++answered;
+    }
+
+    lc->tail = queue_next(lc->tail);
+}
+
+/* ******************************************************* */
+static int client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    lg_conn_t *lc;
+    uint64_t now;
+
+
+    lc = conn->user_data;
+
+    switch ( signal_type )
+    {
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            now = ap_utils_clock_ns();
+
+            if ( opt_is_tcp )
+                lc->received += conn->buffill - conn->bufpos;
+            else
+                lc->received = opt_answer_size; /* datagram is the whole answer */
+
+            while ( lc->received >= opt_answer_size && lc->tail != lc->unsent )
+            {
+                lc->received -= opt_answer_size;
+                complete_request(lc, now);
+            }
+
+            if ( lc->tail == lc->unsent ) /* nothing is expected anymore, the rest is garbage */
+                lc->received = 0;
+
+            conn->bufpos = conn->buffill = 0;
+            break;
+
+        case AP_NET_SIGNAL_CONN_CLOSING:
+            if ( running )
+                ++errors;
+            break;
+    }
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* pushes the queued requests to the socket as far as it takes them */
+static void flush_conn(struct ap_net_conn_pool_t *pool, struct ap_net_connection_t *conn, uint64_t now)
+{
+    lg_conn_t *lc;
+    int n;
+
+
+    lc = conn->user_data;
+
+    while ( lc->unsent != lc->head )
+    {
+        if ( lc->send_off == 0 )
+            lc->sent_ns[lc->unsent] = now;
+
+        n = ap_net_conn_pool_send(pool, conn->idx, payload + lc->send_off, opt_size - lc->send_off);
+
+        if ( n <= 0 )
+        {
+            if ( ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+                lc->unsent = lc->tail = lc->head; /* closed on error. the answers will never come */
+
+            return;
+        }
+
+        lc->send_off += n;
+
+        if ( lc->send_off < opt_size )
+            return;
+
+        if ( lc->intended_ns[lc->unsent] >= measure_from_ns )
+            ++sent;
+
+        lc->send_off = 0;
+        lc->unsent = queue_next(lc->unsent);
+    }
+}
+
+/* ******************************************************* */
+/* drops the requests with no answer for too long. now = 0 drops all */
+static void expire_requests(lg_conn_t *lc, uint64_t now)
+{
+    while ( lc->tail != lc->unsent && (now == 0 || now - lc->sent_ns[lc->tail] > (uint64_t)opt_timeout_ms * 1000000) )
+    {
+        if ( lc->intended_ns[lc->tail] >= measure_from_ns )
+            ++lost;
+
+        lc->tail = queue_next(lc->tail);
+        lc->received = 0;
+    }
+}
+
+/* ******************************************************* */
+/* nanoseconds till the next request */
+static uint64_t next_interval(void)
+{
+    if ( opt_poisson )
+        return (uint64_t)(-log(1.0 - drand48()) / opt_rate * 1e9);
+
+    return (uint64_t)(1e9 / opt_rate);
+}
+
+/* ******************************************************* */
+static void print_hist_row(const char *name, struct ap_utils_hist_t *h)
+{
+    if ( h->count == 0 )
+    {
+        printf("%-13s -\n", name);
+        return;
+    }
+
+    printf("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, h->min / 1e3, (double)h->sum / h->count / 1e3,
+        ap_utils_hist_percentile(h, 50.0) / 1e3, ap_utils_hist_percentile(h, 90.0) / 1e3, ap_utils_hist_percentile(h, 99.0) / 1e3,
+        ap_utils_hist_percentile(h, 99.9) / 1e3, ap_utils_hist_percentile(h, 99.99) / 1e3, h->max / 1e3);
+}
+
+/* ******************************************************* */
+static void print_hist_json(const char *name, struct ap_utils_hist_t *h)
+{
+    printf(",\"%s\":{\"count\":%llu", name, (unsigned long long)h->count);
+
+    if ( h->count > 0 )
+        printf(",\"min\":%llu,\"avg\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"p9999\":%llu,\"max\":%llu",
+            (unsigned long long)h->min, (double)h->sum / h->count,
+            (unsigned long long)ap_utils_hist_percentile(h, 50.0), (unsigned long long)ap_utils_hist_percentile(h, 90.0),
+            (unsigned long long)ap_utils_hist_percentile(h, 99.0), (unsigned long long)ap_utils_hist_percentile(h, 99.9),
+            (unsigned long long)ap_utils_hist_percentile(h, 99.99), (unsigned long long)h->max);
+
+    printf("}");
+}
+
+/* ******************************************************* */
+static void print_results(double seconds)
+{
+    if ( opt_json )
+    {
+        printf("{\"proto\":\"%s\",\"host\":\"%s\",\"port\":%d,\"conns\":%d,\"rate\":%.1f,\"arrivals\":\"%s\",\"size\":%d,\"answer_size\":%d,"
+            "\"seconds\":%.3f,\"sent\":%llu,\"sent_per_sec\":%.1f,\"answered\":%llu,\"lost\":%llu,\"queue_full\":%llu,\"errors\":%llu",
+            opt_is_tcp ? "tcp" : "udp", opt_host, opt_port, opt_conns, opt_rate, opt_poisson ? "poisson" : "const", opt_size, opt_answer_size,
+            seconds, (unsigned long long)sent, sent / seconds, (unsigned long long)answered, (unsigned long long)lost,
+            (unsigned long long)queue_full, (unsigned long long)errors);
+
+        print_hist_json("latency_ns", &latency);
+        print_hist_json("service_ns", &service);
+        printf("}\n");
+
+        return;
+    }
+
+    printf("%s %s:%d, %d conns, target %.1f req/s (%s), %d/%d bytes, %.1f s measured\n", opt_is_tcp ? "tcp" : "udp", opt_host, opt_port,
+        opt_conns, opt_rate, opt_poisson ? "poisson" : "const", opt_size, opt_answer_size, seconds);
+    printf("sent %llu (%.1f/s), answered %llu, lost %llu, queue full %llu, errors %llu\n", (unsigned long long)sent, sent / seconds,
+        (unsigned long long)answered, (unsigned long long)lost, (unsigned long long)queue_full, (unsigned long long)errors);
+    printf("%-13s %9s %9s %9s %9s %9s %9s %9s %9s\n", "usec", "min", "avg", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    print_hist_row("latency", &latency);
+    print_hist_row("service time", &service);
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    int i;
+    int rr;
+    int outstanding;
+    struct ap_net_conn_pool_t *pool;
+    struct ap_net_connection_t *conn;
+    lg_conn_t *lc;
+    uint64_t start, now, next_ns, send_end, drain_end;
+
+
+    while ( -1 != (opt = getopt(argc, argv, "p:h:c:r:a:s:R:d:W:T:j")) )
+    {
+        switch ( opt )
+        {
+            case 'p':
+                if ( strcmp(optarg, "tcp") != 0 && strcmp(optarg, "udp") != 0 )
+                    usage();
+
+                opt_is_tcp = strcmp(optarg, "tcp") == 0;
+                break;
+
+            case 'h': opt_host = optarg; break;
+            case 'c': opt_conns = atoi(optarg); break;
+            case 'r': opt_rate = atof(optarg); break;
+
+            case 'a':
+                if ( strcmp(optarg, "const") != 0 && strcmp(optarg, "poisson") != 0 )
+                    usage();
+
+                opt_poisson = strcmp(optarg, "poisson") == 0;
+                break;
+
+            case 's': opt_size = atoi(optarg); break;
+            case 'R': opt_answer_size = atoi(optarg); break;
+            case 'd': opt_duration = atoi(optarg); break;
+            case 'W': opt_warmup_ms = atoi(optarg); break;
+            case 'T': opt_timeout_ms = atoi(optarg); break;
+            case 'j': opt_json = 1; break;
+            default: usage();
+        }
+    }
+
+    if ( optind != argc - 1 )
+        usage();
+
+    opt_port = atoi(argv[optind]);
+
+    if ( opt_answer_size == -1 )
+        opt_answer_size = opt_size;
+
+    if ( opt_port <= 0 || opt_port > 65535 || opt_conns <= 0 || opt_rate <= 0 || opt_size <= 0 || opt_size > 65000
+         || opt_answer_size <= 0 || opt_duration <= 0 || opt_warmup_ms < 0 || opt_timeout_ms <= 0 )
+        usage();
+
+    payload = malloc(opt_size);
+
+    if ( payload == NULL )
+        return 1;
+
+    memset(payload, 'x', opt_size);
+
+    /* async pool: sends never block, so the schedule is kept */
+    pool = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_ASYNC | (opt_is_tcp ? AP_NET_POOL_FLAGS_TCP : 0), opt_conns, 0,
+        opt_answer_size > 65536 ? opt_answer_size : 65536, client_callback);
+
+    if ( pool == NULL || ! ap_net_conn_pool_poller_create(pool) )
+    {
+        fprintf(stderr, "! pool: %s\n", ap_error_get_string());
+        return 1;
+    }
+
+    for ( i = 0; i < opt_conns; ++i )
+    {
+        conn = ap_net_conn_pool_connect_straddr(pool, 0, opt_host, strchr(opt_host, ':') != NULL ? AF_INET6 : AF_INET, opt_port, 0);
+
+        if ( conn == NULL )
+        {
+            fprintf(stderr, "! connect to %s:%d: %s\n", opt_host, opt_port, ap_error_get_string());
+            return 1;
+        }
+
+        conn->user_data = calloc(1, sizeof(lg_conn_t));
+
+        if ( conn->user_data == NULL )
+            return 1;
+    }
+
+    srand48(getpid());
+    ap_utils_hist_clear(&latency);
+    ap_utils_hist_clear(&service);
+
+    start = ap_utils_clock_ns();
+    measure_from_ns = start + (uint64_t)opt_warmup_ms * 1000000;
+    send_end = measure_from_ns + (uint64_t)opt_duration * 1000000000;
+    drain_end = send_end + (uint64_t)opt_timeout_ms * 1000000;
+    next_ns = start;
+    rr = 0;
+    running = 1;
+
+    for (;;)
+    {
+        if ( ! ap_net_conn_pool_poll(pool) )
+        {
+            fprintf(stderr, "! poll: %s\n", ap_error_get_string());
+            return 1;
+        }
+
+        now = ap_utils_clock_ns();
+
+        for ( ; next_ns <= now && next_ns < send_end; next_ns += next_interval() ) /* all that are due, even if late */
+        {
+            conn = &pool->conns[rr];
+            rr = (rr + 1) % opt_conns;
+
+            if ( ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+            {
+                if ( next_ns >= measure_from_ns )
+                    ++errors;
+
+                continue;
+            }
+
+            lc = conn->user_data;
+
+            if ( queue_next(lc->head) == lc->tail )
+            {
+                if ( next_ns >= measure_from_ns )
+                    ++queue_full;
+
+                continue;
+            }
+
+            lc->intended_ns[lc->head] = next_ns;
+            lc->head = queue_next(lc->head);
+        }
+
+        outstanding = 0;
+
+        for ( i = 0; i < opt_conns; ++i )
+        {
+            conn = &pool->conns[i];
+
+            if ( ! bit_is_set(conn->state, AP_NET_ST_CONNECTED) )
+                continue;
+
+            lc = conn->user_data;
+
+            flush_conn(pool, conn, now);
+
+            if ( ! opt_is_tcp ) /* TCP answers come in order, so they are waited for till the end */
+                expire_requests(lc, now);
+
+            outstanding += lc->head != lc->tail;
+        }
+
+        if ( now >= drain_end || (now >= send_end && outstanding == 0) )
+            break;
+    }
+
+    running = 0;
+
+    for ( i = 0; i < opt_conns; ++i ) /* still unanswered at the end of drain period */
+        if ( pool->conns[i].user_data != NULL )
+            expire_requests(pool->conns[i].user_data, 0);
+
+    print_results((send_end - measure_from_ns) / 1e9);
+
+    for ( i = 0; i < pool->max_connections; ++i )
+    {
+        free(pool->conns[i].user_data);
+        pool->conns[i].user_data = NULL;
+    }
+
+    ap_net_conn_pool_destroy(pool, 1);
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/** \file tools/ap_netstat.c
+ * \brief Part of AP's toolkit. Shows statistics published by ap_net_conn_pool_shm_export() of running process
+ *
+ * Usage: ap_netstat [-c] [-i seconds] [-n count] /segment_name
+ *   -c - show connections list too (exporter should use AP_NET_SHM_CONNS flag)
+ *   -i - refresh interval. default is 1 second
+ *   -n - exit after this many refreshes. default is to run until interrupted
+ */
+#include "../ap_net/ap_net.h"
+#include "../ap_error/ap_error.h"
+#include <unistd.h>
+
+/* ******************************************************* */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ap_netstat [-c] [-i seconds] [-n count] /segment_name\n");
+    exit(2);
+}
+
+/* ******************************************************* */
+/* per-second rate of counter change */
+static double rate(uint64_t now, uint64_t before, double seconds)
+{
+    return seconds > 0 ? (now - before) / seconds : 0;
+}
+
+/* ******************************************************* */
+static void print_totals(struct ap_net_shm_t *shm)
+{
+    struct ap_net_stat_t *st;
+
+
+    st = &shm->stat;
+
+    printf("pid %d, conns: %d/%d, lifetime: %u, timed out: %u, queue full: %u\n",
+        shm->pid, shm->used_slots, shm->max_connections, st->conn_count, st->timedout, st->queue_full_count);
+
+    printf("total: in %llu bytes/%llu msgs, out %llu bytes/%llu msgs, partial sends %llu, EAGAIN in/out %llu/%llu, buffer full %llu, errors %llu\n",
+        (unsigned long long)st->bytes_in, (unsigned long long)st->msgs_in,
+        (unsigned long long)st->bytes_out, (unsigned long long)st->msgs_out,
+        (unsigned long long)st->partial_sends, (unsigned long long)st->eagain_in, (unsigned long long)st->eagain_out,
+        (unsigned long long)st->buf_full, (unsigned long long)st->errors);
+}
+
+/* ******************************************************* */
+static void print_rates(struct ap_net_shm_t *cur, struct ap_net_shm_t *prev)
+{
+    double dt;
+    struct ap_net_stat_t *a;
+    struct ap_net_stat_t *b;
+
+
+    a = &cur->stat;
+    b = &prev->stat;
+
+    dt = (cur->publish_ns - prev->publish_ns) / 1e9;
+
+    printf("%5d %8.1f %10.0f %8.1f %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f %6.1f\n", cur->used_slots,
+        rate(a->conn_count, b->conn_count, dt),
+        rate(a->bytes_in, b->bytes_in, dt), rate(a->msgs_in, b->msgs_in, dt),
+        rate(a->bytes_out, b->bytes_out, dt), rate(a->msgs_out, b->msgs_out, dt),
+        rate(a->recv_calls, b->recv_calls, dt), rate(a->send_calls, b->send_calls, dt),
+        rate(a->epoll_calls, b->epoll_calls, dt), rate(a->accept_calls, b->accept_calls, dt),
+        rate(a->errors, b->errors, dt));
+}
+
+/* ******************************************************* */
+static void print_conns(struct ap_net_shm_t *shm)
+{
+    int i;
+    char addr[INET6_ADDRSTRLEN];
+    struct ap_net_shm_conn_t *c;
+
+
+    printf("%5s %5s %-40s %6s %8s %10s %4s\n", "idx", "fd", "remote", "port", "buffered", "age ms", "st");
+
+    for ( i = 0; i < shm->conns_count; ++i )
+    {
+        c = &shm->conns[i];
+
+        if ( NULL == inet_ntop(c->af, c->remote_addr, addr, sizeof(addr)) )
+            strcpy(addr, "?");
+
+        printf("%5d %5d %-40s %6u %8d %10llu %4x\n", c->idx, c->fd, addr, c->remote_port, c->buffered,
+            (unsigned long long)c->age_ms, c->state);
+    }
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    int show_conns;
+    int interval;
+    int count;
+    int i;
+    size_t size;
+    struct ap_net_shm_t *shm;
+    struct ap_net_shm_t *cur;
+    struct ap_net_shm_t *prev;
+    struct ap_net_shm_t *tmp;
+
+
+    show_conns = 0;
+    interval = 1;
+    count = 0;
+
+    while ( -1 != (opt = getopt(argc, argv, "ci:n:")) )
+    {
+        switch ( opt )
+        {
+            case 'c':
+                show_conns = 1;
+                break;
+
+            case 'i':
+                interval = atoi(optarg);
+                break;
+
+            case 'n':
+                count = atoi(optarg);
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    if ( optind != argc - 1 || interval <= 0 || count < 0 )
+        usage();
+
+    shm = ap_net_shm_attach(argv[optind], &size);
+
+    if ( shm == NULL )
+    {
+        fprintf(stderr, "%s\n", ap_error_get_string());
+        return 1;
+    }
+
+    cur = malloc(size);
+    prev = malloc(size);
+
+    if ( cur == NULL || prev == NULL )
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if ( ! ap_net_shm_snapshot(shm, size, prev) )
+    {
+        fprintf(stderr, "Failed to get consistent snapshot\n");
+        return 1;
+    }
+
+    print_totals(prev);
+
+    for ( i = 0; count == 0 || i < count; ++i )
+    {
+        sleep(interval);
+
+        if ( ! ap_net_shm_snapshot(shm, size, cur) )
+            continue;
+
+        if ( cur->publish_count == prev->publish_count )
+        {
+            printf("no updates. the process is stuck or gone\n");
+            continue;
+        }
+
+        if ( i % 20 == 0 )
+            printf("%5s %8s %10s %8s %10s %8s %8s %8s %8s %8s %6s\n", "conns", "new/s", "in B/s", "msg/s",
+                "out B/s", "msg/s", "recv/s", "send/s", "epoll/s", "acpt/s", "err/s");
+
+        print_rates(cur, prev);
+
+        if ( show_conns )
+            print_conns(cur);
+
+        fflush(stdout);
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    ap_net_shm_detach(shm, size);
+
+    return 0;
+}
@@ -0,0 +1,960 @@
+/** \file tools/ap_replay.c
+ * \brief Part of AP's toolkit. Replays the client side of captured TCP/UDP sessions against a server
+ *
+ * Reads pcapng (as written by ap_net_conn_pool_capture_start(), Wireshark or dumpcap) or classic pcap (tcpdump) file.
+ * Link types: raw IP, Ethernet, Linux cooked v1/v2 and BSD loopback. IP fragments and TCP options do not matter,
+ * TCP retransmissions are dropped by the sequence numbers.
+ *
+ * Sessions are told apart by addresses and ports. The client is the side that sent SYN or, for UDP, the first datagram.
+ * With -s the server is the side with this port, and only its sessions are replayed.
+ * Each session is connected to host:port at the time of its first packet, and the client's payloads are sent
+ * at their captured times divided by -x speed factor. -x 0 sends everything as fast as the server takes it.
+ * The answers are counted and discarded. The session is closed when the captured amount of answer is received
+ * or -T milliseconds after its last send.
+ *
+ * Reported: sessions replayed and failed, bytes sent, bytes received against captured, and two histograms:
+ *   response  - from the send to the first byte of the answer after it
+ *   send lag  - how late the sends were against the schedule. Large values mean the replay did not keep up
+ *
+ * Usage: ap_replay [-h host] [-x speed] [-s server_port] [-c max_conns] [-T linger_ms] [-j] capture_file port
+ *   -j - print results as one JSON object instead of the table
+ */
+#include "../ap_net/ap_net.h"
+#include "../ap_error/ap_error.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* session states */
+#define RP_WAITING 0
+#define RP_ACTIVE  1
+#define RP_DONE    2
+#define RP_FAILED  3
+#define RP_IGNORED 4
+
+#define HASH_SIZE 65536
+
+/** \brief client's payload to send */
+typedef struct
+{
+    uint64_t time_ns; /* since the start of capture */
+    long off; /* in payloads */
+    int len;
+} rp_send_t;
+
+/** \brief captured session. attached to conn->user_data while replayed */
+typedef struct
+{
+    int next_in_hash;
+    int is_tcp;
+    int af;
+    unsigned char client_ip[16];
+    unsigned char server_ip[16];
+    int client_port;
+    int server_port;
+    int seq_known; /* TCP: client's next_seq is valid */
+    uint32_t next_seq;
+    rp_send_t *sends;
+    int sends_count;
+    int sends_size;
+    uint64_t start_ns; /* first packet, since the start of capture */
+    uint64_t expected_in; /* server's payload bytes captured */
+
+    /* replay state */
+    int state; /* RP_* */
+    struct ap_net_connection_t *conn;
+    int next_send;
+    int send_off; /* bytes of the current send already sent */
+    uint64_t received;
+    uint64_t pending_since; /* first send not answered yet */
+    uint64_t last_send_ns; /* when the last payload went out */
+} rp_session_t;
+
+/* options */
+const char *opt_host = "127.0.0.1";
+double opt_speed = 1.0;
+int opt_server_port = 0;
+int opt_conns = 1000;
+int opt_linger_ms = 1000;
+int opt_json = 0;
+int opt_port;
+const char *opt_file;
+
+/* capture */
+rp_session_t *sessions;
+int sessions_count;
+int sessions_size;
+int hash[HASH_SIZE];
+char *payloads;
+long payloads_len;
+long payloads_size;
+uint64_t first_ts; /* the first packet's time. 0 if none yet */
+uint64_t last_ts;
+uint64_t packets;
+uint64_t skipped; /* not IP, not TCP/UDP, fragments */
+
+/* replay */
+int running;
+uint64_t bytes_sent, bytes_received, bytes_expected;
+int replayed, failed, closed_early;
+struct ap_utils_hist_t response;
+struct ap_utils_hist_t send_lag;
+
+/* ******************************************************* */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ap_replay [-h host] [-x speed] [-s server_port] [-c max_conns] [-T linger_ms] [-j] capture_file port\n");
+    exit(2);
+}
+
+/* ******************************************************* */
+static unsigned get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* file's byte order */
+static uint32_t file32(const unsigned char *p, int swap)
+{
+    uint32_t v;
+
+
+    memcpy(&v, p, 4);
+
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static unsigned file16(const unsigned char *p, int swap)
+{
+    uint16_t v;
+
+
+    memcpy(&v, p, 2);
+
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+/* ******************************************************* */
+static unsigned session_hash(int is_tcp, int ip_len, const unsigned char *a, int a_port, const unsigned char *b, int b_port)
+{
+    unsigned h;
+    int i;
+
+
+    /* symmetric, so both directions land in the same bucket */
+    h = is_tcp + a_port + b_port;
+
+    for ( i = 0; i < ip_len; ++i )
+        h += (a[i] + b[i]) * (i + 1) * 2654435761u;
+
+    return (h ^ (h >> 16)) % HASH_SIZE;
+}
+
+/* ******************************************************* */
+/* finds the session. *from_client is set to the direction of packet */
+static rp_session_t *session_find(int is_tcp, int af, const unsigned char *src, int sport, const unsigned char *dst, int dport, int *from_client)
+{
+    rp_session_t *s;
+    int i;
+    int ip_len;
+
+
+    ip_len = af == AF_INET6 ? 16 : 4;
+
+    for ( i = hash[session_hash(is_tcp, ip_len, src, sport, dst, dport)]; i != -1; i = s->next_in_hash )
+    {
+        s = &sessions[i];
+
+        if ( s->is_tcp != is_tcp || s->af != af )
+            continue;
+
+        if ( s->client_port == sport && s->server_port == dport && 0 == memcmp(s->client_ip, src, ip_len) && 0 == memcmp(s->server_ip, dst, ip_len) )
+        {
+            *from_client = 1;
+            return s;
+        }
+
+        if ( s->client_port == dport && s->server_port == sport && 0 == memcmp(s->client_ip, dst, ip_len) && 0 == memcmp(s->server_ip, src, ip_len) )
+        {
+            *from_client = 0;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/* ******************************************************* */
+static rp_session_t *session_new(int is_tcp, int af, const unsigned char *client, int client_port, const unsigned char *server, int server_port, uint64_t ts)
+{
+    rp_session_t *s;
+    void *new_mem;
+    unsigned h;
+    int ip_len;
+
+
+    if ( sessions_count == sessions_size )
+    {
+        new_mem = realloc(sessions, (sessions_size * 2 + 256) * sizeof(rp_session_t));
+
+        if ( new_mem == NULL )
+            return NULL;
+
+        sessions = new_mem;
+        sessions_size = sessions_size * 2 + 256;
+    }
+
+    ip_len = af == AF_INET6 ? 16 : 4;
+
+    s = &sessions[sessions_count];
+    memset(s, 0, sizeof(rp_session_t));
+
+    s->is_tcp = is_tcp;
+    s->af = af;
+    memcpy(s->client_ip, client, ip_len);
+    memcpy(s->server_ip, server, ip_len);
+    s->client_port = client_port;
+    s->server_port = server_port;
+    s->start_ns = ts - first_ts;
+    s->state = opt_server_port == 0 || opt_server_port == server_port ? RP_WAITING : RP_IGNORED;
+
+    /* the newest goes first, so the port reuse finds the new session */
+    h = session_hash(is_tcp, ip_len, client, client_port, server, server_port);
+    s->next_in_hash = hash[h];
+    hash[h] = sessions_count;
+
+    return &sessions[sessions_count++];
+}
+
+/* ******************************************************* */
+static int session_add_send(rp_session_t *s, uint64_t ts, const unsigned char *data, int len)
+{
+    void *new_mem;
+
+
+    if ( s->sends_count == s->sends_size )
+    {
+        new_mem = realloc(s->sends, (s->sends_size * 2 + 8) * sizeof(rp_send_t));
+
+        if ( new_mem == NULL )
+            return 0;
+
+        s->sends = new_mem;
+        s->sends_size = s->sends_size * 2 + 8;
+    }
+
+    if ( payloads_len + len > payloads_size )
+    {
+        new_mem = realloc(payloads, payloads_size * 2 + len + 65536);
+
+        if ( new_mem == NULL )
+            return 0;
+
+        payloads = new_mem;
+        payloads_size = payloads_size * 2 + len + 65536;
+    }
+
+    s->sends[s->sends_count].time_ns = ts - first_ts;
+    s->sends[s->sends_count].off = payloads_len;
+    s->sends[s->sends_count].len = len;
+    ++s->sends_count;
+
+    memcpy(payloads + payloads_len, data, len);
+    payloads_len += len;
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* one IP packet */
+static int parse_ip(const unsigned char *p, int len, uint64_t ts)
+{
+    rp_session_t *s;
+    const unsigned char *src;
+    const unsigned char *dst;
+    const unsigned char *l4;
+    int af;
+    int proto;
+    int l4_len;
+    int sport, dport;
+    int hdr_len;
+    int from_client;
+    int is_tcp;
+    unsigned flags;
+    uint32_t seq;
+    int32_t diff;
+
+
+    if ( len < 20 )
+        return 0;
+
+    if ( (p[0] >> 4) == 4 )
+    {
+        hdr_len = (p[0] & 15) * 4;
+
+        if ( hdr_len < 20 || len < hdr_len || (get16(p + 6) & 0x3fff) != 0 ) /* fragments are not reassembled */
+            return 0;
+
+        af = AF_INET;
+        proto = p[9];
+        src = p + 12;
+        dst = p + 16;
+        l4_len = get16(p + 2) - hdr_len; /* not the captured length: Ethernet may pad short frames */
+    }
+    else if ( (p[0] >> 4) == 6 && len >= 40 )
+    {
+        hdr_len = 40;
+        af = AF_INET6;
+        proto = p[6];
+        src = p + 8;
+        dst = p + 24;
+        l4_len = get16(p + 4);
+    }
+    else
+        return 0;
+
+    l4 = p + hdr_len;
+
+    if ( l4_len > len - hdr_len ) /* snapped */
+        l4_len = len - hdr_len;
+
+    if ( proto == IPPROTO_TCP )
+    {
+        if ( l4_len < 20 || l4_len < (l4[12] >> 4) * 4 )
+            return 0;
+
+        is_tcp = 1;
+        flags = l4[13];
+        seq = get32(l4 + 4);
+        hdr_len = (l4[12] >> 4) * 4;
+    }
+    else if ( proto == IPPROTO_UDP )
+    {
+        if ( l4_len < 8 )
+            return 0;
+
+        is_tcp = 0;
+        flags = 0;
+        seq = 0;
+        hdr_len = 8;
+    }
+    else
+        return 0;
+
+    sport = get16(l4);
+    dport = get16(l4 + 2);
+    l4 += hdr_len;
+    l4_len -= hdr_len;
+
+    if ( first_ts == 0 )
+        first_ts = ts;
+
+    last_ts = ts;
+
+    s = session_find(is_tcp, af, src, sport, dst, dport, &from_client);
+
+    /* SYN on the finished session: the ports are reused */
+    if ( s != NULL && is_tcp && (flags & 0x12) == 0x02 && (s->sends_count > 0 || s->expected_in > 0) )
+        s = NULL;
+
+    if ( s == NULL )
+    {
+        if ( is_tcp && (flags & 0x12) == 0x12 ) /* SYN-ACK: the sender is server */
+            from_client = 0;
+        else if ( (is_tcp && (flags & 0x12) == 0x02) || opt_server_port == 0 ) /* SYN or the first datagram */
+            from_client = 1;
+        else if ( dport == opt_server_port )
+            from_client = 1;
+        else if ( sport == opt_server_port )
+            from_client = 0;
+        else
+            from_client = 1;
+
+        s = from_client ? session_new(is_tcp, af, src, sport, dst, dport, ts) : session_new(is_tcp, af, dst, dport, src, sport, ts);
+
+        if ( s == NULL )
+            return -1;
+    }
+
+    if ( ! from_client )
+    {
+        s->expected_in += l4_len;
+        return 1;
+    }
+
+    if ( is_tcp )
+    {
+        if ( flags & 0x02 ) /* SYN takes one sequence number */
+        {
+            s->next_seq = seq + 1;
+            s->seq_known = 1;
+            return 1;
+        }
+
+        if ( s->seq_known )
+        {
+            diff = (int32_t)(s->next_seq - seq);
+
+            if ( diff > 0 ) /* retransmission or overlap */
+            {
+                if ( diff >= l4_len )
+                    return 1;
+
+                l4 += diff;
+                l4_len -= diff;
+                seq += diff;
+            }
+        }
+
+        s->next_seq = seq + l4_len;
+        s->seq_known = 1;
+    }
+
+    if ( l4_len > 0 && ! session_add_send(s, ts, l4, l4_len) )
+        return -1;
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* link layer frame */
+static int parse_frame(int linktype, const unsigned char *p, int len, uint64_t ts)
+{
+    int off;
+    int ret;
+    unsigned ethertype;
+
+
+    ++packets;
+
+    switch ( linktype )
+    {
+        case 101: /* raw IP */
+        case 228: /* IPv4 */
+        case 229: /* IPv6 */
+        case 12: /* raw IP on some BSDs */
+            off = 0;
+            break;
+
+        case 0: /* BSD loopback: 4 bytes of address family */
+            off = 4;
+            break;
+
+        case 1: /* Ethernet */
+            if ( len < 14 )
+            {
+                ++skipped;
+                return 0;
+            }
+
+            off = 12;
+            ethertype = get16(p + off);
+
+            while ( (ethertype == 0x8100 || ethertype == 0x88a8) && len >= off + 6 ) /* VLAN tags */
+            {
+                off += 4;
+                ethertype = get16(p + off);
+            }
+
+            off += 2;
+
+            if ( ethertype != 0x0800 && ethertype != 0x86dd )
+            {
+                ++skipped;
+                return 0;
+            }
+
+            break;
+
+        case 113: /* Linux cooked */
+            off = 16;
+            break;
+
+        case 276: /* Linux cooked v2 */
+            off = 20;
+            break;
+
+        default:
+            ++skipped;
+            return 0;
+    }
+
+    if ( len <= off )
+    {
+        ++skipped;
+        return 0;
+    }
+
+    ret = parse_ip(p + off, len - off, ts);
+
+    if ( ret == 0 )
+        ++skipped;
+
+    return ret;
+}
+
+/* ******************************************************* */
+/* classic pcap */
+static int parse_pcap(const unsigned char *data, size_t size)
+{
+    uint32_t magic;
+    int swap;
+    int nsec;
+    int linktype;
+    size_t pos;
+    uint32_t caplen;
+    uint64_t ts;
+
+
+    memcpy(&magic, data, 4);
+
+    swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    linktype = file32(data + 20, swap) & 0xffff;
+
+    for ( pos = 24; pos + 16 <= size; pos += 16 + caplen )
+    {
+        caplen = file32(data + pos + 8, swap);
+
+        if ( pos + 16 + caplen > size )
+            break;
+
+        ts = (uint64_t)file32(data + pos, swap) * 1000000000ull + (uint64_t)file32(data + pos + 4, swap) * (nsec ? 1 : 1000);
+
+        if ( -1 == parse_frame(linktype, data + pos + 16, caplen, ts) )
+            return 0;
+    }
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* pcapng: section headers, interface descriptions and enhanced packets. the rest is skipped */
+static int parse_pcapng(const unsigned char *data, size_t size)
+{
+    int linktypes[256];
+    uint64_t units[256]; /* timestamp units per second */
+    int interfaces;
+    int swap;
+    size_t pos;
+    size_t opt;
+    uint32_t type;
+    uint32_t len;
+    uint32_t iface;
+    uint64_t ts;
+    unsigned code, opt_len;
+    int i;
+
+
+    swap = 0;
+    interfaces = 0;
+
+    for ( pos = 0; pos + 12 <= size; pos += len )
+    {
+        memcpy(&type, data + pos, 4);
+
+        if ( type == 0x0A0D0D0A ) /* section header: byte order may change */
+        {
+            swap = file32(data + pos + 8, 0) != 0x1A2B3C4D;
+            interfaces = 0;
+        }
+
+        len = file32(data + pos + 4, swap);
+        type = file32(data + pos, swap);
+
+        if ( len < 12 || pos + len > size )
+            break;
+
+        if ( type == 1 && interfaces < 256 ) /* interface description */
+        {
+            linktypes[interfaces] = file16(data + pos + 8, swap);
+            units[interfaces] = 1000000;
+
+            for ( opt = pos + 16; opt + 4 <= pos + len - 4; opt += 4 + ((opt_len + 3) & ~3u) )
+            {
+                code = file16(data + opt, swap);
+                opt_len = file16(data + opt + 2, swap);
+
+                if ( code == 0 )
+                    break;
+
+                if ( code == 9 && opt_len >= 1 ) /* if_tsresol */
+                {
+                    units[interfaces] = 1;
+
+                    for ( i = 0; i < (data[opt + 4] & 0x7f); ++i )
+                        units[interfaces] *= (data[opt + 4] & 0x80) ? 2 : 10;
+                }
+            }
+
+            ++interfaces;
+        }
+        else if ( type == 6 && len >= 32 ) /* enhanced packet */
+        {
+            iface = file32(data + pos + 8, swap);
+
+            if ( iface >= (uint32_t)interfaces || 28 + file32(data + pos + 20, swap) > len )
+                continue;
+
+            ts = ((uint64_t)file32(data + pos + 12, swap) << 32) | file32(data + pos + 16, swap);
+            ts = ts / units[iface] * 1000000000ull + ts % units[iface] * 1000000000ull / units[iface];
+
+            if ( -1 == parse_frame(linktypes[iface], data + pos + 28, file32(data + pos + 20, swap), ts) )
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* ******************************************************* */
+static int load_capture(const char *file_name)
+{
+    unsigned char *data;
+    struct stat st;
+    uint32_t magic;
+    int fd;
+    int ok;
+    ssize_t n;
+    size_t got;
+
+
+    fd = open(file_name, O_RDONLY);
+
+    if ( fd == -1 || -1 == fstat(fd, &st) || st.st_size < 24 || NULL == (data = malloc(st.st_size)) )
+    {
+        fprintf(stderr, "! %s: %s\n", file_name, fd == -1 ? strerror(errno) : "can't read");
+        return 0;
+    }
+
+    for ( got = 0; got < (size_t)st.st_size; got += n )
+        if ( 0 >= (n = read(fd, data + got, st.st_size - got)) )
+            break;
+
+    close(fd);
+
+    memset(hash, -1, sizeof(hash));
+    memcpy(&magic, data, 4);
+
+    if ( magic == 0x0A0D0D0A )
+        ok = parse_pcapng(data, got);
+    else if ( magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1 )
+        ok = parse_pcap(data, got);
+    else
+    {
+        fprintf(stderr, "! %s: not a pcap or pcapng file\n", file_name);
+        ok = 0;
+    }
+
+    free(data);
+
+    return ok;
+}
+
+/* ******************************************************* */
+static int client_callback(struct ap_net_connection_t *conn, int signal_type)
+{
+    rp_session_t *s;
+
+
+    s = conn->user_data;
+
+    if ( s == NULL )
+        return 1;
+
+    switch ( signal_type )
+    {
+        case AP_NET_SIGNAL_CONN_DATA_IN:
+            s->received += conn->buffill - conn->bufpos;
+            bytes_received += conn->buffill - conn->bufpos;
+            conn->bufpos = conn->buffill = 0;
+
+            if ( s->pending_since != 0 )
+            {
+                ap_utils_hist_add(&response, ap_utils_clock_ns() - s->pending_since);
+                s->pending_since = 0;
+            }
+
+            break;
+
+        case AP_NET_SIGNAL_CONN_CLOSING:
+            if ( running && s->next_send < s->sends_count )
+                ++closed_early;
+
+            s->state = RP_DONE;
+            s->conn = NULL;
+            conn->user_data = NULL;
+            break;
+    }
+
+    return 1;
+}
+
+/* ******************************************************* */
+/* sends what is due. replay_ns is the capture time we are at */
+static void session_service(rp_session_t *s, uint64_t now, uint64_t start, uint64_t replay_ns)
+{
+    rp_send_t *snd;
+    struct ap_net_conn_pool_t *pool;
+    int n;
+
+
+    pool = s->conn->parent;
+
+    while ( s->state == RP_ACTIVE && s->next_send < s->sends_count )
+    {
+        snd = &s->sends[s->next_send];
+
+        if ( opt_speed > 0 && snd->time_ns > replay_ns )
+            return;
+
+        n = ap_net_conn_pool_send(pool, s->conn->idx, payloads + snd->off + s->send_off, snd->len - s->send_off);
+
+        if ( s->state != RP_ACTIVE ) /* closed on error */
+            return;
+
+        if ( n <= 0 )
+            return;
+
+        if ( s->send_off == 0 )
+        {
+            ap_utils_hist_add(&send_lag, opt_speed > 0 && start + snd->time_ns / opt_speed < now ? now - start - snd->time_ns / opt_speed : 0);
+
+            if ( s->pending_since == 0 )
+                s->pending_since = now;
+        }
+
+        s->send_off += n;
+        bytes_sent += n;
+
+        if ( s->send_off < snd->len )
+            return;
+
+        s->send_off = 0;
+        ++s->next_send;
+        s->last_send_ns = now;
+    }
+
+    if ( s->state == RP_ACTIVE && s->next_send == s->sends_count
+         && (s->received >= s->expected_in || now - s->last_send_ns > (uint64_t)opt_linger_ms * 1000000) )
+    {
+        ap_net_conn_pool_close_connection(pool, s->conn->idx);
+        s->state = RP_DONE;
+    }
+}
+
+/* ******************************************************* */
+static void print_hist_row(const char *name, struct ap_utils_hist_t *h)
+{
+    if ( h->count == 0 )
+    {
+        printf("%-13s -\n", name);
+        return;
+    }
+
+    printf("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, h->min / 1e3, (double)h->sum / h->count / 1e3,
+        ap_utils_hist_percentile(h, 50.0) / 1e3, ap_utils_hist_percentile(h, 90.0) / 1e3, ap_utils_hist_percentile(h, 99.0) / 1e3,
+        ap_utils_hist_percentile(h, 99.9) / 1e3, ap_utils_hist_percentile(h, 99.99) / 1e3, h->max / 1e3);
+}
+
+/* ******************************************************* */
+static void print_hist_json(const char *name, struct ap_utils_hist_t *h)
+{
+    printf(",\"%s\":{\"count\":%llu", name, (unsigned long long)h->count);
+
+    if ( h->count > 0 )
+        printf(",\"min\":%llu,\"avg\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"p9999\":%llu,\"max\":%llu",
+            (unsigned long long)h->min, (double)h->sum / h->count,
+            (unsigned long long)ap_utils_hist_percentile(h, 50.0), (unsigned long long)ap_utils_hist_percentile(h, 90.0),
+            (unsigned long long)ap_utils_hist_percentile(h, 99.0), (unsigned long long)ap_utils_hist_percentile(h, 99.9),
+            (unsigned long long)ap_utils_hist_percentile(h, 99.99), (unsigned long long)h->max);
+
+    printf("}");
+}
+
+/* ******************************************************* */
+static void print_results(int total, double captured_sec, double seconds)
+{
+    if ( opt_json )
+    {
+        printf("{\"file\":\"%s\",\"host\":\"%s\",\"port\":%d,\"speed\":%.3f,\"packets\":%llu,\"skipped\":%llu,\"sessions\":%d,"
+            "\"replayed\":%d,\"failed\":%d,\"closed_early\":%d,\"captured_seconds\":%.3f,\"seconds\":%.3f,"
+            "\"bytes_sent\":%llu,\"bytes_received\":%llu,\"bytes_expected\":%llu",
+            opt_file, opt_host, opt_port, opt_speed, (unsigned long long)packets, (unsigned long long)skipped, total,
+            replayed, failed, closed_early, captured_sec, seconds,
+            (unsigned long long)bytes_sent, (unsigned long long)bytes_received, (unsigned long long)bytes_expected);
+
+        print_hist_json("response_ns", &response);
+        print_hist_json("send_lag_ns", &send_lag);
+        printf("}\n");
+
+        return;
+    }
+
+    printf("%s: %llu packets (%llu skipped), %d sessions, %.3f s captured\n", opt_file, (unsigned long long)packets,
+        (unsigned long long)skipped, total, captured_sec);
+    printf("replayed to %s:%d at x%.2f in %.3f s: %d sessions, %d failed, %d closed early\n", opt_host, opt_port, opt_speed, seconds,
+        replayed, failed, closed_early);
+    printf("sent %llu bytes, received %llu of %llu captured\n", (unsigned long long)bytes_sent,
+        (unsigned long long)bytes_received, (unsigned long long)bytes_expected);
+    printf("%-13s %9s %9s %9s %9s %9s %9s %9s %9s\n", "usec", "min", "avg", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    print_hist_row("response", &response);
+    print_hist_row("send lag", &send_lag);
+}
+
+/* ******************************************************* */
+int main(int argc, char **argv)
+{
+    int opt;
+    int i;
+    int total;
+    int next_start;
+    int active;
+    int af;
+    struct ap_net_conn_pool_t *pools[2]; /* UDP, TCP */
+    struct ap_net_connection_t *conn;
+    rp_session_t *s;
+    uint64_t start, now, replay_ns;
+
+
+    while ( -1 != (opt = getopt(argc, argv, "h:x:s:c:T:j")) )
+    {
+        switch ( opt )
+        {
+            case 'h': opt_host = optarg; break;
+            case 'x': opt_speed = atof(optarg); break;
+            case 's': opt_server_port = atoi(optarg); break;
+            case 'c': opt_conns = atoi(optarg); break;
+            case 'T': opt_linger_ms = atoi(optarg); break;
+            case 'j': opt_json = 1; break;
+            default: usage();
+        }
+    }
+
+    if ( optind != argc - 2 )
+        usage();
+
+    opt_file = argv[optind];
+    opt_port = atoi(argv[optind + 1]);
+
+    if ( opt_port <= 0 || opt_port > 65535 || opt_speed < 0 || opt_conns <= 0 || opt_linger_ms < 0 )
+        usage();
+
+    if ( ! load_capture(opt_file) )
+        return 1;
+
+    total = 0;
+    pools[0] = pools[1] = NULL;
+
+    for ( i = 0; i < sessions_count; ++i )
+    {
+        if ( sessions[i].state == RP_IGNORED )
+            continue;
+
+        ++total;
+        bytes_expected += sessions[i].expected_in;
+
+        if ( pools[sessions[i].is_tcp] == NULL )
+        {
+            /* async pool: sends never block, so the schedule is kept */
+            pools[sessions[i].is_tcp] = ap_net_conn_pool_create(AP_NET_POOL_FLAGS_ASYNC | (sessions[i].is_tcp ? AP_NET_POOL_FLAGS_TCP : 0),
+                opt_conns, 0, 65536, client_callback);
+
+            if ( pools[sessions[i].is_tcp] == NULL || ! ap_net_conn_pool_poller_create(pools[sessions[i].is_tcp]) )
+            {
+                fprintf(stderr, "! pool: %s\n", ap_error_get_string());
+                return 1;
+            }
+        }
+    }
+
+    ap_utils_hist_clear(&response);
+    ap_utils_hist_clear(&send_lag);
+
+    af = strchr(opt_host, ':') != NULL ? AF_INET6 : AF_INET;
+    start = ap_utils_clock_ns();
+    next_start = 0;
+    running = 1;
+
+    for (;;)
+    {
+        now = ap_utils_clock_ns();
+        replay_ns = (uint64_t)((now - start) * opt_speed);
+
+        /* starting the sessions that are due, in the order of their first packets */
+        for ( ; next_start < sessions_count; ++next_start )
+        {
+            s = &sessions[next_start];
+
+            if ( s->state == RP_IGNORED )
+                continue;
+
+            if ( (opt_speed > 0 && s->start_ns > replay_ns) || pools[s->is_tcp]->used_slots >= opt_conns )
+                break;
+
+            conn = ap_net_conn_pool_connect_straddr(pools[s->is_tcp], 0, opt_host, af, opt_port, 0);
+
+            if ( conn == NULL )
+            {
+                if ( ! opt_json )
+                    fprintf(stderr, "! session %d: %s\n", next_start, ap_error_get_string());
+
+                s->state = RP_FAILED;
+                ++failed;
+                continue;
+            }
+
+            s->state = RP_ACTIVE;
+            s->conn = conn;
+            s->last_send_ns = now;
+            conn->user_data = s;
+            ++replayed;
+        }
+
+        for ( i = 0; i < 2; ++i )
+        {
+            if ( pools[i] != NULL && ! ap_net_conn_pool_poll(pools[i]) )
+            {
+                fprintf(stderr, "! poll: %s\n", ap_error_get_string());
+                return 1;
+            }
+        }
+
+        active = 0;
+
+        for ( i = 0; i < 2; ++i )
+        {
+            if ( pools[i] == NULL )
+                continue;
+
+            for ( opt = 0; opt < pools[i]->max_connections; ++opt )
+            {
+                s = pools[i]->conns[opt].user_data;
+
+                if ( s == NULL || ! bit_is_set(pools[i]->conns[opt].state, AP_NET_ST_CONNECTED) )
+                    continue;
+
+                session_service(s, now, start, replay_ns);
+                active += s->state == RP_ACTIVE;
+            }
+        }
+
+        if ( next_start == sessions_count && active == 0 )
+            break;
+    }
+
+    running = 0;
+
+    print_results(total, first_ts != 0 ? (last_ts - first_ts) / 1e9 : 0, (ap_utils_clock_ns() - start) / 1e9);
+
+    for ( i = 0; i < 2; ++i )
+        if ( pools[i] != NULL )
+            ap_net_conn_pool_destroy(pools[i], 1);
+
+    return 0;
+}